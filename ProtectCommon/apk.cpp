@@ -0,0 +1,370 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "apk.h"
+
+#define LOCAL_MAGIC     0x04034b50
+#define CENTRAL_MAGIC   0x02014b50
+#define END_MAGIC       0x06054b50
+#define LOCAL_SIZE      30
+#define CENTRAL_SIZE    46
+#define END_SIZE        22
+#define FLAG_DESCRIPTOR 0x0008      // sizes follow the data, rewritten headers carry them
+#define ALIGN_EXTRA_ID  0xd935      // the alignment extra field written by apksigner
+#define LIB_ALIGN       4096
+#define STORED_ALIGN    4
+
+struct apk_output
+{
+    FILE *fp;
+    uint64_t pos;
+    uint8_t *central;       // the new central directory, built while the entries are written
+    size_t central_size;
+    size_t central_cap;
+};
+
+static uint16_t rd16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t rd32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void wr16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void wr32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static int out_write(struct apk_output *out, const void *data, size_t size)
+{
+    if(size != 0 && fwrite(data, 1, size, out->fp) != size)
+    {
+        return -1;
+    }
+    out->pos += size;
+    return 0;
+}
+
+static int central_append(struct apk_output *out, const void *data, size_t size)
+{
+    if(out->central_size + size > out->central_cap)
+    {
+        size_t cap = out->central_cap ? out->central_cap * 2 : 64 * 1024;
+        while(cap < out->central_size + size)
+        {
+            cap *= 2;
+        }
+        uint8_t *central = (uint8_t *)realloc(out->central, cap);
+        if(central == NULL)
+        {
+            return -1;
+        }
+        out->central = central;
+        out->central_cap = cap;
+    }
+    memcpy(out->central + out->central_size, data, size);
+    out->central_size += size;
+    return 0;
+}
+
+static int is_native_lib(const char *name, size_t len)
+{
+    return len > 7 && memcmp(name, "lib/", 4) == 0 && memcmp(name + len - 3, ".so", 3) == 0
+        && memchr(name + 4, '/', len - 4) != NULL;
+}
+
+/*
+ * Writes the local header of an entry from its central record, sizes and
+ * crc always in the header. align > 0 replaces the extra field with an
+ * alignment field padded so the data starts on a multiple of align.
+ */
+static int write_local(struct apk_output *out, const uint8_t *cd, uint16_t method, uint32_t crc,
+                       uint32_t csize, uint32_t usize, const uint8_t *extra, uint16_t extra_len, uint32_t align)
+{
+    uint8_t header[LOCAL_SIZE];
+    uint8_t align_extra[6 + LIB_ALIGN];
+    uint16_t name_len = rd16(cd + 28);
+    uint32_t pad;
+
+    if(align != 0)
+    {
+        pad = (align - (out->pos + LOCAL_SIZE + name_len + 6) % align) % align;
+        memset(align_extra, 0, sizeof(align_extra));
+        wr16(align_extra, ALIGN_EXTRA_ID);
+        wr16(align_extra + 2, 2 + pad);
+        wr16(align_extra + 4, align);
+        extra = align_extra;
+        extra_len = 6 + pad;
+    }
+
+    wr32(header, LOCAL_MAGIC);
+    wr16(header + 4, method == 0 ? 10 : rd16(cd + 6));     // version needed
+    wr16(header + 6, rd16(cd + 8) & ~FLAG_DESCRIPTOR);
+    wr16(header + 8, method);
+    wr16(header + 10, rd16(cd + 12));                       // time
+    wr16(header + 12, rd16(cd + 14));                       // date
+    wr32(header + 14, crc);
+    wr32(header + 18, csize);
+    wr32(header + 22, usize);
+    wr16(header + 26, name_len);
+    wr16(header + 28, extra_len);
+
+    if(out_write(out, header, LOCAL_SIZE) != 0 || out_write(out, cd + CENTRAL_SIZE, name_len) != 0
+       || out_write(out, extra, extra_len) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// the central record of an entry, pointing at its new local header
+static int add_central(struct apk_output *out, const uint8_t *cd, uint32_t offset, uint16_t method,
+                       uint32_t crc, uint32_t csize, uint32_t usize)
+{
+    uint8_t record[CENTRAL_SIZE];
+    size_t tail = rd16(cd + 28) + rd16(cd + 30) + rd16(cd + 32);   // name, extra, comment
+
+    memcpy(record, cd, CENTRAL_SIZE);
+    if(method == 0)
+    {
+        wr16(record + 6, 10);
+    }
+    wr16(record + 8, rd16(cd + 8) & ~FLAG_DESCRIPTOR);
+    wr16(record + 10, method);
+    wr32(record + 16, crc);
+    wr32(record + 20, csize);
+    wr32(record + 24, usize);
+    wr32(record + 42, offset);
+    if(central_append(out, record, CENTRAL_SIZE) != 0 || central_append(out, cd + CENTRAL_SIZE, tail) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static int inflate_raw(const uint8_t *in, uint32_t in_size, uint8_t *out, uint32_t out_size)
+{
+    z_stream stream;
+    int ret;
+
+    memset(&stream, 0, sizeof(stream));
+    if(inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+    {
+        return -1;
+    }
+    stream.next_in = (Bytef *)in;
+    stream.avail_in = in_size;
+    stream.next_out = out;
+    stream.avail_out = out_size;
+    ret = inflate(&stream, Z_FINISH);
+    inflateEnd(&stream);
+    return ret == Z_STREAM_END && stream.total_out == out_size ? 0 : -1;
+}
+
+int apk_repack(const char *in_path, const char *out_path, apk_lib_callback callback, struct apk_stats *stats)
+{
+    struct apk_output out;
+    struct stat st;
+    const uint8_t *map = NULL;
+    const uint8_t *end = NULL;
+    const uint8_t *cd;
+    const uint8_t *local;
+    const uint8_t *data;
+    uint8_t *lib = NULL;
+    uint8_t record[END_SIZE];
+    char name[1024];
+    size_t size = 0;
+    uint32_t count, cd_offset, cd_size, offset, crc, csize, usize, align;
+    uint16_t method, name_len, comment_len;
+    int ret = -1;
+    int fd;
+    uint32_t i;
+
+    memset(&out, 0, sizeof(out));
+    memset(stats, 0, sizeof(*stats));
+
+    fd = open(in_path, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st) != 0 || st.st_size < END_SIZE)
+    {
+        printf("%s: open apk failed\n", in_path);
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    size = st.st_size;
+    map = (const uint8_t *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        printf("%s: mmap failed\n", in_path);
+        return -1;
+    }
+
+    // the end record sits behind at most 64k of archive comment
+    for(end = map + size - END_SIZE; end >= map && end + 0x10000 + END_SIZE >= map + size; end--)
+    {
+        if(rd32(end) == END_MAGIC && end + END_SIZE + rd16(end + 20) == map + size)
+        {
+            break;
+        }
+    }
+    if(end < map || end + 0x10000 + END_SIZE < map + size)
+    {
+        printf("%s: not a zip file\n", in_path);
+        goto _error;
+    }
+    count = rd16(end + 10);
+    cd_size = rd32(end + 12);
+    cd_offset = rd32(end + 16);
+    comment_len = rd16(end + 20);
+    if(count == 0xffff || cd_offset == 0xffffffff || (uint64_t)cd_offset + cd_size > (uint64_t)(end - map))
+    {
+        printf("%s: zip64 and split archives are not supported\n", in_path);
+        goto _error;
+    }
+
+    out.fp = fopen(out_path, "wb");
+    if(out.fp == NULL)
+    {
+        printf("%s: create output failed\n", out_path);
+        goto _error;
+    }
+
+    cd = map + cd_offset;
+    for(i = 0; i < count; i++)
+    {
+        if(cd + CENTRAL_SIZE > map + cd_offset + cd_size || rd32(cd) != CENTRAL_MAGIC
+           || cd + CENTRAL_SIZE + rd16(cd + 28) + rd16(cd + 30) + rd16(cd + 32) > map + cd_offset + cd_size)
+        {
+            printf("%s: bad central directory\n", in_path);
+            goto _error;
+        }
+        method = rd16(cd + 10);
+        crc = rd32(cd + 16);
+        csize = rd32(cd + 20);
+        usize = rd32(cd + 24);
+        name_len = rd16(cd + 28);
+        offset = rd32(cd + 42);
+        local = map + offset;
+        if((uint64_t)offset + LOCAL_SIZE > cd_offset || rd32(local) != LOCAL_MAGIC
+           || (uint64_t)offset + LOCAL_SIZE + rd16(local + 26) + rd16(local + 28) + csize > cd_offset
+           || (rd16(cd + 8) & 0x0001))
+        {
+            printf("%s: bad or encrypted entry %u\n", in_path, i);
+            goto _error;
+        }
+        data = local + LOCAL_SIZE + rd16(local + 26) + rd16(local + 28);
+        snprintf(name, sizeof(name), "%.*s", (int)name_len, (const char *)cd + CENTRAL_SIZE);
+        offset = out.pos;
+
+        if(is_native_lib((const char *)cd + CENTRAL_SIZE, name_len) && (method == 0 || method == 8))
+        {
+            lib = (uint8_t *)malloc(usize ? usize : 1);
+            if(lib == NULL)
+            {
+                goto _error;
+            }
+            if(method == 0 ? (csize != usize ? -1 : (memcpy(lib, data, usize), 0)) : inflate_raw(data, csize, lib, usize))
+            {
+                printf("%s: read %s failed\n", in_path, name);
+                goto _error;
+            }
+            switch(callback(name, lib, usize))
+            {
+            case 0:
+                break;
+            case APK_KEEP:
+                free(lib);
+                lib = NULL;
+                stats->kept++;
+                goto _copy;
+            default:
+                goto _error;
+            }
+            crc = crc32(crc32(0, Z_NULL, 0), lib, usize);
+            if(write_local(&out, cd, 0, crc, usize, usize, NULL, 0, LIB_ALIGN) != 0 || out_write(&out, lib, usize) != 0
+               || add_central(&out, cd, offset, 0, crc, usize, usize) != 0)
+            {
+                goto _write_error;
+            }
+            free(lib);
+            lib = NULL;
+            stats->libs++;
+            stats->lib_bytes += usize;
+            goto _next;
+        }
+
+_copy:
+        if(method == 0)
+        {
+            align = is_native_lib((const char *)cd + CENTRAL_SIZE, name_len) ? LIB_ALIGN : STORED_ALIGN;
+            if(write_local(&out, cd, method, crc, csize, usize, NULL, 0, align) != 0)
+            {
+                goto _write_error;
+            }
+        }
+        else if(write_local(&out, cd, method, crc, csize, usize, local + LOCAL_SIZE + rd16(local + 26), rd16(local + 28), 0) != 0)
+        {
+            goto _write_error;
+        }
+        if(out_write(&out, data, csize) != 0 || add_central(&out, cd, offset, method, crc, csize, usize) != 0)
+        {
+            goto _write_error;
+        }
+
+_next:
+        stats->entries++;
+        cd += CENTRAL_SIZE + name_len + rd16(cd + 30) + rd16(cd + 32);
+    }
+
+    memcpy(record, end, END_SIZE);
+    wr16(record + 8, stats->entries);
+    wr16(record + 10, stats->entries);
+    wr32(record + 12, out.central_size);
+    wr32(record + 16, out.pos);
+    if(out.pos > 0xffffffffULL || out_write(&out, out.central, out.central_size) != 0
+       || out_write(&out, record, END_SIZE) != 0 || out_write(&out, end + END_SIZE, comment_len) != 0)
+    {
+        goto _write_error;
+    }
+    stats->out_bytes = out.pos;
+    ret = stats->libs;
+    goto _error;
+
+_write_error:
+    printf("%s: write failed\n", out_path);
+
+_error:
+    free(lib);
+    free(out.central);
+    if(out.fp != NULL && fclose(out.fp) != 0)
+    {
+        ret = -1;
+    }
+    if(ret < 0 && out.fp != NULL)
+    {
+        unlink(out_path);
+    }
+    munmap((void *)map, size);
+    return ret;
+}
@@ -0,0 +1,38 @@
+#ifndef _APK_H
+#define _APK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Rewrites an APK without unpacking it. Every lib/<abi>/lib*.so is handed
+ * to callback in memory (inflated first if it was compressed). Changed ones
+ * are written back stored, with their data aligned to 4096 bytes so the
+ * platform can mmap them straight from the APK. All other entries are
+ * copied as they are, stored ones aligned to 4 bytes like zipalign does and
+ * stored libraries to 4096 bytes.
+ *
+ * The APK signing block is dropped and the v1 signature no longer matches
+ * the changed libraries, the output has to be signed again.
+ */
+
+/*
+ * Returns 0 after changing data, APK_KEEP to copy the entry through as it
+ * was (not a library the caller handles) and a negative value to abort.
+ */
+#define APK_KEEP 1
+
+typedef int (*apk_lib_callback)(const char *name, uint8_t *data, size_t size);
+
+struct apk_stats
+{
+    uint32_t entries;
+    uint32_t libs;          // changed by the callback
+    uint32_t kept;          // libraries copied through
+    uint64_t lib_bytes;     // uncompressed size of the changed libraries
+    uint64_t out_bytes;
+};
+
+int apk_repack(const char *in_path, const char *out_path, apk_lib_callback callback, struct apk_stats *stats);
+
+#endif
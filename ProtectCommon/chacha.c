@@ -0,0 +1,250 @@
+#include <string.h>
+
+#include "chacha.h"
+
+/*
+ * The vector kernels run CHACHA_LANES blocks side by side, lane i of x[n]
+ * holding word n of block i, and transpose the result back when XORing.
+ * NEON on armeabi-v7a (built as chacha.c.neon), SSE2 on x86 and AVX2 when
+ * the host packer is built with -mavx2. Other targets use the plain
+ * version, which also handles the partial blocks at both ends.
+ */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CHACHA_LANES 8
+typedef __m256i vec;
+#define V_LOAD(p)		_mm256_loadu_si256((const __m256i *) (p))
+#define V_SPLAT(w)		_mm256_set1_epi32(w)
+#define V_ADD(a, b)		_mm256_add_epi32(a, b)
+#define V_XOR(a, b)		_mm256_xor_si256(a, b)
+#define V_ROTL(a, n)	_mm256_or_si256(_mm256_slli_epi32(a, n), _mm256_srli_epi32(a, 32 - (n)))
+#define V_ROTL16(a)		_mm256_shuffle_epi8(a, _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2, \
+						13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2))
+#define V_ROTL8(a)		_mm256_shuffle_epi8(a, _mm256_set_epi8(14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3, \
+						14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3))
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CHACHA_LANES 4
+typedef __m128i vec;
+#define V_LOAD(p)		_mm_loadu_si128((const __m128i *) (p))
+#define V_SPLAT(w)		_mm_set1_epi32(w)
+#define V_ADD(a, b)		_mm_add_epi32(a, b)
+#define V_XOR(a, b)		_mm_xor_si128(a, b)
+#define V_ROTL(a, n)	_mm_or_si128(_mm_slli_epi32(a, n), _mm_srli_epi32(a, 32 - (n)))
+#define V_ROTL16(a)		_mm_shufflehi_epi16(_mm_shufflelo_epi16(a, 0xB1), 0xB1)
+#define V_ROTL8(a)		V_ROTL(a, 8)
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CHACHA_LANES 4
+typedef uint32x4_t vec;
+#define V_LOAD(p)		vld1q_u32(p)
+#define V_SPLAT(w)		vdupq_n_u32(w)
+#define V_ADD(a, b)		vaddq_u32(a, b)
+#define V_XOR(a, b)		veorq_u32(a, b)
+#define V_ROTL(a, n)	vsriq_n_u32(vshlq_n_u32(a, n), a, 32 - (n))
+#define V_ROTL16(a)		vreinterpretq_u32_u16(vrev32q_u16(vreinterpretq_u16_u32(a)))
+#define V_ROTL8(a)		V_ROTL(a, 8)
+#endif
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTER(a, b, c, d) \
+	a += b; d ^= a; d = ROTL(d, 16); \
+	c += d; b ^= c; b = ROTL(b, 12); \
+	a += b; d ^= a; d = ROTL(d, 8); \
+	c += d; b ^= c; b = ROTL(b, 7);
+
+#define V_QUARTER(a, b, c, d) \
+	a = V_ADD(a, b); d = V_XOR(d, a); d = V_ROTL16(d); \
+	c = V_ADD(c, d); b = V_XOR(b, c); b = V_ROTL(b, 12); \
+	a = V_ADD(a, b); d = V_XOR(d, a); d = V_ROTL8(d); \
+	c = V_ADD(c, d); b = V_XOR(b, c); b = V_ROTL(b, 7);
+
+static uint32_t load32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void chacha_init(uint32_t state[16], const uint8_t key[CHACHA_KEY_SIZE], uint64_t nonce)
+{
+	int i;
+
+	state[0] = 0x61707865;		// "expand 32-byte k"
+	state[1] = 0x3320646e;
+	state[2] = 0x79622d32;
+	state[3] = 0x6b206574;
+	for (i = 0; i < 8; ++i) {
+		state[4 + i] = load32(key + 4 * i);
+	}
+	state[12] = 0;
+	state[13] = 0;
+	state[14] = (uint32_t) nonce;
+	state[15] = (uint32_t) (nonce >> 32);
+}
+
+static void chacha_block(const uint32_t state[16], uint64_t counter, uint8_t out[64])
+{
+	uint32_t x[16];
+	uint32_t s[16];
+	int i;
+
+	memcpy(s, state, sizeof(s));
+	s[12] = (uint32_t) counter;
+	s[13] = (uint32_t) (counter >> 32);
+	memcpy(x, s, sizeof(x));
+
+	for (i = 0; i < 10; ++i) {
+		QUARTER(x[0], x[4], x[8], x[12]);
+		QUARTER(x[1], x[5], x[9], x[13]);
+		QUARTER(x[2], x[6], x[10], x[14]);
+		QUARTER(x[3], x[7], x[11], x[15]);
+		QUARTER(x[0], x[5], x[10], x[15]);
+		QUARTER(x[1], x[6], x[11], x[12]);
+		QUARTER(x[2], x[7], x[8], x[13]);
+		QUARTER(x[3], x[4], x[9], x[14]);
+	}
+
+	for (i = 0; i < 16; ++i) {
+		x[i] += s[i];
+		out[4 * i] = x[i];
+		out[4 * i + 1] = x[i] >> 8;
+		out[4 * i + 2] = x[i] >> 16;
+		out[4 * i + 3] = x[i] >> 24;
+	}
+}
+
+#if defined(CHACHA_LANES)
+
+/*
+ * XORs words 4g..4g+3 of every block into data, a, b, c and d being
+ * x[4g]..x[4g+3].
+ */
+static void xor_group(vec a, vec b, vec c, vec d, uint8_t *data)
+{
+#if defined(__AVX2__) || defined(__SSE2__)
+#if defined(__AVX2__)
+	__m256i t0 = _mm256_unpacklo_epi32(a, b);
+	__m256i t1 = _mm256_unpacklo_epi32(c, d);
+	__m256i t2 = _mm256_unpackhi_epi32(a, b);
+	__m256i t3 = _mm256_unpackhi_epi32(c, d);
+	__m256i r[4];
+#else
+	__m128i t0 = _mm_unpacklo_epi32(a, b);
+	__m128i t1 = _mm_unpacklo_epi32(c, d);
+	__m128i t2 = _mm_unpackhi_epi32(a, b);
+	__m128i t3 = _mm_unpackhi_epi32(c, d);
+	__m128i r[4];
+#endif
+	__m128i *p;
+	int i;
+
+#if defined(__AVX2__)
+	r[0] = _mm256_unpacklo_epi64(t0, t1);
+	r[1] = _mm256_unpackhi_epi64(t0, t1);
+	r[2] = _mm256_unpacklo_epi64(t2, t3);
+	r[3] = _mm256_unpackhi_epi64(t2, t3);
+	// the low lanes hold blocks 0-3, the high lanes blocks 4-7
+	for (i = 0; i < 4; ++i) {
+		p = (__m128i *) (data + 64 * i);
+		_mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), _mm256_castsi256_si128(r[i])));
+		p = (__m128i *) (data + 64 * (i + 4));
+		_mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), _mm256_extracti128_si256(r[i], 1)));
+	}
+#else
+	r[0] = _mm_unpacklo_epi64(t0, t1);
+	r[1] = _mm_unpackhi_epi64(t0, t1);
+	r[2] = _mm_unpacklo_epi64(t2, t3);
+	r[3] = _mm_unpackhi_epi64(t2, t3);
+	for (i = 0; i < 4; ++i) {
+		p = (__m128i *) (data + 64 * i);
+		_mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), r[i]));
+	}
+#endif
+#else
+	uint32x4x2_t p = vtrnq_u32(a, b);
+	uint32x4x2_t q = vtrnq_u32(c, d);
+	uint32x4_t r[4];
+	int i;
+
+	r[0] = vcombine_u32(vget_low_u32(p.val[0]), vget_low_u32(q.val[0]));
+	r[1] = vcombine_u32(vget_low_u32(p.val[1]), vget_low_u32(q.val[1]));
+	r[2] = vcombine_u32(vget_high_u32(p.val[0]), vget_high_u32(q.val[0]));
+	r[3] = vcombine_u32(vget_high_u32(p.val[1]), vget_high_u32(q.val[1]));
+	for (i = 0; i < 4; ++i) {
+		vst1q_u8(data + 64 * i, veorq_u8(vld1q_u8(data + 64 * i), vreinterpretq_u8_u32(r[i])));
+	}
+#endif
+}
+
+static void chacha_blocks(const uint32_t state[16], uint64_t counter, uint8_t *data)
+{
+	uint32_t lo[CHACHA_LANES];
+	uint32_t hi[CHACHA_LANES];
+	vec x[16];
+	vec s[16];
+	int i;
+
+	for (i = 0; i < 16; ++i) {
+		s[i] = V_SPLAT(state[i]);
+	}
+	for (i = 0; i < CHACHA_LANES; ++i) {
+		lo[i] = (uint32_t) (counter + i);
+		hi[i] = (uint32_t) ((counter + i) >> 32);
+	}
+	s[12] = V_LOAD(lo);
+	s[13] = V_LOAD(hi);
+	memcpy(x, s, sizeof(x));
+
+	for (i = 0; i < 10; ++i) {
+		V_QUARTER(x[0], x[4], x[8], x[12]);
+		V_QUARTER(x[1], x[5], x[9], x[13]);
+		V_QUARTER(x[2], x[6], x[10], x[14]);
+		V_QUARTER(x[3], x[7], x[11], x[15]);
+		V_QUARTER(x[0], x[5], x[10], x[15]);
+		V_QUARTER(x[1], x[6], x[11], x[12]);
+		V_QUARTER(x[2], x[7], x[8], x[13]);
+		V_QUARTER(x[3], x[4], x[9], x[14]);
+	}
+
+	for (i = 0; i < 16; ++i) {
+		x[i] = V_ADD(x[i], s[i]);
+	}
+	for (i = 0; i < 4; ++i) {
+		xor_group(x[4 * i], x[4 * i + 1], x[4 * i + 2], x[4 * i + 3], data + 16 * i);
+	}
+}
+
+#endif
+
+void chacha20_xor(uint8_t *data, size_t size, const uint8_t key[CHACHA_KEY_SIZE], uint64_t nonce, uint64_t offset)
+{
+	uint32_t state[16];
+	uint8_t block[64];
+	uint64_t counter = offset / 64;
+	size_t skip = offset % 64;
+	size_t n;
+	size_t i;
+
+	chacha_init(state, key, nonce);
+
+	while (size > 0) {
+#if defined(CHACHA_LANES)
+		if (skip == 0 && size >= 64 * CHACHA_LANES) {
+			chacha_blocks(state, counter, data);
+			counter += CHACHA_LANES;
+			data += 64 * CHACHA_LANES;
+			size -= 64 * CHACHA_LANES;
+			continue;
+		}
+#endif
+		chacha_block(state, counter, block);
+		n = 64 - skip < size ? 64 - skip : size;
+		for (i = 0; i < n; ++i) {
+			data[i] ^= block[skip + i];
+		}
+		counter++;
+		data += n;
+		size -= n;
+		skip = 0;
+	}
+}
@@ -0,0 +1,45 @@
+#ifndef _CHACHA_H
+#define _CHACHA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * ChaCha20 (64-bit nonce, 64-bit block counter) shared by the packer in
+ * "crypto code" and the library that decrypts itself on load. Encryption
+ * and decryption are the same XOR; offset is the position in the key
+ * stream, so any part of a range can be processed on its own.
+ *
+ * The nonce is the ELF offset of the protected range, every range gets its
+ * own key stream under the one key.
+ */
+
+#define CHACHA_KEY_SIZE 32
+
+// change it together with the packer, the key is compiled into both
+#define PROTECT_KEY { \
+	0x3b, 0x9e, 0x51, 0xc4, 0x07, 0xd2, 0x6a, 0xf8, \
+	0x19, 0x8c, 0xe3, 0x75, 0x2f, 0xb0, 0x44, 0xd1, \
+	0x86, 0x1a, 0xcd, 0x5e, 0xf3, 0x68, 0x0b, 0x97, \
+	0xa2, 0x3c, 0x7f, 0xe9, 0x14, 0x5b, 0xc0, 0x2d }
+
+/*
+ * Exported by every library that decrypts itself, the packers leave
+ * libraries without it (libc++_shared.so and other third-party code) alone
+ * even if they happen to export a protected name.
+ */
+#define PROTECT_MARKER "protect_decryptor"
+#define PROTECT_DEFINE_MARKER() \
+	extern "C" __attribute__((visibility("default"), used)) const int protect_decryptor = 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void chacha20_xor(uint8_t *data, size_t size, const uint8_t key[CHACHA_KEY_SIZE], uint64_t nonce, uint64_t offset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef _DECRYPT_GATE_H
+#define _DECRYPT_GATE_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/*
+ * Gate for libraries that decrypt their protected code on a background
+ * thread (ASYNC_DECRYPT). start_decrypt() runs decrypt on a new thread and
+ * opens the gate when it returns, even after a failure, so waiting natives
+ * never hang. The natives are registered through stubs outside the
+ * protected code that call wait_decrypted() before going on:
+ *
+ *   static jstring getString_stub(JNIEnv* env,jobject clazz)
+ *   {
+ *   	wait_decrypted();
+ *   	return getString(env,clazz);
+ *   }
+ */
+
+static volatile int g_decrypted = 0;
+static void (*g_decrypt)() = NULL;
+
+// only blocks a native called before the background thread is done
+static inline void wait_decrypted()
+{
+	while(!g_decrypted)
+	{
+		syscall(__NR_futex,&g_decrypted,FUTEX_WAIT,0,NULL,NULL,0);
+	}
+}
+
+static inline void set_decrypted()
+{
+	__sync_synchronize();
+	g_decrypted = 1;
+	syscall(__NR_futex,&g_decrypted,FUTEX_WAKE,INT_MAX,NULL,NULL,0);
+}
+
+static inline void* decrypt_thread(void* arg)
+{
+	g_decrypt();
+	set_decrypted();
+	return NULL;
+}
+
+// decrypts on the calling thread if no thread can be started
+static inline void start_decrypt(void (*decrypt)())
+{
+	pthread_t thread;
+
+	g_decrypt = decrypt;
+	if(pthread_create(&thread,NULL,decrypt_thread,NULL) == 0)
+	{
+		pthread_detach(thread);
+		return;
+	}
+	decrypt_thread(NULL);
+}
+
+#endif
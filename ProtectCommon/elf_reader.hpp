@@ -0,0 +1,397 @@
+#ifndef _ELF_READER_HPP
+#define _ELF_READER_HPP
+
+#include <elf.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Header-only ELF reader shared by the load-time decryptor and the packer.
+ *
+ *   ElfReader<NativeElfTraits> elf((void *) lib_addr);				// loaded image
+ *   ElfReader<Elf32Traits> elf(map, size, ElfReader<Elf32Traits>::FILE_LAYOUT);	// mapped file
+ *   const Elf32_Sym *sym = elf.findSymbol("getString");
+ *
+ * The traits type picks Elf32 or Elf64 at compile time, elfClass() tells
+ * which one a file needs. Nothing is copied: the tables are returned as
+ * pointer ranges into the image and every access is checked against its
+ * size, a range that does not fit yields NULL or an empty table.
+ * Addresses are translated through PT_LOAD in a file and taken relative to
+ * the load base in a loaded image, where the section headers are not
+ * available.
+ */
+
+struct Elf32Traits {
+	typedef Elf32_Ehdr Ehdr;
+	typedef Elf32_Phdr Phdr;
+	typedef Elf32_Shdr Shdr;
+	typedef Elf32_Dyn Dyn;
+	typedef Elf32_Sym Sym;
+	typedef Elf32_Addr Addr;
+	typedef Elf32_Word Word;
+	enum { CLASS = ELFCLASS32 };
+};
+
+struct Elf64Traits {
+	typedef Elf64_Ehdr Ehdr;
+	typedef Elf64_Phdr Phdr;
+	typedef Elf64_Shdr Shdr;
+	typedef Elf64_Dyn Dyn;
+	typedef Elf64_Sym Sym;
+	typedef Elf64_Addr Addr;
+	typedef Elf64_Word Word;
+	enum { CLASS = ELFCLASS64 };
+};
+
+#if defined(__LP64__)
+typedef Elf64Traits NativeElfTraits;
+#else
+typedef Elf32Traits NativeElfTraits;
+#endif
+
+template <typename T>
+class ElfTable {
+public:
+	ElfTable() : begin_(NULL), count_(0) {}
+	ElfTable(T *begin, size_t count) : begin_(count ? begin : NULL), count_(begin ? count : 0) {}
+
+	T *begin() const { return begin_; }
+	T *end() const { return begin_ + count_; }
+	size_t size() const { return count_; }
+	bool empty() const { return count_ == 0; }
+	T &operator[](size_t index) const { return begin_[index]; }
+
+private:
+	T *begin_;
+	size_t count_;
+};
+
+// ELF class of a file, 0 if it is no ELF file
+static inline int elfClass(const void *image, size_t size)
+{
+	const unsigned char *ident = (const unsigned char *) image;
+
+	if (size < EI_NIDENT || memcmp(ident, ELFMAG, SELFMAG) != 0) {
+		return 0;
+	}
+	return ident[EI_CLASS];
+}
+
+template <typename Traits>
+class ElfReader {
+public:
+	typedef typename Traits::Ehdr Ehdr;
+	typedef typename Traits::Phdr Phdr;
+	typedef typename Traits::Shdr Shdr;
+	typedef typename Traits::Dyn Dyn;
+	typedef typename Traits::Sym Sym;
+	typedef typename Traits::Addr Addr;
+	typedef typename Traits::Word Word;
+
+	enum Layout { FILE_LAYOUT, LOADED_LAYOUT };
+
+	// a loaded image has no known size, everything up to the end of the address space is accepted
+	explicit ElfReader(void *base, size_t size = 0, Layout layout = LOADED_LAYOUT)
+		: base_((uint8_t *) base), size_(size ? size : ~(uintptr_t) base), layout_(layout),
+		  dynstr_(NULL), strsz_(0), sysv_hash_(NULL), gnu_hash_(NULL), gnu_hash_addr_(0)
+	{
+		const Ehdr *ehdr = header();
+
+		if (ehdr == NULL || elfClass(base_, size_) != Traits::CLASS) {
+			size_ = 0;
+			return;
+		}
+		phdrs_ = ElfTable<Phdr>(rangeAt<Phdr>(ehdr->e_phoff, ehdr->e_phnum), ehdr->e_phnum);
+		if (layout_ == FILE_LAYOUT && ehdr->e_shentsize == sizeof(Shdr)) {
+			shdrs_ = ElfTable<Shdr>(rangeAt<Shdr>(ehdr->e_shoff, ehdr->e_shnum), ehdr->e_shnum);
+		}
+		loadDynamic();
+	}
+
+	bool valid() const { return size_ != 0 && !phdrs_.empty(); }
+	Ehdr *header() const { return rangeAt<Ehdr>(0, 1); }
+	const ElfTable<Phdr> &segments() const { return phdrs_; }
+	const ElfTable<Shdr> &sections() const { return shdrs_; }
+	const ElfTable<Dyn> &dynamic() const { return dyns_; }
+	const ElfTable<Sym> &symbols() const { return syms_; }
+	bool hasSysvHash() const { return sysv_hash_ != NULL; }
+	bool hasGnuHash() const { return gnu_hash_ != NULL; }
+
+	// count objects of T at file offset off, NULL if they are not all inside the image
+	template <typename T>
+	T *rangeAt(uint64_t off, uint64_t count) const
+	{
+		if (off > size_ || count > (size_ - off) / sizeof(T)) {
+			return NULL;
+		}
+		return (T *) (base_ + off);
+	}
+
+	// same for a virtual address
+	template <typename T>
+	T *rangeAtAddr(Addr addr, uint64_t count) const
+	{
+		uint64_t off;
+
+		if (!addrToOffset(addr, count * sizeof(T), &off)) {
+			return NULL;
+		}
+		return rangeAt<T>(off, count);
+	}
+
+	bool addrToOffset(Addr addr, uint64_t len, uint64_t *off) const
+	{
+		if (layout_ == LOADED_LAYOUT) {
+			*off = addr;
+			return true;
+		}
+		for (const Phdr *phdr = phdrs_.begin(); phdr != phdrs_.end(); ++phdr) {
+			if (phdr->p_type == PT_LOAD && addr >= phdr->p_vaddr && addr - phdr->p_vaddr <= phdr->p_filesz
+					&& len <= phdr->p_filesz - (addr - phdr->p_vaddr)) {
+				*off = phdr->p_offset + (addr - phdr->p_vaddr);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// .dynstr entry, NULL if it is not terminated inside the table
+	const char *string(Word offset) const
+	{
+		if (dynstr_ == NULL || offset >= strsz_ || memchr(dynstr_ + offset, 0, strsz_ - offset) == NULL) {
+			return NULL;
+		}
+		return dynstr_ + offset;
+	}
+
+	const char *sectionName(const Shdr &shdr) const
+	{
+		const Ehdr *ehdr = header();
+		const char *names;
+
+		if (ehdr->e_shstrndx >= shdrs_.size()) {
+			return NULL;
+		}
+		const Shdr &strtab = shdrs_[ehdr->e_shstrndx];
+		names = rangeAt<const char>(strtab.sh_offset, strtab.sh_size);
+		if (names == NULL || shdr.sh_name >= strtab.sh_size || memchr(names + shdr.sh_name, 0, strtab.sh_size - shdr.sh_name) == NULL) {
+			return NULL;
+		}
+		return names + shdr.sh_name;
+	}
+
+	Shdr *findSection(const char *name) const
+	{
+		for (Shdr *shdr = shdrs_.begin(); shdr != shdrs_.end(); ++shdr) {
+			const char *section_name = sectionName(*shdr);
+			if (section_name != NULL && strcmp(section_name, name) == 0) {
+				return shdr;
+			}
+		}
+		return NULL;
+	}
+
+	// a defined .dynsym symbol, through DT_GNU_HASH if present, else DT_HASH
+	Sym *findSymbol(const char *name) const
+	{
+		if (gnu_hash_ != NULL) {
+			return findGnu(name);
+		}
+		if (sysv_hash_ != NULL) {
+			return findSysv(name);
+		}
+		return NULL;
+	}
+
+	static uint32_t sysvHash(const char *name)
+	{
+		const unsigned char *p = (const unsigned char *) name;
+		uint32_t h = 0, g;
+
+		while (*p) {
+			h = (h << 4) + *p++;
+			g = h & 0xf0000000;
+			h ^= g;
+			h ^= g >> 24;
+		}
+		return h;
+	}
+
+	static uint32_t gnuHash(const char *name)
+	{
+		const unsigned char *p = (const unsigned char *) name;
+		uint32_t h = 5381;
+
+		while (*p) {
+			h = h * 33 + *p++;
+		}
+		return h;
+	}
+
+private:
+	void loadDynamic()
+	{
+		Addr strtab = 0, symtab = 0, hash = 0, gnu_hash = 0;
+
+		for (const Phdr *phdr = phdrs_.begin(); phdr != phdrs_.end(); ++phdr) {
+			if (phdr->p_type == PT_DYNAMIC) {
+				uint64_t off = layout_ == FILE_LAYOUT ? (uint64_t) phdr->p_offset : (uint64_t) phdr->p_vaddr;
+				dyns_ = ElfTable<Dyn>(rangeAt<Dyn>(off, phdr->p_filesz / sizeof(Dyn)), phdr->p_filesz / sizeof(Dyn));
+				break;
+			}
+		}
+		for (const Dyn *dyn = dyns_.begin(); dyn != dyns_.end() && dyn->d_tag != DT_NULL; ++dyn) {
+			switch (dyn->d_tag) {
+			case DT_STRTAB:
+				strtab = dyn->d_un.d_ptr;
+				break;
+			case DT_STRSZ:
+				strsz_ = dyn->d_un.d_val;
+				break;
+			case DT_SYMTAB:
+				symtab = dyn->d_un.d_ptr;
+				break;
+			case DT_HASH:
+				hash = dyn->d_un.d_ptr;
+				break;
+			case DT_GNU_HASH:
+				gnu_hash = dyn->d_un.d_ptr;
+				break;
+			}
+		}
+
+		dynstr_ = rangeAtAddr<const char>(strtab, strsz_);
+		if (dynstr_ == NULL) {
+			strsz_ = 0;
+		}
+		if (hash != 0) {
+			sysv_hash_ = rangeAtAddr<uint32_t>(hash, 2);
+			if (sysv_hash_ != NULL && (sysv_hash_[0] == 0 || rangeAtAddr<uint32_t>(hash, 2 + (uint64_t) sysv_hash_[0] + sysv_hash_[1]) == NULL)) {
+				sysv_hash_ = NULL;
+			}
+		}
+		if (gnu_hash != 0) {
+			gnu_hash_ = rangeAtAddr<uint32_t>(gnu_hash, 4);
+			if (gnu_hash_ != NULL && (gnu_hash_[0] == 0 || gnu_hash_[2] == 0
+					|| rangeAtAddr<uint32_t>(gnu_hash, 4 + (uint64_t) gnu_hash_[2] * (sizeof(Addr) / 4) + gnu_hash_[0]) == NULL)) {
+				gnu_hash_ = NULL;
+			}
+			gnu_hash_addr_ = gnu_hash;
+		}
+
+		// .dynsym has no size of its own, the hash tables tell how many symbols there are
+		uint64_t nsym = sysv_hash_ != NULL ? sysv_hash_[1] : gnu_hash_ != NULL ? gnuSymbolCount() : 0;
+		syms_ = ElfTable<Sym>(rangeAtAddr<Sym>(symtab, nsym), nsym);
+	}
+
+	const uint32_t *gnuBuckets() const
+	{
+		return gnu_hash_ + 4 + gnu_hash_[2] * (sizeof(Addr) / 4);
+	}
+
+	// the last chain entry of the highest bucket ends the table
+	uint64_t gnuSymbolCount() const
+	{
+		const uint32_t *buckets = gnuBuckets();
+		uint32_t nbucket = gnu_hash_[0];
+		uint32_t symoffset = gnu_hash_[1];
+		uint64_t last = 0;
+		const uint32_t *chain;
+
+		for (uint32_t i = 0; i < nbucket; ++i) {
+			if (buckets[i] > last) {
+				last = buckets[i];
+			}
+		}
+		if (last < symoffset) {
+			return symoffset;
+		}
+		for (;;) {
+			chain = rangeAtAddr<uint32_t>(gnu_hash_addr_ + (4 + gnu_hash_[2] * (sizeof(Addr) / 4) + nbucket + (last - symoffset)) * 4, 1);
+			if (chain == NULL) {
+				return 0;
+			}
+			if (*chain & 1) {
+				return last + 1;
+			}
+			++last;
+		}
+	}
+
+	Sym *matchSymbol(uint32_t index, const char *name) const
+	{
+		const char *sym_name;
+
+		if (index >= syms_.size()) {
+			return NULL;
+		}
+		sym_name = string(syms_[index].st_name);
+		if (sym_name == NULL || strcmp(sym_name, name) != 0 || syms_[index].st_shndx == SHN_UNDEF) {
+			return NULL;
+		}
+		return &syms_[index];
+	}
+
+	Sym *findSysv(const char *name) const
+	{
+		uint32_t nbucket = sysv_hash_[0];
+		uint32_t nchain = sysv_hash_[1];
+		const uint32_t *bucket = sysv_hash_ + 2;
+		const uint32_t *chain = bucket + nbucket;
+		uint32_t steps = 0;
+		Sym *sym;
+
+		// steps bounds the walk on a corrupt, cyclic chain
+		for (uint32_t i = bucket[sysvHash(name) % nbucket]; i != 0 && i < nchain && steps++ < nchain; i = chain[i]) {
+			if ((sym = matchSymbol(i, name)) != NULL) {
+				return sym;
+			}
+		}
+		return NULL;
+	}
+
+	Sym *findGnu(const char *name) const
+	{
+		const uint32_t bits = sizeof(Addr) * 8;
+		uint32_t nbucket = gnu_hash_[0];
+		uint32_t symoffset = gnu_hash_[1];
+		uint32_t bloom_size = gnu_hash_[2];
+		uint32_t bloom_shift = gnu_hash_[3];
+		const Addr *bloom = (const Addr *) (gnu_hash_ + 4);
+		const uint32_t *buckets = gnuBuckets();
+		const uint32_t *chain = buckets + nbucket;
+		uint32_t h = gnuHash(name);
+		Addr word = bloom[(h / bits) % bloom_size];
+		Sym *sym;
+
+		if (!((word >> (h % bits)) & (word >> ((h >> bloom_shift) % bits)) & 1)) {
+			return NULL;
+		}
+		for (uint32_t i = buckets[h % nbucket]; i >= symoffset && i < syms_.size(); ++i) {
+			uint32_t h2 = chain[i - symoffset];
+			if ((h | 1) == (h2 | 1) && (sym = matchSymbol(i, name)) != NULL) {
+				return sym;
+			}
+			if (h2 & 1) {
+				break;
+			}
+		}
+		return NULL;
+	}
+
+	uint8_t *base_;
+	uint64_t size_;
+	Layout layout_;
+	ElfTable<Phdr> phdrs_;
+	ElfTable<Shdr> shdrs_;
+	ElfTable<Dyn> dyns_;
+	ElfTable<Sym> syms_;
+	const char *dynstr_;
+	uint64_t strsz_;
+	uint32_t *sysv_hash_;
+	uint32_t *gnu_hash_;
+	Addr gnu_hash_addr_;
+};
+
+#endif
@@ -0,0 +1,245 @@
+// the file and apk driver shared by the packers, each packer provides protect_buffer()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "packer.h"
+#include "apk.h"
+
+#define MAX_THREADS 64
+
+// protect_buffer() is the apk callback as it is
+typedef char skipped_is_apk_keep[PROTECT_SKIPPED == APK_KEEP ? 1 : -1];
+
+static char **g_files = NULL;
+static int g_file_count = 0;
+static int g_file_cap = 0;
+static int g_next = 0;
+static int g_failed = 0;
+static int g_skipped = 0;
+static uint64_t g_bytes = 0;
+
+static int protect_file(const char *path)
+{
+    struct stat st;
+    uint8_t *map;
+    size_t size;
+    int ret;
+    int fd;
+
+    fd = open(path, O_RDWR);
+    if(fd < 0)
+    {
+        printf("%s: open file failed\n", path);
+        return PROTECT_ERROR;
+    }
+    if(fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        printf("%s: not an elf file\n", path);
+        close(fd);
+        return PROTECT_ERROR;
+    }
+
+    size = st.st_size;
+    map = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        printf("%s: mmap failed\n", path);
+        return PROTECT_ERROR;
+    }
+
+    ret = protect_buffer(path, map, size);
+    munmap(map, size);
+    if(ret == PROTECT_DONE)
+    {
+        __sync_fetch_and_add(&g_bytes, size);
+    }
+    return ret;
+}
+
+static void add_file(const char *path)
+{
+    if(g_file_count == g_file_cap)
+    {
+        g_file_cap = g_file_cap ? g_file_cap * 2 : 64;
+        g_files = (char **)realloc(g_files, g_file_cap * sizeof(char *));
+        if(g_files == NULL)
+        {
+            printf("out of memory\n");
+            exit(1);
+        }
+    }
+    g_files[g_file_count++] = strdup(path);
+}
+
+// every *.so below a directory, lib/<abi>/ trees included
+static void add_dir(const char *path)
+{
+    char child[PATH_MAX];
+    struct dirent *entry;
+    struct stat st;
+    size_t len;
+    DIR *dir;
+
+    dir = opendir(path);
+    if(dir == NULL)
+    {
+        printf("%s: open dir failed\n", path);
+        return;
+    }
+    while((entry = readdir(dir)) != NULL)
+    {
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        if(stat(child, &st) != 0)
+        {
+            continue;
+        }
+        len = strlen(entry->d_name);
+        if(S_ISDIR(st.st_mode))
+        {
+            add_dir(child);
+        }
+        else if(S_ISREG(st.st_mode) && len > 3 && strcmp(entry->d_name + len - 3, ".so") == 0)
+        {
+            add_file(child);
+        }
+    }
+    closedir(dir);
+}
+
+static void *worker(void *arg)
+{
+    int i;
+
+    while((i = __sync_fetch_and_add(&g_next, 1)) < g_file_count)
+    {
+        switch(protect_file(g_files[i]))
+        {
+        case PROTECT_DONE:
+            break;
+        case PROTECT_SKIPPED:
+            __sync_fetch_and_add(&g_skipped, 1);
+            break;
+        default:
+            __sync_fetch_and_add(&g_failed, 1);
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Streams the apk once: the libraries are protected in memory and written
+ * stored and page aligned, everything else is copied without recompressing.
+ */
+static int protect_apk(const char *in_path, const char *out_path)
+{
+    struct apk_stats stats;
+    struct timespec start, end;
+    double seconds;
+    int ret;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ret = apk_repack(in_path, out_path, protect_buffer, &stats);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if(ret < 0)
+    {
+        printf("%s: protect apk failed\n", in_path);
+        return 1;
+    }
+
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Complete: %u entries, %u libraries protected, %u kept, %.1f MB of libraries, %.1f MB written in %.3f s, %.1f MB/s\n",
+           stats.entries, stats.libs, stats.kept, stats.lib_bytes / 1048576.0, stats.out_bytes / 1048576.0, seconds,
+           seconds > 0 ? stats.out_bytes / 1048576.0 / seconds : 0);
+    if(stats.libs == 0)
+    {
+        printf("%s: no library with the decryptor inside\n", in_path);
+    }
+    return 0;
+}
+
+int main(int argc ,char** argv)
+{
+    pthread_t threads[MAX_THREADS];
+    struct timespec start, end;
+    struct stat st;
+    double seconds;
+    int nthread = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    if(argc == 4 && strcmp(argv[1], "-a") == 0)
+    {
+        return protect_apk(argv[2], argv[3]);
+    }
+
+    for(i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+        {
+            nthread = atoi(argv[++i]);
+        }
+        else if(stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+        {
+            add_dir(argv[i]);
+        }
+        else
+        {
+            add_file(argv[i]);
+        }
+    }
+    if(g_file_count == 0)
+    {
+        printf("input the so files or directories\n");
+        return 0;
+    }
+    if(nthread < 1)
+    {
+        nthread = 1;
+    }
+    if(nthread > MAX_THREADS)
+    {
+        nthread = MAX_THREADS;
+    }
+    if(nthread > g_file_count)
+    {
+        nthread = g_file_count;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 1; i < nthread; i++)
+    {
+        if(pthread_create(&threads[i], NULL, worker, NULL) != 0)
+        {
+            nthread = i;
+            break;
+        }
+    }
+    worker(NULL);
+    for(i = 1; i < nthread; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Complete: %d files, %d skipped, %d failed, %.1f MB in %.3f s on %d threads, %.1f MB/s\n",
+           g_file_count, g_skipped, g_failed, g_bytes / 1048576.0, seconds, nthread,
+           seconds > 0 ? g_bytes / 1048576.0 / seconds : 0);
+
+    return g_failed ? 1 : 0;
+}
@@ -0,0 +1,25 @@
+#ifndef _PACKER_H
+#define _PACKER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PROTECT_DONE    0
+#define PROTECT_SKIPPED 1       // not a library of ours, or packed already, left as it is (APK_KEEP)
+#define PROTECT_ERROR   (-1)
+
+/*
+ * A packed file carries PACKED_MARK in e_ident[EI_PAD], the loader ignores
+ * the padding. Packing is an XOR, a second run would decrypt the code
+ * again, so marked files are skipped.
+ */
+#define PACKED_MARK     'P'
+
+/*
+ * Implemented by each packer: protects the elf image at map in place. map
+ * is a mapped file or a library read out of an apk, path is only for
+ * messages. The image is only changed when PROTECT_DONE is returned.
+ */
+int protect_buffer(const char *path, uint8_t *map, size_t size);
+
+#endif
@@ -0,0 +1,95 @@
+// gcc -O2 -mavx2 -c ../../ProtectCommon/chacha.c && g++ -O2 -pthread -I../../ProtectCommon main.cpp ../../ProtectCommon/packer.cpp ../../ProtectCommon/apk.cpp chacha.o -lz -o crypto  (drop -mavx2 on hosts without it)
+// usage: crypto [-j threads] <so file or directory>...
+//        crypto -a <in.apk> <out.apk>      protects lib/*/*.so inside the apk, sign the output again
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <elf.h>
+
+#include "chacha.h"
+#include "../jni/protect_list.h"
+#include "elf_reader.hpp"
+#include "packer.h"
+
+/*
+ * Encrypts every function of g_protect_funcs in place, the virtual address
+ * of the code doubles as the ChaCha20 nonce. All functions are looked up
+ * before the first byte changes. Only libraries exporting PROTECT_MARKER
+ * are touched, the functions of any other library keep their names.
+ */
+template <typename Traits>
+static int protect_elf(const char *path, uint8_t *map, size_t size)
+{
+    const uint8_t key[CHACHA_KEY_SIZE] = PROTECT_KEY;
+    ElfReader<Traits> elf(map, size, ElfReader<Traits>::FILE_LAYOUT);
+    typename Traits::Sym *marker;
+    typename Traits::Sym *syms[PROTECT_FUNC_COUNT];
+    uint8_t *code[PROTECT_FUNC_COUNT];
+    size_t found = 0;
+    size_t i;
+
+    if(!elf.valid())
+    {
+        printf("%s: not an elf file\n", path);
+        return PROTECT_ERROR;
+    }
+    if(elf.header()->e_ident[EI_PAD] == PACKED_MARK)
+    {
+        printf("%s: already packed, skipped\n", path);
+        return PROTECT_SKIPPED;
+    }
+    marker = elf.findSymbol(PROTECT_MARKER);
+    if(marker == NULL || marker->st_shndx == SHN_UNDEF)
+    {
+        printf("%s: no decryptor inside, skipped\n", path);
+        return PROTECT_SKIPPED;
+    }
+
+    for(i = 0; i < PROTECT_FUNC_COUNT; i++)
+    {
+        syms[i] = elf.findSymbol(g_protect_funcs[i]);
+        if(syms[i] == NULL)
+        {
+            continue;
+        }
+        code[i] = elf.template rangeAtAddr<uint8_t>(syms[i]->st_value & ~1, syms[i]->st_size);   //thumb bit
+        if(code[i] == NULL)
+        {
+            printf("%s: %s is outside the file\n", path, g_protect_funcs[i]);
+            return PROTECT_ERROR;
+        }
+        found++;
+    }
+    if(found == 0)
+    {
+        printf("%s: none of the protected functions found\n", path);
+        return PROTECT_ERROR;
+    }
+
+    for(i = 0; i < PROTECT_FUNC_COUNT; i++)
+    {
+        if(syms[i] == NULL)
+        {
+            printf("%s: %s not found, skipped\n", path, g_protect_funcs[i]);
+            continue;
+        }
+        chacha20_xor(code[i], syms[i]->st_size, key, syms[i]->st_value & ~1, 0);
+    }
+    elf.header()->e_ident[EI_PAD] = PACKED_MARK;
+    return PROTECT_DONE;
+}
+
+int protect_buffer(const char *path, uint8_t *map, size_t size)
+{
+    switch(elfClass(map, size))
+    {
+    case ELFCLASS32:
+        return protect_elf<Elf32Traits>(path, map, size);
+    case ELFCLASS64:
+        return protect_elf<Elf64Traits>(path, map, size);
+    default:
+        printf("%s: not an elf file\n", path);
+        return PROTECT_ERROR;
+    }
+}
@@ -3,6 +3,10 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_MODULE    := ProtectFunc
-LOCAL_SRC_FILES := ProtectFunc.cpp
+LOCAL_SRC_FILES := ProtectFunc.cpp ../../ProtectCommon/chacha.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../../ProtectCommon
+ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
+LOCAL_SRC_FILES := $(LOCAL_SRC_FILES:chacha.c=chacha.c.neon)
+endif
 LOCAL_LDLIBS += -L$(SYSROOT)/usr/lib -llog
 include $(BUILD_SHARED_LIBRARY)
@@ -1 +1 @@
-APP_ABI := armeabi armeabi-v7a x86
\ No newline at end of file
+APP_ABI := armeabi armeabi-v7a arm64-v8a x86
\ No newline at end of file
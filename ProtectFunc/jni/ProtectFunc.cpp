@@ -7,6 +7,11 @@
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/errno.h>
+#include <unistd.h>
+
+#include "chacha.h"
+#include "protect_list.h"
+#include "elf_reader.hpp"
 
 #define LOG_TAG "CCDebug"
 
@@ -21,12 +26,6 @@
 	__android_log_print(ANDROID_LOG_DEBUG,LOG_TAG,msg)
 
 
-#define SYMTAB  0x01
-#define HASH    0X02
-#define STRTAB  0x04
-#define STRSZ   0X08
-
-
 #ifdef __cplusplus
 extern "C"{
 #endif
@@ -40,11 +39,35 @@ void init_getString() __attribute__((constructor));
 }
 #endif
 
+PROTECT_DEFINE_MARKER();
+
+// the protected functions are decrypted in the constructor unless this is defined (here or with LOCAL_CFLAGS += -DASYNC_DECRYPT)
+//#define ASYNC_DECRYPT	// decrypt on a background thread, init_getString returns at once
+
+#ifdef ASYNC_DECRYPT
+#include "decrypt_gate.h"
+
+/*
+ * Registered in place of the protected functions. Only calls through JNI
+ * are covered, native code calling a protected function directly must
+ * call wait_decrypted() first.
+ */
+static jstring getString_stub(JNIEnv* env,jobject clazz)
+{
+	wait_decrypted();
+	return getString(env,clazz);
+}
+
+#define NATIVE_ENTRY(func) (void*)func##_stub
+#else
+#define NATIVE_ENTRY(func) (void*)func
+#endif
+
 JNINativeMethod g_method[] = {
 	{
 		"getString",
 		"()Ljava/lang/String;",
-		(void*)getString
+		NATIVE_ENTRY(getString)
 	}
 };
 
@@ -126,149 +149,112 @@ unsigned long get_cur_lib_addr()
 }
 
 
-// \bonic\linker\Linker.cpp
-static unsigned elfhash(const char* _name) {
-    const unsigned char* name = (const unsigned char*) _name;
-    unsigned h = 0, g;
+struct protect_func
+{
+	unsigned long addr;
+	unsigned long size;
+};
 
-    while(*name) {
-        h = (h << 4) + *name++;
-        g = h & 0xf0000000;
-        h ^= g;
-        h ^= g >> 24;
-    }
-    return h;
+static int compare_func(const void* a,const void* b)
+{
+	unsigned long addr_a = ((const protect_func*)a)->addr;
+	unsigned long addr_b = ((const protect_func*)b)->addr;
+	return addr_a < addr_b ? -1 : addr_a > addr_b;
 }
 
-void init_getString()
+/*
+ * Decrypts every function of g_protect_funcs. They are sorted by address
+ * and functions whose pages touch or overlap are handled under one pair
+ * of mprotect calls.
+ */
+static void decrypt_funcs(unsigned long lib_addr,protect_func* funcs,int count)
 {
-	unsigned long lib_addr = 0;
-	Elf32_Ehdr*  ptr_ehdr = NULL;
-	Elf32_Phdr*  ptr_phdr = NULL;
-	Elf32_Dyn*   ptr_dyn = NULL;;
-	Elf32_Sym*   ptr_dynsym = NULL;
-	Elf32_Sym* 	 sym = NULL;
-	const char* ptr_hashtab = NULL;
-	const char* ptr_dynstr = NULL;
-	int flag = 0;
-	unsigned long strtab_size = 0;
-	unsigned func_hash = 0;
-	const char func_name[] = "getString";
-	unsigned long func_addr = 0;
-	unsigned   func_size =0;
-	unsigned long func = (unsigned long)getString;
-	size_t nbucket;
-	size_t nchain;
-	unsigned* bucket;
-	unsigned* chain;
-	const unsigned page_size = 0x1000;
-
-	int i =0;
-	lib_addr = get_cur_lib_addr();
-	if(0 == lib_addr)
-	{
-		LOGD("get_cur_lib_addr failed");
-		return;
-	}
-	ptr_ehdr = (Elf32_Ehdr*)lib_addr;
-	ptr_phdr = (Elf32_Phdr*)(lib_addr+ptr_ehdr->e_phoff);
-	for(i=0;i<ptr_ehdr->e_phnum;i++,ptr_phdr++)
+	const unsigned long page_size = 0x1000;
+	const uint8_t key[CHACHA_KEY_SIZE] = PROTECT_KEY;
+	unsigned long range_start;
+	unsigned long range_end;
+	int first;
+	int i;
+
+	qsort(funcs,count,sizeof(protect_func),compare_func);
+
+	for(first = 0; first < count; first = i)
 	{
-		if(PT_DYNAMIC == ptr_phdr->p_type)
+		range_start = funcs[first].addr & ~(page_size - 1);
+		range_end = (funcs[first].addr + funcs[first].size + page_size - 1) & ~(page_size - 1);
+		for(i = first + 1; i < count && (funcs[i].addr & ~(page_size - 1)) <= range_end; i++)
 		{
-			ptr_dyn = (Elf32_Dyn*)(lib_addr+ptr_phdr->p_vaddr);
-			break;
+			unsigned long end = (funcs[i].addr + funcs[i].size + page_size - 1) & ~(page_size - 1);
+			if(end > range_end)
+			{
+				range_end = end;
+			}
 		}
 
-	}
-	if(NULL == ptr_dyn)
-	{
-		LOGD("find .dynamic failed");
-		return ;
-	}
-	// .dynsym  .dynstr .hash .
-	for (Elf32_Dyn* d = ptr_dyn; d->d_tag != DT_NULL; ++d)
-	{
-		switch(d->d_tag)
+		if(mprotect((void*)range_start,range_end - range_start,PROT_WRITE|PROT_READ|PROT_EXEC) != 0)
 		{
-		case DT_SYMTAB:
-			ptr_dynsym = (Elf32_Sym*)(lib_addr+d->d_un.d_ptr);
-			flag |= SYMTAB;
-			break;
-		case DT_STRTAB:
-		    ptr_dynstr = (const char*)(lib_addr + d->d_un.d_ptr);
-		    flag |= STRTAB;
-		    break;
-		case DT_STRSZ:
-			strtab_size = d->d_un.d_val;
-			flag |= STRSZ;
-			break;
-		case DT_HASH:
-			ptr_hashtab = (const char*)(lib_addr + d->d_un.d_ptr);
-			flag |= HASH;
-			break;
+			LOGD("change page protect failed");
+			LOGD(strerror(errno));
+			return;
 		}
-	}
-
-	if(flag & 0xf == 0xf)
-	{
-		LOGD("all segement get");
-	}
-
-	nbucket = *(unsigned*)ptr_hashtab;
-	nchain = *(unsigned*)(ptr_hashtab+4);
-	bucket = (unsigned*)(ptr_hashtab+8);
-	chain = bucket + nbucket;
-
-	func_hash = elfhash(func_name);
-
-	for (unsigned n = bucket[func_hash % nbucket]; n != 0; n = chain[n])
-	{
-	    sym = ptr_dynsym + n;
-		if (strcmp(ptr_dynstr + sym->st_name, func_name)) continue;
-
-		switch(ELF32_ST_BIND(sym->st_info))
+		for(int j = first; j < i; j++)
 		{
-		case STB_GLOBAL:
-	    case STB_WEAK:
-	    	if (sym->st_shndx == SHN_UNDEF)
-	    	{
-	              continue;
-	        }
+			chacha20_xor((uint8_t*)funcs[j].addr,funcs[j].size,key,funcs[j].addr - lib_addr,0);
+			__builtin___clear_cache((char*)funcs[j].addr,(char*)(funcs[j].addr + funcs[j].size));
+		}
+		if(mprotect((void*)range_start,range_end - range_start,PROT_READ|PROT_EXEC) != 0)
+		{
+			LOGD("resume page protect failed");
+			LOGD(strerror(errno));
+			return;
 		}
-
-		func_addr = lib_addr+sym->st_value;
-		func_size = sym->st_size;
-		break;
 	}
+}
 
-	unsigned page_off = func_addr % page_size;
+static void decrypt_protected()
+{
+	unsigned long lib_addr = 0;
+	protect_func funcs[PROTECT_FUNC_COUNT];
+	int count = 0;
+	int i;
 
-	if(mprotect((const void*)(func_addr-page_off),func_size+page_off,PROT_WRITE|PROT_READ|PROT_EXEC)!= JNI_OK)
+	lib_addr = get_cur_lib_addr();
+	if(0 == lib_addr)
 	{
-		int n = errno;
-		char *msg = strerror(errno);
-		LOGD("change page protect failed");
-		LOGD(msg);
+		LOGD("get_cur_lib_addr failed");
 		return;
-
 	}
 
-	for(int i =0;i<func_size;i++)
+	ElfReader<NativeElfTraits> elf((void*)lib_addr);
+	if(!elf.valid() || elf.symbols().empty())
 	{
-		((char*)func_addr)[i] = ~((char*)func_addr)[i];
+		LOGD("find the needed dynamic section failed");
+		return;
 	}
 
-
-	if(mprotect((const void*)(func_addr-page_off),func_size+page_off,PROT_READ|PROT_EXEC) != JNI_OK)
+	for(i = 0; i < (int)PROTECT_FUNC_COUNT; i++)
 	{
-		int n = errno;
-		char *msg = strerror(errno);
-		LOGD("resume page protect failed");
-		LOGD(msg);
-		return;
+		NativeElfTraits::Sym* sym = elf.findSymbol(g_protect_funcs[i]);
+		if(NULL == sym)
+		{
+			LOGD("protected function not found");
+			continue;
+		}
+		funcs[count].addr = lib_addr+(sym->st_value & ~1);	// the thumb bit is not part of the address
+		funcs[count].size = sym->st_size;
+		count++;
 	}
 
+	decrypt_funcs(lib_addr,funcs,count);
+}
+
+void init_getString()
+{
+#ifdef ASYNC_DECRYPT
+	start_decrypt(decrypt_protected);
+#else
+	decrypt_protected();
+#endif
 }
 
 
@@ -0,0 +1,15 @@
+#ifndef _PROTECT_LIST_H
+#define _PROTECT_LIST_H
+
+/*
+ * Exported functions encrypted by "crypto code" and decrypted again by
+ * init_getString, both are built from this list. Add every JNI function
+ * that should be protected, the order does not matter.
+ */
+static const char* g_protect_funcs[] = {
+	"getString",
+};
+
+#define PROTECT_FUNC_COUNT (sizeof(g_protect_funcs) / sizeof(g_protect_funcs[0]))
+
+#endif
@@ -0,0 +1,78 @@
+// gcc -O2 -mavx2 -c ../../ProtectCommon/chacha.c && g++ -O2 -pthread -I../../ProtectCommon main.cpp ../../ProtectCommon/packer.cpp ../../ProtectCommon/apk.cpp chacha.o -lz -o crypto  (drop -mavx2 on hosts without it)
+// usage: crypto [-j threads] <so file or directory>...
+//        crypto -a <in.apk> <out.apk>      protects lib/*/*.so inside the apk, sign the output again
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <elf.h>
+
+#include "chacha.h"
+#include "elf_reader.hpp"
+#include "packer.h"
+
+/*
+ * Encrypts .mytext in place and leaves its size in e_entry and its offset
+ * in e_shoff for the library, the offset is also the ChaCha20 nonce.
+ * The section headers are unreachable afterwards, files packed before
+ * PACKED_MARK existed are recognized by that. Libraries that do not export
+ * PROTECT_MARKER are not ours and stay as they are.
+ */
+template <typename Traits>
+static int protect_elf(const char *path, uint8_t *map, size_t size)
+{
+    const uint8_t key[CHACHA_KEY_SIZE] = PROTECT_KEY;
+    ElfReader<Traits> elf(map, size, ElfReader<Traits>::FILE_LAYOUT);
+    typename Traits::Sym *marker;
+    typename Traits::Shdr *shdr;
+    uint8_t *section;
+
+    if(!elf.valid())
+    {
+        printf("%s: not an elf file\n", path);
+        return PROTECT_ERROR;
+    }
+    if(elf.header()->e_ident[EI_PAD] == PACKED_MARK || elf.sections().empty())
+    {
+        printf("%s: already packed or no section headers, skipped\n", path);
+        return PROTECT_SKIPPED;
+    }
+    marker = elf.findSymbol(PROTECT_MARKER);
+    if(marker == NULL || marker->st_shndx == SHN_UNDEF)
+    {
+        printf("%s: no decryptor inside, skipped\n", path);
+        return PROTECT_SKIPPED;
+    }
+    shdr = elf.findSection(".mytext");
+    if(shdr == NULL)
+    {
+        printf("%s: find target section failed\n", path);
+        return PROTECT_ERROR;
+    }
+    section = elf.template rangeAt<uint8_t>(shdr->sh_offset, shdr->sh_size);
+    if(section == NULL)
+    {
+        printf("%s: .mytext is outside the file\n", path);
+        return PROTECT_ERROR;
+    }
+
+    chacha20_xor(section, shdr->sh_size, key, shdr->sh_offset, 0);
+    elf.header()->e_entry = shdr->sh_size;
+    elf.header()->e_shoff = shdr->sh_offset;
+    elf.header()->e_ident[EI_PAD] = PACKED_MARK;
+    return PROTECT_DONE;
+}
+
+int protect_buffer(const char *path, uint8_t *map, size_t size)
+{
+    switch(elfClass(map, size))
+    {
+    case ELFCLASS32:
+        return protect_elf<Elf32Traits>(path, map, size);
+    case ELFCLASS64:
+        return protect_elf<Elf64Traits>(path, map, size);
+    default:
+        printf("%s: not an elf file\n", path);
+        return PROTECT_ERROR;
+    }
+}
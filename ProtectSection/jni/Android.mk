@@ -4,7 +4,11 @@ include $(CLEAR_VARS)
 
 LOCAL_MODULE    := protect_section
 #VisualGDBAndroid: AutoUpdateSourcesInNextLine
-LOCAL_SRC_FILES := protect_section.cpp
+LOCAL_SRC_FILES := protect_section.cpp ../../ProtectCommon/chacha.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../../ProtectCommon
+ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
+LOCAL_SRC_FILES := $(LOCAL_SRC_FILES:chacha.c=chacha.c.neon)
+endif
 LOCAL_ARM_MODE  := arm
 LOCAL_LDLIBS += -L$(SYSROOT)/usr/lib -llog
 
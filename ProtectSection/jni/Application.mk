@@ -1,2 +1,2 @@
 
-APP_ABI := armeabi 
\ No newline at end of file
+APP_ABI := armeabi armeabi-v7a arm64-v8a
\ No newline at end of file
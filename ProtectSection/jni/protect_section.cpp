@@ -7,6 +7,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <signal.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "chacha.h"
+#include "elf_reader.hpp"
 
 /*
 #if defined (__arm__)
@@ -56,17 +64,54 @@ JNIEXPORT jstring JNICALL getString(JNIEnv*,jobject)__attribute__((section(".myt
 void init_getString()__attribute__((constructor));  //initarray
 unsigned long get_cur_lib_addr();
 
+// phases of the last whole-range decryption
+struct decrypt_timing
+{
+	unsigned long long unprotect_ns;	// mprotect to RW
+	unsigned long long spawn_ns;		// starting the helper threads
+	unsigned long long decrypt_ns;		// until the last one joined
+	unsigned long long protect_ns;		// mprotect back to R-X and the cache flush
+	unsigned long bytes;
+	int threads;
+};
+void get_decrypt_timing(struct decrypt_timing* timing);
+
 #ifdef __cplusplus
 }
 #endif
 
+PROTECT_DEFINE_MARKER();
+
+
+
+/*
+ * .mytext is decrypted eagerly in the constructor by default. Both modes
+ * below are opt-in, define one here or with LOCAL_CFLAGS += -D...
+ * LAZY_DECRYPT takes over SIGSEGV for the life of the process.
+ */
+//#define LAZY_DECRYPT	// decrypt .mytext a page at a time when it is first used
+//#define ASYNC_DECRYPT	// decrypt it on a background thread, ignored with LAZY_DECRYPT
+
+#if defined(ASYNC_DECRYPT) && !defined(LAZY_DECRYPT)
+#include "decrypt_gate.h"
+
+// registered in place of getString, the stubs must stay out of .mytext
+static jstring getString_stub(JNIEnv* env,jobject clazz)
+{
+	wait_decrypted();
+	return getString(env,clazz);
+}
 
+#define NATIVE_ENTRY(func) (void*)func##_stub
+#else
+#define NATIVE_ENTRY(func) (void*)func
+#endif
 
 static JNINativeMethod g_methods[] = {
 		{
 			"getString",
 			"()Ljava/lang/String;",
-			(void*)getString
+			NATIVE_ENTRY(getString)
 		}
 };
 
@@ -101,44 +146,367 @@ unsigned long get_cur_lib_addr()
 }
 
 
-void init_getString()
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 0x1000
+#endif
+
+static const uint8_t g_key[CHACHA_KEY_SIZE] = PROTECT_KEY;
+static unsigned long g_text_addr = 0;	// .mytext in memory
+static unsigned long g_text_size = 0;
+static unsigned long g_text_nonce = 0;	// its file offset
+
+#ifdef LAZY_DECRYPT
+static unsigned long g_lazy_start = 0;	// the whole pages left encrypted
+static unsigned long g_lazy_end = 0;
+static unsigned char* g_lazy_done = NULL;	// one byte per page
+static volatile int g_lazy_lock = 0;
+static struct sigaction g_old_segv_action;
+#endif
+
+/*
+ * Makes the pages of [page_start,page_end) writable. The ones .mytext only
+ * partly covers keep PROT_EXEC, the code sharing them (JNI_OnLoad, the
+ * stubs) may run on another thread meanwhile.
+ */
+static int unprotect_pages(unsigned long page_start,unsigned long page_end)
 {
-	//LOGD("Hello init_getString");
+	unsigned long inner_start = (g_text_addr + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	unsigned long inner_end = (g_text_addr + g_text_size) & ~(PAGE_SIZE - 1);
+	unsigned long lo = page_start < inner_start ? inner_start : page_start;
+	unsigned long hi = page_end > inner_end ? inner_end : page_end;
 
-	unsigned long lib_addr;
-	Elf32_Ehdr* ptr_ehdr = NULL;
-	Elf32_Shdr* ptr_shdr = NULL;
-	unsigned long mytext_addr;
-	unsigned long mytext_size = 0;
-	unsigned long page_size = 0x1000;
-	lib_addr = get_cur_lib_addr();
-	if(NULL == lib_addr)
+	if(lo >= hi)
 	{
-		return ;
+		return mprotect((void*)page_start,page_end - page_start,PROT_READ | PROT_WRITE | PROT_EXEC);
+	}
+	if(page_start < lo && mprotect((void*)page_start,lo - page_start,PROT_READ | PROT_WRITE | PROT_EXEC) != 0)
+	{
+		return -1;
+	}
+	if(hi < page_end && mprotect((void*)hi,page_end - hi,PROT_READ | PROT_WRITE | PROT_EXEC) != 0)
+	{
+		return -1;
 	}
+	return mprotect((void*)lo,hi - lo,PROT_READ | PROT_WRITE);
+}
+
+// decrypt_range() without the logging, the SIGSEGV handler uses it: -1 if unprotecting failed, -2 if protecting again failed
+static int decrypt_quiet(unsigned long start,unsigned long end)
+{
+	unsigned long page_start;
+	unsigned long page_end;
+
+	page_start = start & ~(PAGE_SIZE - 1);
+	page_end = (end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	if(unprotect_pages(page_start,page_end) != 0)
+	{
+		return -1;
+	}
+
+	chacha20_xor((uint8_t*)start,end - start,g_key,g_text_nonce,start - g_text_addr);
+
+	if(mprotect((void*)page_start,page_end - page_start,PROT_READ | PROT_EXEC) != 0)
+	{
+		return -2;
+	}
+	__builtin___clear_cache((char*)start,(char*)end);
+	return 0;
+}
+
+// decrypts the part of .mytext in [start,end), which must be page aligned or the section bounds
+static int decrypt_range(unsigned long start,unsigned long end)
+{
+	int ret;
 
-	ptr_ehdr = (Elf32_Ehdr*)lib_addr;
-	mytext_size = ptr_ehdr->e_entry; //size
-	mytext_addr = ptr_ehdr->e_shoff + lib_addr;  //offset
-	unsigned long offset = mytext_addr % page_size;
-	LOGD("invoke mprotect first");
-	if(mprotect((const void*)(mytext_addr-offset) , mytext_size,PROT_READ | PROT_WRITE | PROT_EXEC) != 0)
+	if(start < g_text_addr)
+	{
+		start = g_text_addr;
+	}
+	if(end > g_text_addr + g_text_size)
+	{
+		end = g_text_addr + g_text_size;
+	}
+	if(start >= end)
+	{
+		return 0;
+	}
+
+	ret = decrypt_quiet(start,end);
+	if(ret == -1)
 	{
 		LOGD("change the mem failed");
-		return ;
 	}
+	else if(ret == -2)
+	{
+		LOGD("resume mem failed");
+	}
+	return ret == 0 ? 0 : -1;
+}
+
+#define PARALLEL_THRESHOLD	(512 * 1024)	// smaller ranges are not worth a thread
+#define PARALLEL_CHUNK_MIN	(128 * 1024)
+#define MAX_DECRYPT_THREADS	8
+
+static struct decrypt_timing g_timing;
+
+struct decrypt_chunk
+{
+	unsigned long start;
+	unsigned long end;
+};
+
+static unsigned long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void* decrypt_chunk_thread(void* arg)
+{
+	decrypt_chunk* chunk = (decrypt_chunk*)arg;
+	chacha20_xor((uint8_t*)chunk->start,chunk->end - chunk->start,g_key,g_text_nonce,chunk->start - g_text_addr);
+	return NULL;
+}
+
+/*
+ * decrypt_range() for big ranges: the pages are opened once, split into
+ * page aligned chunks for short-lived threads (this one takes the first)
+ * and closed again after the join. Small ranges and single core devices
+ * go straight to decrypt_range().
+ */
+static int decrypt_parallel(unsigned long start,unsigned long end)
+{
+	decrypt_chunk chunks[MAX_DECRYPT_THREADS];
+	pthread_t threads[MAX_DECRYPT_THREADS];
+	int started[MAX_DECRYPT_THREADS];
+	unsigned long page_start;
+	unsigned long page_end;
+	unsigned long long t0,t1,t2,t3,t4;
+	long ncpu;
+	int n;
+	int i;
+
+	if(start < g_text_addr)
+	{
+		start = g_text_addr;
+	}
+	if(end > g_text_addr + g_text_size)
+	{
+		end = g_text_addr + g_text_size;
+	}
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	n = ncpu < MAX_DECRYPT_THREADS ? ncpu : MAX_DECRYPT_THREADS;
+	if(end - start < PARALLEL_THRESHOLD || n < 2)
+	{
+		t0 = now_ns();
+		i = decrypt_range(start,end);
+		memset(&g_timing,0,sizeof(g_timing));
+		g_timing.decrypt_ns = now_ns() - t0;
+		g_timing.bytes = start < end ? end - start : 0;
+		g_timing.threads = 1;
+		return i;
+	}
+	if((end - start) / PARALLEL_CHUNK_MIN < (unsigned long)n)
+	{
+		n = (end - start) / PARALLEL_CHUNK_MIN;
+	}
+
+	t0 = now_ns();
+	page_start = start & ~(PAGE_SIZE - 1);
+	page_end = (end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	if(unprotect_pages(page_start,page_end) != 0)
+	{
+		LOGD("change the mem failed");
+		return -1;
+	}
+	t1 = now_ns();
+
+	for(i = 0; i < n; i++)
+	{
+		chunks[i].start = i == 0 ? start : (start + (end - start) / n * i) & ~(PAGE_SIZE - 1);
+		chunks[i].end = i == n - 1 ? end : (start + (end - start) / n * (i + 1)) & ~(PAGE_SIZE - 1);
+	}
+	for(i = 1; i < n; i++)
+	{
+		started[i] = pthread_create(&threads[i],NULL,decrypt_chunk_thread,&chunks[i]) == 0;
+	}
+	t2 = now_ns();
 
-	for(int i=0;i<mytext_size;i++)
+	decrypt_chunk_thread(&chunks[0]);
+	for(i = 1; i < n; i++)
 	{
-		((char*)mytext_addr)[i] =~ ((char*)mytext_addr)[i];
+		if(started[i])
+		{
+			pthread_join(threads[i],NULL);
+		}
+		else
+		{
+			decrypt_chunk_thread(&chunks[i]);
+		}
 	}
-	LOGD("invoke mprotect to resume the page");
-	if(mprotect((const void*)(mytext_addr-offset),mytext_size,PROT_READ | PROT_EXEC)!=0)
+	t3 = now_ns();
+
+	if(mprotect((void*)page_start,page_end - page_start,PROT_READ | PROT_EXEC) != 0)
 	{
 		LOGD("resume mem failed");
+		return -1;
+	}
+	__builtin___clear_cache((char*)start,(char*)end);
+	t4 = now_ns();
+
+	g_timing.unprotect_ns = t1 - t0;
+	g_timing.spawn_ns = t2 - t1;
+	g_timing.decrypt_ns = t3 - t2;
+	g_timing.protect_ns = t4 - t3;
+	g_timing.bytes = end - start;
+	g_timing.threads = n;
+	__android_log_print(ANDROID_LOG_DEBUG,LOG_TAG,"decrypted %lu bytes on %d threads: mprotect %llu us, spawn %llu us, decrypt %llu us, restore %llu us",
+		g_timing.bytes,n,g_timing.unprotect_ns / 1000,g_timing.spawn_ns / 1000,g_timing.decrypt_ns / 1000,g_timing.protect_ns / 1000);
+	return 0;
+}
+
+void get_decrypt_timing(struct decrypt_timing* timing)
+{
+	*timing = g_timing;
+}
+
+#ifdef LAZY_DECRYPT
+/*
+ * The encrypted pages are PROT_NONE, executing or reading them (literal
+ * pools) faults here. The faulting page is decrypted and made R-X, then
+ * the instruction runs again. Other faults, and pages that could not be
+ * decrypted, go to the previous handler. Every signal is blocked while it
+ * runs (see lazy_decrypt), so no handler on this thread can fault on an
+ * encrypted page while it holds g_lazy_lock. Nothing in here may log.
+ */
+static void lazy_handler(int sig,siginfo_t* info,void* ucontext)
+{
+	unsigned long addr = (unsigned long)info->si_addr;
+	unsigned long page = addr & ~(PAGE_SIZE - 1);
+	int ret = 0;
+	unsigned char* done;
+
+	if(addr < g_lazy_start || addr >= g_lazy_end)
+	{
+		goto _chain;
+	}
+
+	while(!__sync_bool_compare_and_swap(&g_lazy_lock,0,1))
+	{
+		sched_yield();
+	}
+	// another thread may have done it while we waited
+	done = &g_lazy_done[(page - g_lazy_start) / PAGE_SIZE];
+	if(!*done)
+	{
+		ret = decrypt_quiet(page,page + PAGE_SIZE);
+		if(ret == 0)
+		{
+			*done = 1;
+		}
+	}
+	__sync_lock_release(&g_lazy_lock);
+	if(ret == 0)
+	{
+		return;
+	}
+
+_chain:
+	if(g_old_segv_action.sa_flags & SA_SIGINFO)
+	{
+		g_old_segv_action.sa_sigaction(sig,info,ucontext);
+	}
+	else if(g_old_segv_action.sa_handler == SIG_DFL || g_old_segv_action.sa_handler == SIG_IGN)
+	{
+		sigaction(sig,&g_old_segv_action,NULL);
+	}
+	else
+	{
+		g_old_segv_action.sa_handler(sig);
+	}
+}
+
+/*
+ * Only the pages .mytext covers completely are left encrypted, the ones it
+ * shares with other code (maybe this handler) are decrypted right away.
+ */
+static int lazy_decrypt()
+{
+	struct sigaction action;
+
+	g_lazy_start = (g_text_addr + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	g_lazy_end = (g_text_addr + g_text_size) & ~(PAGE_SIZE - 1);
+	if(g_lazy_start >= g_lazy_end)
+	{
+		return decrypt_parallel(g_text_addr,g_text_addr + g_text_size);
+	}
+
+	g_lazy_done = (unsigned char*)calloc((g_lazy_end - g_lazy_start) / PAGE_SIZE,1);
+	if(NULL == g_lazy_done)
+	{
+		return decrypt_parallel(g_text_addr,g_text_addr + g_text_size);
+	}
+
+	if(decrypt_range(g_text_addr,g_lazy_start) != 0 || decrypt_range(g_lazy_end,g_text_addr + g_text_size) != 0)
+	{
+		return -1;
+	}
+
+	memset(&action,0,sizeof(action));
+	action.sa_sigaction = lazy_handler;
+	action.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigfillset(&action.sa_mask);
+	if(sigaction(SIGSEGV,&action,&g_old_segv_action) != 0)
+	{
+		return decrypt_parallel(g_lazy_start,g_lazy_end);
+	}
+
+	if(mprotect((void*)g_lazy_start,g_lazy_end - g_lazy_start,PROT_NONE) != 0)
+	{
+		LOGD("protect the encrypted pages failed");
+		sigaction(SIGSEGV,&g_old_segv_action,NULL);
+		return decrypt_parallel(g_lazy_start,g_lazy_end);
+	}
+	return 0;
+}
+#endif
+
+#if defined(ASYNC_DECRYPT) && !defined(LAZY_DECRYPT)
+static void decrypt_text()
+{
+	decrypt_parallel(g_text_addr,g_text_addr + g_text_size);
+}
+#endif
+
+void init_getString()
+{
+	//LOGD("Hello init_getString");
+
+	unsigned long lib_addr;
+	NativeElfTraits::Ehdr* ptr_ehdr = NULL;
+	lib_addr = get_cur_lib_addr();
+	if(0 == lib_addr)
+	{
+#if defined(ASYNC_DECRYPT) && !defined(LAZY_DECRYPT)
+		set_decrypted();
+#endif
 		return ;
 	}
 
+	ptr_ehdr = (NativeElfTraits::Ehdr*)lib_addr;
+	g_text_size = ptr_ehdr->e_entry; //size
+	g_text_nonce = ptr_ehdr->e_shoff;
+	g_text_addr = ptr_ehdr->e_shoff + lib_addr;  //offset
+
+#if defined(LAZY_DECRYPT)
+	lazy_decrypt();
+#elif defined(ASYNC_DECRYPT)
+	start_decrypt(decrypt_text);
+#else
+	decrypt_parallel(g_text_addr,g_text_addr + g_text_size);
+#endif
 }
 
 
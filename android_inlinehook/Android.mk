@@ -19,7 +19,11 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_MODULE    := hook
-LOCAL_SRC_FILES := inlineHook.c backtrace.c utils.c asm.S
+LOCAL_SRC_FILES := inlineHook.c relocate.c symcache.c scanner.c memo.c sample.c trace.c override.c inject.c coverage.c watch.c integrity.c jnibridge.c syscallhook.c backtrace.c utils.c asm.S
+ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
+LOCAL_SRC_FILES := $(LOCAL_SRC_FILES:scanner.c=scanner.c.neon)
+LOCAL_SRC_FILES := $(LOCAL_SRC_FILES:integrity.c=integrity.c.neon)
+endif
 LOCAL_LDLIBS += -L$(SYSROOT)/usr/lib -llog
 
 include $(BUILD_STATIC_LIBRARY)
\ No newline at end of file
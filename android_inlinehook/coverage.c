@@ -0,0 +1,667 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <sys/ucontext.h>
+
+#include "inlineHook.h"
+#include "coverage.h"
+
+#define ENABLE_DEBUG
+#include "log.h"
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 4096
+#endif
+
+#define PAGE_START(addr) (~(PAGE_SIZE - 1) & (addr))
+#define ALIGN_PC(pc)	(((pc)) & 0xFFFFFFFC)
+
+// the undefined instructions the kernel turns into SIGTRAP, as used by gdb
+#define THUMB_BREAKPOINT	0xDE01
+#define ARM_BREAKPOINT		0xE7F001F0
+
+// how an instruction leaves it, see decodeThumb() and decodeArm()
+#define FLOW_NEXT		0	// falls through, calls included
+#define FLOW_COND		1	// conditional branch to target, or falls through
+#define FLOW_JUMP		2	// unconditional branch to target
+#define FLOW_END		3	// return, indirect or computed branch
+
+// per halfword of a scanned range
+#define SCAN_VISITED	0x1
+#define SCAN_LEADER		0x2
+#define SCAN_DATA		0x4		// literal referenced by the code
+#define SCAN_IT			0x8		// inside an IT block, can not start a block
+#define SCAN_CONT		0x10	// second halfword of a 32-bit instruction
+
+#define SCAN_ROUNDS		4
+
+extern int asm_cacheflush(long start, long end, long flags);
+
+struct decoded {
+	int length;
+	int flow;
+	uint32_t target;
+	uint32_t data;			// literal address, 0 for none
+	int data_length;
+	int it_count;			// instructions covered by an IT
+};
+
+struct scanState {
+	uint32_t start;
+	uint32_t size;
+	int thumb;
+	uint8_t *flags;
+	uint32_t *stack;
+	int nstack;
+	int changed;			// a visited halfword turned out to be data
+};
+
+struct coverageBlock {
+	uint32_t addr;			// with the thumb bit
+	uint32_t orig;
+	uint32_t page;
+	volatile int hit;
+};
+
+struct coveragePage {
+	uint32_t addr;
+	volatile int remaining;	// blocks not hit yet, the page goes back to R-X at 0
+};
+
+static struct coverageBlock *blocks;
+static uint32_t nblock;
+static uint32_t maxblock;
+static struct coveragePage *pages;
+static uint32_t npage;
+static uint8_t *bitmap;
+static int started;
+static struct sigaction old_action;
+
+static int32_t signExtend(uint32_t value, int bits)
+{
+	return (int32_t) (value << (32 - bits)) >> (32 - bits);
+}
+
+static void decodeThumb(uint32_t pc, struct decoded *d)
+{
+	uint16_t hw1 = *(uint16_t *) pc;
+	uint16_t hw2;
+	uint32_t s, j1, j2, imm;
+
+	memset(d, 0, sizeof(struct decoded));
+	d->length = 2;
+	d->flow = FLOW_NEXT;
+
+	if ((hw1 & 0xE000) == 0xE000 && (hw1 & 0x1800) != 0) {
+		hw2 = *(uint16_t *) (pc + 2);
+		d->length = 4;
+
+		if ((hw1 & 0xF800) == 0xF000 && (hw2 & 0x8000) == 0x8000) {
+			s = (hw1 >> 10) & 1;
+			j1 = (hw2 >> 13) & 1;
+			j2 = (hw2 >> 11) & 1;
+			if ((hw2 & 0xD000) == 0x8000 && ((hw1 >> 6) & 0xE) != 0xE) {
+				// B<c>.W
+				imm = (s << 20) | (j2 << 19) | (j1 << 18) | ((hw1 & 0x3F) << 12) | ((hw2 & 0x7FF) << 1);
+				d->flow = FLOW_COND;
+				d->target = pc + 4 + signExtend(imm, 21);
+			}
+			else if ((hw2 & 0xD000) == 0x9000) {
+				// B.W
+				imm = (s << 24) | ((~(j1 ^ s) & 1) << 23) | ((~(j2 ^ s) & 1) << 22) | ((hw1 & 0x3FF) << 12) | ((hw2 & 0x7FF) << 1);
+				d->flow = FLOW_JUMP;
+				d->target = pc + 4 + signExtend(imm, 25);
+			}
+			return;
+		}
+		if ((hw1 & 0xFF7F) == 0xF85F) {
+			// LDR.W Rt, <label>
+			d->data = ALIGN_PC(pc + 4) + ((hw1 & 0x80) ? (hw2 & 0xFFF) : -(hw2 & 0xFFF));
+			d->data_length = 4;
+		}
+		else if ((hw1 & 0xFE7F) == 0xE85F) {
+			// LDRD Rt, Rt2, <label>
+			d->data = ALIGN_PC(pc + 4) + ((hw1 & 0x80) ? (hw2 & 0xFF) << 2 : -((hw2 & 0xFF) << 2));
+			d->data_length = 8;
+		}
+		else if ((hw1 & 0xFF3F) == 0xED1F && (hw2 & 0x0E00) == 0x0A00) {
+			// VLDR Sd/Dd, <label>
+			d->data = ALIGN_PC(pc + 4) + ((hw1 & 0x80) ? (hw2 & 0xFF) << 2 : -((hw2 & 0xFF) << 2));
+			d->data_length = (hw2 & 0x100) ? 8 : 4;
+		}
+		else if (((hw1 & 0xFBFF) == 0xF20F || (hw1 & 0xFBFF) == 0xF2AF) && (hw2 & 0x8000) == 0) {
+			// ADR.W Rd, <label>
+			imm = ((hw1 & 0x400) << 1) | ((hw2 & 0x7000) >> 4) | (hw2 & 0xFF);
+			d->data = ALIGN_PC(pc + 4) + ((hw1 & 0xA0) ? -imm : imm);
+			d->data_length = 4;
+		}
+
+		if ((hw1 & 0xFF70) == 0xF850 && (hw2 & 0xF000) == 0xF000) {
+			d->flow = FLOW_END;		// LDR.W PC, [...]
+		}
+		else if (((hw1 & 0xFFD0) == 0xE890 || (hw1 & 0xFFD0) == 0xE910) && (hw2 & 0x8000)) {
+			d->flow = FLOW_END;		// POP.W / LDM.W {..., PC}
+		}
+		else if ((hw1 & 0xFFF0) == 0xE8D0 && (hw2 & 0xFFE0) == 0xF000) {
+			d->flow = FLOW_END;		// TBB / TBH
+		}
+		return;
+	}
+
+	if ((hw1 & 0xFF00) == 0xBF00 && (hw1 & 0xF) != 0) {
+		// IT, the mask's lowest set bit ends it
+		d->it_count = 4 - __builtin_ctz(hw1 & 0xF);
+	}
+	else if ((hw1 & 0xF000) == 0xD000) {
+		if ((hw1 & 0x0E00) == 0x0E00) {
+			d->flow = (hw1 & 0x0100) ? FLOW_NEXT : FLOW_END;	// SVC, UDF
+		}
+		else {
+			d->flow = FLOW_COND;	// B<c>
+			d->target = pc + 4 + signExtend((hw1 & 0xFF) << 1, 9);
+		}
+	}
+	else if ((hw1 & 0xF800) == 0xE000) {
+		d->flow = FLOW_JUMP;		// B
+		d->target = pc + 4 + signExtend((hw1 & 0x7FF) << 1, 12);
+	}
+	else if ((hw1 & 0xF500) == 0xB100) {
+		d->flow = FLOW_COND;		// CBZ / CBNZ
+		d->target = pc + 4 + (((hw1 >> 3) & 0x1F) << 1) + (((hw1 >> 9) & 1) << 6);
+	}
+	else if ((hw1 & 0xFF80) == 0x4700) {
+		d->flow = FLOW_END;			// BX Rm
+	}
+	else if ((hw1 & 0xFF87) == 0x4487 || (hw1 & 0xFF87) == 0x4687) {
+		d->flow = FLOW_END;			// ADD / MOV PC, Rm
+	}
+	else if ((hw1 & 0xFF00) == 0xBD00 || (hw1 & 0xFF00) == 0xBE00) {
+		d->flow = FLOW_END;			// POP {..., PC}, BKPT
+	}
+	else if ((hw1 & 0xF800) == 0x4800 || (hw1 & 0xF800) == 0xA000) {
+		d->data = ALIGN_PC(pc + 4) + ((hw1 & 0xFF) << 2);	// LDR Rt, <label> / ADR
+		d->data_length = 4;
+	}
+}
+
+static uint32_t armImmediate(uint32_t instruction)
+{
+	uint32_t imm = instruction & 0xFF;
+	uint32_t rotate = ((instruction >> 8) & 0xF) * 2;
+
+	return rotate ? (imm >> rotate) | (imm << (32 - rotate)) : imm;
+}
+
+static void decodeArm(uint32_t pc, struct decoded *d)
+{
+	uint32_t instruction = *(uint32_t *) pc;
+	uint32_t cond = instruction >> 28;
+	uint32_t opcode;
+	int end;
+
+	memset(d, 0, sizeof(struct decoded));
+	d->length = 4;
+	d->flow = FLOW_NEXT;
+
+	if (cond == 0xF) {
+		return;		// BLX <label> and other unconditional instructions fall through
+	}
+
+	if ((instruction & 0x0F000000) == 0x0A000000) {
+		d->flow = cond == 0xE ? FLOW_JUMP : FLOW_COND;	// B<c>
+		d->target = pc + 8 + (signExtend(instruction & 0xFFFFFF, 24) << 2);
+		return;
+	}
+	if ((instruction & 0x0FFFFFD0) == 0x012FFF10) {
+		end = !(instruction & 0x20);	// BX, BLX Rm returns
+	}
+	else if ((instruction & 0x0FFF00F0) == 0x07F000F0) {
+		end = 1;	// UDF
+	}
+	else if ((instruction & 0x0C50F000) == 0x0410F000) {
+		end = 1;	// LDR PC, [...]
+	}
+	else if ((instruction & 0x0E108000) == 0x08108000) {
+		end = 1;	// POP / LDM {..., PC}
+	}
+	else {
+		opcode = (instruction >> 21) & 0xF;
+		// data processing writing PC, compares and the multiply / extra load space excluded
+		end = (instruction & 0x0C00F000) == 0x0000F000 && (opcode < 8 || opcode > 11) && (instruction & 0x0E000090) != 0x00000090;
+	}
+
+	if ((instruction & 0x0F7F0000) == 0x051F0000) {
+		// LDR Rt, <label>
+		d->data = pc + 8 + ((instruction & 0x800000) ? (instruction & 0xFFF) : -(instruction & 0xFFF));
+		d->data_length = 4;
+	}
+	else if ((instruction & 0x0F7F00F0) == 0x014F00D0) {
+		// LDRD Rt, Rt2, <label>
+		d->data = pc + 8 + ((instruction & 0x800000) ? 1 : -1) * (((instruction >> 4) & 0xF0) | (instruction & 0xF));
+		d->data_length = 8;
+	}
+	else if ((instruction & 0x0F3F0E00) == 0x0D1F0A00) {
+		// VLDR Sd/Dd, <label>
+		d->data = pc + 8 + ((instruction & 0x800000) ? (instruction & 0xFF) << 2 : -((instruction & 0xFF) << 2));
+		d->data_length = (instruction & 0x100) ? 8 : 4;
+	}
+	else if ((instruction & 0x0FFF0000) == 0x028F0000 || (instruction & 0x0FFF0000) == 0x024F0000) {
+		// ADR Rd, <label>
+		d->data = pc + 8 + ((instruction & 0x00800000) ? armImmediate(instruction) : -armImmediate(instruction));
+		d->data_length = 4;
+	}
+
+	if (end) {
+		// a conditional return still falls through
+		d->flow = cond == 0xE ? FLOW_END : FLOW_COND;
+		d->target = 0;
+	}
+}
+
+static int inRange(struct scanState *s, uint32_t addr)
+{
+	return addr >= s->start && addr < s->start + s->size && (addr & (s->thumb ? 1 : 3)) == 0;
+}
+
+static void pushLeader(struct scanState *s, uint32_t addr)
+{
+	if (!inRange(s, addr)) {
+		return;
+	}
+	s->flags[(addr - s->start) / 2] |= SCAN_LEADER;
+	s->stack[s->nstack++] = addr;
+}
+
+static void markData(struct scanState *s, uint32_t addr, int length)
+{
+	uint32_t end = addr + length;
+
+	for (addr &= ~1; addr < end; addr += 2) {
+		if (addr >= s->start && addr < s->start + s->size) {
+			if ((s->flags[(addr - s->start) / 2] & (SCAN_VISITED | SCAN_DATA)) == SCAN_VISITED) {
+				s->changed = 1;
+			}
+			s->flags[(addr - s->start) / 2] |= SCAN_DATA;
+		}
+	}
+}
+
+/*
+ * Follows the control flow from the entry, every branch ends a linear run
+ * and pushes its target and fall through as leaders. Runs stop at code
+ * already visited and at literals, so a literal pool behind a call that
+ * never returns is not taken for code once its load has been seen.
+ */
+static void scanRange(struct scanState *s)
+{
+	struct decoded d;
+	uint32_t pc;
+	uint32_t i;
+	int it_left;
+
+	pushLeader(s, s->start);
+	while (s->nstack > 0) {
+		pc = s->stack[--s->nstack];
+		it_left = 0;
+
+		while (inRange(s, pc)) {
+			i = (pc - s->start) / 2;
+			if (s->flags[i] & (SCAN_VISITED | SCAN_DATA)) {
+				break;
+			}
+			if (pc + (s->thumb ? 2 : 4) > s->start + s->size) {
+				break;
+			}
+
+			if (s->thumb) {
+				decodeThumb(pc, &d);
+			}
+			else {
+				decodeArm(pc, &d);
+			}
+			if (pc + d.length > s->start + s->size) {
+				break;
+			}
+
+			s->flags[i] |= SCAN_VISITED | (it_left ? SCAN_IT : 0);
+			if (d.length == 4) {
+				s->flags[i + 1] |= SCAN_VISITED | SCAN_CONT;
+			}
+			if (d.data_length) {
+				markData(s, d.data, d.data_length);
+			}
+
+			if (it_left > 0) {
+				--it_left;
+				// a branch inside an IT block is conditional, a leader can not follow it
+				if (d.flow != FLOW_NEXT && d.target) {
+					pushLeader(s, d.target);
+				}
+				pc += d.length;
+				continue;
+			}
+			it_left = d.it_count;
+
+			if (d.flow == FLOW_NEXT) {
+				pc += d.length;
+				continue;
+			}
+			if (d.target) {
+				pushLeader(s, d.target);
+			}
+			if (d.flow == FLOW_COND) {
+				pushLeader(s, pc + d.length);
+			}
+			break;
+		}
+	}
+}
+
+static int addBlock(uint32_t addr)
+{
+	struct coverageBlock *grown;
+
+	if (nblock == maxblock) {
+		grown = (struct coverageBlock *) realloc(blocks, (maxblock ? maxblock * 2 : 1024) * sizeof(struct coverageBlock));
+		if (grown == NULL) {
+			return -1;
+		}
+		blocks = grown;
+		maxblock = maxblock ? maxblock * 2 : 1024;
+	}
+	memset(&blocks[nblock], 0, sizeof(struct coverageBlock));
+	blocks[nblock++].addr = addr;
+	return 0;
+}
+
+int registerCoverageByAddr(uint32_t start, uint32_t size)
+{
+	struct scanState s;
+	uint32_t i;
+	int round;
+	int count;
+
+	if (!start || size < 2 || started) {
+		LOGD("illegal parameter in registerCoverageByAddr()");
+		return -1;
+	}
+
+	memset(&s, 0, sizeof(s));
+	s.thumb = start & 1;
+	s.start = start & ~1;
+	s.size = size;
+	if (!s.thumb && (s.start & 3)) {
+		LOGD("arm code at 0x%x is not aligned", s.start);
+		return -1;
+	}
+
+	s.flags = (uint8_t *) calloc(size / 2 + 1, 1);
+	s.stack = (uint32_t *) malloc((size / 2 + 2) * 2 * sizeof(uint32_t));
+	if (s.flags == NULL || s.stack == NULL) {
+		free(s.flags);
+		free(s.stack);
+		return -1;
+	}
+
+	// literals found late can turn code visited earlier into data, scan again without it
+	for (round = 0; round < SCAN_ROUNDS; ++round) {
+		for (i = 0; i < size / 2; ++i) {
+			s.flags[i] &= SCAN_DATA;
+		}
+		s.changed = 0;
+		s.nstack = 0;
+		scanRange(&s);
+		if (!s.changed) {
+			break;
+		}
+	}
+
+	count = 0;
+	for (i = 0; i < size / 2; ++i) {
+		if ((s.flags[i] & (SCAN_LEADER | SCAN_VISITED | SCAN_DATA | SCAN_IT | SCAN_CONT)) == (SCAN_LEADER | SCAN_VISITED)) {
+			if (addBlock((s.start + i * 2) | s.thumb) == -1) {
+				break;
+			}
+			++count;
+		}
+	}
+
+	free(s.flags);
+	free(s.stack);
+
+	LOGD("%d basic blocks in 0x%x-0x%x", count, s.start, s.start + size);
+	return count;
+}
+
+int registerCoverageByName(const char *function_name, const char *so_name)
+{
+	struct soinfo *si;
+	Elf32_Sym *sym;
+	size_t i;
+
+	if (function_name == NULL || so_name == NULL) {
+		LOGD("illegal parameter in registerCoverageByName()");
+		return -1;
+	}
+
+	si = (struct soinfo *) dlopen(so_name, RTLD_NOW);
+	if (si == NULL) {
+		LOGD("dlopen %s failed", so_name);
+		return -1;
+	}
+
+	for (i = 1; i < si->nchain; ++i) {
+		sym = &si->symtab[i];
+		if (ELF32_ST_TYPE(sym->st_info) == STT_FUNC && sym->st_shndx != SHN_UNDEF && strcmp(si->strtab + sym->st_name, function_name) == 0) {
+			return registerCoverageByAddr(si->base + sym->st_value, sym->st_size);
+		}
+	}
+
+	LOGD("can not find %s in %s", function_name, so_name);
+	return -1;
+}
+
+int registerCoverageBySo(const char *so_name)
+{
+	struct soinfo *si;
+	Elf32_Sym *sym;
+	size_t i;
+	int count;
+	int n;
+
+	if (so_name == NULL) {
+		LOGD("illegal parameter in registerCoverageBySo()");
+		return -1;
+	}
+
+	si = (struct soinfo *) dlopen(so_name, RTLD_NOW);
+	if (si == NULL) {
+		LOGD("dlopen %s failed", so_name);
+		return -1;
+	}
+
+	count = 0;
+	for (i = 1; i < si->nchain; ++i) {
+		sym = &si->symtab[i];
+		if (ELF32_ST_TYPE(sym->st_info) != STT_FUNC || sym->st_shndx == SHN_UNDEF || sym->st_size == 0) {
+			continue;
+		}
+		n = registerCoverageByAddr(si->base + sym->st_value, sym->st_size);
+		if (n > 0) {
+			count += n;
+		}
+	}
+	return count;
+}
+
+static struct coverageBlock *findBlock(uint32_t pc)
+{
+	uint32_t low = 0;
+	uint32_t high = nblock;
+	uint32_t mid;
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		if ((blocks[mid].addr & ~1) == pc) {
+			return &blocks[mid];
+		}
+		if ((blocks[mid].addr & ~1) < pc) {
+			low = mid + 1;
+		}
+		else {
+			high = mid;
+		}
+	}
+	return NULL;
+}
+
+static void trapHandler(int sig, siginfo_t *info, void *ucontext)
+{
+	ucontext_t *uc = (ucontext_t *) ucontext;
+	struct coverageBlock *block;
+	struct coveragePage *page;
+	uint32_t pc;
+
+	pc = uc->uc_mcontext.arm_pc;
+	block = findBlock(pc);
+	if (block == NULL) {
+		if (old_action.sa_flags & SA_SIGINFO) {
+			old_action.sa_sigaction(sig, info, ucontext);
+		}
+		else if (old_action.sa_handler == SIG_DFL || old_action.sa_handler == SIG_IGN) {
+			// not ours, trap again with the previous disposition
+			sigaction(SIGTRAP, &old_action, NULL);
+		}
+		else {
+			old_action.sa_handler(sig);
+		}
+		return;
+	}
+
+	// a thread losing the race traps again until the instruction is back
+	if (!__sync_bool_compare_and_swap(&block->hit, 0, 1)) {
+		return;
+	}
+
+	bitmap[block - blocks] = 1;
+	if (block->addr & 1) {
+		*(uint16_t *) pc = block->orig;
+	}
+	else {
+		*(uint32_t *) pc = block->orig;
+	}
+	asm_cacheflush(pc, pc + 4, 0);
+
+	page = &pages[block->page];
+	if (__sync_sub_and_fetch(&page->remaining, 1) == 0) {
+		mprotect((void *) page->addr, PAGE_SIZE, PROT_READ | PROT_EXEC);
+	}
+}
+
+static int compareBlocks(const void *a, const void *b)
+{
+	uint32_t x = ((const struct coverageBlock *) a)->addr & ~1;
+	uint32_t y = ((const struct coverageBlock *) b)->addr & ~1;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Blocks stay writable until their last block was hit, then the page goes
+ * back to R-X. The breakpoints are single aligned stores, running threads
+ * either see the old instruction or trap.
+ */
+int coverageStart(uint8_t *map, uint32_t size)
+{
+	struct sigaction action;
+	uint32_t i, n;
+	uint32_t addr;
+
+	if (started || nblock == 0) {
+		LOGD("no coverage registered or already started");
+		return -1;
+	}
+
+	// aliases and overlapping registrations give the same block twice
+	qsort(blocks, nblock, sizeof(struct coverageBlock), compareBlocks);
+	for (i = 0, n = 0; i < nblock; ++i) {
+		if (n == 0 || (blocks[n - 1].addr & ~1) != (blocks[i].addr & ~1)) {
+			blocks[n++] = blocks[i];
+		}
+	}
+	nblock = n;
+
+	if (map == NULL) {
+		size = nblock;
+		map = (uint8_t *) calloc(size, 1);
+		if (map == NULL) {
+			return -1;
+		}
+	}
+	if (nblock > size) {
+		LOGD("%u blocks do not fit into the bitmap, %u are not instrumented", nblock, nblock - size);
+		nblock = size;
+	}
+	bitmap = map;
+
+	pages = (struct coveragePage *) calloc(nblock, sizeof(struct coveragePage));
+	if (pages == NULL) {
+		return -1;
+	}
+	for (i = 0; i < nblock; ++i) {
+		addr = PAGE_START(blocks[i].addr);
+		if (npage == 0 || pages[npage - 1].addr != addr) {
+			pages[npage++].addr = addr;
+		}
+		blocks[i].page = npage - 1;
+		pages[npage - 1].remaining++;
+	}
+
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = trapHandler;
+	action.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(SIGTRAP, &action, &old_action) == -1) {
+		return -1;
+	}
+	started = 1;
+
+	for (i = 0; i < npage; ++i) {
+		mprotect((void *) pages[i].addr, PAGE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC);
+	}
+	for (i = 0; i < nblock; ++i) {
+		addr = blocks[i].addr & ~1;
+		if (blocks[i].addr & 1) {
+			blocks[i].orig = *(uint16_t *) addr;
+			*(uint16_t *) addr = THUMB_BREAKPOINT;
+		}
+		else {
+			blocks[i].orig = *(uint32_t *) addr;
+			*(uint32_t *) addr = ARM_BREAKPOINT;
+		}
+	}
+	for (i = 0; i < npage; ++i) {
+		asm_cacheflush(pages[i].addr, pages[i].addr + PAGE_SIZE, 0);
+	}
+
+	LOGD("coverage of %u blocks on %u pages", nblock, npage);
+	return 0;
+}
+
+uint8_t *getCoverageBitmap()
+{
+	return bitmap;
+}
+
+uint32_t getCoverageBlockCount()
+{
+	return nblock;
+}
+
+uint32_t getCoverageBlockAddr(uint32_t index)
+{
+	return index < nblock ? blocks[index].addr : 0;
+}
@@ -0,0 +1,38 @@
+#ifndef _COVERAGE_H
+#define _COVERAGE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Basic-block coverage without recompiling. The first instruction of every
+ * block found in the registered code is replaced with a breakpoint; the
+ * first hit sets bitmap[index] to 1, puts the instruction back and resumes,
+ * so every block costs one trap and nothing afterwards.
+ *
+ * Blocks are found by following the control flow from the entry point, code
+ * only reached through a jump table or a function pointer inside the
+ * function is not instrumented. Literal pools referenced by the code are
+ * never patched.
+ *
+ * Register everything first, then coverageStart() numbers the blocks in
+ * address order and patches them. bitmap may be shared memory of a fuzzer,
+ * NULL allocates one, blocks beyond size are not instrumented.
+ */
+int registerCoverageByAddr(uint32_t start, uint32_t size);	// start | 1 for thumb code
+int registerCoverageByName(const char *function_name, const char *so_name);
+int registerCoverageBySo(const char *so_name);	// every function in .dynsym
+int coverageStart(uint8_t *bitmap, uint32_t size);
+
+uint8_t *getCoverageBitmap();
+uint32_t getCoverageBlockCount();
+uint32_t getCoverageBlockAddr(uint32_t index);	// with the thumb bit
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
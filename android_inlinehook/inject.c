@@ -0,0 +1,694 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	// pwrite64
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/user.h>
+#include <sys/syscall.h>
+
+#include "utils.h"
+#include "relocate.h"
+#include "inject.h"
+
+#define ENABLE_DEBUG
+#include "log.h"
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 4096
+#endif
+
+#define PAGE_START(addr) (~(PAGE_SIZE - 1) & (addr))
+
+#ifndef PTRACE_SEIZE
+#define PTRACE_SEIZE		0x4206
+#define PTRACE_INTERRUPT	0x4207
+#endif
+#ifndef PTRACE_EVENT_STOP
+#define PTRACE_EVENT_STOP	128
+#endif
+
+#define MAX_TIDS			1024
+#define MAX_WORKERS			16
+#define MAX_RETRIES			5
+#define RETRY_DELAY_US		2000
+#define TRAMPOLINE_SLOT		256		// relocated instructions + jump back, worst case
+
+#if defined(__arm__)
+typedef struct pt_regs remoteRegs;
+#define REG_PC(regs)		((regs).ARM_pc)
+#define REG_RET(regs)		((regs).ARM_r0)
+#define SYS_MMAP			192		// mmap2
+#define SYS_MUNMAP			91
+#elif defined(__x86_64__)
+typedef struct user_regs_struct remoteRegs;
+#define REG_PC(regs)		((regs).rip)
+#endif
+
+struct injectTarget {
+	pid_t pid;
+	pid_t tids[MAX_TIDS];
+	int signals[MAX_TIDS];	// signals that arrived while stopped, passed on at detach
+	int ntid;
+	int memfd;
+};
+
+struct injectJob {
+	const pid_t *pids;
+	int npid;
+	int next;
+	const struct injectPatch *patches;
+	int npatch;
+	const struct injectHook *hooks;
+	int nhook;
+	struct injectResult *results;
+	int succeeded;
+};
+
+static uint64_t nowUs()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static ssize_t vmReadv(pid_t pid, uintptr_t addr, void *buf, size_t length)
+{
+	struct iovec local = {buf, length};
+	struct iovec remote = {(void *) addr, length};
+
+	return syscall(__NR_process_vm_readv, pid, &local, 1, &remote, 1, 0);
+}
+
+static int openMem(struct injectTarget *t)
+{
+	char path[32];
+
+	if (t->memfd == -1) {
+		snprintf(path, sizeof(path), "/proc/%d/mem", t->pid);
+		t->memfd = open(path, O_RDWR);
+	}
+	return t->memfd;
+}
+
+static int readRemote(struct injectTarget *t, uintptr_t addr, void *buf, size_t length)
+{
+	if (vmReadv(t->pid, addr, buf, length) == (ssize_t) length) {
+		return 0;
+	}
+	if (openMem(t) == -1) {
+		return -1;
+	}
+	return pread64(t->memfd, buf, length, (off64_t) addr) == (ssize_t) length ? 0 : -1;
+}
+
+/*
+ * process_vm_writev() honours the page protection, read-only text goes
+ * through /proc/<pid>/mem which writes like ptrace (copy on write, and the
+ * kernel keeps the I-cache coherent).
+ */
+static int writeRemote(struct injectTarget *t, uintptr_t addr, const void *data, size_t length)
+{
+	struct iovec local = {(void *) data, length};
+	struct iovec remote = {(void *) addr, length};
+
+	if (syscall(__NR_process_vm_writev, t->pid, &local, 1, &remote, 1, 0) == (ssize_t) length) {
+		return 0;
+	}
+	if (openMem(t) == -1) {
+		return -1;
+	}
+	return pwrite64(t->memfd, data, length, (off64_t) addr) == (ssize_t) length ? 0 : -1;
+}
+
+/*
+ * All or nothing: saved receives the bytes the patches overwrite, if a write
+ * fails the earlier ones are undone while the target is still stopped.
+ */
+static int writePatches(struct injectTarget *t, const struct injectPatch *patches, int npatch, uint8_t *saved)
+{
+	uint8_t *p;
+	int error;
+	int i;
+	int j;
+
+	for (i = 0, p = saved; i < npatch; p += patches[i++].length) {
+		if (readRemote(t, patches[i].addr, p, patches[i].length) == -1) {
+			return -1;
+		}
+	}
+
+	for (i = 0; i < npatch; ++i) {
+		if (writeRemote(t, patches[i].addr, patches[i].data, patches[i].length) == -1) {
+			break;
+		}
+	}
+	if (i == npatch) {
+		return 0;
+	}
+
+	error = errno;
+	for (j = 0, p = saved; j < i; p += patches[j++].length) {
+		writeRemote(t, patches[j].addr, p, patches[j].length);
+	}
+	errno = error;
+	return -1;
+}
+
+// any stop will do, a signal that caused it is kept for the detach
+static int waitStop(struct injectTarget *t, int i)
+{
+	int status;
+	int sig;
+
+	while (waitpid(t->tids[i], &status, __WALL) == -1) {
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+	if (!WIFSTOPPED(status)) {
+		return -1;
+	}
+
+	sig = WSTOPSIG(status);
+	if (status >> 16 == 0 && sig != SIGSTOP && sig != SIGTRAP) {
+		t->signals[i] = sig;
+	}
+	return 0;
+}
+
+static int seized(struct injectTarget *t, pid_t tid)
+{
+	int i;
+
+	for (i = 0; i < t->ntid; ++i) {
+		if (t->tids[i] == tid) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void releaseTarget(struct injectTarget *t)
+{
+	int i;
+
+	for (i = 0; i < t->ntid; ++i) {
+		// a thread killed by an exit_group() of an already released thread has to be reaped by us
+		if (ptrace(PTRACE_DETACH, t->tids[i], NULL, (void *) (long) t->signals[i]) == -1 && errno == ESRCH) {
+			waitpid(t->tids[i], NULL, __WALL);
+		}
+	}
+	t->ntid = 0;
+}
+
+/*
+ * Threads created while we attach show up in the next pass over
+ * /proc/<pid>/task, stop once a pass finds nothing new.
+ */
+static int stopTarget(struct injectTarget *t)
+{
+	pid_t tids[MAX_TIDS + 1];
+	int first;
+	int added;
+	int i;
+	int j;
+
+	t->ntid = 0;
+	do {
+		if (getAllTids(t->pid, tids) == -1) {
+			releaseTarget(t);
+			return -1;
+		}
+
+		first = t->ntid;
+		for (i = 0; tids[i] != 0 && t->ntid < MAX_TIDS; ++i) {
+			if (seized(t, tids[i])) {
+				continue;
+			}
+			if (ptrace(PTRACE_SEIZE, tids[i], NULL, NULL) == -1) {
+				if (errno == ESRCH) {
+					continue;	// exited in the meantime
+				}
+				LOGD("PTRACE_SEIZE %d failed: %s", tids[i], strerror(errno));
+				releaseTarget(t);
+				return -1;
+			}
+			ptrace(PTRACE_INTERRUPT, tids[i], NULL, NULL);
+			t->signals[t->ntid] = 0;
+			t->tids[t->ntid++] = tids[i];
+		}
+		added = t->ntid - first;
+
+		for (i = j = first; i < t->ntid; ++i) {
+			if (waitStop(t, i) == 0) {
+				t->tids[j] = t->tids[i];
+				t->signals[j++] = t->signals[i];
+			}
+		}
+		t->ntid = j;
+	} while (added > 0);
+
+	if (t->ntid == 0) {
+		errno = ESRCH;
+		return -1;
+	}
+	return 0;
+}
+
+static int threadsInRanges(struct injectTarget *t, const struct injectPatch *patches, int npatch)
+{
+	remoteRegs regs;
+	uintptr_t pc;
+	int i;
+	int j;
+
+	for (i = 0; i < t->ntid; ++i) {
+		if (ptrace(PTRACE_GETREGS, t->tids[i], NULL, &regs) == -1) {
+			return -1;
+		}
+		pc = (uintptr_t) REG_PC(regs);
+		for (j = 0; j < npatch; ++j) {
+			if (pc >= patches[j].addr && pc < patches[j].addr + patches[j].length) {
+				LOGD("thread %d of %d is executing 0x%lx", t->tids[i], t->pid, (unsigned long) pc);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+#if defined(__arm__)
+/*
+ * Runs a system call in a stopped thread: "svc #0; udf" is written over the start of the page the thread is stopped in, the thread
+ * runs it until the trap and everything is put back afterwards.
+ */
+static int remoteSyscall(struct injectTarget *t, int i, long nr, const long *args, long *ret)
+{
+	remoteRegs saved;
+	remoteRegs regs;
+	uintptr_t addr;
+	long orig[2];
+	int status;
+
+	if (ptrace(PTRACE_GETREGS, t->tids[i], NULL, &saved) == -1) {
+		return -1;
+	}
+	addr = PAGE_START((uintptr_t) REG_PC(saved));
+
+	errno = 0;
+	orig[0] = ptrace(PTRACE_PEEKTEXT, t->tids[i], (void *) addr, NULL);
+	orig[1] = ptrace(PTRACE_PEEKTEXT, t->tids[i], (void *) (addr + sizeof(long)), NULL);
+	if (errno != 0) {
+		return -1;
+	}
+
+	regs = saved;
+	ptrace(PTRACE_POKETEXT, t->tids[i], (void *) addr, (void *) 0xEF000000);	// SVC #0
+	ptrace(PTRACE_POKETEXT, t->tids[i], (void *) (addr + 4), (void *) 0xE7F001F0);	// UDF, raises SIGTRAP
+	memcpy(regs.uregs, args, 6 * sizeof(long));
+	regs.ARM_r7 = nr;
+	regs.ARM_pc = addr;
+	regs.ARM_cpsr &= ~0x0600FC20;	// ARM state, no IT block
+	regs.ARM_ORIG_r0 = -1;
+	ptrace(PTRACE_SETREGS, t->tids[i], NULL, &regs);
+
+	while (1) {
+		if (ptrace(PTRACE_CONT, t->tids[i], NULL, NULL) == -1 || waitpid(t->tids[i], &status, __WALL) == -1 || !WIFSTOPPED(status)) {
+			return -1;
+		}
+		if (status >> 16 == 0 && WSTOPSIG(status) == SIGTRAP) {
+			break;
+		}
+		if (status >> 16 == 0 && WSTOPSIG(status) != SIGSTOP) {
+			t->signals[i] = WSTOPSIG(status);
+		}
+	}
+
+	ptrace(PTRACE_GETREGS, t->tids[i], NULL, &regs);
+	*ret = (long) REG_RET(regs);
+
+	ptrace(PTRACE_POKETEXT, t->tids[i], (void *) addr, (void *) orig[0]);
+	ptrace(PTRACE_POKETEXT, t->tids[i], (void *) (addr + sizeof(long)), (void *) orig[1]);
+	ptrace(PTRACE_SETREGS, t->tids[i], NULL, &saved);
+
+	return 0;
+}
+
+static uintptr_t remoteMmap(struct injectTarget *t, size_t length)
+{
+	long args[6] = {0, (long) length, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0};
+	long ret;
+
+	if (remoteSyscall(t, 0, SYS_MMAP, args, &ret) == -1 || (unsigned long) ret >= (unsigned long) -PAGE_SIZE) {
+		return 0;
+	}
+	return (uintptr_t) ret;
+}
+
+static void remoteMunmap(struct injectTarget *t, uintptr_t addr, size_t length)
+{
+	long args[6] = {(long) addr, (long) length, 0, 0, 0, 0};
+	long ret;
+
+	remoteSyscall(t, 0, SYS_MUNMAP, args, &ret);
+}
+
+struct hookPlan {
+	uint32_t trampoline[TRAMPOLINE_SLOT / sizeof(uint32_t)];
+	uint32_t patch[3];
+	uint32_t proto;
+	uint32_t addr;
+	int thumb;
+};
+
+static uint32_t readRemoteWord(void *arg, uint32_t addr)
+{
+	uint32_t word = 0;
+
+	vmReadv(*(pid_t *) arg, addr, &word, sizeof(word));
+	return word;
+}
+
+/*
+ * Same entry patch as inlineHookInArm/Thumb(), the trampoline is relocated
+ * against the target's memory and only depends on absolute addresses, so all
+ * of this is done before the target is stopped.
+ */
+static int planHook(pid_t pid, const struct injectHook *hook, struct hookPlan *plan, struct injectPatch *patch)
+{
+	struct relocateContext ctx;
+	uint32_t orig[3];
+	uint16_t *p;
+	int length;
+	int idx;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.read_word = readRemoteWord;
+	ctx.read_arg = &pid;
+
+	plan->thumb = hook->target_addr & 1;
+	plan->addr = hook->target_addr & ~1;
+	if (vmReadv(pid, plan->addr, orig, 10) != 10) {
+		return -1;
+	}
+
+	if (plan->thumb) {
+		p = (uint16_t *) plan->patch;
+		idx = 0;
+		if (plan->addr % 4 != 0) {
+			p[idx++] = 0xBF00;	// NOP
+		}
+		p[idx++] = 0xF8DF;
+		p[idx++] = 0xF000;	// LDR.W PC, [PC]
+		p[idx++] = hook->new_addr & 0xFFFF;
+		p[idx++] = hook->new_addr >> 16;
+		length = idx * sizeof(uint16_t);
+		relocateInstructionInThumb(&ctx, plan->addr, (uint16_t *) orig, length, (uint16_t *) plan->trampoline);
+	}
+	else {
+		plan->patch[0] = 0xE51FF004;	// LDR PC, [PC, #-4]
+		plan->patch[1] = hook->new_addr;
+		length = 8;
+		relocateInstructionInArm(&ctx, plan->addr, orig, length, plan->trampoline);
+	}
+
+	patch->addr = plan->addr;
+	patch->data = plan->patch;
+	patch->length = length;
+	return 0;
+}
+
+// returns the address of the trampolines, 0 if they could not be written
+static uintptr_t writeTrampolines(struct injectTarget *t, int nhook, struct hookPlan *plans, size_t *size)
+{
+	uintptr_t base;
+	long args[6];
+	long ret;
+	int i;
+
+	*size = (nhook * TRAMPOLINE_SLOT + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	base = remoteMmap(t, *size);
+	if (base == 0) {
+		LOGD("remote mmap in %d failed", t->pid);
+		return 0;
+	}
+
+	for (i = 0; i < nhook; ++i) {
+		plans[i].proto = base + i * TRAMPOLINE_SLOT + plans[i].thumb;
+		if (writeRemote(t, base + i * TRAMPOLINE_SLOT, plans[i].trampoline, TRAMPOLINE_SLOT) == -1) {
+			remoteMunmap(t, base, *size);
+			return 0;
+		}
+	}
+
+	args[0] = base;
+	args[1] = base + *size;
+	args[2] = 0;
+	if (remoteSyscall(t, 0, 0xF0002, args, &ret) == -1) {	// cacheflush
+		remoteMunmap(t, base, *size);
+		return 0;
+	}
+	return base;
+}
+#endif
+
+/*
+ * For hooks patches holds the proto_addr writes followed by the entry
+ * patches, the latter are planned first and the former are only known once
+ * the trampolines are mapped, so they are filled in backwards.
+ */
+static int injectOne(struct injectJob *job, pid_t pid, struct injectResult *result)
+{
+	struct injectTarget *t;
+	struct injectPatch *patches;
+	const struct injectPatch *todo;
+	int ntodo;
+	uint8_t *saved;
+	size_t length;
+	uint64_t start;
+	int ret;
+	int i;
+#if defined(__arm__)
+	struct hookPlan *plans = NULL;
+	uintptr_t base = 0;
+	size_t size;
+	int first;
+#endif
+
+	t = (struct injectTarget *) malloc(sizeof(struct injectTarget));
+	patches = NULL;
+	saved = NULL;
+	if (t == NULL) {
+		result->error = ENOMEM;
+		return -1;
+	}
+	t->pid = pid;
+	t->ntid = 0;
+	t->memfd = -1;
+
+	todo = job->patches;
+	ntodo = job->npatch;
+#if defined(__arm__)
+	if (job->nhook > 0) {
+		plans = (struct hookPlan *) calloc(job->nhook, sizeof(struct hookPlan));
+		patches = (struct injectPatch *) calloc(job->nhook * 2, sizeof(struct injectPatch));
+		if (plans == NULL || patches == NULL) {
+			result->error = ENOMEM;
+			goto _error;
+		}
+		for (i = 0; i < job->nhook; ++i) {
+			if (planHook(pid, &job->hooks[i], &plans[i], &patches[job->nhook + i]) == -1) {
+				result->error = errno ? errno : EFAULT;
+				goto _error;
+			}
+		}
+		todo = patches + job->nhook;
+		ntodo = job->nhook;
+	}
+#endif
+
+	length = job->nhook * sizeof(uint32_t);
+	for (i = 0; i < ntodo; ++i) {
+		length += todo[i].length;
+	}
+	saved = (uint8_t *) malloc(length);
+	if (saved == NULL) {
+		result->error = ENOMEM;
+		goto _error;
+	}
+
+	for (result->retries = 0; ; ++result->retries) {
+		start = nowUs();
+		if (stopTarget(t) == -1) {
+			result->error = errno;
+			goto _error;
+		}
+		result->nthread = t->ntid;
+
+		ret = threadsInRanges(t, todo, ntodo);
+		if (ret == 0) {
+			break;
+		}
+		releaseTarget(t);
+		if (ret == -1 || result->retries == MAX_RETRIES) {
+			result->error = ret == -1 ? errno : EBUSY;
+			goto _error;
+		}
+		usleep(RETRY_DELAY_US);
+	}
+
+#if defined(__arm__)
+	if (job->nhook > 0) {
+		base = writeTrampolines(t, job->nhook, plans, &size);
+		if (base == 0) {
+			result->error = errno ? errno : EFAULT;
+			releaseTarget(t);
+			goto _error;
+		}
+		first = job->nhook;
+		for (i = job->nhook - 1; i >= 0; --i) {
+			if (job->hooks[i].proto_addr) {
+				--first;
+				patches[first].addr = job->hooks[i].proto_addr;
+				patches[first].data = &plans[i].proto;
+				patches[first].length = sizeof(plans[i].proto);
+			}
+		}
+		todo = patches + first;
+		ntodo = job->nhook * 2 - first;
+	}
+#endif
+	if (writePatches(t, todo, ntodo, saved) == -1) {
+		result->error = errno ? errno : EFAULT;
+#if defined(__arm__)
+		if (base != 0) {
+			remoteMunmap(t, base, size);
+		}
+#endif
+	}
+	releaseTarget(t);
+	result->pause_us = nowUs() - start;
+
+	if (result->error == 0) {
+		LOGD("injected into %d: %d threads stopped for %u us", pid, result->nthread, result->pause_us);
+	}
+
+_error:
+	if (t->memfd != -1) {
+		close(t->memfd);
+	}
+	free(t);
+	free(saved);
+	free(patches);
+#if defined(__arm__)
+	free(plans);
+#endif
+	return result->error == 0 ? 0 : -1;
+}
+
+static void *injectThread(void *arg)
+{
+	struct injectJob *job = (struct injectJob *) arg;
+	struct injectResult result;
+	int i;
+
+	while (1) {
+		i = __sync_fetch_and_add(&job->next, 1);
+		if (i >= job->npid) {
+			break;
+		}
+
+		memset(&result, 0, sizeof(result));
+		result.pid = job->pids[i];
+		if (injectOne(job, job->pids[i], &result) == 0) {
+			__sync_fetch_and_add(&job->succeeded, 1);
+		}
+		if (job->results != NULL) {
+			job->results[i] = result;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * ptrace ties a tracee to the thread that attached it, so every target is
+ * handled from start to end by one worker.
+ */
+static int runJob(struct injectJob *job, int nworker)
+{
+	pthread_t tids[MAX_WORKERS];
+	int i;
+
+	if (nworker > job->npid) {
+		nworker = job->npid;
+	}
+	if (nworker > MAX_WORKERS) {
+		nworker = MAX_WORKERS;
+	}
+
+	for (i = 1; i < nworker; ++i) {
+		if (pthread_create(&tids[i], NULL, injectThread, job) != 0) {
+			break;
+		}
+	}
+	nworker = i;
+	injectThread(job);
+	for (i = 1; i < nworker; ++i) {
+		pthread_join(tids[i], NULL);
+	}
+
+	return job->succeeded;
+}
+
+int injectPatches(const pid_t *pids, int npid, const struct injectPatch *patches, int npatch, int nworker, struct injectResult *results)
+{
+	struct injectJob job;
+
+	if (pids == NULL || npid <= 0 || patches == NULL || npatch <= 0) {
+		LOGD("illegal parameter");
+		return -1;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.pids = pids;
+	job.npid = npid;
+	job.patches = patches;
+	job.npatch = npatch;
+	job.results = results;
+	return runJob(&job, nworker);
+}
+
+int injectInlineHooks(const pid_t *pids, int npid, const struct injectHook *hooks, int nhook, int nworker, struct injectResult *results)
+{
+#if defined(__arm__)
+	struct injectJob job;
+
+	if (pids == NULL || npid <= 0 || hooks == NULL || nhook <= 0) {
+		LOGD("illegal parameter");
+		return -1;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.pids = pids;
+	job.npid = npid;
+	job.hooks = hooks;
+	job.nhook = nhook;
+	job.results = results;
+	return runJob(&job, nworker);
+#else
+	LOGD("inline hooks can only be injected on arm");
+	return -1;
+#endif
+}
@@ -0,0 +1,50 @@
+#ifndef _INJECT_H
+#define _INJECT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Installs hooks in other processes. Every target is stopped with
+ * PTRACE_SEIZE/PTRACE_INTERRUPT only for the writes themselves: patches and
+ * trampolines are built before the target is stopped, written with
+ * process_vm_writev() (or /proc/<pid>/mem for read-only text) and the target
+ * is detached right away. Up to nworker targets are handled at the same time.
+ * A target with a thread executing one of the patched ranges is released and
+ * retried a few times before it fails with EBUSY. A target is patched
+ * completely or not at all, if a write fails the earlier ones are undone and
+ * the trampolines are unmapped before it is released.
+ *
+ * All addresses are addresses in the target processes, the handlers must
+ * already be mapped there (e.g. in a library loaded before the fork).
+ */
+
+struct injectPatch {
+	uintptr_t addr;
+	const void *data;
+	size_t length;
+};
+
+struct injectHook {
+	uint32_t target_addr;	// +1 for thumb code
+	uint32_t new_addr;
+	uint32_t proto_addr;	// where to store the trampoline address, 0 if not needed
+};
+
+struct injectResult {
+	pid_t pid;
+	int error;			// 0 or an errno value
+	int nthread;		// threads stopped
+	int retries;
+	uint32_t pause_us;	// time the target was stopped in the successful attempt
+};
+
+/*
+ * Both return the number of targets patched successfully, results[i] (if
+ * not NULL) describes pids[i]. injectInlineHooks() is only available on ARM.
+ */
+int injectPatches(const pid_t *pids, int npid, const struct injectPatch *patches, int npatch, int nworker, struct injectResult *results);
+int injectInlineHooks(const pid_t *pids, int npid, const struct injectHook *hooks, int nhook, int nworker, struct injectResult *results);
+
+#endif
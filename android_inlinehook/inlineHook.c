@@ -1,12 +1,21 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <dlfcn.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <asm/signal.h>
 
 #include "list.h"
 #include "utils.h"
 #include "backtrace.h"
+#include "relocate.h"
+#include "symcache.h"
+#include "scanner.h"
+#include "memo.h"
+#include "trace.h"
+#include "sample.h"
 #include "inlineHook.h"
 
 #define ENABLE_DEBUG
@@ -17,575 +26,147 @@
 #endif
 
 #define PAGE_START(addr) (~(PAGE_SIZE - 1) & (addr))
-#define ALIGN_PC(pc)	(pc & 0xFFFFFFFC)
 
 #define HOOKING_STATUS		0
 #define HOOKED_STATUS		1
 #define UNHOOKING_STATUS	2
 
-// THUMB16
-#define B1_THUMB16		0	// B <label>
-#define B2_THUMB16		1	// B <label>
-#define BX_THUMB16		2	// BX PC
-#define ADD_THUMB16		3	// ADD <Rdn>, PC (Rd != PC, Rn != PC) 在对ADD进行修正时，采用了替换PC为Rr的方法，当Rd也为PC时，由于之前更改了Rr的值，可能会影响跳转后的正常功能。
-#define MOV_THUMB16		4	// MOV Rd, PC
-#define ADR_THUMB16		5	// ADR Rd, <label>
-#define LDR_THUMB16		6 	// LDR Rt, <label>
-// THUMB32
-#define BLX_THUMB32		7	// BLX <label>
-#define BL_THUMB32 		8	// BL <label>
-#define B1_THUMB32		9 	// B.W <label>
-#define B2_THUMB32		10 	// B.W <label>
-#define ADR1_THUMB32	11 	// ADR.W Rd, <label>
-#define ADR2_THUMB32	12 	// ADR.W Rd, <label>
-#define LDR_THUMB32		13	// LDR.W Rt, <label>
-#define TBB_THUMB32		14	// TBB [PC, Rm]
-#define TBH_THUMB32		15	// TBH [PC, Rm, LSL #1]
-// ARM
-#define BLX_ARM			16	// BLX <label>
-#define BL_ARM 			17	// BL <label>
-#define B_ARM			18	// B <label>
-#define BX_ARM			19 	// BX PC
-#define ADD_ARM			20	// ADD Rd, PC, Rm (Rd != PC, Rm != PC) 在对ADD进行修正时，采用了替换PC为Rr的方法，当Rd也为PC时，由于之前更改了Rr的值，可能会影响跳转后的正常功能;实际汇编中没有发现Rm也为PC的情况，故未做处理。
-#define ADR1_ARM		21 	// ADR Rd, <label>
-#define ADR2_ARM		22 	// ADR Rd, <label>
-#define MOV_ARM			23	// MOV Rd, PC
-#define LDR_ARM			24	// LDR Rt, <label>
-
-#define UNDEFINE		99
-
 extern int asm_cacheflush(long start, long end, long flags);
 extern void *asm_mmap2(void *addr, size_t length, int prot, int flags, int fd, off_t pgoffset);
 
 
 static struct list_head head = {&head, &head};
+// guards head and is held while code is patched, so fork() never copies a half written hook
+static pthread_mutex_t hook_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t fork_once = PTHREAD_ONCE_INIT;
 
-static int getTypeInThumb16(uint16_t instruction)
-{
-	if ((instruction & 0xF000) == 0xD000) {
-		LOGD("B1_THUMB16");
-		return B1_THUMB16;
-	}
-	if ((instruction & 0xF800) == 0xE000) {
-		LOGD("B2_THUMB16");
-		return B2_THUMB16;
-	}
-	if ((instruction & 0xFFF8) == 0x4778) {
-		LOGD("BX_THUMB16");
-		return BX_THUMB16;
-	}
-	if ((instruction & 0xFF78) == 0x4478) {
-		LOGD("ADD_THUMB16");
-		return ADD_THUMB16;
-	}
-	if ((instruction & 0xFF78) == 0x4678) {
-		LOGD("MOV_THUMB16");
-		return MOV_THUMB16;
-	}
-	if ((instruction & 0xF800) == 0xA000) {
-		LOGD("ADR_THUMB16");
-		return ADR_THUMB16;
-	}
-	if ((instruction & 0xF800) == 0x4800) {
-		LOGD("LDR_THUMB16");
-		return LDR_THUMB16;
-	}
-	return UNDEFINE;
-}
+#define TRAMPOLINE_RANGE	(15 * 1024 * 1024)	// B.W reaches +-16MB, B +-32MB
 
-static int getTypeInThumb32(uint32_t instruction)
-{
-	if ((instruction & 0xF800D000) == 0xF000C000) {
-		LOGD("BLX_THUMB32");
-		return BLX_THUMB32;
-	}
-	if ((instruction & 0xF800D000) == 0xF000D000) {
-		LOGD("BL_THUMB32");
-		return BL_THUMB32;
-	}
-	if ((instruction & 0xF800D000) == 0xF0008000) {
-		LOGD("B1_THUMB32");
-		return B1_THUMB32;
-	}
-	if ((instruction & 0xF800D000) == 0xF0009000) {
-		LOGD("B2_THUMB32");
-		return B2_THUMB32;
-	}
-	if ((instruction & 0xFBFF8000) == 0xF2AF0000) {
-		LOGD("ADR1_THUMB32");
-		return ADR1_THUMB32;
-	}
-	if ((instruction & 0xFBFF8000) == 0xF20F0000) {
-		LOGD("ADR2_THUMB32");
-		return ADR2_THUMB32;		
-	}
-	if ((instruction & 0xFF7F0000) == 0xF85F0000) {
-		LOGD("LDR_THUMB32");
-		return LDR_THUMB32;
-	}
-	if ((instruction & 0xFFFF00F0) == 0xE8DF0000) {
-		LOGD("TBB_THUMB32");
-		return TBB_THUMB32;
-	}
-	if ((instruction & 0xFFFF00F0) == 0xE8DF0010) {
-		LOGD("TBH_THUMB32");
-		return TBH_THUMB32;
-	}
-	return UNDEFINE;
-}
+#define TRAMPOLINE_SLOT		256
+#define TRAMPOLINE_SLOTS	(PAGE_SIZE / TRAMPOLINE_SLOT)
 
-static int getTypeInArm(uint32_t instruction)
-{
-	if ((instruction & 0xFE000000) == 0xFA000000) {
-		LOGD("BLX_ARM");
-		return BLX_ARM;
-	}
-	if ((instruction & 0xF000000) == 0xB000000) {
-		LOGD("BL_ARM");
-		return BL_ARM;
-	}
-	if ((instruction & 0xF000000) == 0xA000000) {
-		LOGD("B_ARM");
-		return B_ARM;
-	}
-	if ((instruction & 0xFF000FF) == 0x120001F) {
-		LOGD("BX_ARM");
-		return BX_ARM;
-	}
-	if ((instruction & 0xFEF0010) == 0x8F0000) {
-		LOGD("ADD_ARM");
-		return ADD_ARM;
-	}
-	if ((instruction & 0xFFF0000) == 0x28F0000) {
-		LOGD("ADR1_ARM");
-		return ADR1_ARM;
-	}
-	if ((instruction & 0xFFF0000) == 0x24F0000) {
-		LOGD("ADR2_ARM");
-		return ADR2_ARM;		
-	}
-	if ((instruction & 0xE5F0000) == 0x41F0000) {
-		LOGD("LDR_ARM");
-		return LDR_ARM;
-	}
-	if ((instruction & 0xFE00FFF) == 0x1A0000F) {
-		LOGD("MOV_ARM");
-		return MOV_ARM;
-	}
-	return UNDEFINE;
-}
+// trampolines share pages, so hooking before fork() leaves few of them to copy
+struct trampolinePage {
+	struct list_head list;
+	uint32_t base;
+	uint32_t used;		// bitmap of TRAMPOLINE_SLOTS slots
+};
+
+static struct list_head trampoline_pages = {&trampoline_pages, &trampoline_pages};
 
-static int relocateInstructionInThumb16(uint32_t pc, uint16_t instruction, uint16_t *trampoline_instructions)
+/*
+ * Tries to map a page within branch range of the target, a few hints
+ * around it are enough in practice, any address will do otherwise.
+ */
+static void *mapTrampolinePage(uint32_t target_addr)
 {
-	int type;
-	int offset;
-	
-	type = getTypeInThumb16(instruction);
-	if (type == B1_THUMB16 || type == B2_THUMB16 || type == BX_THUMB16) {
-		uint32_t x;
-		int top_bit;
-		uint32_t imm32;
-		uint32_t value;
-		int idx;
-		
-		idx = 0;
-		if (type == B1_THUMB16) {
-			x = (instruction & 0xFF) << 1;
-			top_bit = x >> 8;
-			imm32 = top_bit ? (x | (0xFFFFFFFF << 8)) : x;
-			value = pc + imm32;
-			trampoline_instructions[idx++] = instruction & 0xFF00;
-			trampoline_instructions[idx++] = 0xE003;	// B PC, #6
-		}
-		else if (type == B2_THUMB16) {
-			x = (instruction & 0x7FF) << 1;
-			top_bit = x >> 11;
-			imm32 = top_bit ? (x | (0xFFFFFFFF << 11)) : x;
-			value = pc + imm32;
-		}
-		else if (type == BX_THUMB16) {
-			value = pc;
-		}
-		
-		trampoline_instructions[idx++] = 0xF8DF;
-		trampoline_instructions[idx++] = 0xF000;	// LDR.W PC, [PC]
-		trampoline_instructions[idx++] = value & 0xFFFF;
-		trampoline_instructions[idx++] = value >> 16;
-		offset = idx;
-	}
-	else if (type == ADD_THUMB16) {
-		int rdn;
-		int rm;
-		int r;
-		
-		rdn = ((instruction & 0x80) >> 4) | (instruction & 0x7);
-		
-		for (r = 7; ; --r) {
-			if (r != rdn) {
-				break;
-			}
-		}
-		
-		trampoline_instructions[0] = 0xB400 | (1 << r);	// PUSH {Rr}
-		trampoline_instructions[1] = 0x4802 | (r << 8);	// LDR Rr, [PC, #8]
-		trampoline_instructions[2] = (instruction & 0xFF87) | (r << 3);
-		trampoline_instructions[3] = 0xBC00 | (1 << r);	// POP {Rr}
-		trampoline_instructions[4] = 0xE002;	// B PC, #4
-		trampoline_instructions[5] = 0xBF00;
-		trampoline_instructions[6] = pc & 0xFFFF;
-		trampoline_instructions[7] = pc >> 16;
-		offset = 8;
-	}
-	else if (type == MOV_THUMB16 || type == ADR_THUMB16 || type == LDR_THUMB16) {
-		int r;
-		uint32_t value;
-		
-		if (type == MOV_THUMB16) {
-			r = instruction & 0x7;
-			value = pc;
-		}
-		else if (type == ADR_THUMB16) {
-			r = (instruction & 0x700) >> 8;
-			value = ALIGN_PC(pc) + (instruction & 0xFF) << 2;
+	int32_t step;
+	uint32_t hint;
+	void *addr;
+	int i;
+
+	for (i = 1; i <= 4; ++i) {
+		step = ((i + 1) / 2) * 0x100000;
+		hint = PAGE_START(target_addr) + ((i & 1) ? step : -step);
+		addr = asm_mmap2((void *) hint, PAGE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
+		if ((uint32_t) addr >= (uint32_t) -PAGE_SIZE) {
+			continue;
 		}
-		else {
-			r = (instruction & 0x700) >> 8;
-			value = ((uint32_t *) (ALIGN_PC(pc) + ((instruction & 0xFF) << 2)))[0];
+		if ((uint32_t) addr - target_addr + TRAMPOLINE_RANGE <= 2 * TRAMPOLINE_RANGE) {
+			return addr;
 		}
-
-		trampoline_instructions[0] = 0x4800 | (r << 8);	// LDR Rd, [PC]
-		trampoline_instructions[1] = 0xE001;	// B PC, #2
-		trampoline_instructions[2] = value & 0xFFFF;
-		trampoline_instructions[3] = value >> 16;
-		offset = 4;
-	}
-	else {
-		trampoline_instructions[0] = instruction;
-		offset = 1;
+		munmap(addr, PAGE_SIZE);
 	}
-	
-	return offset;
+
+	return asm_mmap2(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
 }
 
-static int relocateInstructionInThumb32(uint32_t pc, uint16_t high_instruction, uint16_t low_instruction, uint16_t *trampoline_instructions)
+static void *allocTrampoline(uint32_t target_addr)
 {
-	uint32_t instruction;
-	int type;
-	int idx;
-	int offset;
-	
-	instruction = (high_instruction << 16) | low_instruction;
-	type = getTypeInThumb32(instruction);
-	idx = 0;
-	if (type == BLX_THUMB32 || type == BL_THUMB32 || type == B1_THUMB32 || type == B2_THUMB32) {
-		uint32_t j1;
-		uint32_t j2;
-		uint32_t s;
-		uint32_t i1;
-		uint32_t i2;
-		uint32_t x;
-		uint32_t imm32;
-		uint32_t value;
-
-		j1 = (low_instruction & 0x2000) >> 13;
-		j2 = (low_instruction & 0x800) >> 11;
-		s = (high_instruction & 0x400) >> 10;
-		i1 = !(j1 ^ s);
-		i2 = !(j2 ^ s);
-
-		if (type == BLX_THUMB32 || type == BL_THUMB32) {
-			trampoline_instructions[idx++] = 0xF20F;
-			trampoline_instructions[idx++] = 0x0E09;	// ADD.W LR, PC, #9
-		}
-		else if (type == B1_THUMB32) {
-			trampoline_instructions[idx++] = 0xD000 | ((high_instruction & 0x3C0) << 2);
-			trampoline_instructions[idx++] = 0xE003;	// B PC, #6
-		}
-		trampoline_instructions[idx++] = 0xF8DF;
-		trampoline_instructions[idx++] = 0xF000;	// LDR.W PC, [PC]
-		if (type == BLX_THUMB32) {
-			x = (s << 24) | (i1 << 23) | (i2 << 22) | ((high_instruction & 0x3FF) << 12) | ((low_instruction & 0x7FE) << 1);
-			imm32 = s ? (x | (0xFFFFFFFF << 25)) : x;
-			value = pc + imm32;
-		}
-		else if (type == BL_THUMB32) {
-			x = (s << 24) | (i1 << 23) | (i2 << 22) | ((high_instruction & 0x3FF) << 12) | ((low_instruction & 0x7FF) << 1);
-			imm32 = s ? (x | (0xFFFFFFFF << 25)) : x;
-			value = pc + imm32 + 1;
-		}
-		else if (type == B1_THUMB32) {
-			x = (s << 20) | (j2 << 19) | (j1 << 18) | ((high_instruction & 0x3F) << 12) | ((low_instruction & 0x7FF) << 1);
-			imm32 = s ? (x | (0xFFFFFFFF << 21)) : x;
-			value = pc + imm32 + 1;
-		}
-		else if (type == B2_THUMB32) {
-			x = (s << 24) | (i1 << 23) | (i2 << 22) | ((high_instruction & 0x3FF) << 12) | ((low_instruction & 0x7FF) << 1);
-			imm32 = s ? (x | (0xFFFFFFFF << 25)) : x;
-			value = pc + imm32 + 1;
-		}
-		trampoline_instructions[idx++] = value & 0xFFFF;
-		trampoline_instructions[idx++] = value >> 16;
-		offset = idx;
-	}
-	else if (type == ADR1_THUMB32 || type == ADR2_THUMB32 || type == LDR_THUMB32) {
-		int r;
-		uint32_t imm32;
-		uint32_t value;
-		
-		if (type == ADR1_THUMB32 || type == ADR2_THUMB32) {
-			uint32_t i;
-			uint32_t imm3;
-			uint32_t imm8;
-		
-			r = (low_instruction & 0xF00) >> 8;
-			i = (high_instruction & 0x400) >> 10;
-			imm3 = (low_instruction & 0x7000) >> 12;
-			imm8 = instruction & 0xFF;
-			
-			imm32 = (i << 31) | (imm3 << 30) | (imm8 << 27);
-			
-			if (type == ADR1_THUMB32) {
-				value = ALIGN_PC(pc) + imm32;
-			}
-			else {
-				value = ALIGN_PC(pc) - imm32;
-			}
+	struct list_head *pos;
+	struct trampolinePage *page;
+	void *addr;
+	int i;
+
+	// prefer a page in range, a far one still beats mapping another page
+	page = NULL;
+	list_for_each(pos, &trampoline_pages) {
+		struct trampolinePage *p = list_entry(pos, struct trampolinePage, list);
+
+		if (p->used == (1U << TRAMPOLINE_SLOTS) - 1) {
+			continue;
 		}
-		else {
-			int is_add;
-			uint32_t *addr;
-			
-			is_add = (high_instruction & 0x80) >> 7;
-			r = low_instruction >> 12;
-			imm32 = low_instruction & 0xFFF;
-			
-			if (is_add) {
-				addr = (uint32_t *) (ALIGN_PC(pc) + imm32);
-			}
-			else {
-				addr = (uint32_t *) (ALIGN_PC(pc) - imm32);
-			}
-			
-			value = addr[0];
+		if (p->base - target_addr + TRAMPOLINE_RANGE <= 2 * TRAMPOLINE_RANGE) {
+			page = p;
+			break;
 		}
-		
-		trampoline_instructions[0] = 0x4800 | (r << 8);	// LDR Rr, [PC]
-		trampoline_instructions[1] = 0xE001;	// B PC, #2
-		trampoline_instructions[2] = value & 0xFFFF;
-		trampoline_instructions[3] = value >> 16;
-		offset = 4;
 	}
 
-	else if (type == TBB_THUMB32 || type == TBH_THUMB32) {
-		int rm;
-		int r;
-		int rx;
-		
-		rm = low_instruction & 0xF;
-		
-		for (r = 7;; --r) {
-			if (r != rm) {
-				break;
-			}
-		}
-		
-		for (rx = 7; ; --rx) {
-			if (rx != rm && rx != r) {
-				break;
-			}
-		}
-		
-		trampoline_instructions[0] = 0xB400 | (1 << rx);	// PUSH {Rx}
-		trampoline_instructions[1] = 0x4805 | (r << 8);	// LDR Rr, [PC, #20]
-		trampoline_instructions[2] = 0x4600 | (rm << 3) | rx;	// MOV Rx, Rm
-		if (type == TBB_THUMB32) {
-			trampoline_instructions[3] = 0xEB00 | r;
-			trampoline_instructions[4] = 0x0000 | (rx << 8) | rx;	// ADD.W Rx, Rr, Rx
-			trampoline_instructions[5] = 0x7800 | (rx << 3) | rx; 	// LDRB Rx, [Rx]
+	if (page == NULL) {
+		addr = mapTrampolinePage(target_addr);
+		if ((uint32_t) addr >= (uint32_t) -PAGE_SIZE) {
+			return NULL;
 		}
-		else if (type == TBH_THUMB32) {
-			trampoline_instructions[3] = 0xEB00 | r;
-			trampoline_instructions[4] = 0x0040 | (rx << 8) | rx;	// ADD.W Rx, Rr, Rx, LSL #1
-			trampoline_instructions[5] = 0x8800 | (rx << 3) | rx; 	// LDRH Rx, [Rx]
-		}
-		trampoline_instructions[6] = 0xEB00 | r;
-		trampoline_instructions[7] = 0x0040 | (r << 8) | rx;	// ADD Rr, Rr, Rx, LSL #1
-		trampoline_instructions[8] = 0x3001 | (r << 8);	// ADD Rr, #1
-		trampoline_instructions[9] = 0xBC00 | (1 << rx);	// POP {Rx}
-		trampoline_instructions[10] = 0x4700 | (r << 3);	// BX Rr
-		trampoline_instructions[11] = 0xBF00;
-		trampoline_instructions[12] = pc & 0xFFFF;
-		trampoline_instructions[13] = pc >> 16;
-		offset = 14;
-	}
-	else {
-		trampoline_instructions[0] = high_instruction;
-		trampoline_instructions[1] = low_instruction;
-		offset = 2;
+		page = (struct trampolinePage *) calloc(1, sizeof(struct trampolinePage));
+		page->base = (uint32_t) addr;
+		list_add(&page->list, &trampoline_pages);
 	}
 
-	return offset;
+	for (i = 0; page->used & (1U << i); ++i);
+	page->used |= 1U << i;
+	return (void *) (page->base + i * TRAMPOLINE_SLOT);
 }
 
-static void relocateInstructionInThumb(uint32_t target_addr, uint16_t *orig_instructions, int length, uint16_t *trampoline_instructions)
+static void freeTrampoline(void *trampoline)
 {
-	int i;
-	uint32_t pc;
-	uint32_t lr;
-
-	i = 0;
-	pc = target_addr + 4;
-	while (1) {
-		int offset;
-		
-		if ((int) (&trampoline_instructions[0]) % 4 != 0) {
-			trampoline_instructions[0] = 0xBF00;	// NOP
-			trampoline_instructions += 1;
-		}
-		
-		if ((orig_instructions[i] >> 11) >= 0x1D && (orig_instructions[i] >> 11) <= 0x1F) {
-			offset = relocateInstructionInThumb32(pc, orig_instructions[i], orig_instructions[i + 1], trampoline_instructions);
-			pc += sizeof(uint32_t);
-			trampoline_instructions += offset;
-			i += 2;
-		}
-		else {
-			offset = relocateInstructionInThumb16(pc, orig_instructions[i], trampoline_instructions);
-			pc += sizeof(uint16_t);
-			trampoline_instructions += offset;
-			++i;
-		}
-		
-		if (i >= length / sizeof(uint16_t)) {
-			break;
+	struct list_head *pos;
+	struct trampolinePage *page;
+
+	list_for_each(pos, &trampoline_pages) {
+		page = list_entry(pos, struct trampolinePage, list);
+		if (page->base == PAGE_START((uint32_t) trampoline)) {
+			page->used &= ~(1U << (((uint32_t) trampoline - page->base) / TRAMPOLINE_SLOT));
+			if (page->used == 0) {
+				munmap((void *) page->base, PAGE_SIZE);
+				list_del(&page->list);
+				free(page);
+			}
+			return;
 		}
 	}
-	
-	if ((int) (&trampoline_instructions[0]) % 4 != 0) {
-		trampoline_instructions[0] = 0xBF00;	// NOP
-		trampoline_instructions += 1;
-	}
-	
-	lr = target_addr + i * sizeof(uint16_t) + 1;
-	trampoline_instructions[0] = 0xF8DF;
-	trampoline_instructions[1] = 0xF000;	// LDR.W PC, [PC]
-	trampoline_instructions[2] = lr & 0xFFFF;
-	trampoline_instructions[3] = lr >> 16;
 }
 
-static void relocateInstructionInArm(uint32_t target_addr, uint32_t *orig_instructions, int length, uint32_t *trampoline_instructions)
+/*
+ * A patch can straddle two pages, every page it touches gets written.
+ */
+static void protectRange(uint32_t addr, int length, int prot)
 {
-	uint32_t pc;
-	uint32_t lr;
-	int i;
-	int idx;
+	mprotect((void *) PAGE_START(addr), PAGE_START(addr + length - 1) + PAGE_SIZE - PAGE_START(addr), prot);
+}
 
-	pc = target_addr + 8;
-	lr = target_addr + length;
+/*
+ * The trampoline address is known here, so the relocator can emit direct
+ * branches, ADR and PC-relative LDR instead of absolute literals. Anything
+ * out of range makes it fail and the absolute form is used instead.
+ */
+static void relocateTrampoline(struct inlineHookInfo *info, int length, int thumb)
+{
+	struct relocateContext ctx;
 
-	idx = 0;
-	for (i = 0; i < length / sizeof(uint32_t); ++i) {
-		uint32_t instruction;
-		int type;
-
-		instruction = orig_instructions[i];
-		type = getTypeInArm(instruction);
-		if (type == BLX_ARM || type == BL_ARM || type == B_ARM || type == BX_ARM) {
-			uint32_t x;
-			int top_bit;
-			uint32_t imm32;
-			uint32_t value;
-
-			if (type == BLX_ARM || type == BL_ARM) {
-				trampoline_instructions[idx++] = 0xE28FE004;	// ADD LR, PC, #4
-			}
-			trampoline_instructions[idx++] = 0xE51FF004;  	// LDR PC, [PC, #-4]
-			if (type == BLX_ARM) {
-				x = ((instruction & 0xFFFFFF) << 2) | ((instruction & 0x1000000) >> 23);
-			}
-			else if (type == BL_ARM || type == B_ARM) {
-				x = (instruction & 0xFFFFFF) << 2;
-			}
-			else {
-				x = 0;
-			}
-			
-			top_bit = x >> 25;
-			imm32 = top_bit ? (x | (0xFFFFFFFF << 26)) : x;
-			if (type == BLX_ARM) {
-				value = pc + imm32 + 1;
-			}
-			else {
-				value = pc + imm32;
-			}
-			trampoline_instructions[idx++] = value;
-			
-		}
-		else if (type == ADD_ARM) {
-			int rd;
-			int rm;
-			int r;
-			
-			rd = (instruction & 0xF000) >> 12;
-			rm = instruction & 0xF;
-			
-			for (r = 12; ; --r) {
-				if (r != rd && r != rm) {
-					break;
-				}
-			}
-			
-			trampoline_instructions[idx++] = 0xE52D0004 | (r << 12);	// PUSH {Rr}
-			trampoline_instructions[idx++] = 0xE59F0008 | (r << 12);	// LDR Rr, [PC, #8]
-			trampoline_instructions[idx++] = (instruction & 0xFFF0FFFF) | (r << 16);
-			trampoline_instructions[idx++] = 0xE49D0004 | (r << 12);	// POP {Rr}
-			trampoline_instructions[idx++] = 0xE28FF000;	// ADD PC, PC
-			trampoline_instructions[idx++] = pc;
-		}
-		else if (type == ADR1_ARM || type == ADR2_ARM || type == LDR_ARM || type == MOV_ARM) {
-			int r;
-			uint32_t value;
-			
-			r = (instruction & 0xF000) >> 12;
-			
-			if (type == ADR1_ARM || type == ADR2_ARM || type == LDR_ARM) {
-				uint32_t imm32;
-				
-				imm32 = instruction & 0xFFF;
-				if (type == ADR1_ARM) {
-					value = pc + imm32;
-				}
-				else if (type == ADR2_ARM) {
-					value = pc - imm32;
-				}
-				else if (type == LDR_ARM) {
-					int is_add;
-					
-					is_add = (instruction & 0x800000) >> 23;
-					if (is_add) {
-						value = ((uint32_t *) (pc + imm32))[0];
-					}
-					else {
-						value = ((uint32_t *) (pc - imm32))[0];
-					}
-				}
-			}
-			else {
-				value = pc;
-			}
-				
-			trampoline_instructions[idx++] = 0xE51F0000 | (r << 12);	// LDR Rr, [PC]
-			trampoline_instructions[idx++] = 0xE28FF000;	// ADD PC, PC
-			trampoline_instructions[idx++] = value;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.buffer = info->trampoline_instructions;
+	ctx.buffer_addr = (uint32_t) info->trampoline_instructions;
+
+	if (thumb) {
+		if (relocateInstructionInThumb(&ctx, info->target_addr, (uint16_t *) info->orig_instructions, length, (uint16_t *) info->trampoline_instructions) == -1) {
+			relocateInstructionInThumb(NULL, info->target_addr, (uint16_t *) info->orig_instructions, length, (uint16_t *) info->trampoline_instructions);
 		}
-		else {
-			trampoline_instructions[idx++] = instruction;
+	}
+	else {
+		if (relocateInstructionInArm(&ctx, info->target_addr, (uint32_t *) info->orig_instructions, length, (uint32_t *) info->trampoline_instructions) == -1) {
+			relocateInstructionInArm(NULL, info->target_addr, (uint32_t *) info->orig_instructions, length, (uint32_t *) info->trampoline_instructions);
 		}
-		pc += sizeof(uint32_t);
 	}
-	
-	trampoline_instructions[idx++] = 0xe51ff004;	// LDR PC, [PC, #-4]
-	trampoline_instructions[idx++] = lr;
 }
 
 static void inlineHookInThumb(struct inlineHookInfo *info)
@@ -596,7 +177,7 @@ static void inlineHookInThumb(struct inlineHookInfo *info)
 	info->orig_instructions = malloc(10);
 	memcpy(info->orig_instructions, (void *) info->target_addr, 10);
 
-	mprotect((void *) PAGE_START(info->target_addr), PAGE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC);
+	protectRange(info->target_addr, 10, PROT_READ | PROT_WRITE | PROT_EXEC);
 	
 	idx = 0;
 	if (info->target_addr % 4 != 0) {
@@ -608,14 +189,14 @@ static void inlineHookInThumb(struct inlineHookInfo *info)
 	((uint16_t *) info->target_addr)[idx++] = info->new_addr & 0xFFFF;
 	((uint16_t *) info->target_addr)[idx++] = info->new_addr >> 16;
 
-	mprotect((void *) PAGE_START(info->target_addr), PAGE_SIZE, PROT_READ | PROT_EXEC);
+	protectRange(info->target_addr, 10, PROT_READ | PROT_EXEC);
 
 	if (info->proto_addr != NULL) {
-		info->trampoline_instructions = asm_mmap2(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
-		relocateInstructionInThumb(info->target_addr, (uint16_t *) info->orig_instructions, idx * sizeof(uint16_t), (uint16_t *) info->trampoline_instructions);
+		info->trampoline_instructions = allocTrampoline(info->target_addr);
+		relocateTrampoline(info, idx * sizeof(uint16_t), 1);
 		*(info->proto_addr) = info->trampoline_instructions + 1;
-		info->target_addr += 1;
 	}
+	info->target_addr += 1;
 }
 
 static void inlineHookInArm(struct inlineHookInfo *info)
@@ -623,16 +204,16 @@ static void inlineHookInArm(struct inlineHookInfo *info)
 	info->orig_instructions = malloc(8);
 	memcpy(info->orig_instructions, (void *) info->target_addr, 8);
 
-	mprotect((void *) PAGE_START(info->target_addr), PAGE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC);
+	protectRange(info->target_addr, 8, PROT_READ | PROT_WRITE | PROT_EXEC);
 
 	((uint32_t *) (info->target_addr))[0] = 0xe51ff004;	// LDR PC, [PC, #-4]
 	((uint32_t *) (info->target_addr))[1] = info->new_addr;
 
-	mprotect((void *) PAGE_START(info->target_addr), PAGE_SIZE, PROT_READ | PROT_EXEC);
+	protectRange(info->target_addr, 8, PROT_READ | PROT_EXEC);
 
 	if (info->proto_addr != NULL) {
-		info->trampoline_instructions = asm_mmap2(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
-		relocateInstructionInArm(info->target_addr, (uint32_t *) info->orig_instructions, 8, (uint32_t *) info->trampoline_instructions);
+		info->trampoline_instructions = allocTrampoline(info->target_addr);
+		relocateTrampoline(info, 8, 0);
 		*(info->proto_addr) = info->trampoline_instructions;
 	}
 }
@@ -691,14 +272,17 @@ int unregisterInlineHookByName(const char *function_name, const char *so_name)
 		return -1;
 	}
 
+	pthread_mutex_lock(&hook_lock);
 	list_for_each(pos, &head) {
 		info = list_entry(pos, struct inlineHookInfo, list);
 		if (strcmp(function_name, info->function_name) == 0 && strcmp(so_name, info->so_name) == 0) {
 			LOGD("unregister inline hook success, function_name: %s, so_name: %s", function_name, so_name);
 			info->status = UNHOOKING_STATUS;
+			pthread_mutex_unlock(&hook_lock);
 			return 0;
 		}
 	}
+	pthread_mutex_unlock(&hook_lock);
 	
 	LOGD("we do not need to unregister inline hook, function_name: %s, so_name: %s", function_name, so_name);
 	return -1;
@@ -714,31 +298,44 @@ int unregisterInlineHookByAddr(uint32_t target_addr)
 		return -1;
 	}
 
+	pthread_mutex_lock(&hook_lock);
 	list_for_each(pos, &head) {
 		info = list_entry(pos, struct inlineHookInfo, list);
 		if (target_addr == info->target_addr) {
 			LOGD("unregister inline hook success, target_addr: 0x%x", target_addr);
 			info->status = UNHOOKING_STATUS;
+			pthread_mutex_unlock(&hook_lock);
 			return 0;
 		}
 	}
+	pthread_mutex_unlock(&hook_lock);
 	
 	LOGD("we do not need to unregister inline hook, target_addr: 0x%x", target_addr);
 	return -1;
 }
 
-int registerInlineHookByName(const char *function_name, const char *so_name, uint32_t offset, uint32_t new_addr, uint32_t **proto_addr)
+/*
+ * The doRegister functions only fill in info, addHook() publishes it once the
+ * caller has set up the rest, forkPrepare() may look at it from then on.
+ */
+static void addHook(struct inlineHookInfo *info)
+{
+	pthread_mutex_lock(&hook_lock);
+	list_add(&info->list, &head);
+	pthread_mutex_unlock(&hook_lock);
+}
+
+static struct inlineHookInfo *doRegisterInlineHookByName(const char *function_name, const char *so_name, uint32_t offset, uint32_t new_addr, uint32_t **proto_addr)
 {
 	struct inlineHookInfo *info;
 	struct soinfo *si;
 	
 	if (function_name == NULL || so_name == NULL || !new_addr) {
 		LOGD("illegal parameter in registerInlineHookByName()");
-		return -1;
+		return NULL;
 	}
 
 	info = (struct inlineHookInfo *) calloc(1, sizeof(struct inlineHookInfo));
-	list_add(&info->list, &head);
 	
 	strncpy(info->so_name, so_name, strlen(so_name));
 	strncpy(info->function_name, function_name, strlen(function_name));
@@ -746,17 +343,18 @@ int registerInlineHookByName(const char *function_name, const char *so_name, uin
 	si = (struct soinfo *) dlopen(info->so_name, RTLD_NOW);
 	if (si == NULL) {
 		LOGD("dlopen %s failed", info->so_name);
-		list_del(&info->list);
 		free(info);
-		return -1;
+		return NULL;
 	}
 		
-	info->target_addr = findSymbolAddr(si, info->function_name);
+	info->target_addr = findSymbolAddrInCache(si, info->function_name);
+	if (!info->target_addr) {
+		info->target_addr = findSymbolAddr(si, info->function_name);
+	}
 	if (!info->target_addr) {
 		LOGD("can not find %s in %s", info->function_name, so_name);
-		list_del(&info->list);
 		free(info);
-		return -1;
+		return NULL;
 	}
 
 	info->target_addr += offset;
@@ -766,20 +364,19 @@ int registerInlineHookByName(const char *function_name, const char *so_name, uin
 
 	LOGD("register inline hook success, function_name: %s, so_name: %s, offset: 0x%x", info->function_name, info->so_name, offset);
 
-	return 0;
+	return info;
 }
 
-int registerInlineHookByAddr(uint32_t target_addr, uint32_t new_addr, uint32_t **proto_addr)
+static struct inlineHookInfo *doRegisterInlineHookByAddr(uint32_t target_addr, uint32_t new_addr, uint32_t **proto_addr)
 {
 	struct inlineHookInfo *info;
 	
 	if (!target_addr || !new_addr) {
 		LOGD("illegal parameter");
-		return -1;
+		return NULL;
 	}
 
 	info = (struct inlineHookInfo *) calloc(1, sizeof(struct inlineHookInfo));
-	list_add(&info->list, &head);
 	
 	info->target_addr = target_addr;
 	info->new_addr = new_addr;
@@ -788,9 +385,683 @@ int registerInlineHookByAddr(uint32_t target_addr, uint32_t new_addr, uint32_t *
 
 	LOGD("register inline hook success, target_addr: 0x%x, new_addr: 0x%x", target_addr, new_addr);
 
+	return info;
+}
+
+int registerInlineHookByName(const char *function_name, const char *so_name, uint32_t offset, uint32_t new_addr, uint32_t **proto_addr)
+{
+	struct inlineHookInfo *info;
+
+	info = doRegisterInlineHookByName(function_name, so_name, offset, new_addr, proto_addr);
+	if (info == NULL) {
+		return -1;
+	}
+	addHook(info);
+
+	return 0;
+}
+
+int registerInlineHookByAddr(uint32_t target_addr, uint32_t new_addr, uint32_t **proto_addr)
+{
+	struct inlineHookInfo *info;
+
+	info = doRegisterInlineHookByAddr(target_addr, new_addr, proto_addr);
+	if (info == NULL) {
+		return -1;
+	}
+	addHook(info);
+
+	return 0;
+}
+
+int registerInlineHookByPattern(const char *pattern, const char *so_name, uint32_t offset, uint32_t new_addr, uint32_t **proto_addr)
+{
+	uintptr_t addrs[2];
+	int n;
+
+	if (pattern == NULL || !new_addr) {
+		LOGD("illegal parameter in registerInlineHookByPattern()");
+		return -1;
+	}
+
+	n = scanPattern(pattern, so_name, addrs, 2);
+	if (n != 1) {
+		LOGD("pattern %s matched %d times in %s", pattern, n, so_name ? so_name : "(all)");
+		return -1;
+	}
+
+	return registerInlineHookByAddr((uint32_t) addrs[0] + offset, new_addr, proto_addr);
+}
+
+/*
+ * The stub page starts with a small literal pool followed by ARM code:
+ *   [0] trampoline (written by inlineHookInArm/Thumb through proto_addr)
+ *   [1] callback
+ *   [2] arg
+ * The code builds a struct inlineHookRegs on the stack, calls the callback
+ * with an 8-byte aligned sp, writes the context back and continues in the
+ * trampoline, i.e. the relocated original instructions.
+ */
+#define STUB_TRAMPOLINE		0
+#define STUB_CALLBACK		1
+#define STUB_ARG			2
+#define STUB_CODE			4
+// sampled stubs, the countdown in front of the register stub
+#define STUB_SAMPLE_SLOTS	4
+#define STUB_SAMPLE_HASH	5
+#define STUB_SAMPLE_PERIOD	6
+#define STUB_SAMPLE_CODE	8
+
+#define LDR_LITERAL_ARM(rt, idx, literal)	(0xE51F0000 | ((rt) << 12) | ((idx) * 4 + 8 - (literal) * 4))	// LDR Rt, [PC, #-imm]
+
+/*
+ * With a sampler only every period-th call of a thread gets to the register
+ * stub, the others restore r0-r2 and the flags and go straight on to the
+ * trampoline. The countdown slot is picked by a hash of the thread pointer
+ * (TPIDRURO, ARMv6K and later), threads sharing a slot share its countdown.
+ */
+static int emitSampleCountdown(uint32_t *stub, struct sampler *sampler)
+{
+	int idx;
+
+	stub[STUB_SAMPLE_SLOTS] = (uint32_t) samplerSlots(sampler);
+	stub[STUB_SAMPLE_HASH] = 0x9E3779B9;
+	stub[STUB_SAMPLE_PERIOD] = (uint32_t) samplerPeriod(sampler);
+	stub[7] = 0;
+
+	idx = STUB_SAMPLE_CODE;
+	stub[idx++] = 0xE92D0007;	// PUSH {R0-R2}
+	stub[idx++] = 0xE10F2000;	// MRS R2, CPSR
+	stub[idx++] = 0xEE1D0F70;	// MRC p15, 0, R0, c13, c0, 3
+	stub[idx] = LDR_LITERAL_ARM(1, idx, STUB_SAMPLE_HASH);	// LDR R1, =0x9E3779B9
+	++idx;
+	stub[idx++] = 0xE0000091;	// MUL R0, R1, R0
+	stub[idx++] = 0xE1A00D20;	// MOV R0, R0, LSR #26
+	stub[idx] = LDR_LITERAL_ARM(1, idx, STUB_SAMPLE_SLOTS);	// LDR R1, =slots
+	++idx;
+	stub[idx++] = 0xE0811300;	// ADD R1, R1, R0, LSL #6
+	stub[idx++] = 0xE5910000;	// LDR R0, [R1]
+	stub[idx++] = 0xE2500001;	// SUBS R0, R0, #1
+	stub[idx++] = 0xDA000003;	// BLE sample
+	stub[idx++] = 0xE5810000;	// STR R0, [R1]
+	stub[idx++] = 0xE128F002;	// MSR APSR_nzcvq, R2
+	stub[idx++] = 0xE8BD0007;	// POP {R0-R2}
+	stub[idx] = LDR_LITERAL_ARM(15, idx, STUB_TRAMPOLINE);	// LDR PC, =trampoline
+	++idx;
+	// sample:
+	stub[idx] = LDR_LITERAL_ARM(0, idx, STUB_SAMPLE_PERIOD);	// LDR R0, =&period
+	++idx;
+	stub[idx++] = 0xE5900000;	// LDR R0, [R0]
+	stub[idx++] = 0xE5810000;	// STR R0, [R1]
+	stub[idx++] = 0xE128F002;	// MSR APSR_nzcvq, R2
+	stub[idx++] = 0xE8BD0007;	// POP {R0-R2}
+
+	return idx;
+}
+
+static uint32_t *createRegsStub(inlineHookCallback callback, void *arg, int flags, struct sampler *sampler)
+{
+	uint32_t *stub;
+	uint32_t frame_size;
+	int idx;
+
+	stub = asm_mmap2(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
+	if ((uint32_t) stub >= (uint32_t) -PAGE_SIZE) {
+		LOGD("mmap stub failed");
+		return NULL;
+	}
+
+	if (flags & INLINE_HOOK_REGS_VFP) {
+		frame_size = sizeof(struct inlineHookRegs);
+	}
+	else {
+		frame_size = offsetof(struct inlineHookRegs, d);
+	}
+
+	stub[STUB_TRAMPOLINE] = 0;
+	stub[STUB_CALLBACK] = (uint32_t) callback;
+	stub[STUB_ARG] = (uint32_t) arg;
+	stub[3] = 0;
+
+	idx = sampler != NULL ? emitSampleCountdown(stub, sampler) : STUB_CODE;
+	stub[idx++] = 0xE24DD000 | frame_size;	// SUB SP, SP, #frame_size
+	if (flags & INLINE_HOOK_REGS_FAST) {
+		stub[idx++] = 0xE88D001F;	// STMIA SP, {R0-R4}
+		stub[idx++] = 0xE58DC030;	// STR R12, [SP, #48]
+	}
+	else {
+		stub[idx++] = 0xE88D1FFF;	// STMIA SP, {R0-R12}
+	}
+	stub[idx++] = 0xE28D0000 | frame_size;	// ADD R0, SP, #frame_size
+	stub[idx++] = 0xE58D0034;	// STR R0, [SP, #52]
+	stub[idx++] = 0xE58DE038;	// STR LR, [SP, #56]
+	stub[idx++] = 0xE10F0000;	// MRS R0, CPSR
+	stub[idx++] = 0xE58D003C;	// STR R0, [SP, #60]
+	if (flags & INLINE_HOOK_REGS_VFP) {
+		stub[idx++] = 0xE28D0040;	// ADD R0, SP, #64
+		stub[idx++] = 0xEC800B20;	// VSTMIA R0, {D0-D15}
+		stub[idx++] = 0xEEF11A10;	// VMRS R1, FPSCR
+		stub[idx++] = 0xE58D10C0;	// STR R1, [SP, #192]
+	}
+	stub[idx++] = 0xE1A0000D;	// MOV R0, SP
+	stub[idx] = LDR_LITERAL_ARM(1, idx, STUB_ARG);	// LDR R1, =arg
+	++idx;
+	stub[idx++] = 0xE1A0400D;	// MOV R4, SP
+	stub[idx++] = 0xE3CDD007;	// BIC SP, SP, #7
+	stub[idx] = LDR_LITERAL_ARM(12, idx, STUB_CALLBACK);	// LDR R12, =callback
+	++idx;
+	stub[idx++] = 0xE12FFF3C;	// BLX R12
+	stub[idx++] = 0xE1A0D004;	// MOV SP, R4
+	if (flags & INLINE_HOOK_REGS_VFP) {
+		stub[idx++] = 0xE28D0040;	// ADD R0, SP, #64
+		stub[idx++] = 0xEC900B20;	// VLDMIA R0, {D0-D15}
+		stub[idx++] = 0xE59D10C0;	// LDR R1, [SP, #192]
+		stub[idx++] = 0xEEE11A10;	// VMSR FPSCR, R1
+	}
+	stub[idx++] = 0xE59D003C;	// LDR R0, [SP, #60]
+	stub[idx++] = 0xE128F000;	// MSR APSR_nzcvq, R0
+	stub[idx++] = 0xE59DE038;	// LDR LR, [SP, #56]
+	if (flags & INLINE_HOOK_REGS_FAST) {
+		stub[idx++] = 0xE59DC030;	// LDR R12, [SP, #48]
+		stub[idx++] = 0xE89D001F;	// LDMIA SP, {R0-R4}
+	}
+	else {
+		stub[idx++] = 0xE89D1FFF;	// LDMIA SP, {R0-R12}
+	}
+	stub[idx++] = 0xE28DD000 | frame_size;	// ADD SP, SP, #frame_size
+	stub[idx] = LDR_LITERAL_ARM(15, idx, STUB_TRAMPOLINE);	// LDR PC, =trampoline
+	++idx;
+
+	asm_cacheflush((uint32_t) stub, (uint32_t) &stub[idx], 0);
+
+	return stub;
+}
+
+int registerInlineHookCallbackByName(const char *function_name, const char *so_name, uint32_t offset, inlineHookCallback callback, void *arg, int flags)
+{
+	struct inlineHookInfo *info;
+	uint32_t *stub;
+
+	if (callback == NULL) {
+		LOGD("illegal parameter in registerInlineHookCallbackByName()");
+		return -1;
+	}
+
+	stub = createRegsStub(callback, arg, flags, NULL);
+	if (stub == NULL) {
+		return -1;
+	}
+
+	info = doRegisterInlineHookByName(function_name, so_name, offset, (uint32_t) &stub[STUB_CODE], (uint32_t **) &stub[STUB_TRAMPOLINE]);
+	if (info == NULL) {
+		munmap(stub, PAGE_SIZE);
+		return -1;
+	}
+	info->stub_instructions = stub;
+	addHook(info);
+
+	return 0;
+}
+
+int registerInlineHookCallbackByAddr(uint32_t target_addr, inlineHookCallback callback, void *arg, int flags)
+{
+	struct inlineHookInfo *info;
+	uint32_t *stub;
+
+	if (callback == NULL) {
+		LOGD("illegal parameter");
+		return -1;
+	}
+
+	stub = createRegsStub(callback, arg, flags, NULL);
+	if (stub == NULL) {
+		return -1;
+	}
+
+	info = doRegisterInlineHookByAddr(target_addr, (uint32_t) &stub[STUB_CODE], (uint32_t **) &stub[STUB_TRAMPOLINE]);
+	if (info == NULL) {
+		munmap(stub, PAGE_SIZE);
+		return -1;
+	}
+	info->stub_instructions = stub;
+	addHook(info);
+
+	return 0;
+}
+
+int registerInlineHookSampledByName(const char *function_name, const char *so_name, uint32_t offset, inlineHookCallback callback, void *arg, int flags, uint32_t period, uint32_t budget_ns)
+{
+	struct inlineHookInfo *info;
+	struct sampler *sampler;
+	uint32_t *stub;
+
+	sampler = samplerCreate(callback, arg, period, budget_ns);
+	if (sampler == NULL) {
+		LOGD("illegal parameter in registerInlineHookSampledByName()");
+		return -1;
+	}
+
+	stub = createRegsStub(samplerCallback, sampler, flags, sampler);
+	if (stub == NULL) {
+		samplerDestroy(sampler);
+		return -1;
+	}
+
+	info = doRegisterInlineHookByName(function_name, so_name, offset, (uint32_t) &stub[STUB_SAMPLE_CODE], (uint32_t **) &stub[STUB_TRAMPOLINE]);
+	if (info == NULL) {
+		munmap(stub, PAGE_SIZE);
+		samplerDestroy(sampler);
+		return -1;
+	}
+	info->stub_instructions = stub;
+	info->sampler = sampler;
+	addHook(info);
+
 	return 0;
 }
 
+int registerInlineHookSampledByAddr(uint32_t target_addr, inlineHookCallback callback, void *arg, int flags, uint32_t period, uint32_t budget_ns)
+{
+	struct inlineHookInfo *info;
+	struct sampler *sampler;
+	uint32_t *stub;
+
+	sampler = samplerCreate(callback, arg, period, budget_ns);
+	if (sampler == NULL) {
+		LOGD("illegal parameter");
+		return -1;
+	}
+
+	stub = createRegsStub(samplerCallback, sampler, flags, sampler);
+	if (stub == NULL) {
+		samplerDestroy(sampler);
+		return -1;
+	}
+
+	info = doRegisterInlineHookByAddr(target_addr, (uint32_t) &stub[STUB_SAMPLE_CODE], (uint32_t **) &stub[STUB_TRAMPOLINE]);
+	if (info == NULL) {
+		munmap(stub, PAGE_SIZE);
+		samplerDestroy(sampler);
+		return -1;
+	}
+	info->stub_instructions = stub;
+	info->sampler = sampler;
+	addHook(info);
+
+	return 0;
+}
+
+int getInlineHookSampleStatsByAddr(uint32_t target_addr, struct inlineHookSampleStats *stats)
+{
+	struct list_head *pos;
+	struct inlineHookInfo *info;
+
+	if (!target_addr || stats == NULL) {
+		LOGD("illegal parameter");
+		return -1;
+	}
+
+	pthread_mutex_lock(&hook_lock);
+	list_for_each(pos, &head) {
+		info = list_entry(pos, struct inlineHookInfo, list);
+		if (info->sampler != NULL && target_addr == info->target_addr) {
+			samplerGetStats(info->sampler, stats);
+			pthread_mutex_unlock(&hook_lock);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&hook_lock);
+
+	return -1;
+}
+
+void dumpInlineHookSampleStats()
+{
+	struct list_head *pos;
+	struct inlineHookInfo *info;
+	struct inlineHookSampleStats stats;
+
+	pthread_mutex_lock(&hook_lock);
+	list_for_each(pos, &head) {
+		info = list_entry(pos, struct inlineHookInfo, list);
+		if (info->sampler == NULL) {
+			continue;
+		}
+		samplerGetStats(info->sampler, &stats);
+		LOGD("sample 0x%x %s: 1 in %u, %llu samples of ~%llu calls, %llu ns in the handler",
+			info->target_addr, info->function_name, stats.period,
+			(unsigned long long) stats.samples, (unsigned long long) stats.calls,
+			(unsigned long long) stats.handler_ns);
+	}
+	pthread_mutex_unlock(&hook_lock);
+}
+
+/*
+ * Stub for hooks that call the original from C (memo, trace). It uses the
+ * same literal pool layout with the trampoline slot unused, the C side calls
+ * the original itself. It spills r0-r3 so that function(args, arg) sees the
+ * arguments as an array, and its r0:r1 is returned straight to the caller.
+ */
+static uint32_t *createCallStub(void *function, void *arg)
+{
+	uint32_t *stub;
+	int idx;
+
+	stub = asm_mmap2(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
+	if ((uint32_t) stub >= (uint32_t) -PAGE_SIZE) {
+		LOGD("mmap stub failed");
+		return NULL;
+	}
+
+	stub[STUB_TRAMPOLINE] = 0;
+	stub[STUB_CALLBACK] = (uint32_t) function;
+	stub[STUB_ARG] = (uint32_t) arg;
+	stub[3] = 0;
+
+	idx = STUB_CODE;
+	stub[idx++] = 0xE92D000F;	// PUSH {R0-R3}
+	stub[idx++] = 0xE1A0000D;	// MOV R0, SP
+	stub[idx] = LDR_LITERAL_ARM(1, idx, STUB_ARG);	// LDR R1, =arg
+	++idx;
+	stub[idx++] = 0xE92D4010;	// PUSH {R4, LR}
+	stub[idx] = LDR_LITERAL_ARM(12, idx, STUB_CALLBACK);	// LDR R12, =function
+	++idx;
+	stub[idx++] = 0xE12FFF3C;	// BLX R12
+	stub[idx++] = 0xE8BD4010;	// POP {R4, LR}
+	stub[idx++] = 0xE28DD010;	// ADD SP, SP, #16
+	stub[idx++] = 0xE12FFF1E;	// BX LR
+
+	asm_cacheflush((uint32_t) stub, (uint32_t) &stub[idx], 0);
+
+	return stub;
+}
+
+int registerInlineHookMemoByName(const char *function_name, const char *so_name, uint32_t offset, int nargs, uint32_t max_entries, uint32_t ttl_ms)
+{
+	struct inlineHookInfo *info;
+	struct memoCache *memo;
+	uint32_t *stub;
+
+	memo = memoCreate(nargs, max_entries, ttl_ms);
+	if (memo == NULL) {
+		LOGD("illegal parameter in registerInlineHookMemoByName()");
+		return -1;
+	}
+
+	stub = createCallStub(memoCall, memo);
+	if (stub == NULL) {
+		memoDestroy(memo);
+		return -1;
+	}
+
+	info = doRegisterInlineHookByName(function_name, so_name, offset, (uint32_t) &stub[STUB_CODE], memoTrampoline(memo));
+	if (info == NULL) {
+		munmap(stub, PAGE_SIZE);
+		memoDestroy(memo);
+		return -1;
+	}
+	info->stub_instructions = stub;
+	info->memo = memo;
+	addHook(info);
+
+	return 0;
+}
+
+int registerInlineHookMemoByAddr(uint32_t target_addr, int nargs, uint32_t max_entries, uint32_t ttl_ms)
+{
+	struct inlineHookInfo *info;
+	struct memoCache *memo;
+	uint32_t *stub;
+
+	memo = memoCreate(nargs, max_entries, ttl_ms);
+	if (memo == NULL) {
+		LOGD("illegal parameter");
+		return -1;
+	}
+
+	stub = createCallStub(memoCall, memo);
+	if (stub == NULL) {
+		memoDestroy(memo);
+		return -1;
+	}
+
+	info = doRegisterInlineHookByAddr(target_addr, (uint32_t) &stub[STUB_CODE], memoTrampoline(memo));
+	if (info == NULL) {
+		munmap(stub, PAGE_SIZE);
+		memoDestroy(memo);
+		return -1;
+	}
+	info->stub_instructions = stub;
+	info->memo = memo;
+	addHook(info);
+
+	return 0;
+}
+
+int registerInlineHookTraceByName(const char *function_name, const char *so_name, uint32_t offset, uint16_t id)
+{
+	struct inlineHookInfo *info;
+	struct traceProbe *probe;
+	uint32_t *stub;
+
+	probe = traceProbeCreate(id);
+	if (probe == NULL) {
+		return -1;
+	}
+
+	stub = createCallStub(traceCall, probe);
+	if (stub == NULL) {
+		traceProbeDestroy(probe);
+		return -1;
+	}
+
+	info = doRegisterInlineHookByName(function_name, so_name, offset, (uint32_t) &stub[STUB_CODE], traceTrampoline(probe));
+	if (info == NULL) {
+		munmap(stub, PAGE_SIZE);
+		traceProbeDestroy(probe);
+		return -1;
+	}
+	info->stub_instructions = stub;
+	info->probe = probe;
+	addHook(info);
+
+	return 0;
+}
+
+int registerInlineHookTraceByAddr(uint32_t target_addr, uint16_t id)
+{
+	struct inlineHookInfo *info;
+	struct traceProbe *probe;
+	uint32_t *stub;
+
+	probe = traceProbeCreate(id);
+	if (probe == NULL) {
+		return -1;
+	}
+
+	stub = createCallStub(traceCall, probe);
+	if (stub == NULL) {
+		traceProbeDestroy(probe);
+		return -1;
+	}
+
+	info = doRegisterInlineHookByAddr(target_addr, (uint32_t) &stub[STUB_CODE], traceTrampoline(probe));
+	if (info == NULL) {
+		munmap(stub, PAGE_SIZE);
+		traceProbeDestroy(probe);
+		return -1;
+	}
+	info->stub_instructions = stub;
+	info->probe = probe;
+	addHook(info);
+
+	return 0;
+}
+
+int getInlineHookMemoStatsByName(const char *function_name, const char *so_name, struct inlineHookMemoStats *stats)
+{
+	struct list_head *pos;
+	struct inlineHookInfo *info;
+
+	if (function_name == NULL || so_name == NULL || stats == NULL) {
+		LOGD("illegal parameter");
+		return -1;
+	}
+
+	pthread_mutex_lock(&hook_lock);
+	list_for_each(pos, &head) {
+		info = list_entry(pos, struct inlineHookInfo, list);
+		if (info->memo != NULL && strcmp(function_name, info->function_name) == 0 && strcmp(so_name, info->so_name) == 0) {
+			memoGetStats(info->memo, stats);
+			pthread_mutex_unlock(&hook_lock);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&hook_lock);
+
+	return -1;
+}
+
+int getInlineHookMemoStatsByAddr(uint32_t target_addr, struct inlineHookMemoStats *stats)
+{
+	struct list_head *pos;
+	struct inlineHookInfo *info;
+
+	if (!target_addr || stats == NULL) {
+		LOGD("illegal parameter");
+		return -1;
+	}
+
+	pthread_mutex_lock(&hook_lock);
+	list_for_each(pos, &head) {
+		info = list_entry(pos, struct inlineHookInfo, list);
+		if (info->memo != NULL && target_addr == info->target_addr) {
+			memoGetStats(info->memo, stats);
+			pthread_mutex_unlock(&hook_lock);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&hook_lock);
+
+	return -1;
+}
+
+void dumpInlineHookMemoStats()
+{
+	struct list_head *pos;
+	struct inlineHookInfo *info;
+	struct inlineHookMemoStats stats;
+	uint64_t calls;
+
+	pthread_mutex_lock(&hook_lock);
+	list_for_each(pos, &head) {
+		info = list_entry(pos, struct inlineHookInfo, list);
+		if (info->memo == NULL) {
+			continue;
+		}
+		memoGetStats(info->memo, &stats);
+		calls = stats.hits + stats.misses;
+		LOGD("memo 0x%x %s: %llu calls, hit rate %u%%, %u entries, %u bytes, %llu evicted, %llu expired",
+			info->target_addr, info->function_name,
+			(unsigned long long) calls, calls ? (unsigned) (stats.hits * 100 / calls) : 0,
+			stats.entries, stats.memory,
+			(unsigned long long) stats.evictions, (unsigned long long) stats.expirations);
+	}
+	pthread_mutex_unlock(&hook_lock);
+}
+
+static void forkPrepare()
+{
+	struct list_head *pos;
+	struct inlineHookInfo *info;
+
+	pthread_mutex_lock(&hook_lock);
+	list_for_each(pos, &head) {
+		info = list_entry(pos, struct inlineHookInfo, list);
+		if (info->memo != NULL) {
+			memoLock(info->memo);
+		}
+	}
+}
+
+static void forkRelease()
+{
+	struct list_head *pos;
+	struct inlineHookInfo *info;
+
+	list_for_each(pos, &head) {
+		info = list_entry(pos, struct inlineHookInfo, list);
+		if (info->memo != NULL) {
+			memoUnlock(info->memo);
+		}
+	}
+	pthread_mutex_unlock(&hook_lock);
+}
+
+static void registerForkHandlers()
+{
+	pthread_atfork(forkPrepare, forkRelease, forkRelease);
+}
+
+static int comparePages(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a;
+	uint32_t y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+void getInlineHookPageStats(struct inlineHookPageStats *stats)
+{
+	struct list_head *pos;
+	struct inlineHookInfo *info;
+	uint32_t *pages;
+	uint32_t addr;
+	int length;
+	int n;
+	int i;
+
+	memset(stats, 0, sizeof(struct inlineHookPageStats));
+	pthread_mutex_lock(&hook_lock);
+
+	n = 0;
+	list_for_each(pos, &head) {
+		++n;
+	}
+	pages = (uint32_t *) malloc((2 * n + 1) * sizeof(uint32_t));
+
+	n = 0;
+	list_for_each(pos, &head) {
+		info = list_entry(pos, struct inlineHookInfo, list);
+		if (info->status == HOOKING_STATUS) {
+			continue;
+		}
+		if (info->stub_instructions != NULL) {
+			++stats->stub_pages;
+		}
+		addr = info->target_addr & ~1;
+		length = info->target_addr & 1 ? 10 : 8;
+		pages[n++] = PAGE_START(addr);
+		if (PAGE_START(addr + length - 1) != PAGE_START(addr)) {
+			pages[n++] = PAGE_START(addr + length - 1);
+		}
+	}
+
+	qsort(pages, n, sizeof(uint32_t), comparePages);
+	for (i = 0; i < n; ++i) {
+		if (i == 0 || pages[i] != pages[i - 1]) {
+			++stats->code_pages;
+		}
+	}
+	free(pages);
+
+	list_for_each(pos, &trampoline_pages) {
+		++stats->trampoline_pages;
+	}
+
+	pthread_mutex_unlock(&hook_lock);
+}
+
 static int doInlineUnHook(struct inlineHookInfo *info)
 {
 	int length;
@@ -803,15 +1074,25 @@ static int doInlineUnHook(struct inlineHookInfo *info)
 		length = 10;
 	}
 	
-	mprotect((void *) PAGE_START(info->target_addr), PAGE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC);
+	protectRange(info->target_addr, length, PROT_READ | PROT_WRITE | PROT_EXEC);
 	memcpy((void *) info->target_addr, info->orig_instructions, length);
-	mprotect((void *) PAGE_START(info->target_addr), PAGE_SIZE, PROT_READ | PROT_EXEC);
+	protectRange(info->target_addr, length, PROT_READ | PROT_EXEC);
 
 	asm_cacheflush(info->target_addr, info->target_addr + length, 0);
 	
 	free(info->orig_instructions);
-	if (info->trampoline_instructions != NULL) {
-		munmap(info->trampoline_instructions, PAGE_SIZE);
+
+	/*
+	 * A thread can still be inside a stub hook, e.g. blocked in a slow
+	 * original called by memoCall() or traceCall(), and returns through the stub, its
+	 * trampoline and its state. There is no telling when the last one left,
+	 * so all of them stay, a memo cache only drops its entries.
+	 */
+	if (info->trampoline_instructions != NULL && info->stub_instructions == NULL) {
+		freeTrampoline(info->trampoline_instructions);
+	}
+	if (info->memo != NULL) {
+		memoFlush(info->memo);
 	}
 	
 	LOGD("end inline unhooking, target_addr: 0x%x", info->target_addr);
@@ -828,6 +1109,9 @@ int inlineUnHook()
 	pid_t tids[1024];
 	struct list_head *node;
 
+	pthread_once(&fork_once, registerForkHandlers);
+	pthread_mutex_lock(&hook_lock);
+
 	i = 0;
 	list_for_each(pos, &head) {
 		info = list_entry(pos, struct inlineHookInfo, list);
@@ -838,6 +1122,7 @@ int inlineUnHook()
 	addr[i] = 0;
 
 	if (getAllTids(getpid(), tids) == -1) {
+		pthread_mutex_unlock(&hook_lock);
 		return -1;
 	}
 
@@ -858,6 +1143,7 @@ int inlineUnHook()
 	}
 
 	contAllThreads(getpid(), tids);
+	pthread_mutex_unlock(&hook_lock);
 
 	return 0;
 }
@@ -873,7 +1159,9 @@ static int doInlineHook(struct inlineHookInfo *info)
 		asm_cacheflush(info->target_addr - 1, info->target_addr - 1 + 10, 0);
 	}
 	
-	LOGD("end inline hooking, target_addr: 0x%x, new_addr: 0x%x, *proto_addr: 0x%x", info->target_addr, info->new_addr, (uint32_t) *(info->proto_addr));
+	info->status = HOOKED_STATUS;
+
+	LOGD("end inline hooking, target_addr: 0x%x, new_addr: 0x%x, *proto_addr: 0x%x", info->target_addr, info->new_addr, info->proto_addr != NULL ? (uint32_t) *(info->proto_addr) : 0);
 	
 	return 0;
 }
@@ -886,6 +1174,9 @@ int inlineHook()
 	uint32_t addr[1024];
 	pid_t tids[1024];
 
+	pthread_once(&fork_once, registerForkHandlers);
+	pthread_mutex_lock(&hook_lock);
+
 	i = 0;
 	list_for_each(pos, &head) {
 		info = list_entry(pos, struct inlineHookInfo, list);
@@ -896,6 +1187,7 @@ int inlineHook()
 	addr[i] = 0;
 
 	if (getAllTids(getpid(), tids) == -1) {
+		pthread_mutex_unlock(&hook_lock);
 		return -1;
 	}
 
@@ -914,6 +1206,7 @@ int inlineHook()
 	}
 
 	contAllThreads(getpid(), tids);
+	pthread_mutex_unlock(&hook_lock);
 
 	return 0;
 }
\ No newline at end of file
@@ -5,6 +5,10 @@
 
 #include "list.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct soinfo {
 	char name[128];
 	const Elf32_Phdr* phdr;
@@ -40,6 +44,65 @@ struct soinfo {
 	size_t rel_count;
 };
 
+/*
+ * Register context passed to a callback hook. r[], sp, lr and cpsr are
+ * always present; d[] and fpscr are only saved with INLINE_HOOK_REGS_VFP.
+ * With INLINE_HOOK_REGS_FAST only r0-r4, r12, sp, lr and cpsr are saved,
+ * r5-r11 are preserved by the callback itself (AAPCS) and are not readable.
+ * Changes to sp are ignored, changes to the other fields are written back.
+ */
+struct inlineHookRegs {
+	uint32_t r[13];
+	uint32_t sp;
+	uint32_t lr;
+	uint32_t cpsr;
+	uint64_t d[16];
+	uint32_t fpscr;
+	uint32_t unused;
+};
+
+typedef void (*inlineHookCallback)(struct inlineHookRegs *regs, void *arg);
+
+#define INLINE_HOOK_REGS_FAST	0x1	// save caller-saved registers only
+#define INLINE_HOOK_REGS_VFP	0x2	// save d0-d15 and fpscr as well
+
+struct inlineHookMemoStats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;		// dropped to stay within max_entries
+	uint64_t expirations;	// dropped because they were older than ttl_ms
+	uint32_t entries;
+	uint32_t memory;		// bytes held by the cache
+};
+
+struct inlineHookSampleStats {
+	uint32_t period;		// the handler runs on 1 in period calls of a thread
+	uint64_t samples;
+	uint64_t calls;			// estimated from samples and period
+	uint64_t handler_ns;
+};
+
+struct inlineHookTraceStats {
+	uint64_t records;	// written to the trace file
+	uint64_t dropped;	// lost because the flusher fell behind
+	uint64_t bytes;		// size of the trace file
+};
+
+struct inlineHookPageStats {
+	uint32_t code_pages;		// code pages holding a patch, private to this process
+	uint32_t trampoline_pages;
+	uint32_t stub_pages;
+};
+
+#define INLINE_HOOK_CPU_NEON	0x1
+#define INLINE_HOOK_CPU_VFPV4	0x2
+#define INLINE_HOOK_CPU_IDIV	0x4		// sdiv/udiv in ARM state
+#define INLINE_HOOK_CPU_AES		0x8
+#define INLINE_HOOK_CPU_PMULL	0x10
+#define INLINE_HOOK_CPU_SHA1	0x20
+#define INLINE_HOOK_CPU_SHA2	0x40
+#define INLINE_HOOK_CPU_CRC32	0x80
+
 struct inlineHookInfo {
 	struct list_head list;
 	char so_name[128];
@@ -49,14 +112,88 @@ struct inlineHookInfo {
 	uint32_t **proto_addr;
 	void *orig_instructions;
 	void *trampoline_instructions;
+	void *stub_instructions;
+	void *memo;
+	void *probe;
+	void *sampler;
 	int status;
 };
 
+/*
+ * Unhooking a callback, sampled, memo or trace hook does not free its stub
+ * page, trampoline and state, a thread may still be inside the hooked call
+ * and return through them. Only the entries of a memo cache are freed.
+ */
 int unregisterInlineHookByName(const char *function_name, const char *so_name);
 int unregisterInlineHookByAddr(uint32_t target_addr);
 int registerInlineHookByName(const char *function_name, const char *so_name, uint32_t offset, uint32_t new_addr, uint32_t **proto_addr);
 int registerInlineHookByAddr(uint32_t target_addr, uint32_t new_addr, uint32_t **proto_addr);
+/*
+ * The pattern must match exactly once in the executable mappings of so_name
+ * (all of them if so_name is NULL), see scanner.h for the syntax. The hook is
+ * placed at match + offset, add 1 to offset for thumb code.
+ */
+int registerInlineHookByPattern(const char *pattern, const char *so_name, uint32_t offset, uint32_t new_addr, uint32_t **proto_addr);
+int registerInlineHookCallbackByName(const char *function_name, const char *so_name, uint32_t offset, inlineHookCallback callback, void *arg, int flags);
+int registerInlineHookCallbackByAddr(uint32_t target_addr, inlineHookCallback callback, void *arg, int flags);
+/*
+ * Sampled callback hooks run the callback on 1 in period calls per thread,
+ * the other calls only pay for a countdown in the stub. With budget_ns the
+ * period is adjusted every 100ms so the callback uses about budget_ns of CPU
+ * time per second in total, period is only the starting point then.
+ */
+int registerInlineHookSampledByName(const char *function_name, const char *so_name, uint32_t offset, inlineHookCallback callback, void *arg, int flags, uint32_t period, uint32_t budget_ns);
+int registerInlineHookSampledByAddr(uint32_t target_addr, inlineHookCallback callback, void *arg, int flags, uint32_t period, uint32_t budget_ns);
+int getInlineHookSampleStatsByAddr(uint32_t target_addr, struct inlineHookSampleStats *stats);
+void dumpInlineHookSampleStats();
+/*
+ * Memoized hooks cache the return value (r0:r1) of a pure function keyed on
+ * its first nargs (at most 4) register arguments, pointers are compared by
+ * address and not by the data they point to. A miss calls the original. The
+ * cache keeps at most max_entries results, evicting the least recently used,
+ * and drops results older than ttl_ms unless ttl_ms is 0. Only functions
+ * taking and returning integers or pointers (softfp) can be memoized.
+ */
+int registerInlineHookMemoByName(const char *function_name, const char *so_name, uint32_t offset, int nargs, uint32_t max_entries, uint32_t ttl_ms);
+int registerInlineHookMemoByAddr(uint32_t target_addr, int nargs, uint32_t max_entries, uint32_t ttl_ms);
+int getInlineHookMemoStatsByName(const char *function_name, const char *so_name, struct inlineHookMemoStats *stats);
+int getInlineHookMemoStatsByAddr(uint32_t target_addr, struct inlineHookMemoStats *stats);
+void dumpInlineHookMemoStats();
+/*
+ * Traced hooks record every call between startInlineHookTrace() and
+ * stopInlineHookTrace(): r0-r3, thread and time on entry, r0:r1 on return,
+ * tagged with id. The same restrictions as for memoized hooks apply. Probes
+ * never block, records are dropped when the flusher falls behind. The file
+ * format is in trace.h, tracedump decodes it.
+ */
+int registerInlineHookTraceByName(const char *function_name, const char *so_name, uint32_t offset, uint16_t id);
+int registerInlineHookTraceByAddr(uint32_t target_addr, uint16_t id);
+int startInlineHookTrace(const char *path);
+int stopInlineHookTrace();
+void getInlineHookTraceStats(struct inlineHookTraceStats *stats);
+/*
+ * CPU overrides register replacement implementations that need the given
+ * INLINE_HOOK_CPU_* features. applyCpuOverrides() registers a hook to the
+ * best variant the CPU supports for each target and returns how many targets
+ * it redirected, inlineHook() installs them. Register every variant of a
+ * target before calling applyCpuOverrides().
+ */
+uint32_t getCpuFeatures();
+int registerCpuOverrideByName(const char *function_name, const char *so_name, uint32_t required, uint32_t new_addr);
+int registerCpuOverrideByAddr(uint32_t target_addr, uint32_t required, uint32_t new_addr);
+int applyCpuOverrides();
+/*
+ * Hooks installed before fork() stay shared copy-on-write with every child,
+ * only the pages counted here were copied, in the installing process. fork()
+ * waits for a running inlineHook() or inlineUnHook() to finish.
+ */
+void getInlineHookPageStats(struct inlineHookPageStats *stats);
+int setSymbolCacheDir(const char *dir);
 int inlineUnHook();
 int inlineHook();
 
-#endif
\ No newline at end of file
+#ifdef __cplusplus
+}
+#endif
+
+#endif
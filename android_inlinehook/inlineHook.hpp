@@ -0,0 +1,107 @@
+#ifndef _INLINEHOOK_HPP
+#define _INLINEHOOK_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "inlineHook.h"
+
+/*
+ * Typed C++11 layer over the C API.
+ *
+ *   static constexpr HookSymbol kOpen("libc.so", "open");
+ *   static Hook<int(const char *, int, int)> open_hook;
+ *
+ *   static int myOpen(const char *path, int flags, int mode)
+ *   {
+ *       return open_hook.callOriginal(path, flags, mode);
+ *   }
+ *
+ *   open_hook.registerHook(kOpen, myOpen);
+ *   while (inlineHook() < 0);
+ *
+ * The replacement must have exactly the hooked signature, anything else
+ * (including a lambda with captures) fails to compile. The patched branch
+ * jumps straight to the replacement and callOriginal() is a direct call
+ * through the trampoline pointer, so there is no thunk and no extra
+ * indirection at runtime.
+ */
+
+struct HookSymbol {
+	const char *so_name;
+	const char *function_name;
+	uint32_t offset;
+
+	constexpr HookSymbol(const char *so_name, const char *function_name, uint32_t offset = 0)
+		: so_name(so_name), function_name(function_name), offset(offset) {}
+};
+
+template <typename Signature>
+class Hook;
+
+template <typename R, typename... Args>
+class Hook<R(Args...)> {
+public:
+	typedef R (*Function)(Args...);
+
+	static_assert(sizeof(Function) == sizeof(uint32_t), "the hook engine stores code addresses in uint32_t");
+
+	constexpr Hook() : target_(0), original_(NULL) {}
+
+	int registerHook(const HookSymbol &symbol, Function replacement)
+	{
+		if (registerInlineHookByName(symbol.function_name, symbol.so_name, symbol.offset, toAddr(replacement), protoAddr()) == -1) {
+			return -1;
+		}
+		name_ = symbol;
+		return 0;
+	}
+
+	int registerHook(Function target, Function replacement)
+	{
+		if (registerInlineHookByAddr(toAddr(target), toAddr(replacement), protoAddr()) == -1) {
+			return -1;
+		}
+		target_ = toAddr(target);
+		return 0;
+	}
+
+	// takes effect with the next inlineUnHook()
+	int unregisterHook()
+	{
+		if (target_ != 0) {
+			return unregisterInlineHookByAddr(target_);
+		}
+		return unregisterInlineHookByName(name_.function_name, name_.so_name);
+	}
+
+	R callOriginal(Args... args) const
+	{
+		return original_(args...);
+	}
+
+	Function original() const
+	{
+		return original_;
+	}
+
+private:
+	static uint32_t toAddr(Function function)
+	{
+		return static_cast<uint32_t>(reinterpret_cast<uintptr_t>(function));
+	}
+
+	uint32_t **protoAddr()
+	{
+		return reinterpret_cast<uint32_t **>(&original_);
+	}
+
+	Hook(const Hook &) = delete;
+	Hook &operator=(const Hook &) = delete;
+
+	uint32_t target_;
+	HookSymbol name_ = HookSymbol(NULL, NULL);
+	Function original_;	// written by inlineHook() through proto_addr
+};
+
+#endif
@@ -0,0 +1,719 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define INTEGRITY_NEON
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#define INTEGRITY_SSE41
+#endif
+
+#include "integrity.h"
+
+#define ENABLE_DEBUG
+#include "log.h"
+
+#define INTEGRITY_PAGE	4096
+#define BATCH_PAGES		64		// pages checked under the lock in one step
+#define MAX_REPORTS		32		// ranges collected in one step
+#define MERGE_GAP		16		// changes closer than this are reported as one range
+#define SLEEP_SLICE_MS	10		// how fast integrityStop() is noticed between passes
+
+#ifndef SCHED_IDLE
+#define SCHED_IDLE		5
+#endif
+
+#define PRIME1	2654435761U
+#define PRIME2	2246822519U
+#define PRIME3	3266489917U
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+struct integrityRegion {
+	uintptr_t start;
+	uintptr_t end;
+	uint64_t offset;
+	char *path;
+	uint32_t *hashes;		// per page, of the file contents
+	uint8_t *known;			// hashes[i] was computed
+	int gone;				// unmapped or unreadable since integrityInit
+};
+
+// a pass in progress, steps of it run with integrity_lock released in between
+struct integrityCursor {
+	int generation;
+	int region;
+	uint32_t page;
+	int fd;					// file of the current region, -1 until needed
+};
+
+static pthread_mutex_t integrity_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct integrityRegion *regions = NULL;
+static int nregion = 0;
+static int generation = 0;
+static uint8_t *file_pages = NULL;	// BATCH_PAGES pages read from the file
+static struct integrityRange *exclusions = NULL;
+static int nexclusion = 0;
+static int exclusion_cap = 0;
+static struct integrityStats stats;
+
+static pthread_t scanner;
+static volatile int scanner_running = 0;
+static integrityCallback scanner_callback;
+static void *scanner_arg;
+static uint32_t scanner_budget;
+static uint32_t scanner_interval;
+
+static uint64_t nowNs(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t finishHash(const uint32_t v[4])
+{
+	uint32_t h;
+
+	h = ROTL(v[0], 1) + ROTL(v[1], 7) + ROTL(v[2], 12) + ROTL(v[3], 18) + INTEGRITY_PAGE;
+	h ^= h >> 15;
+	h *= PRIME2;
+	h ^= h >> 13;
+	h *= PRIME3;
+	h ^= h >> 16;
+	return h;
+}
+
+/*
+ * XXH32 (seed 0) of the pages at a and b. The four XXH32 accumulators are
+ * the lanes of one vector, and the two pages are two independent multiply
+ * chains that hide each other's latency.
+ */
+static void hashPages(const uint8_t *a, const uint8_t *b, uint32_t *ha, uint32_t *hb)
+{
+	uint32_t va[4] = {PRIME1 + PRIME2, PRIME2, 0, 0 - PRIME1};
+	uint32_t vb[4];
+	int i;
+
+	memcpy(vb, va, sizeof(vb));
+
+#if defined(INTEGRITY_NEON)
+	{
+		uint32x4_t p1 = vdupq_n_u32(PRIME1);
+		uint32x4_t p2 = vdupq_n_u32(PRIME2);
+		uint32x4_t x = vld1q_u32(va);
+		uint32x4_t y = x;
+
+		for (i = 0; i < INTEGRITY_PAGE; i += 16) {
+			x = vmlaq_u32(x, vreinterpretq_u32_u8(vld1q_u8(a + i)), p2);
+			y = vmlaq_u32(y, vreinterpretq_u32_u8(vld1q_u8(b + i)), p2);
+			x = vmulq_u32(vsriq_n_u32(vshlq_n_u32(x, 13), x, 19), p1);
+			y = vmulq_u32(vsriq_n_u32(vshlq_n_u32(y, 13), y, 19), p1);
+		}
+		vst1q_u32(va, x);
+		vst1q_u32(vb, y);
+	}
+#elif defined(INTEGRITY_SSE41)
+	{
+		__m128i p1 = _mm_set1_epi32((int) PRIME1);
+		__m128i p2 = _mm_set1_epi32((int) PRIME2);
+		__m128i x = _mm_loadu_si128((const __m128i *) va);
+		__m128i y = x;
+
+		for (i = 0; i < INTEGRITY_PAGE; i += 16) {
+			x = _mm_add_epi32(x, _mm_mullo_epi32(_mm_loadu_si128((const __m128i *) (a + i)), p2));
+			y = _mm_add_epi32(y, _mm_mullo_epi32(_mm_loadu_si128((const __m128i *) (b + i)), p2));
+			x = _mm_mullo_epi32(_mm_or_si128(_mm_slli_epi32(x, 13), _mm_srli_epi32(x, 19)), p1);
+			y = _mm_mullo_epi32(_mm_or_si128(_mm_slli_epi32(y, 13), _mm_srli_epi32(y, 19)), p1);
+		}
+		_mm_storeu_si128((__m128i *) va, x);
+		_mm_storeu_si128((__m128i *) vb, y);
+	}
+#else
+	for (i = 0; i < INTEGRITY_PAGE; i += 16) {
+		uint32_t wa[4];
+		uint32_t wb[4];
+		int j;
+
+		memcpy(wa, a + i, sizeof(wa));
+		memcpy(wb, b + i, sizeof(wb));
+		for (j = 0; j < 4; ++j) {
+			va[j] = ROTL(va[j] + wa[j] * PRIME2, 13) * PRIME1;
+			vb[j] = ROTL(vb[j] + wb[j] * PRIME2, 13) * PRIME1;
+		}
+	}
+#endif
+
+	*ha = finishHash(va);
+	*hb = finishHash(vb);
+}
+
+static void freeRegions()
+{
+	int i;
+
+	for (i = 0; i < nregion; ++i) {
+		free(regions[i].path);
+		free(regions[i].hashes);
+		free(regions[i].known);
+	}
+	free(regions);
+	regions = NULL;
+	nregion = 0;
+}
+
+int integrityInit(const char *so_name)
+{
+	struct integrityRegion *list;
+	struct integrityRegion *region;
+	struct stat st;
+	char line[1024];
+	uint32_t pages;
+	int cap;
+	int n;
+	FILE *fp;
+
+	pthread_mutex_lock(&integrity_lock);
+	if (scanner_running) {
+		pthread_mutex_unlock(&integrity_lock);
+		return -1;
+	}
+	if (file_pages == NULL) {
+		file_pages = (uint8_t *) malloc(BATCH_PAGES * INTEGRITY_PAGE);
+	}
+	fp = fopen("/proc/self/maps", "r");
+	if (fp == NULL || file_pages == NULL) {
+		if (fp != NULL) {
+			fclose(fp);
+		}
+		pthread_mutex_unlock(&integrity_lock);
+		return -1;
+	}
+
+	list = NULL;
+	cap = 0;
+	n = 0;
+	pages = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		unsigned long start;
+		unsigned long end;
+		unsigned long long offset;
+		unsigned long long file_end;
+		char perms[8];
+		char *path;
+		int pos;
+		size_t len;
+
+		pos = 0;
+		if (sscanf(line, "%lx-%lx %7s %llx %*s %*s %n", &start, &end, perms, &offset, &pos) < 4) {
+			continue;
+		}
+		path = line + pos;
+		if (perms[0] != 'r' || perms[2] != 'x' || pos == 0 || path[0] != '/') {
+			continue;
+		}
+		len = strcspn(path, "\n");
+		path[len] = '\0';
+		if ((len > 10 && strcmp(path + len - 10, " (deleted)") == 0) || (so_name != NULL && strstr(path, so_name) == NULL)) {
+			continue;
+		}
+
+		// pages past the end of the file are not backed by it
+		if (stat(path, &st) != 0 || (unsigned long long) st.st_size <= offset) {
+			continue;
+		}
+		file_end = start + ((st.st_size - offset + INTEGRITY_PAGE - 1) & ~(unsigned long long) (INTEGRITY_PAGE - 1));
+		if (file_end < end) {
+			end = file_end;
+		}
+
+		if (n == cap) {
+			cap = cap ? cap * 2 : 64;
+			region = (struct integrityRegion *) realloc(list, cap * sizeof(struct integrityRegion));
+			if (region == NULL) {
+				break;
+			}
+			list = region;
+		}
+		region = &list[n];
+		memset(region, 0, sizeof(struct integrityRegion));
+		region->start = start;
+		region->end = end;
+		region->offset = offset;
+		region->path = strdup(path);
+		region->hashes = (uint32_t *) malloc((end - start) / INTEGRITY_PAGE * sizeof(uint32_t));
+		region->known = (uint8_t *) calloc((end - start) / INTEGRITY_PAGE, 1);
+		if (region->path == NULL || region->hashes == NULL || region->known == NULL) {
+			free(region->path);
+			free(region->hashes);
+			free(region->known);
+			break;
+		}
+		pages += (end - start) / INTEGRITY_PAGE;
+		++n;
+	}
+	fclose(fp);
+
+	freeRegions();
+	regions = list;
+	nregion = n;
+	++generation;
+	memset(&stats, 0, sizeof(stats));
+	stats.regions = n;
+	stats.pages = pages;
+	pthread_mutex_unlock(&integrity_lock);
+
+	LOGD("integrity: %d executable mappings, %u pages", n, pages);
+	return n;
+}
+
+int integrityExclude(uintptr_t start, uintptr_t end)
+{
+	struct integrityRange *list;
+
+	if (start >= end) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&integrity_lock);
+	if (nexclusion == exclusion_cap) {
+		list = (struct integrityRange *) realloc(exclusions, (exclusion_cap ? exclusion_cap * 2 : 16) * sizeof(struct integrityRange));
+		if (list == NULL) {
+			pthread_mutex_unlock(&integrity_lock);
+			return -1;
+		}
+		exclusions = list;
+		exclusion_cap = exclusion_cap ? exclusion_cap * 2 : 16;
+	}
+	memset(&exclusions[nexclusion], 0, sizeof(struct integrityRange));
+	exclusions[nexclusion].start = start;
+	exclusions[nexclusion].end = end;
+	++nexclusion;
+	pthread_mutex_unlock(&integrity_lock);
+	return 0;
+}
+
+static int isExcluded(uintptr_t start, uintptr_t end)
+{
+	int i;
+
+	for (i = 0; i < nexclusion; ++i) {
+		if (exclusions[i].start <= start && end <= exclusions[i].end) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * A page of a file mapping can only be in swap if it was written to, i.e. it
+ * is a private copy, possibly patched. Marks those as resident so they are
+ * checked as well (and swapped back in by the check).
+ */
+static void addSwapped(uintptr_t start, uint32_t count, unsigned char *resident)
+{
+	uint64_t entries[BATCH_PAGES];
+	uint32_t i;
+	int fd;
+
+	for (i = 0; i < count && (resident[i] & 1); ++i) {
+	}
+	if (i == count) {
+		return;
+	}
+
+	fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return;
+	}
+	if (pread(fd, entries, count * sizeof(uint64_t), (off_t) (start / INTEGRITY_PAGE * sizeof(uint64_t))) == (ssize_t) (count * sizeof(uint64_t))) {
+		for (i = 0; i < count; ++i) {
+			if (entries[i] & (1ULL << 62)) {	// swapped
+				resident[i] |= 1;
+			}
+		}
+	}
+	close(fd);
+}
+
+static int readFile(struct integrityCursor *cur, struct integrityRegion *region, uint32_t page, uint32_t count)
+{
+	size_t size = count * INTEGRITY_PAGE;
+	off_t offset = region->offset + (uint64_t) page * INTEGRITY_PAGE;
+	size_t done;
+	ssize_t n;
+
+	if (cur->fd == -1) {
+		cur->fd = open(region->path, O_RDONLY | O_CLOEXEC);
+		if (cur->fd == -1) {
+			return -1;
+		}
+	}
+
+	done = 0;
+	while (done < size) {
+		n = pread(cur->fd, file_pages + done, size - done, offset + done);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		done += n;
+	}
+	// the tail of the last page reads as zero in memory as well
+	memset(file_pages + done, 0, size - done);
+	return 0;
+}
+
+/*
+ * All ranges of a step belong to one region. When the reports are full the
+ * last range grows instead, the changes are still covered.
+ */
+static void addReport(struct integrityRegion *region, uintptr_t start, uintptr_t end,
+					  struct integrityRange *reports, int *nreport)
+{
+	struct integrityRange *last = *nreport ? &reports[*nreport - 1] : NULL;
+
+	if (last != NULL && (start <= last->end + MERGE_GAP || *nreport == MAX_REPORTS)) {
+		last->end = end;
+		return;
+	}
+	last = &reports[(*nreport)++];
+	last->start = start;
+	last->end = end;
+	last->path = region->path;
+	last->offset = region->offset + (start - region->start);
+}
+
+// finds the changed bytes of a page whose hash differs
+static void diffPage(struct integrityRegion *region, const uint8_t *mem, const uint8_t *file,
+					 struct integrityRange *reports, int *nreport)
+{
+	uintptr_t base = (uintptr_t) mem;
+	int i;
+	int j;
+
+	i = 0;
+	while (i < INTEGRITY_PAGE) {
+		if (mem[i] == file[i] || isExcluded(base + i, base + i + 1)) {
+			++i;
+			continue;
+		}
+		for (j = i + 1; j < INTEGRITY_PAGE && mem[j] != file[j] && !isExcluded(base + j, base + j + 1); ++j) {
+		}
+		addReport(region, base + i, base + j, reports, nreport);
+		i = j;
+	}
+}
+
+/*
+ * Checks up to BATCH_PAGES pages of the cursor's region and moves the cursor
+ * on, returns 1 once every region was visited. Runs with integrity_lock held.
+ */
+static int checkStep(struct integrityCursor *cur, struct integrityRange *reports, int *nreport)
+{
+	struct integrityRegion *region;
+	unsigned char resident[BATCH_PAGES];
+	const uint8_t *todo[BATCH_PAGES];
+	uint32_t index[BATCH_PAGES];
+	uint32_t hash[2];
+	uintptr_t start;
+	uint32_t first;
+	uint32_t count;
+	uint32_t i;
+	uint32_t j;
+	int ntodo;
+	int k;
+
+	while (cur->region < nregion && (regions[cur->region].gone
+		   || cur->page >= (regions[cur->region].end - regions[cur->region].start) / INTEGRITY_PAGE)) {
+		if (cur->fd != -1) {
+			close(cur->fd);
+			cur->fd = -1;
+		}
+		cur->region++;
+		cur->page = 0;
+	}
+	if (cur->region >= nregion) {
+		return 1;
+	}
+
+	region = &regions[cur->region];
+	first = cur->page;
+	count = (region->end - region->start) / INTEGRITY_PAGE - first;
+	if (count > BATCH_PAGES) {
+		count = BATCH_PAGES;
+	}
+	start = region->start + first * INTEGRITY_PAGE;
+	cur->page += count;
+
+	// also tells whether the library is still mapped
+	if (mincore((void *) start, count * INTEGRITY_PAGE, resident) != 0) {
+		if (errno == ENOMEM) {
+			LOGD("integrity: %s unmapped", region->path);
+			region->gone = 1;
+		}
+		return 0;
+	}
+	addSwapped(start, count, resident);
+
+	// hashes of the file, taken the first time a page is found resident
+	for (i = 0; i < count; ) {
+		if (!(resident[i] & 1) || region->known[first + i]) {
+			++i;
+			continue;
+		}
+		for (j = i + 1; j < count && (resident[j] & 1) && !region->known[first + j]; ++j) {
+		}
+		if (readFile(cur, region, first + i, j - i) == -1) {
+			LOGD("integrity: read %s failed: %s", region->path, strerror(errno));
+			region->gone = 1;
+			return 0;
+		}
+		for (k = 0; k < (int) (j - i); k += 2) {
+			int b = k + 1 < (int) (j - i) ? k + 1 : k;
+
+			hashPages(file_pages + k * INTEGRITY_PAGE, file_pages + b * INTEGRITY_PAGE, &hash[0], &hash[1]);
+			region->hashes[first + i + k] = hash[0];
+			region->hashes[first + i + b] = hash[1];
+			region->known[first + i + k] = 1;
+			region->known[first + i + b] = 1;
+		}
+		i = j;
+	}
+
+	ntodo = 0;
+	for (i = 0; i < count; ++i) {
+		uintptr_t page = start + i * INTEGRITY_PAGE;
+
+		if (!(resident[i] & 1) || isExcluded(page, page + INTEGRITY_PAGE)) {
+			stats.skipped++;
+			continue;
+		}
+		todo[ntodo] = (const uint8_t *) page;
+		index[ntodo++] = first + i;
+	}
+
+	for (k = 0; k < ntodo; k += 2) {
+		int b = k + 1 < ntodo ? k + 1 : k;
+		int m;
+
+		hashPages(todo[k], todo[b], &hash[0], &hash[1]);
+		for (m = 0; m <= b - k; ++m) {
+			stats.checked++;
+			if (hash[m] == region->hashes[index[k + m]]) {
+				continue;
+			}
+			if (readFile(cur, region, index[k + m], 1) == 0) {
+				diffPage(region, todo[k + m], file_pages, reports, nreport);
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * One step of a pass with the lock held and the callbacks run after it is
+ * released. Returns 1 when the pass is complete, -1 if integrityInit() ran
+ * in between. The reports get their own copy of the path, integrityInit()
+ * may free the regions as soon as the lock is released.
+ */
+static int runStep(struct integrityCursor *cur, integrityCallback callback, void *arg, int *found)
+{
+	struct integrityRange reports[MAX_REPORTS];
+	char path[PATH_MAX];
+	int nreport;
+	int done;
+	int i;
+
+	nreport = 0;
+	pthread_mutex_lock(&integrity_lock);
+	if (cur->generation != generation) {
+		pthread_mutex_unlock(&integrity_lock);
+		return -1;
+	}
+	done = checkStep(cur, reports, &nreport);
+	stats.modified += nreport;
+	if (nreport > 0) {
+		snprintf(path, sizeof(path), "%s", reports[0].path);
+	}
+	pthread_mutex_unlock(&integrity_lock);
+
+	for (i = 0; i < nreport; ++i) {
+		reports[i].path = path;		// all of one region
+		LOGD("integrity: %s+0x%llx modified, %u bytes at %p", reports[i].path, (unsigned long long) reports[i].offset,
+			(unsigned) (reports[i].end - reports[i].start), (void *) reports[i].start);
+		if (callback != NULL) {
+			callback(&reports[i], arg);
+		}
+	}
+	*found += nreport;
+	return done;
+}
+
+static void finishPass(struct integrityCursor *cur, uint64_t start_ns)
+{
+	if (cur->fd != -1) {
+		close(cur->fd);
+		cur->fd = -1;
+	}
+	pthread_mutex_lock(&integrity_lock);
+	if (cur->generation == generation) {
+		stats.passes++;
+		stats.last_pass_ms = (nowNs(CLOCK_MONOTONIC) - start_ns) / 1000000;
+	}
+	pthread_mutex_unlock(&integrity_lock);
+}
+
+int integrityCheck(integrityCallback callback, void *arg)
+{
+	struct integrityCursor cur;
+	uint64_t start_ns;
+	int found;
+	int done;
+
+	pthread_mutex_lock(&integrity_lock);
+	if (regions == NULL) {
+		pthread_mutex_unlock(&integrity_lock);
+		return -1;
+	}
+	cur.generation = generation;
+	pthread_mutex_unlock(&integrity_lock);
+	cur.region = 0;
+	cur.page = 0;
+	cur.fd = -1;
+
+	start_ns = nowNs(CLOCK_MONOTONIC);
+	found = 0;
+	while ((done = runStep(&cur, callback, arg, &found)) == 0) {
+	}
+	finishPass(&cur, start_ns);
+	return done == -1 ? -1 : found;
+}
+
+static void sleepNs(uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+	}
+}
+
+/*
+ * After every step the thread sleeps long enough to stay within its budget
+ * of CPU time, counted with the thread's own clock so time it was preempted
+ * does not count.
+ */
+static void *scannerThread(void *arg)
+{
+	struct sched_param param;
+	struct integrityCursor cur;
+	uint64_t start_ns;
+	uint64_t cpu_ns;
+	uint32_t slept;
+	int found;
+	int done;
+
+	memset(&param, 0, sizeof(param));
+	if (sched_setscheduler(0, SCHED_IDLE, &param) != 0) {
+		setpriority(PRIO_PROCESS, syscall(__NR_gettid), 19);
+	}
+
+	while (scanner_running) {
+		pthread_mutex_lock(&integrity_lock);
+		cur.generation = generation;
+		pthread_mutex_unlock(&integrity_lock);
+		cur.region = 0;
+		cur.page = 0;
+		cur.fd = -1;
+
+		start_ns = nowNs(CLOCK_MONOTONIC);
+		found = 0;
+		do {
+			cpu_ns = nowNs(CLOCK_THREAD_CPUTIME_ID);
+			done = runStep(&cur, scanner_callback, scanner_arg, &found);
+			cpu_ns = nowNs(CLOCK_THREAD_CPUTIME_ID) - cpu_ns;
+			__sync_fetch_and_add(&stats.cpu_ns, cpu_ns);
+			if (scanner_budget < 100) {
+				sleepNs(cpu_ns * (100 - scanner_budget) / scanner_budget);
+			}
+		} while (done == 0 && scanner_running);
+		finishPass(&cur, start_ns);
+
+		for (slept = 0; slept < scanner_interval && scanner_running; slept += SLEEP_SLICE_MS) {
+			usleep(SLEEP_SLICE_MS * 1000);
+		}
+	}
+	return NULL;
+}
+
+int integrityStart(integrityCallback callback, void *arg, uint32_t budget_percent, uint32_t interval_ms)
+{
+	pthread_mutex_lock(&integrity_lock);
+	if (scanner_running || regions == NULL) {
+		pthread_mutex_unlock(&integrity_lock);
+		return -1;
+	}
+
+	scanner_callback = callback;
+	scanner_arg = arg;
+	scanner_budget = budget_percent == 0 ? 1 : (budget_percent > 100 ? 100 : budget_percent);
+	scanner_interval = interval_ms;
+	scanner_running = 1;
+	if (pthread_create(&scanner, NULL, scannerThread, NULL) != 0) {
+		scanner_running = 0;
+		pthread_mutex_unlock(&integrity_lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&integrity_lock);
+	return 0;
+}
+
+int integrityStop()
+{
+	pthread_mutex_lock(&integrity_lock);
+	if (!scanner_running) {
+		pthread_mutex_unlock(&integrity_lock);
+		return -1;
+	}
+	scanner_running = 0;
+	pthread_mutex_unlock(&integrity_lock);
+
+	pthread_join(scanner, NULL);
+	return 0;
+}
+
+void getIntegrityStats(struct integrityStats *out)
+{
+	pthread_mutex_lock(&integrity_lock);
+	memcpy(out, &stats, sizeof(struct integrityStats));
+	pthread_mutex_unlock(&integrity_lock);
+}
+
+void dumpIntegrityStats()
+{
+	struct integrityStats stats;
+
+	getIntegrityStats(&stats);
+	LOGD("integrity: %u regions, %u pages, %llu passes (last %u ms), %llu pages checked, %llu skipped, %llu ranges modified, %llu ms cpu",
+		stats.regions, stats.pages, (unsigned long long) stats.passes, stats.last_pass_ms,
+		(unsigned long long) stats.checked, (unsigned long long) stats.skipped,
+		(unsigned long long) stats.modified, (unsigned long long) (stats.cpu_ns / 1000000));
+}
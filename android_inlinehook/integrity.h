@@ -0,0 +1,68 @@
+#ifndef _INTEGRITY_H
+#define _INTEGRITY_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Compares the executable file mappings of the process with the files they
+ * were mapped from, to find code patched in memory (inline hooks like the
+ * ones of this library, breakpoints, ...). /proc/self/maps is read once by
+ * integrityInit(), call it again after libraries were loaded or unloaded.
+ * Stop the background scan before unloading a library it covers.
+ *
+ * Every page is hashed (XXH32) and compared with the hash of the same page
+ * on disk, which is computed once and kept. Only a page whose hash differs
+ * is read back from the file and diffed, so the reported ranges cover the
+ * changed bytes. Pages that are not resident are skipped: a clean page that
+ * was dropped is read back from the file and cannot differ, and scanning
+ * does not pull the code of every library into memory. Pages in swap (zram)
+ * are private copies and are checked, /proc/self/pagemap tells them apart.
+ *
+ * Ranges we change ourselves (code decrypted on load, our own hooks) are
+ * excluded with integrityExclude(). Libraries with text relocations differ
+ * from their files by design and should be excluded as a whole.
+ */
+
+struct integrityRange {
+	uintptr_t start;
+	uintptr_t end;
+	const char *path;		// valid until the callback returns
+	uint64_t offset;		// file offset of start
+};
+
+typedef void (*integrityCallback)(const struct integrityRange *range, void *arg);
+
+struct integrityStats {
+	uint32_t regions;		// executable file mappings
+	uint32_t pages;
+	uint64_t passes;		// complete scans of all regions
+	uint64_t checked;		// pages hashed and compared
+	uint64_t skipped;		// pages not resident or excluded
+	uint64_t modified;		// ranges reported
+	uint64_t cpu_ns;		// time spent by the background thread
+	uint32_t last_pass_ms;
+};
+
+int integrityInit(const char *so_name);		// NULL takes every executable file mapping
+int integrityExclude(uintptr_t start, uintptr_t end);
+int integrityCheck(integrityCallback callback, void *arg);	// one pass on the calling thread, returns the ranges found
+
+/*
+ * Scans again and again on an idle-priority thread. budget_percent limits
+ * the CPU time of the thread, interval_ms is the pause between two passes.
+ * The callback runs on that thread, outside of any lock.
+ */
+int integrityStart(integrityCallback callback, void *arg, uint32_t budget_percent, uint32_t interval_ms);
+int integrityStop();
+void getIntegrityStats(struct integrityStats *stats);
+void dumpIntegrityStats();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
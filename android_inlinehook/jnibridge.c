@@ -0,0 +1,303 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "inlineHook.h"
+#include "jnibridge.h"
+
+#define ENABLE_DEBUG
+#include "log.h"
+
+#define HANDLER_SIGNATURE	"(ILjava/nio/ByteBuffer;)V"
+
+struct javaHandler {
+	jclass clazz;		// global reference
+	jmethodID method;
+	jint id;
+	size_t size;		// bytes of struct inlineHookRegs the stub saved
+};
+
+// everything a thread needs for an upcall, created on its first hit
+struct threadState {
+	JNIEnv *env;
+	jobject buffer;		// global reference to a direct ByteBuffer over regs
+	struct inlineHookRegs regs;
+	int attached;
+	int busy;
+};
+
+static JavaVM *java_vm;
+static pthread_key_t state_key;
+static pthread_once_t state_once = PTHREAD_ONCE_INIT;
+
+static jmethodID byte_buffer_order;
+static jobject native_order;	// global reference to ByteOrder.nativeOrder()
+
+static void freeThreadState(void *data)
+{
+	struct threadState *state = (struct threadState *) data;
+	JNIEnv *env;
+
+	// the key is cleared before destructors run, GetEnv still works until we detach
+	if ((*java_vm)->GetEnv(java_vm, (void **) &env, JNI_VERSION_1_6) == JNI_OK) {
+		(*env)->DeleteGlobalRef(env, state->buffer);
+	}
+	if (state->attached) {
+		(*java_vm)->DetachCurrentThread(java_vm);
+	}
+	free(state);
+}
+
+static void createStateKey()
+{
+	pthread_key_create(&state_key, freeThreadState);
+}
+
+int jniBridgeInit(JavaVM *vm)
+{
+	JNIEnv *env;
+	jclass byte_order;
+	jclass byte_buffer;
+	jmethodID native_order_method;
+	jobject order;
+	int ret;
+
+	if (vm == NULL || (*vm)->GetEnv(vm, (void **) &env, JNI_VERSION_1_6) != JNI_OK) {
+		LOGD("illegal parameter in jniBridgeInit()");
+		return -1;
+	}
+	if (java_vm != NULL) {
+		return 0;
+	}
+
+	// every step stops at the first pending exception, JNI allows no other call with one
+	ret = -1;
+	byte_buffer = NULL;
+	order = NULL;
+	byte_order = (*env)->FindClass(env, "java/nio/ByteOrder");
+	if (byte_order == NULL) {
+		goto _out;
+	}
+	native_order_method = (*env)->GetStaticMethodID(env, byte_order, "nativeOrder", "()Ljava/nio/ByteOrder;");
+	if (native_order_method == NULL) {
+		goto _out;
+	}
+	order = (*env)->CallStaticObjectMethod(env, byte_order, native_order_method);
+	if ((*env)->ExceptionCheck(env) || order == NULL) {
+		goto _out;
+	}
+	byte_buffer = (*env)->FindClass(env, "java/nio/ByteBuffer");
+	if (byte_buffer == NULL) {
+		goto _out;
+	}
+	byte_buffer_order = (*env)->GetMethodID(env, byte_buffer, "order", "(Ljava/nio/ByteOrder;)Ljava/nio/ByteBuffer;");
+	if (byte_buffer_order == NULL) {
+		goto _out;
+	}
+	native_order = (*env)->NewGlobalRef(env, order);
+	if (native_order == NULL) {
+		goto _out;
+	}
+
+	pthread_once(&state_once, createStateKey);
+	java_vm = vm;
+	ret = 0;
+
+_out:
+	if (ret == -1) {
+		(*env)->ExceptionClear(env);
+		LOGD("can not resolve java.nio.ByteOrder");
+	}
+	if (order != NULL) {
+		(*env)->DeleteLocalRef(env, order);
+	}
+	if (byte_buffer != NULL) {
+		(*env)->DeleteLocalRef(env, byte_buffer);
+	}
+	if (byte_order != NULL) {
+		(*env)->DeleteLocalRef(env, byte_order);
+	}
+	return ret;
+}
+
+static struct threadState *getThreadState()
+{
+	struct threadState *state;
+	JavaVMAttachArgs args;
+	jobject buffer;
+	jint ret;
+
+	state = (struct threadState *) pthread_getspecific(state_key);
+	if (state != NULL) {
+		return state;
+	}
+
+	state = (struct threadState *) calloc(1, sizeof(struct threadState));
+	if (state == NULL) {
+		return NULL;
+	}
+
+	ret = (*java_vm)->GetEnv(java_vm, (void **) &state->env, JNI_VERSION_1_6);
+	if (ret == JNI_EDETACHED) {
+		args.version = JNI_VERSION_1_6;
+		args.name = "inlinehook";
+		args.group = NULL;
+		ret = (*java_vm)->AttachCurrentThreadAsDaemon(java_vm, (void *) &state->env, &args);
+		state->attached = ret == JNI_OK;
+	}
+	if (ret != JNI_OK) {
+		free(state);
+		return NULL;
+	}
+
+	buffer = (*state->env)->NewDirectByteBuffer(state->env, &state->regs, sizeof(state->regs));
+	if (buffer != NULL) {
+		(*state->env)->DeleteLocalRef(state->env, (*state->env)->CallObjectMethod(state->env, buffer, byte_buffer_order, native_order));
+		state->buffer = (*state->env)->NewGlobalRef(state->env, buffer);
+		(*state->env)->DeleteLocalRef(state->env, buffer);
+	}
+	if (state->buffer == NULL || (*state->env)->ExceptionCheck(state->env)) {
+		(*state->env)->ExceptionClear(state->env);
+		if (state->attached) {
+			(*java_vm)->DetachCurrentThread(java_vm);
+		}
+		free(state);
+		return NULL;
+	}
+
+	pthread_setspecific(state_key, state);
+	return state;
+}
+
+// -1 if the handler was skipped or threw, regs are left as they were then
+static int upcall(struct inlineHookRegs *regs, struct javaHandler *handler)
+{
+	struct threadState *state;
+	JNIEnv *env;
+	int ret;
+
+	state = getThreadState();
+	if (state == NULL || state->busy) {
+		return -1;
+	}
+	env = state->env;
+
+	state->busy = 1;
+	memcpy(&state->regs, regs, handler->size);
+	(*env)->CallStaticVoidMethod(env, handler->clazz, handler->method, handler->id, state->buffer);
+	if ((*env)->ExceptionCheck(env)) {
+		(*env)->ExceptionDescribe(env);
+		(*env)->ExceptionClear(env);
+		ret = -1;
+	}
+	else {
+		memcpy(regs, &state->regs, handler->size);
+		ret = 0;
+	}
+	state->busy = 0;
+	return ret;
+}
+
+#if defined(__arm__)
+static void javaCallback(struct inlineHookRegs *regs, void *arg)
+{
+	upcall(regs, (struct javaHandler *) arg);
+}
+#endif
+
+static struct javaHandler *createHandler(JNIEnv *env, jclass clazz, const char *method_name, int id, int flags)
+{
+	struct javaHandler *handler;
+	jmethodID method;
+
+	if (java_vm == NULL || env == NULL || clazz == NULL || method_name == NULL) {
+		LOGD("illegal parameter, jniBridgeInit() has to be called first");
+		return NULL;
+	}
+
+	method = (*env)->GetStaticMethodID(env, clazz, method_name, HANDLER_SIGNATURE);
+	if (method == NULL) {
+		(*env)->ExceptionClear(env);
+		LOGD("no static void %s(int, ByteBuffer)", method_name);
+		return NULL;
+	}
+
+	handler = (struct javaHandler *) malloc(sizeof(struct javaHandler));
+	if (handler == NULL) {
+		return NULL;
+	}
+	handler->clazz = (jclass) (*env)->NewGlobalRef(env, clazz);
+	if (handler->clazz == NULL) {
+		free(handler);
+		return NULL;
+	}
+	handler->method = method;
+	handler->id = id;
+	handler->size = (flags & INLINE_HOOK_REGS_VFP) ? sizeof(struct inlineHookRegs) : offsetof(struct inlineHookRegs, d);
+	return handler;
+}
+
+static void freeHandler(JNIEnv *env, struct javaHandler *handler)
+{
+	(*env)->DeleteGlobalRef(env, handler->clazz);
+	free(handler);
+}
+
+int callInlineHookJava(JNIEnv *env, struct inlineHookRegs *regs, jclass clazz, const char *method_name, int id, int flags)
+{
+	struct javaHandler *handler;
+	int ret;
+
+	if (regs == NULL) {
+		LOGD("illegal parameter in callInlineHookJava()");
+		return -1;
+	}
+	handler = createHandler(env, clazz, method_name, id, flags);
+	if (handler == NULL) {
+		return -1;
+	}
+	ret = upcall(regs, handler);
+	freeHandler(env, handler);
+	return ret;
+}
+
+int registerInlineHookJavaByName(JNIEnv *env, const char *function_name, const char *so_name, uint32_t offset, jclass clazz, const char *method_name, int id, int flags)
+{
+#if defined(__arm__)
+	struct javaHandler *handler;
+
+	handler = createHandler(env, clazz, method_name, id, flags);
+	if (handler == NULL) {
+		return -1;
+	}
+	if (registerInlineHookCallbackByName(function_name, so_name, offset, javaCallback, handler, flags) == -1) {
+		freeHandler(env, handler);
+		return -1;
+	}
+	return 0;
+#else
+	LOGD("inline hooks are only available on arm");
+	return -1;
+#endif
+}
+
+int registerInlineHookJavaByAddr(JNIEnv *env, uint32_t target_addr, jclass clazz, const char *method_name, int id, int flags)
+{
+#if defined(__arm__)
+	struct javaHandler *handler;
+
+	handler = createHandler(env, clazz, method_name, id, flags);
+	if (handler == NULL) {
+		return -1;
+	}
+	if (registerInlineHookCallbackByAddr(target_addr, javaCallback, handler, flags) == -1) {
+		freeHandler(env, handler);
+		return -1;
+	}
+	return 0;
+#else
+	LOGD("inline hooks are only available on arm");
+	return -1;
+#endif
+}
@@ -0,0 +1,42 @@
+#ifndef _JNIBRIDGE_H
+#define _JNIBRIDGE_H
+
+#include <jni.h>
+#include <stdint.h>
+
+#include "inlineHook.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Callback hooks handled by a static Java method
+ *
+ *   static void onHook(int id, java.nio.ByteBuffer regs)
+ *
+ * regs is a direct, native ordered ByteBuffer over a struct inlineHookRegs
+ * (r0 at 0, r1 at 4, ..., sp at 52, lr at 56, cpsr at 60, d0 at 64 with
+ * INLINE_HOOK_REGS_VFP), values put into it are written back before the
+ * original code continues. The buffer belongs to the calling thread and is
+ * reused for every hit, it must not be kept after onHook() returns.
+ *
+ * clazz and the method are resolved once at registration, so registration
+ * has to run on a thread that can see the class (e.g. from JNI_OnLoad).
+ * Hits on threads unknown to the VM attach them as daemons once, hits from
+ * inside the handler itself skip Java and run the original code.
+ *
+ * callInlineHookJava() runs a handler on regs once, the way a hit would,
+ * without installing a hook. It works on any VM, the register functions
+ * only on ARM. It returns -1 if the handler threw or was skipped.
+ */
+int jniBridgeInit(JavaVM *vm);
+int callInlineHookJava(JNIEnv *env, struct inlineHookRegs *regs, jclass clazz, const char *method_name, int id, int flags);
+int registerInlineHookJavaByName(JNIEnv *env, const char *function_name, const char *so_name, uint32_t offset, jclass clazz, const char *method_name, int id, int flags);
+int registerInlineHookJavaByAddr(JNIEnv *env, uint32_t target_addr, jclass clazz, const char *method_name, int id, int flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
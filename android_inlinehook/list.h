@@ -17,17 +17,17 @@ struct list_head {
 #define list_for_each_safe(pos, n, head) \
 	for (pos = (head)->next, n = pos->next; pos != (head); pos = n, n = pos->next)
 
-static inline void _list_add(struct list_head *new, struct list_head *prev, struct list_head *next)
+static inline void _list_add(struct list_head *entry, struct list_head *prev, struct list_head *next)
 {
-	next->prev = new;
-	new->next = next;
-	new->prev = prev;
-	prev->next = new;
+	next->prev = entry;
+	entry->next = next;
+	entry->prev = prev;
+	prev->next = entry;
 }
 
-static inline void list_add(struct list_head *new, struct list_head *head)
+static inline void list_add(struct list_head *entry, struct list_head *head)
 {
-	_list_add(new, head, head->next);
+	_list_add(entry, head, head->next);
 }
 
 static inline void _list_del(struct list_head *prev, struct list_head *next)
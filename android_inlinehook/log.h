@@ -1,7 +1,7 @@
 #ifndef _LOG_H
 #define _LOG_H
 
-#ifdef ENABLE_DEBUG
+#if defined(ENABLE_DEBUG) && defined(__ANDROID__)
 #include <android/log.h>
 #define LOG_TAG "ele7enxxh_inlineHook"
 #define LOGD(fmt, args...) __android_log_print(ANDROID_LOG_DEBUG,LOG_TAG, fmt, ##args)
@@ -9,4 +9,4 @@
 #define LOGD(fmt,args...)
 #endif
 
-#endif
\ No newline at end of file
+#endif
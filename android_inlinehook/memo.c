@@ -0,0 +1,288 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "list.h"
+#include "memo.h"
+
+#define ENABLE_DEBUG
+#include "log.h"
+
+#define MEMO_SHARDS		16	// power of two, the top hash bits pick the shard
+#define MEMO_MAX_ARGS	4	// r0-r3, stack arguments are not part of the key
+
+typedef uint64_t (*memoFunction)(uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3);
+
+struct memoEntry {
+	struct list_head hash;
+	struct list_head lru;
+	uint32_t hashv;
+	uint64_t expires;
+	uint64_t value;
+	uint32_t args[MEMO_MAX_ARGS];
+};
+
+struct memoShard {
+	pthread_mutex_t lock;
+	struct list_head *buckets;
+	uint32_t nbucket;
+	struct list_head lru;		// most recently used first
+	uint32_t count;
+	uint32_t max;				// its part of max_entries, may be 0
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t expirations;
+} __attribute__((aligned(64)));
+
+struct memoCache {
+	struct memoShard shards[MEMO_SHARDS];
+	uint32_t *trampoline;
+	int nargs;
+	uint32_t ttl_ms;
+};
+
+static uint64_t nowMs()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t hashArgs(const uint32_t *args, int nargs)
+{
+	uint32_t h = 0x9E3779B9;
+	int i;
+
+	for (i = 0; i < nargs; ++i) {
+		h ^= args[i];
+		h *= 0x85EBCA6B;
+		h ^= h >> 13;
+	}
+	h *= 0xC2B2AE35;
+	h ^= h >> 16;
+	return h;
+}
+
+struct memoCache *memoCreate(int nargs, uint32_t max_entries, uint32_t ttl_ms)
+{
+	struct memoCache *memo;
+	uint32_t nbucket;
+	int i;
+	uint32_t j;
+
+	if (nargs < 0 || nargs > MEMO_MAX_ARGS || max_entries == 0) {
+		return NULL;
+	}
+
+	memo = (struct memoCache *) calloc(1, sizeof(struct memoCache));
+	if (memo == NULL) {
+		return NULL;
+	}
+	memo->nargs = nargs;
+	memo->ttl_ms = ttl_ms;
+
+	// keep the load factor of a full shard at or below 1
+	nbucket = 1;
+	while (nbucket < (max_entries + MEMO_SHARDS - 1) / MEMO_SHARDS) {
+		nbucket <<= 1;
+	}
+
+	for (i = 0; i < MEMO_SHARDS; ++i) {
+		struct memoShard *shard = &memo->shards[i];
+
+		pthread_mutex_init(&shard->lock, NULL);
+		INIT_LIST_HEAD(&shard->lru);
+		// max_entries in total, the first max_entries % MEMO_SHARDS shards hold one more
+		shard->max = max_entries / MEMO_SHARDS + ((uint32_t) i < max_entries % MEMO_SHARDS);
+		shard->nbucket = nbucket;
+		shard->buckets = (struct list_head *) malloc(nbucket * sizeof(struct list_head));
+		if (shard->buckets == NULL) {
+			memoDestroy(memo);
+			return NULL;
+		}
+		for (j = 0; j < nbucket; ++j) {
+			INIT_LIST_HEAD(&shard->buckets[j]);
+		}
+	}
+
+	return memo;
+}
+
+void memoDestroy(struct memoCache *memo)
+{
+	struct list_head *pos;
+	struct list_head *node;
+	int i;
+
+	for (i = 0; i < MEMO_SHARDS; ++i) {
+		struct memoShard *shard = &memo->shards[i];
+
+		if (shard->buckets == NULL) {
+			continue;
+		}
+		list_for_each_safe(pos, node, &shard->lru) {
+			free(list_entry(pos, struct memoEntry, lru));
+		}
+		free(shard->buckets);
+		pthread_mutex_destroy(&shard->lock);
+	}
+	free(memo);
+}
+
+void memoFlush(struct memoCache *memo)
+{
+	struct list_head *pos;
+	struct list_head *node;
+	struct memoShard *shard;
+	uint32_t j;
+	int i;
+
+	for (i = 0; i < MEMO_SHARDS; ++i) {
+		shard = &memo->shards[i];
+
+		pthread_mutex_lock(&shard->lock);
+		list_for_each_safe(pos, node, &shard->lru) {
+			free(list_entry(pos, struct memoEntry, lru));
+		}
+		INIT_LIST_HEAD(&shard->lru);
+		for (j = 0; j < shard->nbucket; ++j) {
+			INIT_LIST_HEAD(&shard->buckets[j]);
+		}
+		shard->count = 0;
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+void memoLock(struct memoCache *memo)
+{
+	int i;
+
+	for (i = 0; i < MEMO_SHARDS; ++i) {
+		pthread_mutex_lock(&memo->shards[i].lock);
+	}
+}
+
+void memoUnlock(struct memoCache *memo)
+{
+	int i;
+
+	for (i = MEMO_SHARDS - 1; i >= 0; --i) {
+		pthread_mutex_unlock(&memo->shards[i].lock);
+	}
+}
+
+uint32_t **memoTrampoline(struct memoCache *memo)
+{
+	return &memo->trampoline;
+}
+
+static void removeEntry(struct memoShard *shard, struct memoEntry *entry)
+{
+	list_del(&entry->hash);
+	list_del(&entry->lru);
+	shard->count--;
+	free(entry);
+}
+
+static struct memoEntry *findEntry(struct memoCache *memo, struct memoShard *shard, const uint32_t *args, uint32_t hashv)
+{
+	struct list_head *bucket = &shard->buckets[hashv & (shard->nbucket - 1)];
+	struct list_head *pos;
+
+	list_for_each(pos, bucket) {
+		struct memoEntry *entry = list_entry(pos, struct memoEntry, hash);
+
+		if (entry->hashv == hashv && memcmp(entry->args, args, memo->nargs * sizeof(uint32_t)) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+uint64_t memoCall(uint32_t *args, struct memoCache *memo)
+{
+	struct memoShard *shard;
+	struct memoEntry *entry;
+	uint32_t hashv;
+	uint64_t now;
+	uint64_t value;
+
+	hashv = hashArgs(args, memo->nargs);
+	shard = &memo->shards[hashv >> 28];
+	now = memo->ttl_ms ? nowMs() : 0;
+
+	pthread_mutex_lock(&shard->lock);
+	entry = findEntry(memo, shard, args, hashv);
+	if (entry != NULL && memo->ttl_ms && entry->expires <= now) {
+		removeEntry(shard, entry);
+		shard->expirations++;
+		entry = NULL;
+	}
+	if (entry != NULL) {
+		list_del(&entry->lru);
+		list_add(&entry->lru, &shard->lru);
+		shard->hits++;
+		value = entry->value;
+		pthread_mutex_unlock(&shard->lock);
+		return value;
+	}
+	shard->misses++;
+	pthread_mutex_unlock(&shard->lock);
+
+	// the lock is not held across the call, the original may be slow or recurse
+	value = ((memoFunction) memo->trampoline)(args[0], args[1], args[2], args[3]);
+
+	pthread_mutex_lock(&shard->lock);
+	entry = findEntry(memo, shard, args, hashv);
+	if (entry == NULL) {
+		if (shard->max == 0) {
+			pthread_mutex_unlock(&shard->lock);
+			return value;
+		}
+		if (shard->count >= shard->max) {
+			removeEntry(shard, list_entry(shard->lru.prev, struct memoEntry, lru));
+			shard->evictions++;
+		}
+		entry = (struct memoEntry *) malloc(sizeof(struct memoEntry));
+		if (entry == NULL) {
+			pthread_mutex_unlock(&shard->lock);
+			return value;
+		}
+		memcpy(entry->args, args, sizeof(entry->args));
+		entry->hashv = hashv;
+		list_add(&entry->hash, &shard->buckets[hashv & (shard->nbucket - 1)]);
+		shard->count++;
+	}
+	else {
+		list_del(&entry->lru);	// another thread filled it in the meantime
+	}
+	list_add(&entry->lru, &shard->lru);
+	entry->value = value;
+	entry->expires = now + memo->ttl_ms;
+	pthread_mutex_unlock(&shard->lock);
+
+	return value;
+}
+
+void memoGetStats(struct memoCache *memo, struct inlineHookMemoStats *stats)
+{
+	int i;
+
+	memset(stats, 0, sizeof(struct inlineHookMemoStats));
+	stats->memory = sizeof(struct memoCache);
+	for (i = 0; i < MEMO_SHARDS; ++i) {
+		struct memoShard *shard = &memo->shards[i];
+
+		pthread_mutex_lock(&shard->lock);
+		stats->hits += shard->hits;
+		stats->misses += shard->misses;
+		stats->evictions += shard->evictions;
+		stats->expirations += shard->expirations;
+		stats->entries += shard->count;
+		stats->memory += shard->nbucket * sizeof(struct list_head) + shard->count * sizeof(struct memoEntry);
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
@@ -0,0 +1,26 @@
+#ifndef _MEMO_H
+#define _MEMO_H
+
+#include <stdint.h>
+
+#include "inlineHook.h"
+
+struct memoCache;
+
+struct memoCache *memoCreate(int nargs, uint32_t max_entries, uint32_t ttl_ms);
+void memoDestroy(struct memoCache *memo);
+void memoFlush(struct memoCache *memo);	// drops the entries, memoCall() may still run
+void memoGetStats(struct memoCache *memo, struct inlineHookMemoStats *stats);
+// every shard, held across fork() so the child never inherits a locked one
+void memoLock(struct memoCache *memo);
+void memoUnlock(struct memoCache *memo);
+
+/*
+ * Entry point of the memo stub: args points at the saved r0-r3 and the
+ * result is returned in r0:r1. Misses call the original function through
+ * memo->trampoline, which inlineHook() fills in through proto_addr.
+ */
+uint64_t memoCall(uint32_t *args, struct memoCache *memo);
+uint32_t **memoTrampoline(struct memoCache *memo);
+
+#endif
@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <elf.h>
+
+#include "list.h"
+#include "inlineHook.h"
+
+#define ENABLE_DEBUG
+#include "log.h"
+
+#ifndef AT_HWCAP2
+#define AT_HWCAP2	26
+#endif
+
+// arch/arm/include/uapi/asm/hwcap.h
+#define ARM_HWCAP_NEON		(1 << 12)
+#define ARM_HWCAP_VFPv4		(1 << 16)
+#define ARM_HWCAP_IDIVA		(1 << 17)
+#define ARM_HWCAP2_AES		(1 << 0)
+#define ARM_HWCAP2_PMULL	(1 << 1)
+#define ARM_HWCAP2_SHA1		(1 << 2)
+#define ARM_HWCAP2_SHA2		(1 << 3)
+#define ARM_HWCAP2_CRC32	(1 << 4)
+
+// bionic only has getauxval() since API 18, older systems go through /proc/self/auxv
+extern unsigned long getauxval(unsigned long type) __attribute__((weak));
+
+struct cpuOverride {
+	struct list_head list;
+	char so_name[128];
+	char function_name[128];
+	uint32_t target_addr;
+	uint32_t features;
+	uint32_t new_addr;
+	int applied;
+};
+
+static struct list_head overrides = {&overrides, &overrides};
+static pthread_mutex_t overrides_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t features_once = PTHREAD_ONCE_INIT;
+static uint32_t features;
+
+static void readAuxv(unsigned long *hwcap, unsigned long *hwcap2)
+{
+	Elf32_auxv_t auxv;
+	int fd;
+
+	if (getauxval != NULL) {
+		*hwcap = getauxval(AT_HWCAP);
+		*hwcap2 = getauxval(AT_HWCAP2);
+		return;
+	}
+
+	fd = open("/proc/self/auxv", O_RDONLY);
+	if (fd == -1) {
+		return;
+	}
+	while (read(fd, &auxv, sizeof(auxv)) == sizeof(auxv) && auxv.a_type != AT_NULL) {
+		if (auxv.a_type == AT_HWCAP) {
+			*hwcap = auxv.a_un.a_val;
+		}
+		else if (auxv.a_type == AT_HWCAP2) {
+			*hwcap2 = auxv.a_un.a_val;
+		}
+	}
+	close(fd);
+}
+
+static void initCpuFeatures()
+{
+	unsigned long hwcap = 0;
+	unsigned long hwcap2 = 0;
+
+	readAuxv(&hwcap, &hwcap2);
+
+	features = 0;
+	if (hwcap & ARM_HWCAP_NEON) {
+		features |= INLINE_HOOK_CPU_NEON;
+	}
+	if (hwcap & ARM_HWCAP_VFPv4) {
+		features |= INLINE_HOOK_CPU_VFPV4;
+	}
+	if (hwcap & ARM_HWCAP_IDIVA) {
+		features |= INLINE_HOOK_CPU_IDIV;
+	}
+	if (hwcap2 & ARM_HWCAP2_AES) {
+		features |= INLINE_HOOK_CPU_AES;
+	}
+	if (hwcap2 & ARM_HWCAP2_PMULL) {
+		features |= INLINE_HOOK_CPU_PMULL;
+	}
+	if (hwcap2 & ARM_HWCAP2_SHA1) {
+		features |= INLINE_HOOK_CPU_SHA1;
+	}
+	if (hwcap2 & ARM_HWCAP2_SHA2) {
+		features |= INLINE_HOOK_CPU_SHA2;
+	}
+	if (hwcap2 & ARM_HWCAP2_CRC32) {
+		features |= INLINE_HOOK_CPU_CRC32;
+	}
+
+	LOGD("cpu features: 0x%x (hwcap 0x%lx, hwcap2 0x%lx)", features, hwcap, hwcap2);
+}
+
+uint32_t getCpuFeatures()
+{
+	pthread_once(&features_once, initCpuFeatures);
+	return features;
+}
+
+static int addOverride(const char *function_name, const char *so_name, uint32_t target_addr, uint32_t required, uint32_t new_addr)
+{
+	struct cpuOverride *entry;
+
+	entry = (struct cpuOverride *) calloc(1, sizeof(struct cpuOverride));
+	if (entry == NULL) {
+		return -1;
+	}
+	if (function_name != NULL) {
+		strncpy(entry->function_name, function_name, sizeof(entry->function_name) - 1);
+		strncpy(entry->so_name, so_name, sizeof(entry->so_name) - 1);
+	}
+	entry->target_addr = target_addr;
+	entry->features = required;
+	entry->new_addr = new_addr;
+
+	pthread_mutex_lock(&overrides_lock);
+	list_add(&entry->list, &overrides);
+	pthread_mutex_unlock(&overrides_lock);
+
+	return 0;
+}
+
+int registerCpuOverrideByName(const char *function_name, const char *so_name, uint32_t required, uint32_t new_addr)
+{
+	if (function_name == NULL || so_name == NULL || !new_addr) {
+		LOGD("illegal parameter in registerCpuOverrideByName()");
+		return -1;
+	}
+	return addOverride(function_name, so_name, 0, required, new_addr);
+}
+
+int registerCpuOverrideByAddr(uint32_t target_addr, uint32_t required, uint32_t new_addr)
+{
+	if (!target_addr || !new_addr) {
+		LOGD("illegal parameter");
+		return -1;
+	}
+	return addOverride(NULL, NULL, target_addr, required, new_addr);
+}
+
+static int sameTarget(struct cpuOverride *a, struct cpuOverride *b)
+{
+	if (a->target_addr || b->target_addr) {
+		return a->target_addr == b->target_addr;
+	}
+	return strcmp(a->function_name, b->function_name) == 0 && strcmp(a->so_name, b->so_name) == 0;
+}
+
+static int countBits(uint32_t x)
+{
+	int n = 0;
+
+	for (; x; x &= x - 1) {
+		++n;
+	}
+	return n;
+}
+
+/*
+ * For every target the usable variant that needs the most features wins,
+ * variants of the same weight are taken in registration order. Targets
+ * without a usable variant stay untouched.
+ */
+int applyCpuOverrides()
+{
+	struct list_head *pos;
+	struct list_head *other;
+	struct cpuOverride *entry;
+	struct cpuOverride *best;
+	uint32_t cpu;
+	int count;
+	int ret;
+
+	cpu = getCpuFeatures();
+	count = 0;
+
+	pthread_mutex_lock(&overrides_lock);
+	// list_add() prepends, walking backwards visits the variants in registration order
+	for (pos = overrides.prev; pos != &overrides; pos = pos->prev) {
+		entry = list_entry(pos, struct cpuOverride, list);
+		if (entry->applied) {
+			continue;
+		}
+
+		best = NULL;
+		for (other = pos; other != &overrides; other = other->prev) {
+			struct cpuOverride *variant = list_entry(other, struct cpuOverride, list);
+
+			if (!sameTarget(entry, variant)) {
+				continue;
+			}
+			variant->applied = 1;
+			if ((variant->features & cpu) != variant->features) {
+				continue;
+			}
+			if (best == NULL || countBits(variant->features) > countBits(best->features)) {
+				best = variant;
+			}
+		}
+		if (best == NULL) {
+			continue;
+		}
+
+		if (best->target_addr) {
+			ret = registerInlineHookByAddr(best->target_addr, best->new_addr, NULL);
+		}
+		else {
+			ret = registerInlineHookByName(best->function_name, best->so_name, 0, best->new_addr, NULL);
+		}
+		if (ret == 0) {
+			LOGD("override %s 0x%x with 0x%x (features 0x%x)", best->function_name, best->target_addr, best->new_addr, best->features);
+			++count;
+		}
+	}
+	pthread_mutex_unlock(&overrides_lock);
+
+	return count;
+}
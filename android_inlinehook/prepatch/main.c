@@ -0,0 +1,442 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../relocate.h"
+
+/*
+ * Offline pre-patcher: bakes inline hooks into an ARM .so at build time.
+ *
+ *   prepatch <in.so> <manifest> <out.so>
+ *
+ * Every manifest line is "target[+offset] handler [orig]", '#' starts a comment.
+ * All three are symbols of the same library. The entry of target is replaced
+ * with a branch to handler, the overwritten instructions are relocated into a
+ * new R-X segment, and orig (a dummy function of at least 4 bytes) is
+ * overwritten with a branch to that trampoline so the handler can call it.
+ * Everything is PC-relative, no dynamic relocation is added and nothing has to
+ * run at load time.
+ */
+
+#define PAGE_SIZE			4096
+#define PAGE_END(x)			(((x) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+#define ALIGN8(x)			(((x) + 7) & ~7)
+
+#define MAX_HOOKS			1024
+#define TRAMPOLINE_SIZE		192	// relocated instructions + veneer, worst case
+
+struct hookEntry {
+	char target[128];
+	uint32_t offset;
+	char handler[128];
+	char orig[128];
+};
+
+static char *readFile(const char *path, uint32_t *size)
+{
+	struct stat st;
+	char *buf;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("open %s failed\n", path);
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	buf = (char *) malloc(st.st_size);
+	if (buf == NULL || read(fd, buf, st.st_size) != st.st_size) {
+		printf("read %s failed\n", path);
+		free(buf);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	*size = st.st_size;
+	return buf;
+}
+
+static int parseManifest(const char *path, struct hookEntry *hooks, int max)
+{
+	FILE *fp;
+	char line[512];
+	int n;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		printf("open %s failed\n", path);
+		return -1;
+	}
+
+	n = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		char target[128];
+		char *plus;
+		int fields;
+
+		if (strchr(line, '#') != NULL) {
+			*strchr(line, '#') = '\0';
+		}
+
+		memset(&hooks[n], 0, sizeof(struct hookEntry));
+		fields = sscanf(line, "%127s %127s %127s", target, hooks[n].handler, hooks[n].orig);
+		if (fields <= 0) {
+			continue;
+		}
+		if (fields < 2) {
+			printf("bad manifest line: %s", line);
+			fclose(fp);
+			return -1;
+		}
+		if (n == max) {
+			printf("too many hooks\n");
+			fclose(fp);
+			return -1;
+		}
+
+		plus = strchr(target, '+');
+		if (plus != NULL) {
+			*plus = '\0';
+			hooks[n].offset = strtoul(plus + 1, NULL, 0);
+		}
+		strcpy(hooks[n].target, target);
+		++n;
+	}
+
+	fclose(fp);
+	return n;
+}
+
+static int64_t vaddrToOffset(char *image, uint32_t vaddr)
+{
+	Elf32_Ehdr *ehdr;
+	Elf32_Phdr *phdr;
+	int i;
+
+	ehdr = (Elf32_Ehdr *) image;
+	phdr = (Elf32_Phdr *) (image + ehdr->e_phoff);
+	for (i = 0; i < ehdr->e_phnum; ++i) {
+		if (phdr[i].p_type == PT_LOAD && vaddr >= phdr[i].p_vaddr && vaddr < phdr[i].p_vaddr + phdr[i].p_filesz) {
+			return vaddr - phdr[i].p_vaddr + phdr[i].p_offset;
+		}
+	}
+	return -1;
+}
+
+// .symtab first, so that static handlers of unstripped libraries are found too
+static Elf32_Sym *findSymbol(char *image, const char *symbol_name)
+{
+	Elf32_Ehdr *ehdr;
+	Elf32_Shdr *shdr;
+	int pass;
+	int i;
+
+	ehdr = (Elf32_Ehdr *) image;
+	shdr = (Elf32_Shdr *) (image + ehdr->e_shoff);
+	for (pass = 0; pass < 2; ++pass) {
+		for (i = 0; i < ehdr->e_shnum; ++i) {
+			Elf32_Sym *symtab;
+			const char *strtab;
+			size_t j;
+
+			if (shdr[i].sh_type != (pass == 0 ? SHT_SYMTAB : SHT_DYNSYM)) {
+				continue;
+			}
+			symtab = (Elf32_Sym *) (image + shdr[i].sh_offset);
+			strtab = image + shdr[shdr[i].sh_link].sh_offset;
+			for (j = 0; j < shdr[i].sh_size / sizeof(Elf32_Sym); ++j) {
+				if (symtab[j].st_shndx != SHN_UNDEF && ELF32_ST_TYPE(symtab[j].st_info) == STT_FUNC && strcmp(strtab + symtab[j].st_name, symbol_name) == 0) {
+					return &symtab[j];
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+static int writeBranch(char *image, uint32_t from, uint32_t to, int thumb)
+{
+	int64_t off;
+
+	off = vaddrToOffset(image, from);
+	if (off < 0) {
+		return -1;
+	}
+	if (thumb) {
+		return encodeThumbBranch(from, to, (uint16_t *) (image + off));
+	}
+	return encodeArmBranch(from, to, (uint32_t *) (image + off));
+}
+
+/*
+ * Bakes one hook. The trampoline lives at vaddr tramp_addr, host pointer tramp.
+ * Returns the number of bytes used in the new segment.
+ */
+static int bakeHook(char *image, struct hookEntry *hook, uint32_t tramp_addr, char *tramp)
+{
+	Elf32_Sym *sym;
+	uint32_t target_addr;
+	uint32_t handler_addr;
+	uint32_t entry_addr;
+	uint32_t orig[4];
+	int64_t off;
+	int thumb;
+	int used;
+	int length;
+	struct relocateContext ctx;
+
+	sym = findSymbol(image, hook->target);
+	if (sym == NULL) {
+		printf("can not find %s\n", hook->target);
+		return -1;
+	}
+	target_addr = sym->st_value + hook->offset;
+	thumb = target_addr & 1;
+	target_addr &= ~1;
+
+	sym = findSymbol(image, hook->handler);
+	if (sym == NULL) {
+		printf("can not find %s\n", hook->handler);
+		return -1;
+	}
+	handler_addr = sym->st_value;
+
+	off = vaddrToOffset(image, target_addr);
+	if (off < 0) {
+		printf("%s is not in a loaded segment\n", hook->target);
+		return -1;
+	}
+	memcpy(orig, image + off, sizeof(orig));
+
+	// a veneer is needed when the entry branch has to switch instruction sets
+	used = 0;
+	entry_addr = handler_addr;
+	if (thumb && !(handler_addr & 1)) {
+		((uint16_t *) tramp)[0] = 0x4778;	// BX PC
+		((uint16_t *) tramp)[1] = 0x46C0;	// NOP
+		if (encodeArmBranch(tramp_addr + 4, handler_addr, (uint32_t *) (tramp + 4)) == -1) {
+			printf("%s is out of range\n", hook->handler);
+			return -1;
+		}
+		entry_addr = tramp_addr | 1;
+		used = 8;
+	}
+	else if (!thumb && (handler_addr & 1)) {
+		if (hook->offset != 0) {
+			printf("%s: arm to thumb veneer clobbers ip, only allowed at function entry\n", hook->target);
+			return -1;
+		}
+		((uint32_t *) tramp)[0] = 0xE28FC001;	// ADD IP, PC, #1
+		((uint32_t *) tramp)[1] = 0xE12FFF1C;	// BX IP
+		if (encodeThumbBranch(tramp_addr + 8, handler_addr, (uint16_t *) (tramp + 8)) == -1) {
+			printf("%s is out of range\n", hook->handler);
+			return -1;
+		}
+		entry_addr = tramp_addr;
+		used = 12;
+	}
+
+	// relocate the 4 bytes that the entry branch overwrites
+	used = ALIGN8(used);
+	ctx.buffer = tramp + used;
+	ctx.buffer_addr = tramp_addr + used;
+	ctx.error = 0;
+	ctx.read_word = NULL;
+	ctx.read_arg = NULL;
+	if (thumb) {
+		length = relocateInstructionInThumb(&ctx, target_addr, (uint16_t *) orig, 4, (uint16_t *) (tramp + used));
+	}
+	else {
+		length = relocateInstructionInArm(&ctx, target_addr, orig, 4, (uint32_t *) (tramp + used));
+	}
+	if (length < 0) {
+		printf("%s: entry instructions can not be relocated\n", hook->target);
+		return -1;
+	}
+
+	if (writeBranch(image, target_addr, thumb ? (entry_addr | 1) : entry_addr, thumb) == -1) {
+		printf("%s: can not branch to %s\n", hook->target, hook->handler);
+		return -1;
+	}
+
+	if (hook->orig[0] != '\0') {
+		uint32_t orig_addr;
+
+		sym = findSymbol(image, hook->orig);
+		if (sym == NULL) {
+			printf("can not find %s\n", hook->orig);
+			return -1;
+		}
+		orig_addr = sym->st_value;
+		if (sym->st_size < 4 || (orig_addr & 1) != thumb) {
+			printf("%s must be a function of at least 4 bytes in the same instruction set as %s\n", hook->orig, hook->target);
+			return -1;
+		}
+		if (writeBranch(image, orig_addr & ~1, thumb ? (ctx.buffer_addr | 1) : ctx.buffer_addr, thumb) == -1) {
+			printf("%s: can not branch to trampoline\n", hook->orig);
+			return -1;
+		}
+	}
+
+	printf("hooked %s+0x%x -> %s, trampoline at 0x%x (%d bytes)\n", hook->target, hook->offset, hook->handler, ctx.buffer_addr, length);
+
+	return ALIGN8(used + length);
+}
+
+int main(int argc, char **argv)
+{
+	struct hookEntry *hooks;
+	char *image;
+	char *out;
+	uint32_t image_size;
+	uint32_t out_size;
+	uint32_t seg;
+	uint32_t cursor;
+	Elf32_Ehdr *ehdr;
+	Elf32_Phdr *old_phdr;
+	Elf32_Phdr *new_phdr;
+	int nhooks;
+	int has_phdr;
+	int last_load;
+	int phnum;
+	int i;
+	int j;
+	int fd;
+
+	if (argc < 4) {
+		printf("usage: %s <in.so> <manifest> <out.so>\n", argv[0]);
+		return -1;
+	}
+
+	out = NULL;
+	hooks = (struct hookEntry *) malloc(sizeof(struct hookEntry) * MAX_HOOKS);
+	image = readFile(argv[1], &image_size);
+	if (hooks == NULL || image == NULL) {
+		goto _error;
+	}
+
+	ehdr = (Elf32_Ehdr *) image;
+	if (image_size < sizeof(Elf32_Ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_ident[EI_CLASS] != ELFCLASS32 || ehdr->e_machine != EM_ARM) {
+		printf("%s is not an arm elf32 file\n", argv[1]);
+		goto _error;
+	}
+
+	nhooks = parseManifest(argv[2], hooks, MAX_HOOKS);
+	if (nhooks < 0) {
+		goto _error;
+	}
+
+	// the new segment starts past both the file and the memory image, vaddr == offset
+	old_phdr = (Elf32_Phdr *) (image + ehdr->e_phoff);
+	seg = image_size;
+	has_phdr = 0;
+	last_load = -1;
+	for (i = 0; i < ehdr->e_phnum; ++i) {
+		if (old_phdr[i].p_type == PT_LOAD) {
+			if (old_phdr[i].p_vaddr + old_phdr[i].p_memsz > seg) {
+				seg = old_phdr[i].p_vaddr + old_phdr[i].p_memsz;
+			}
+			last_load = i;
+		}
+		if (old_phdr[i].p_type == PT_PHDR) {
+			has_phdr = 1;
+		}
+	}
+	seg = PAGE_END(seg);
+	phnum = ehdr->e_phnum + 1 + !has_phdr;
+
+	out_size = seg + ALIGN8(phnum * sizeof(Elf32_Phdr)) + nhooks * TRAMPOLINE_SIZE;
+	out = (char *) calloc(1, out_size);
+	if (out == NULL) {
+		goto _error;
+	}
+	memcpy(out, image, image_size);
+
+	cursor = seg + ALIGN8(phnum * sizeof(Elf32_Phdr));
+	for (i = 0; i < nhooks; ++i) {
+		int used;
+
+		used = bakeHook(out, &hooks[i], cursor, out + cursor);
+		if (used < 0) {
+			goto _error;
+		}
+		cursor += used;
+	}
+	out_size = cursor;
+
+	// move the program headers into the new segment and add its PT_LOAD
+	ehdr = (Elf32_Ehdr *) out;
+	new_phdr = (Elf32_Phdr *) (out + seg);
+	j = 0;
+	if (!has_phdr) {
+		new_phdr[j].p_type = PT_PHDR;
+		new_phdr[j].p_flags = PF_R;
+		new_phdr[j].p_align = 4;
+		++j;
+	}
+	for (i = 0; i < ehdr->e_phnum; ++i) {
+		new_phdr[j++] = old_phdr[i];
+		if (i == last_load) {
+			new_phdr[j].p_type = PT_LOAD;
+			new_phdr[j].p_offset = seg;
+			new_phdr[j].p_vaddr = seg;
+			new_phdr[j].p_paddr = seg;
+			new_phdr[j].p_filesz = out_size - seg;
+			new_phdr[j].p_memsz = out_size - seg;
+			new_phdr[j].p_flags = PF_R | PF_X;
+			new_phdr[j].p_align = PAGE_SIZE;
+			++j;
+		}
+	}
+	for (i = 0; i < phnum; ++i) {
+		if (new_phdr[i].p_type == PT_PHDR) {
+			new_phdr[i].p_offset = seg;
+			new_phdr[i].p_vaddr = seg;
+			new_phdr[i].p_paddr = seg;
+			new_phdr[i].p_filesz = phnum * sizeof(Elf32_Phdr);
+			new_phdr[i].p_memsz = phnum * sizeof(Elf32_Phdr);
+		}
+	}
+	ehdr->e_phoff = seg;
+	ehdr->e_phnum = phnum;
+
+	fd = open(argv[3], O_WRONLY | O_CREAT | O_TRUNC, 0755);
+	if (fd < 0) {
+		printf("open %s failed\n", argv[3]);
+		goto _error;
+	}
+	if (write(fd, out, out_size) != out_size) {
+		printf("write %s failed\n", argv[3]);
+		close(fd);
+		goto _error;
+	}
+	close(fd);
+
+	printf("Complete, %d hooks\n", nhooks);
+	free(out);
+	free(image);
+	free(hooks);
+	return 0;
+
+_error:
+	if (out != NULL) {
+		free(out);
+	}
+	if (image != NULL) {
+		free(image);
+	}
+	if (hooks != NULL) {
+		free(hooks);
+	}
+	return -1;
+}
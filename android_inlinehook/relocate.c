@@ -0,0 +1,955 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#include "relocate.h"
+
+#define ENABLE_DEBUG
+#include "log.h"
+
+#define ALIGN_PC(pc)	(((pc)) & 0xFFFFFFFC)
+#define PIC(ctx)		((ctx) != NULL && (ctx)->buffer != NULL)
+
+// THUMB16
+#define B1_THUMB16		0	// B <label>
+#define B2_THUMB16		1	// B <label>
+#define BX_THUMB16		2	// BX PC
+#define ADD_THUMB16		3	// ADD <Rdn>, PC (Rd != PC, Rn != PC) 在对ADD进行修正时，采用了替换PC为Rr的方法，当Rd也为PC时，由于之前更改了Rr的值，可能会影响跳转后的正常功能。
+#define MOV_THUMB16		4	// MOV Rd, PC
+#define ADR_THUMB16		5	// ADR Rd, <label>
+#define LDR_THUMB16		6 	// LDR Rt, <label>
+// THUMB32
+#define BLX_THUMB32		7	// BLX <label>
+#define BL_THUMB32 		8	// BL <label>
+#define B1_THUMB32		9 	// B.W <label>
+#define B2_THUMB32		10 	// B.W <label>
+#define ADR1_THUMB32	11 	// ADR.W Rd, <label>
+#define ADR2_THUMB32	12 	// ADR.W Rd, <label>
+#define LDR_THUMB32		13	// LDR.W Rt, <label>
+#define TBB_THUMB32		14	// TBB [PC, Rm]
+#define TBH_THUMB32		15	// TBH [PC, Rm, LSL #1]
+// ARM
+#define BLX_ARM			16	// BLX <label>
+#define BL_ARM 			17	// BL <label>
+#define B_ARM			18	// B <label>
+#define BX_ARM			19 	// BX PC
+#define ADD_ARM			20	// ADD Rd, PC, Rm (Rd != PC, Rm != PC) 在对ADD进行修正时，采用了替换PC为Rr的方法，当Rd也为PC时，由于之前更改了Rr的值，可能会影响跳转后的正常功能;实际汇编中没有发现Rm也为PC的情况，故未做处理。
+#define ADR1_ARM		21 	// ADR Rd, <label>
+#define ADR2_ARM		22 	// ADR Rd, <label>
+#define MOV_ARM			23	// MOV Rd, PC
+#define LDR_ARM			24	// LDR Rt, <label>
+
+#define UNDEFINE		99
+
+// low halfword opcodes of the Thumb32 branches
+#define B_W_THUMB32_OP	0x9000
+#define BL_THUMB32_OP	0xD000
+#define BLX_THUMB32_OP	0xC000
+
+static int getTypeInThumb16(uint16_t instruction)
+{
+	if ((instruction & 0xF000) == 0xD000) {
+		LOGD("B1_THUMB16");
+		return B1_THUMB16;
+	}
+	if ((instruction & 0xF800) == 0xE000) {
+		LOGD("B2_THUMB16");
+		return B2_THUMB16;
+	}
+	if ((instruction & 0xFFF8) == 0x4778) {
+		LOGD("BX_THUMB16");
+		return BX_THUMB16;
+	}
+	if ((instruction & 0xFF78) == 0x4478) {
+		LOGD("ADD_THUMB16");
+		return ADD_THUMB16;
+	}
+	if ((instruction & 0xFF78) == 0x4678) {
+		LOGD("MOV_THUMB16");
+		return MOV_THUMB16;
+	}
+	if ((instruction & 0xF800) == 0xA000) {
+		LOGD("ADR_THUMB16");
+		return ADR_THUMB16;
+	}
+	if ((instruction & 0xF800) == 0x4800) {
+		LOGD("LDR_THUMB16");
+		return LDR_THUMB16;
+	}
+	return UNDEFINE;
+}
+
+static int getTypeInThumb32(uint32_t instruction)
+{
+	if ((instruction & 0xF800D000) == 0xF000C000) {
+		LOGD("BLX_THUMB32");
+		return BLX_THUMB32;
+	}
+	if ((instruction & 0xF800D000) == 0xF000D000) {
+		LOGD("BL_THUMB32");
+		return BL_THUMB32;
+	}
+	if ((instruction & 0xF800D000) == 0xF0008000) {
+		LOGD("B1_THUMB32");
+		return B1_THUMB32;
+	}
+	if ((instruction & 0xF800D000) == 0xF0009000) {
+		LOGD("B2_THUMB32");
+		return B2_THUMB32;
+	}
+	if ((instruction & 0xFBFF8000) == 0xF2AF0000) {
+		LOGD("ADR1_THUMB32");
+		return ADR1_THUMB32;
+	}
+	if ((instruction & 0xFBFF8000) == 0xF20F0000) {
+		LOGD("ADR2_THUMB32");
+		return ADR2_THUMB32;
+	}
+	if ((instruction & 0xFF7F0000) == 0xF85F0000) {
+		LOGD("LDR_THUMB32");
+		return LDR_THUMB32;
+	}
+	if ((instruction & 0xFFFF00F0) == 0xE8DF0000) {
+		LOGD("TBB_THUMB32");
+		return TBB_THUMB32;
+	}
+	if ((instruction & 0xFFFF00F0) == 0xE8DF0010) {
+		LOGD("TBH_THUMB32");
+		return TBH_THUMB32;
+	}
+	return UNDEFINE;
+}
+
+static int getTypeInArm(uint32_t instruction)
+{
+	if ((instruction & 0xFE000000) == 0xFA000000) {
+		LOGD("BLX_ARM");
+		return BLX_ARM;
+	}
+	if ((instruction & 0xF000000) == 0xB000000) {
+		LOGD("BL_ARM");
+		return BL_ARM;
+	}
+	if ((instruction & 0xF000000) == 0xA000000) {
+		LOGD("B_ARM");
+		return B_ARM;
+	}
+	if ((instruction & 0xFF000FF) == 0x120001F) {
+		LOGD("BX_ARM");
+		return BX_ARM;
+	}
+	if ((instruction & 0xFEF0010) == 0x8F0000) {
+		LOGD("ADD_ARM");
+		return ADD_ARM;
+	}
+	if ((instruction & 0xFFF0000) == 0x28F0000) {
+		LOGD("ADR1_ARM");
+		return ADR1_ARM;
+	}
+	if ((instruction & 0xFFF0000) == 0x24F0000) {
+		LOGD("ADR2_ARM");
+		return ADR2_ARM;
+	}
+	if ((instruction & 0xE5F0000) == 0x41F0000) {
+		LOGD("LDR_ARM");
+		return LDR_ARM;
+	}
+	if ((instruction & 0xFE00FFF) == 0x1A0000F) {
+		LOGD("MOV_ARM");
+		return MOV_ARM;
+	}
+	return UNDEFINE;
+}
+
+static uint32_t trampolineAddr(struct relocateContext *ctx, void *instructions)
+{
+	if (!PIC(ctx)) {
+		return (uint32_t) (uintptr_t) instructions;
+	}
+	return ctx->buffer_addr + (uint32_t) ((char *) instructions - (char *) ctx->buffer);
+}
+
+static uint32_t readWord(struct relocateContext *ctx, uint32_t addr)
+{
+	if (ctx != NULL && ctx->read_word != NULL) {
+		return ctx->read_word(ctx->read_arg, addr);
+	}
+	return ((uint32_t *) (uintptr_t) addr)[0];
+}
+
+static int encodeThumb32Branch(uint32_t from, uint32_t to, uint16_t op, uint16_t *instructions)
+{
+	int32_t offset;
+	uint32_t s;
+	uint32_t j1;
+	uint32_t j2;
+
+	if (op == BLX_THUMB32_OP) {
+		offset = (int32_t) (ALIGN_PC(to) - ALIGN_PC(from + 4));
+	}
+	else {
+		offset = (int32_t) ((to & ~1) - (from + 4));
+	}
+	if (offset < -(1 << 24) || offset >= (1 << 24)) {
+		return -1;
+	}
+
+	s = (offset >> 24) & 1;
+	j1 = (~(offset >> 23) & 1) ^ s;
+	j2 = (~(offset >> 22) & 1) ^ s;
+	instructions[0] = 0xF000 | (s << 10) | ((offset >> 12) & 0x3FF);
+	instructions[1] = op | (j1 << 13) | (j2 << 11) | ((offset >> 1) & 0x7FF);
+	return 0;
+}
+
+static int encodeArm32Branch(uint32_t from, uint32_t to, uint32_t op, uint32_t *instruction)
+{
+	int32_t offset;
+
+	offset = (int32_t) ((to & ~1) - (from + 8));
+	if (offset < -(1 << 25) || offset >= (1 << 25)) {
+		return -1;
+	}
+
+	if (to & 1) {
+		if (op != 0xEB000000) {
+			return -1;	// only BLX can switch to thumb
+		}
+		instruction[0] = 0xFA000000 | (((offset >> 1) & 1) << 24) | ((offset >> 2) & 0xFFFFFF);	// BLX <label>
+	}
+	else {
+		instruction[0] = op | ((offset >> 2) & 0xFFFFFF);
+	}
+	return 0;
+}
+
+int encodeThumbBranch(uint32_t from, uint32_t to, uint16_t *instructions)
+{
+	if (!(to & 1)) {
+		return -1;
+	}
+	return encodeThumb32Branch(from, to, B_W_THUMB32_OP, instructions);	// B.W <label>
+}
+
+int encodeArmBranch(uint32_t from, uint32_t to, uint32_t *instruction)
+{
+	if (to & 1) {
+		return -1;
+	}
+	return encodeArm32Branch(from, to, 0xEA000000, instruction);	// B <label>
+}
+
+static int emitThumbJump(struct relocateContext *ctx, uint32_t value, uint16_t *trampoline_instructions)
+{
+	if (!PIC(ctx)) {
+		trampoline_instructions[0] = 0xF8DF;
+		trampoline_instructions[1] = 0xF000;	// LDR.W PC, [PC]
+		trampoline_instructions[2] = value & 0xFFFF;
+		trampoline_instructions[3] = value >> 16;
+		return 4;
+	}
+
+	if (!(value & 1) || encodeThumb32Branch(trampolineAddr(ctx, trampoline_instructions), value, B_W_THUMB32_OP, trampoline_instructions) == -1) {
+		LOGD("can not branch from thumb trampoline to 0x%x", value);
+		ctx->error = 1;
+		return 0;
+	}
+	return 2;
+}
+
+static int emitThumbCall(struct relocateContext *ctx, uint32_t value, uint16_t *trampoline_instructions)
+{
+	if (!PIC(ctx)) {
+		trampoline_instructions[0] = 0xF20F;
+		trampoline_instructions[1] = 0x0E09;	// ADD.W LR, PC, #9
+		trampoline_instructions[2] = 0xF8DF;
+		trampoline_instructions[3] = 0xF000;	// LDR.W PC, [PC]
+		trampoline_instructions[4] = value & 0xFFFF;
+		trampoline_instructions[5] = value >> 16;
+		return 6;
+	}
+
+	if (encodeThumb32Branch(trampolineAddr(ctx, trampoline_instructions), value, (value & 1) ? BL_THUMB32_OP : BLX_THUMB32_OP, trampoline_instructions) == -1) {
+		LOGD("can not call 0x%x from thumb trampoline", value);
+		ctx->error = 1;
+		return 0;
+	}
+	return 2;
+}
+
+// trampoline_instructions must be 4-byte aligned
+static int emitThumbLoadAddr(struct relocateContext *ctx, int r, uint32_t value, uint16_t *trampoline_instructions)
+{
+	int32_t delta;
+	uint32_t imm;
+
+	// MOV PC, PC and the like are jumps, the computed value must not end up as an offset in PC
+	if (r == 15) {
+		return emitThumbJump(ctx, value, trampoline_instructions);
+	}
+
+	if (!PIC(ctx)) {
+		if (r < 8) {
+			trampoline_instructions[0] = 0x4800 | (r << 8);	// LDR Rr, [PC]
+			trampoline_instructions[1] = 0xE001;	// B PC, #2
+			trampoline_instructions[2] = value & 0xFFFF;
+			trampoline_instructions[3] = value >> 16;
+			return 4;
+		}
+		trampoline_instructions[0] = 0xF8DF;
+		trampoline_instructions[1] = (r << 12) | 4;	// LDR.W Rr, [PC, #4]
+		trampoline_instructions[2] = 0xE002;	// B PC, #4
+		trampoline_instructions[3] = 0xBF00;
+		trampoline_instructions[4] = value & 0xFFFF;
+		trampoline_instructions[5] = value >> 16;
+		return 6;
+	}
+
+	delta = (int32_t) (value - ALIGN_PC(trampolineAddr(ctx, trampoline_instructions) + 4));
+	if (delta > -4096 && delta < 4096) {
+		imm = delta < 0 ? -delta : delta;
+		trampoline_instructions[0] = (delta < 0 ? 0xF2AF : 0xF20F) | ((imm >> 1) & 0x400);
+		trampoline_instructions[1] = ((imm & 0x700) << 4) | (r << 8) | (imm & 0xFF);	// ADR.W Rr, <label>
+		return 2;
+	}
+
+	value -= trampolineAddr(ctx, trampoline_instructions) + 8;
+	trampoline_instructions[0] = 0xF8DF;
+	trampoline_instructions[1] = (r << 12) | 4;	// LDR.W Rr, [PC, #4]
+	trampoline_instructions[2] = 0x4478 | ((r & 0x8) << 4) | (r & 0x7);	// ADD Rr, PC
+	trampoline_instructions[3] = 0xE001;	// B PC, #2
+	trampoline_instructions[4] = value & 0xFFFF;
+	trampoline_instructions[5] = value >> 16;
+	return 6;
+}
+
+// trampoline_instructions must be 4-byte aligned
+static int emitThumbLoadWord(struct relocateContext *ctx, int r, uint32_t addr, uint16_t *trampoline_instructions)
+{
+	int32_t delta;
+
+	if (!PIC(ctx)) {
+		return emitThumbLoadAddr(ctx, r, readWord(ctx, addr), trampoline_instructions);
+	}
+
+	delta = (int32_t) (addr - ALIGN_PC(trampolineAddr(ctx, trampoline_instructions) + 4));
+	if (delta > -4096 && delta < 4096) {
+		trampoline_instructions[0] = delta < 0 ? 0xF85F : 0xF8DF;
+		trampoline_instructions[1] = (r << 12) | (delta < 0 ? -delta : delta);	// LDR.W Rr, <label>
+		return 2;
+	}
+
+	// LDR.W PC, <label> out of reach: the target goes through R0 and a stack slot POP loads PC from
+	if (r == 15) {
+		addr -= trampolineAddr(ctx, trampoline_instructions) + 12;
+		trampoline_instructions[0] = 0xB081;	// SUB SP, #4
+		trampoline_instructions[1] = 0xB401;	// PUSH {R0}
+		trampoline_instructions[2] = 0xF8DF;
+		trampoline_instructions[3] = 0x0008;	// LDR.W R0, [PC, #8]
+		trampoline_instructions[4] = 0x4478;	// ADD R0, PC
+		trampoline_instructions[5] = 0x6800;	// LDR R0, [R0]
+		trampoline_instructions[6] = 0x9001;	// STR R0, [SP, #4]
+		trampoline_instructions[7] = 0xBD01;	// POP {R0, PC}
+		trampoline_instructions[8] = addr & 0xFFFF;
+		trampoline_instructions[9] = addr >> 16;
+		return 10;
+	}
+
+	addr -= trampolineAddr(ctx, trampoline_instructions) + 8;
+	trampoline_instructions[0] = 0xF8DF;
+	trampoline_instructions[1] = (r << 12) | 8;	// LDR.W Rr, [PC, #8]
+	trampoline_instructions[2] = 0x4478 | ((r & 0x8) << 4) | (r & 0x7);	// ADD Rr, PC
+	trampoline_instructions[3] = 0xF8D0 | r;
+	trampoline_instructions[4] = r << 12;	// LDR.W Rr, [Rr]
+	trampoline_instructions[5] = 0xE001;	// B PC, #2
+	trampoline_instructions[6] = addr & 0xFFFF;
+	trampoline_instructions[7] = addr >> 16;
+	return 8;
+}
+
+// modified immediate (8 bits rotated right by an even amount), -1 if value has none
+static int encodeArmImmediate(uint32_t value)
+{
+	int rotate;
+
+	for (rotate = 0; rotate < 32; rotate += 2) {
+		uint32_t imm = (value << rotate) | (rotate ? value >> (32 - rotate) : 0);
+
+		if (imm <= 0xFF) {
+			return ((rotate / 2) << 8) | imm;
+		}
+	}
+	return -1;
+}
+
+static int emitArmJump(struct relocateContext *ctx, uint32_t value, uint32_t *trampoline_instructions)
+{
+	if (!PIC(ctx)) {
+		trampoline_instructions[0] = 0xE51FF004;	// LDR PC, [PC, #-4]
+		trampoline_instructions[1] = value;
+		return 2;
+	}
+
+	if (encodeArm32Branch(trampolineAddr(ctx, trampoline_instructions), value, 0xEA000000, trampoline_instructions) == -1) {
+		LOGD("can not branch from arm trampoline to 0x%x", value);
+		ctx->error = 1;
+		return 0;
+	}
+	return 1;
+}
+
+static int emitArmCall(struct relocateContext *ctx, uint32_t value, uint32_t *trampoline_instructions)
+{
+	if (!PIC(ctx)) {
+		trampoline_instructions[0] = 0xE28FE004;	// ADD LR, PC, #4
+		trampoline_instructions[1] = 0xE51FF004;	// LDR PC, [PC, #-4]
+		trampoline_instructions[2] = value;
+		return 3;
+	}
+
+	if (encodeArm32Branch(trampolineAddr(ctx, trampoline_instructions), value, 0xEB000000, trampoline_instructions) == -1) {
+		LOGD("can not call 0x%x from arm trampoline", value);
+		ctx->error = 1;
+		return 0;
+	}
+	return 1;
+}
+
+static int emitArmLoadAddr(struct relocateContext *ctx, int r, uint32_t value, uint32_t *trampoline_instructions)
+{
+	int32_t delta;
+	int imm;
+
+	// MOV PC, PC and the like are jumps, the computed value must not end up as an offset in PC
+	if (r == 15) {
+		return emitArmJump(ctx, value, trampoline_instructions);
+	}
+
+	if (!PIC(ctx)) {
+		trampoline_instructions[0] = 0xE51F0000 | (r << 12);	// LDR Rr, [PC]
+		trampoline_instructions[1] = 0xE28FF000;	// ADD PC, PC
+		trampoline_instructions[2] = value;
+		return 3;
+	}
+
+	delta = (int32_t) (value - (trampolineAddr(ctx, trampoline_instructions) + 8));
+	if ((imm = encodeArmImmediate(delta < 0 ? -delta : delta)) != -1) {
+		trampoline_instructions[0] = (delta < 0 ? 0xE24F0000 : 0xE28F0000) | (r << 12) | imm;	// ADR Rr, <label>
+		return 1;
+	}
+
+	trampoline_instructions[0] = 0xE59F0004 | (r << 12);	// LDR Rr, [PC, #4]
+	trampoline_instructions[1] = 0xE08F0000 | (r << 12) | r;	// ADD Rr, PC, Rr
+	trampoline_instructions[2] = 0xEA000000;	// B PC
+	trampoline_instructions[3] = value - (trampolineAddr(ctx, trampoline_instructions) + 12);
+	return 4;
+}
+
+static int emitArmLoadWord(struct relocateContext *ctx, int r, uint32_t addr, uint32_t *trampoline_instructions)
+{
+	int32_t delta;
+
+	if (!PIC(ctx)) {
+		return emitArmLoadAddr(ctx, r, readWord(ctx, addr), trampoline_instructions);
+	}
+
+	delta = (int32_t) (addr - (trampolineAddr(ctx, trampoline_instructions) + 8));
+	if (delta > -4096 && delta < 4096) {
+		trampoline_instructions[0] = (delta < 0 ? 0xE51F0000 : 0xE59F0000) | (r << 12) | (delta < 0 ? -delta : delta);	// LDR Rr, <label>
+		return 1;
+	}
+
+	// LDR PC, <label> out of reach: the target goes through R0 and a stack slot POP loads PC from
+	if (r == 15) {
+		trampoline_instructions[0] = 0xE24DD004;	// SUB SP, SP, #4
+		trampoline_instructions[1] = 0xE52D0004;	// PUSH {R0}
+		trampoline_instructions[2] = 0xE59F000C;	// LDR R0, [PC, #12]
+		trampoline_instructions[3] = 0xE08F0000;	// ADD R0, PC, R0
+		trampoline_instructions[4] = 0xE5900000;	// LDR R0, [R0]
+		trampoline_instructions[5] = 0xE58D0004;	// STR R0, [SP, #4]
+		trampoline_instructions[6] = 0xE8BD8001;	// POP {R0, PC}
+		trampoline_instructions[7] = addr - (trampolineAddr(ctx, trampoline_instructions) + 20);
+		return 8;
+	}
+
+	trampoline_instructions[0] = 0xE59F0008 | (r << 12);	// LDR Rr, [PC, #8]
+	trampoline_instructions[1] = 0xE08F0000 | (r << 12) | r;	// ADD Rr, PC, Rr
+	trampoline_instructions[2] = 0xE5900000 | (r << 16) | (r << 12);	// LDR Rr, [Rr]
+	trampoline_instructions[3] = 0xEA000000;	// B PC
+	trampoline_instructions[4] = addr - (trampolineAddr(ctx, trampoline_instructions) + 12);
+	return 5;
+}
+
+// trampoline_instructions must be 4-byte aligned
+static int relocateInstructionInThumb16(struct relocateContext *ctx, uint32_t pc, uint16_t instruction, uint16_t *trampoline_instructions)
+{
+	int type;
+	int offset;
+
+	type = getTypeInThumb16(instruction);
+	if (type == B1_THUMB16 || type == B2_THUMB16 || type == BX_THUMB16) {
+		uint32_t x;
+		int top_bit;
+		uint32_t imm32;
+		uint32_t value;
+		int idx;
+
+		idx = 0;
+		if (type == B1_THUMB16) {
+			x = (instruction & 0xFF) << 1;
+			top_bit = x >> 8;
+			imm32 = top_bit ? (x | (0xFFFFFFFF << 8)) : x;
+			value = pc + imm32 + 1;
+			trampoline_instructions[idx++] = instruction & 0xFF00;
+			trampoline_instructions[idx++] = 0xE003;	// B PC, #6
+		}
+		else if (type == B2_THUMB16) {
+			x = (instruction & 0x7FF) << 1;
+			top_bit = x >> 11;
+			imm32 = top_bit ? (x | (0xFFFFFFFF << 11)) : x;
+			value = pc + imm32 + 1;
+		}
+		else if (type == BX_THUMB16) {
+			value = pc;
+		}
+
+		offset = emitThumbJump(ctx, value, &trampoline_instructions[idx]);
+		if (type == B1_THUMB16) {
+			trampoline_instructions[1] = 0xE000 | (offset - 1);	// B over the jump
+		}
+		offset += idx;
+	}
+	else if (type == ADD_THUMB16) {
+		int rdn;
+		int r;
+
+		rdn = ((instruction & 0x80) >> 4) | (instruction & 0x7);
+
+		for (r = 7; ; --r) {
+			if (r != rdn) {
+				break;
+			}
+		}
+
+		if (!PIC(ctx)) {
+			trampoline_instructions[0] = 0xB400 | (1 << r);	// PUSH {Rr}
+			trampoline_instructions[1] = 0x4802 | (r << 8);	// LDR Rr, [PC, #8]
+			trampoline_instructions[2] = (instruction & 0xFF87) | (r << 3);
+			trampoline_instructions[3] = 0xBC00 | (1 << r);	// POP {Rr}
+			trampoline_instructions[4] = 0xE002;	// B PC, #4
+			trampoline_instructions[5] = 0xBF00;
+			trampoline_instructions[6] = pc & 0xFFFF;
+			trampoline_instructions[7] = pc >> 16;
+			offset = 8;
+		}
+		else {
+			trampoline_instructions[0] = 0xB400 | (1 << r);	// PUSH {Rr}
+			trampoline_instructions[1] = 0xBF00;	// NOP
+			offset = 2;
+			offset += emitThumbLoadAddr(ctx, r, pc, &trampoline_instructions[offset]);
+			trampoline_instructions[offset++] = (instruction & 0xFF87) | (r << 3);
+			trampoline_instructions[offset++] = 0xBC00 | (1 << r);	// POP {Rr}
+		}
+	}
+	else if (type == MOV_THUMB16 || type == ADR_THUMB16) {
+		int r;
+		uint32_t value;
+
+		if (type == MOV_THUMB16) {
+			r = ((instruction & 0x80) >> 4) | (instruction & 0x7);
+			value = r == 15 ? pc | 1 : pc;	// MOV PC, PC stays in thumb state
+		}
+		else {
+			r = (instruction & 0x700) >> 8;
+			value = ALIGN_PC(pc) + ((instruction & 0xFF) << 2);
+		}
+
+		offset = emitThumbLoadAddr(ctx, r, value, trampoline_instructions);
+	}
+	else if (type == LDR_THUMB16) {
+		int r;
+
+		r = (instruction & 0x700) >> 8;
+		offset = emitThumbLoadWord(ctx, r, ALIGN_PC(pc) + ((instruction & 0xFF) << 2), trampoline_instructions);
+	}
+	else {
+		trampoline_instructions[0] = instruction;
+		offset = 1;
+	}
+
+	return offset;
+}
+
+// trampoline_instructions must be 4-byte aligned
+static int relocateInstructionInThumb32(struct relocateContext *ctx, uint32_t pc, uint16_t high_instruction, uint16_t low_instruction, uint16_t *trampoline_instructions)
+{
+	uint32_t instruction;
+	int type;
+	int idx;
+	int offset;
+
+	instruction = (high_instruction << 16) | low_instruction;
+	type = getTypeInThumb32(instruction);
+	idx = 0;
+	if (type == BLX_THUMB32 || type == BL_THUMB32 || type == B1_THUMB32 || type == B2_THUMB32) {
+		uint32_t j1;
+		uint32_t j2;
+		uint32_t s;
+		uint32_t i1;
+		uint32_t i2;
+		uint32_t x;
+		uint32_t imm32;
+		uint32_t value;
+
+		j1 = (low_instruction & 0x2000) >> 13;
+		j2 = (low_instruction & 0x800) >> 11;
+		s = (high_instruction & 0x400) >> 10;
+		i1 = !(j1 ^ s);
+		i2 = !(j2 ^ s);
+
+		if (type == B1_THUMB32) {
+			trampoline_instructions[idx++] = 0xD000 | ((high_instruction & 0x3C0) << 2);
+			trampoline_instructions[idx++] = 0xE003;	// B PC, #6
+		}
+		if (type == BLX_THUMB32) {
+			x = (s << 24) | (i1 << 23) | (i2 << 22) | ((high_instruction & 0x3FF) << 12) | ((low_instruction & 0x7FE) << 1);
+			imm32 = s ? (x | (0xFFFFFFFF << 25)) : x;
+			value = ALIGN_PC(pc) + imm32;
+		}
+		else if (type == BL_THUMB32) {
+			x = (s << 24) | (i1 << 23) | (i2 << 22) | ((high_instruction & 0x3FF) << 12) | ((low_instruction & 0x7FF) << 1);
+			imm32 = s ? (x | (0xFFFFFFFF << 25)) : x;
+			value = pc + imm32 + 1;
+		}
+		else if (type == B1_THUMB32) {
+			x = (s << 20) | (j2 << 19) | (j1 << 18) | ((high_instruction & 0x3F) << 12) | ((low_instruction & 0x7FF) << 1);
+			imm32 = s ? (x | (0xFFFFFFFF << 21)) : x;
+			value = pc + imm32 + 1;
+		}
+		else if (type == B2_THUMB32) {
+			x = (s << 24) | (i1 << 23) | (i2 << 22) | ((high_instruction & 0x3FF) << 12) | ((low_instruction & 0x7FF) << 1);
+			imm32 = s ? (x | (0xFFFFFFFF << 25)) : x;
+			value = pc + imm32 + 1;
+		}
+
+		if (type == BLX_THUMB32 || type == BL_THUMB32) {
+			offset = emitThumbCall(ctx, value, &trampoline_instructions[idx]);
+		}
+		else {
+			offset = emitThumbJump(ctx, value, &trampoline_instructions[idx]);
+		}
+		if (type == B1_THUMB32) {
+			trampoline_instructions[1] = 0xE000 | (offset - 1);	// B over the jump
+		}
+		offset += idx;
+	}
+	else if (type == ADR1_THUMB32 || type == ADR2_THUMB32) {
+		int r;
+		uint32_t i;
+		uint32_t imm3;
+		uint32_t imm8;
+		uint32_t imm32;
+		uint32_t value;
+
+		r = (low_instruction & 0xF00) >> 8;
+		i = (high_instruction & 0x400) >> 10;
+		imm3 = (low_instruction & 0x7000) >> 12;
+		imm8 = instruction & 0xFF;
+
+		imm32 = (i << 11) | (imm3 << 8) | imm8;
+
+		if (type == ADR1_THUMB32) {
+			value = ALIGN_PC(pc) - imm32;
+		}
+		else {
+			value = ALIGN_PC(pc) + imm32;
+		}
+
+		offset = emitThumbLoadAddr(ctx, r, value, trampoline_instructions);
+	}
+	else if (type == LDR_THUMB32) {
+		int r;
+		int is_add;
+		uint32_t imm32;
+		uint32_t addr;
+
+		is_add = (high_instruction & 0x80) >> 7;
+		r = low_instruction >> 12;
+		imm32 = low_instruction & 0xFFF;
+
+		if (is_add) {
+			addr = ALIGN_PC(pc) + imm32;
+		}
+		else {
+			addr = ALIGN_PC(pc) - imm32;
+		}
+
+		offset = emitThumbLoadWord(ctx, r, addr, trampoline_instructions);
+	}
+	else if (type == TBB_THUMB32 || type == TBH_THUMB32) {
+		int rm;
+		int r;
+		int rx;
+
+		if (PIC(ctx)) {
+			LOGD("TBB/TBH can not be relocated position independently");
+			ctx->error = 1;
+			return 0;
+		}
+
+		rm = low_instruction & 0xF;
+
+		for (r = 7;; --r) {
+			if (r != rm) {
+				break;
+			}
+		}
+
+		for (rx = 7; ; --rx) {
+			if (rx != rm && rx != r) {
+				break;
+			}
+		}
+
+		trampoline_instructions[0] = 0xB400 | (1 << rx);	// PUSH {Rx}
+		trampoline_instructions[1] = 0x4805 | (r << 8);	// LDR Rr, [PC, #20]
+		trampoline_instructions[2] = 0x4600 | (rm << 3) | rx;	// MOV Rx, Rm
+		if (type == TBB_THUMB32) {
+			trampoline_instructions[3] = 0xEB00 | r;
+			trampoline_instructions[4] = 0x0000 | (rx << 8) | rx;	// ADD.W Rx, Rr, Rx
+			trampoline_instructions[5] = 0x7800 | (rx << 3) | rx; 	// LDRB Rx, [Rx]
+		}
+		else if (type == TBH_THUMB32) {
+			trampoline_instructions[3] = 0xEB00 | r;
+			trampoline_instructions[4] = 0x0040 | (rx << 8) | rx;	// ADD.W Rx, Rr, Rx, LSL #1
+			trampoline_instructions[5] = 0x8800 | (rx << 3) | rx; 	// LDRH Rx, [Rx]
+		}
+		trampoline_instructions[6] = 0xEB00 | r;
+		trampoline_instructions[7] = 0x0040 | (r << 8) | rx;	// ADD Rr, Rr, Rx, LSL #1
+		trampoline_instructions[8] = 0x3001 | (r << 8);	// ADD Rr, #1
+		trampoline_instructions[9] = 0xBC00 | (1 << rx);	// POP {Rx}
+		trampoline_instructions[10] = 0x4700 | (r << 3);	// BX Rr
+		trampoline_instructions[11] = 0xBF00;
+		trampoline_instructions[12] = pc & 0xFFFF;
+		trampoline_instructions[13] = pc >> 16;
+		offset = 14;
+	}
+	else {
+		trampoline_instructions[0] = high_instruction;
+		trampoline_instructions[1] = low_instruction;
+		offset = 2;
+	}
+
+	return offset;
+}
+
+int relocateInstructionInThumb(struct relocateContext *ctx, uint32_t target_addr, uint16_t *orig_instructions, int length, uint16_t *trampoline_instructions)
+{
+	uint16_t *start;
+	int i;
+	uint32_t pc;
+	uint32_t lr;
+
+	start = trampoline_instructions;
+	i = 0;
+	pc = target_addr + 4;
+	while (1) {
+		int offset;
+		int thumb32;
+		int type;
+
+		thumb32 = (orig_instructions[i] >> 11) >= 0x1D && (orig_instructions[i] >> 11) <= 0x1F;
+		if (thumb32) {
+			type = getTypeInThumb32(((uint32_t) orig_instructions[i] << 16) | orig_instructions[i + 1]);
+		}
+		else {
+			type = getTypeInThumb16(orig_instructions[i]);
+		}
+
+		// instructions copied as they are need no literal pool and no alignment
+		if (type != UNDEFINE && trampolineAddr(ctx, trampoline_instructions) % 4 != 0) {
+			trampoline_instructions[0] = 0xBF00;	// NOP
+			trampoline_instructions += 1;
+		}
+
+		if (thumb32) {
+			offset = relocateInstructionInThumb32(ctx, pc, orig_instructions[i], orig_instructions[i + 1], trampoline_instructions);
+			pc += sizeof(uint32_t);
+			trampoline_instructions += offset;
+			i += 2;
+		}
+		else {
+			offset = relocateInstructionInThumb16(ctx, pc, orig_instructions[i], trampoline_instructions);
+			pc += sizeof(uint16_t);
+			trampoline_instructions += offset;
+			++i;
+		}
+
+		if (i >= length / sizeof(uint16_t)) {
+			break;
+		}
+	}
+
+	// B.W back needs no alignment, the literal of LDR.W PC does
+	if (!PIC(ctx) && trampolineAddr(ctx, trampoline_instructions) % 4 != 0) {
+		trampoline_instructions[0] = 0xBF00;	// NOP
+		trampoline_instructions += 1;
+	}
+
+	lr = target_addr + i * sizeof(uint16_t) + 1;
+	trampoline_instructions += emitThumbJump(ctx, lr, trampoline_instructions);
+
+	if (PIC(ctx) && ctx->error) {
+		return -1;
+	}
+	return (trampoline_instructions - start) * sizeof(uint16_t);
+}
+
+int relocateInstructionInArm(struct relocateContext *ctx, uint32_t target_addr, uint32_t *orig_instructions, int length, uint32_t *trampoline_instructions)
+{
+	uint32_t pc;
+	uint32_t lr;
+	int i;
+	int idx;
+
+	pc = target_addr + 8;
+	lr = target_addr + length;
+
+	idx = 0;
+	for (i = 0; i < length / sizeof(uint32_t); ++i) {
+		uint32_t instruction;
+		int type;
+
+		instruction = orig_instructions[i];
+		type = getTypeInArm(instruction);
+		if (type == BLX_ARM || type == BL_ARM || type == B_ARM || type == BX_ARM) {
+			uint32_t x;
+			int top_bit;
+			uint32_t imm32;
+			uint32_t value;
+			uint32_t cond;
+			int header;
+			int offset;
+
+			if (type == BLX_ARM) {
+				x = ((instruction & 0xFFFFFF) << 2) | ((instruction & 0x1000000) >> 23);
+			}
+			else if (type == BL_ARM || type == B_ARM) {
+				x = (instruction & 0xFFFFFF) << 2;
+			}
+			else {
+				x = 0;
+			}
+
+			top_bit = x >> 25;
+			imm32 = top_bit ? (x | (0xFFFFFFFF << 26)) : x;
+			if (type == BLX_ARM) {
+				value = pc + imm32 + 1;
+			}
+			else if (type == BX_ARM) {
+				value = pc;
+			}
+			else {
+				value = pc + imm32;
+			}
+
+			cond = instruction >> 28;
+			header = 0;
+			if (type != BLX_ARM && cond != 0xE) {
+				trampoline_instructions[idx++] = (cond << 28) | 0xA000000;	// B<cond> PC
+				header = idx++;
+			}
+			if (type == BLX_ARM || type == BL_ARM) {
+				offset = emitArmCall(ctx, value, &trampoline_instructions[idx]);
+			}
+			else {
+				offset = emitArmJump(ctx, value, &trampoline_instructions[idx]);
+			}
+			if (header) {
+				trampoline_instructions[header] = 0xEA000000 | (offset - 1);	// B over the jump
+			}
+			idx += offset;
+		}
+		else if (type == ADD_ARM) {
+			int rd;
+			int rm;
+			int r;
+
+			rd = (instruction & 0xF000) >> 12;
+			rm = instruction & 0xF;
+
+			for (r = 12; ; --r) {
+				if (r != rd && r != rm) {
+					break;
+				}
+			}
+
+			trampoline_instructions[idx++] = 0xE52D0004 | (r << 12);	// PUSH {Rr}
+			if (!PIC(ctx)) {
+				trampoline_instructions[idx++] = 0xE59F0008 | (r << 12);	// LDR Rr, [PC, #8]
+				trampoline_instructions[idx++] = (instruction & 0xFFF0FFFF) | (r << 16);
+				trampoline_instructions[idx++] = 0xE49D0004 | (r << 12);	// POP {Rr}
+				trampoline_instructions[idx++] = 0xE28FF000;	// ADD PC, PC
+				trampoline_instructions[idx++] = pc;
+			}
+			else {
+				idx += emitArmLoadAddr(ctx, r, pc, &trampoline_instructions[idx]);
+				trampoline_instructions[idx++] = (instruction & 0xFFF0FFFF) | (r << 16);
+				trampoline_instructions[idx++] = 0xE49D0004 | (r << 12);	// POP {Rr}
+			}
+		}
+		else if (type == ADR1_ARM || type == ADR2_ARM || type == MOV_ARM) {
+			int r;
+			uint32_t value;
+
+			r = (instruction & 0xF000) >> 12;
+
+			if (type == ADR1_ARM || type == ADR2_ARM) {
+				uint32_t imm32;
+				int rotate;
+
+				imm32 = instruction & 0xFF;
+				rotate = ((instruction & 0xF00) >> 8) * 2;
+				if (rotate) {
+					imm32 = (imm32 >> rotate) | (imm32 << (32 - rotate));
+				}
+				if (type == ADR1_ARM) {
+					value = pc + imm32;
+				}
+				else {
+					value = pc - imm32;
+				}
+			}
+			else {
+				value = pc;
+			}
+
+			idx += emitArmLoadAddr(ctx, r, value, &trampoline_instructions[idx]);
+		}
+		else if (type == LDR_ARM) {
+			int r;
+			int is_add;
+			uint32_t imm32;
+
+			r = (instruction & 0xF000) >> 12;
+			imm32 = instruction & 0xFFF;
+			is_add = (instruction & 0x800000) >> 23;
+			if (is_add) {
+				idx += emitArmLoadWord(ctx, r, pc + imm32, &trampoline_instructions[idx]);
+			}
+			else {
+				idx += emitArmLoadWord(ctx, r, pc - imm32, &trampoline_instructions[idx]);
+			}
+		}
+		else {
+			trampoline_instructions[idx++] = instruction;
+		}
+		pc += sizeof(uint32_t);
+	}
+
+	idx += emitArmJump(ctx, lr, &trampoline_instructions[idx]);
+
+	if (PIC(ctx) && ctx->error) {
+		return -1;
+	}
+	return idx * sizeof(uint32_t);
+}
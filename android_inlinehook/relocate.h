@@ -0,0 +1,33 @@
+#ifndef _RELOCATE_H
+#define _RELOCATE_H
+
+#include <stdint.h>
+
+/*
+ * Where the trampoline buffer will run. Without a context the relocators
+ * emit absolute literals and read PC-relative data from the running image,
+ * which is what the runtime engine wants. With a context they emit
+ * position independent code (direct branches and PC-relative address
+ * computations) for a buffer that will run at buffer_addr, so nothing in the
+ * trampoline needs a relocation. error is set when an instruction can not be
+ * expressed that way or a branch is out of range.
+ *
+ * A context without a buffer keeps the absolute output and only changes where
+ * PC-relative data is read from: read_word(read_arg, addr), e.g. the memory
+ * of another process, instead of the current process.
+ */
+struct relocateContext {
+	void *buffer;
+	uint32_t buffer_addr;
+	int error;
+	uint32_t (*read_word)(void *arg, uint32_t addr);
+	void *read_arg;
+};
+
+int relocateInstructionInThumb(struct relocateContext *ctx, uint32_t target_addr, uint16_t *orig_instructions, int length, uint16_t *trampoline_instructions);
+int relocateInstructionInArm(struct relocateContext *ctx, uint32_t target_addr, uint32_t *orig_instructions, int length, uint32_t *trampoline_instructions);
+
+int encodeThumbBranch(uint32_t from, uint32_t to, uint16_t *instructions);
+int encodeArmBranch(uint32_t from, uint32_t to, uint32_t *instruction);
+
+#endif
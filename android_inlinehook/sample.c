@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sample.h"
+
+#define ENABLE_DEBUG
+#include "log.h"
+
+#define SAMPLE_WINDOW_NS	100000000	// the period is adjusted every 100ms
+#define SAMPLE_MAX_PERIOD	(1 << 24)
+#define SAMPLE_MAX_STEP		4			// factor the period may change by per window
+
+struct sampler {
+	uint8_t slots[SAMPLE_SLOTS * SAMPLE_SLOT_SIZE];	// first, the stub indexes it
+	volatile int32_t period;
+	inlineHookCallback callback;
+	void *arg;
+	uint32_t budget_ns;		// handler ns per second, 0 keeps the period
+	volatile uint64_t window_ns;		// 64-bit, a slow handler overflows 32 bits in 4.3s
+	volatile uint32_t window_samples;
+	volatile int adjusting;
+	uint64_t window_start;
+	uint64_t samples;
+	uint64_t handler_ns;
+	uint64_t calls;			// estimated, samples times the period they were taken at
+} __attribute__((aligned(64)));
+
+static uint64_t nowNs()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct sampler *samplerCreate(inlineHookCallback callback, void *arg, uint32_t period, uint32_t budget_ns)
+{
+	struct sampler *sampler;
+
+	if (callback == NULL || period == 0 || period > SAMPLE_MAX_PERIOD) {
+		return NULL;
+	}
+	if (posix_memalign((void **) &sampler, 64, sizeof(struct sampler)) != 0) {
+		return NULL;
+	}
+
+	// zeroed slots make the first call of every thread a sample
+	memset(sampler, 0, sizeof(struct sampler));
+	sampler->period = period;
+	sampler->callback = callback;
+	sampler->arg = arg;
+	sampler->budget_ns = budget_ns;
+	sampler->window_start = nowNs();
+	return sampler;
+}
+
+void samplerDestroy(struct sampler *sampler)
+{
+	free(sampler);
+}
+
+void *samplerSlots(struct sampler *sampler)
+{
+	return sampler->slots;
+}
+
+volatile int32_t *samplerPeriod(struct sampler *sampler)
+{
+	return &sampler->period;
+}
+
+/*
+ * Scales the period by how far the last window was from the budget, at
+ * most SAMPLE_MAX_STEP either way so a single slow handler call does not
+ * switch sampling off.
+ */
+static void adjustPeriod(struct sampler *sampler, uint64_t now)
+{
+	uint64_t spent;
+	uint32_t samples;
+	double rate;
+	double period;
+
+	spent = __sync_lock_test_and_set(&sampler->window_ns, 0);
+	samples = __sync_lock_test_and_set(&sampler->window_samples, 0);
+
+	sampler->samples += samples;
+	sampler->handler_ns += spent;
+	sampler->calls += (uint64_t) samples * sampler->period;
+
+	if (sampler->budget_ns != 0) {
+		rate = (double) spent * 1000000000 / (now - sampler->window_start);
+		period = sampler->period;
+		if (rate * SAMPLE_MAX_STEP < sampler->budget_ns) {
+			period /= SAMPLE_MAX_STEP;
+		}
+		else if (rate > sampler->budget_ns * (double) SAMPLE_MAX_STEP) {
+			period *= SAMPLE_MAX_STEP;
+		}
+		else {
+			period = period * rate / sampler->budget_ns;
+		}
+
+		if (period < 1) {
+			period = 1;
+		}
+		if (period > SAMPLE_MAX_PERIOD) {
+			period = SAMPLE_MAX_PERIOD;
+		}
+		sampler->period = (int32_t) period;
+	}
+	sampler->window_start = now;
+}
+
+void samplerCallback(struct inlineHookRegs *regs, void *arg)
+{
+	struct sampler *sampler = (struct sampler *) arg;
+	uint64_t start;
+	uint64_t end;
+
+	start = nowNs();
+	sampler->callback(regs, sampler->arg);
+	end = nowNs();
+
+	__sync_fetch_and_add(&sampler->window_ns, end - start);
+	__sync_fetch_and_add(&sampler->window_samples, 1);
+
+	// without samples the period only shrinks once the next one comes in
+	if (end - sampler->window_start >= SAMPLE_WINDOW_NS && __sync_bool_compare_and_swap(&sampler->adjusting, 0, 1)) {
+		if (end - sampler->window_start >= SAMPLE_WINDOW_NS) {
+			adjustPeriod(sampler, end);
+		}
+		__sync_lock_release(&sampler->adjusting);
+	}
+}
+
+void samplerGetStats(struct sampler *sampler, struct inlineHookSampleStats *stats)
+{
+	memset(stats, 0, sizeof(struct inlineHookSampleStats));
+	stats->period = sampler->period;
+	stats->samples = sampler->samples + sampler->window_samples;
+	stats->handler_ns = sampler->handler_ns + __sync_fetch_and_add(&sampler->window_ns, 0);	// no torn read on 32-bit
+	stats->calls = sampler->calls + (uint64_t) sampler->window_samples * sampler->period;
+}
@@ -0,0 +1,26 @@
+#ifndef _SAMPLE_H
+#define _SAMPLE_H
+
+#include <stdint.h>
+
+#include "inlineHook.h"
+
+#define SAMPLE_SLOTS		64	// per-thread countdowns, picked by a hash of the thread pointer
+#define SAMPLE_SLOT_SIZE	64	// one cache line each
+
+struct sampler;
+
+struct sampler *samplerCreate(inlineHookCallback callback, void *arg, uint32_t period, uint32_t budget_ns);
+void samplerDestroy(struct sampler *sampler);
+void samplerGetStats(struct sampler *sampler, struct inlineHookSampleStats *stats);
+
+/*
+ * The sample stub decrements the countdown slot of the calling thread and
+ * reloads it from *samplerPeriod() when it runs out, then calls
+ * samplerCallback(regs, sampler) like a callback hook.
+ */
+void samplerCallback(struct inlineHookRegs *regs, void *arg);
+void *samplerSlots(struct sampler *sampler);
+volatile int32_t *samplerPeriod(struct sampler *sampler);
+
+#endif
@@ -0,0 +1,387 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SCAN_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SCAN_SSE2
+#endif
+
+#include "scanner.h"
+
+#define ENABLE_DEBUG
+#include "log.h"
+
+#define MAX_PATTERN		256
+#define MAX_REGIONS		512
+#define MAX_THREADS		8
+#define CHUNK_SIZE		(256 * 1024)	// smallest piece of work handed to a thread
+#define PARALLEL_SIZE	(1024 * 1024)	// below this the scan runs on the calling thread
+
+struct pattern {
+	uint8_t bytes[MAX_PATTERN];
+	uint8_t mask[MAX_PATTERN];	// 0xFF for a literal byte, 0 for a wildcard
+	int length;
+	int anchor;					// index of the first literal byte pair
+	int anchor_pair;			// anchor + 1 is a literal too
+};
+
+struct region {
+	uintptr_t start;
+	uintptr_t end;
+};
+
+struct scanJob {
+	struct pattern *pat;
+	struct region regions[MAX_REGIONS];
+	int nregion;
+	uintptr_t chunk_size;
+	int nchunk;
+	int next_chunk;
+	pthread_mutex_t lock;
+	uintptr_t *results;
+	int max;
+	int count;
+};
+
+static int parsePattern(const char *str, struct pattern *pat)
+{
+	char hex[3];
+	char *end;
+	int i;
+
+	memset(pat, 0, sizeof(struct pattern));
+	while (*str) {
+		if (*str == ' ') {
+			++str;
+			continue;
+		}
+		if (pat->length == MAX_PATTERN) {
+			return -1;
+		}
+		if (*str == '?') {
+			str += str[1] == '?' ? 2 : 1;
+			pat->length++;
+			continue;
+		}
+
+		hex[0] = str[0];
+		hex[1] = str[1];
+		hex[2] = '\0';
+		pat->bytes[pat->length] = (uint8_t) strtoul(hex, &end, 16);
+		if (end != hex + 2) {
+			return -1;
+		}
+		pat->mask[pat->length++] = 0xFF;
+		str += 2;
+	}
+
+	pat->anchor = -1;
+	for (i = 0; i < pat->length; ++i) {
+		if (pat->mask[i] && i + 1 < pat->length && pat->mask[i + 1]) {
+			pat->anchor = i;
+			pat->anchor_pair = 1;
+			break;
+		}
+	}
+	if (pat->anchor == -1) {
+		for (i = 0; i < pat->length; ++i) {
+			if (pat->mask[i]) {
+				pat->anchor = i;
+				break;
+			}
+		}
+	}
+	return pat->anchor == -1 ? -1 : 0;
+}
+
+static int readRegions(const char *so_name, struct region *regions, int max)
+{
+	FILE *fp;
+	char line[512];
+	int n;
+
+	fp = fopen("/proc/self/maps", "r");
+	if (fp == NULL) {
+		return -1;
+	}
+
+	n = 0;
+	while (fgets(line, sizeof(line), fp) && n < max) {
+		unsigned long start;
+		unsigned long end;
+		char perms[8];
+		int path;
+
+		path = 0;
+		if (sscanf(line, "%lx-%lx %7s %*s %*s %*s %n", &start, &end, perms, &path) < 3) {
+			continue;
+		}
+		if (perms[0] != 'r' || perms[2] != 'x') {
+			continue;
+		}
+		if (so_name != NULL && (path == 0 || strstr(line + path, so_name) == NULL)) {
+			continue;
+		}
+		regions[n].start = start;
+		regions[n].end = end;
+		++n;
+	}
+
+	fclose(fp);
+	return n;
+}
+
+static int verify(struct pattern *pat, const uint8_t *p)
+{
+	int i;
+
+	for (i = 0; i < pat->length; ++i) {
+		if ((p[i] & pat->mask[i]) != pat->bytes[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Threads report matches in any order, results is kept as a max-heap of the
+ * max lowest addresses so far and sorted once the scan is done.
+ */
+static void addResult(struct scanJob *job, uintptr_t addr)
+{
+	uintptr_t *heap = job->results;
+	uintptr_t tmp;
+	int n;
+	int i;
+	int c;
+
+	pthread_mutex_lock(&job->lock);
+	n = job->count < job->max ? job->count : job->max;
+	if (n < job->max) {
+		for (i = n; i > 0 && heap[(i - 1) / 2] < addr; i = (i - 1) / 2) {
+			heap[i] = heap[(i - 1) / 2];
+		}
+		heap[i] = addr;
+	}
+	else if (n > 0 && addr < heap[0]) {
+		heap[0] = addr;
+		for (i = 0; (c = 2 * i + 1) < n; i = c) {
+			if (c + 1 < n && heap[c + 1] > heap[c]) {
+				++c;
+			}
+			if (heap[c] <= heap[i]) {
+				break;
+			}
+			tmp = heap[i];
+			heap[i] = heap[c];
+			heap[c] = tmp;
+		}
+	}
+	job->count++;
+	pthread_mutex_unlock(&job->lock);
+}
+
+/*
+ * Looks for pattern starts in [start, end) of a region ending at region_end.
+ * The SIMD loop compares 16 anchor positions per step against the anchor
+ * byte (pair) and only verifies the candidates.
+ */
+static void scanRange(struct scanJob *job, const uint8_t *start, const uint8_t *end, const uint8_t *region_end)
+{
+	struct pattern *pat = job->pat;
+	const uint8_t *p;
+	const uint8_t *hi;
+	uint8_t b0;
+	uint8_t b1;
+
+	if (region_end - start < pat->length) {
+		return;
+	}
+	if (end > region_end - pat->length + 1) {
+		end = region_end - pat->length + 1;
+	}
+
+	b0 = pat->bytes[pat->anchor];
+	b1 = pat->anchor_pair ? pat->bytes[pat->anchor + 1] : 0;
+	p = start + pat->anchor;
+	hi = end + pat->anchor;
+
+#if defined(SCAN_NEON)
+	{
+		uint8x16_t v0 = vdupq_n_u8(b0);
+		uint8x16_t v1 = vdupq_n_u8(b1);
+
+		for (; p + 16 <= hi && p + 17 <= region_end; p += 16) {
+			uint8x16_t eq;
+			uint64_t m;
+
+			eq = vceqq_u8(vld1q_u8(p), v0);
+			if (pat->anchor_pair) {
+				eq = vandq_u8(eq, vceqq_u8(vld1q_u8(p + 1), v1));
+			}
+			m = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+			while (m) {
+				int bit = __builtin_ctzll(m) >> 2;
+
+				if (verify(pat, p + bit - pat->anchor)) {
+					addResult(job, (uintptr_t) (p + bit - pat->anchor));
+				}
+				m &= ~(0xFULL << (bit * 4));
+			}
+		}
+	}
+#elif defined(SCAN_SSE2)
+	{
+		__m128i v0 = _mm_set1_epi8((char) b0);
+		__m128i v1 = _mm_set1_epi8((char) b1);
+
+		for (; p + 16 <= hi && p + 17 <= region_end; p += 16) {
+			__m128i eq;
+			uint32_t m;
+
+			eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), v0);
+			if (pat->anchor_pair) {
+				eq = _mm_and_si128(eq, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 1)), v1));
+			}
+			m = _mm_movemask_epi8(eq);
+			while (m) {
+				int bit = __builtin_ctz(m);
+
+				if (verify(pat, p + bit - pat->anchor)) {
+					addResult(job, (uintptr_t) (p + bit - pat->anchor));
+				}
+				m &= m - 1;
+			}
+		}
+	}
+#endif
+
+	for (; p < hi; ++p) {
+		p = memchr(p, b0, hi - p);
+		if (p == NULL) {
+			break;
+		}
+		if (verify(pat, p - pat->anchor)) {
+			addResult(job, (uintptr_t) (p - pat->anchor));
+		}
+	}
+}
+
+static void *scanThread(void *arg)
+{
+	struct scanJob *job = (struct scanJob *) arg;
+
+	while (1) {
+		int chunk;
+		int r;
+
+		chunk = __sync_fetch_and_add(&job->next_chunk, 1);
+		if (chunk >= job->nchunk) {
+			break;
+		}
+
+		// chunks are numbered across regions in order
+		for (r = 0; r < job->nregion; ++r) {
+			uintptr_t size = job->regions[r].end - job->regions[r].start;
+			int n = (size + job->chunk_size - 1) / job->chunk_size;
+
+			if (chunk < n) {
+				uintptr_t start = job->regions[r].start + chunk * job->chunk_size;
+				uintptr_t end = start + job->chunk_size < job->regions[r].end ? start + job->chunk_size : job->regions[r].end;
+
+				scanRange(job, (const uint8_t *) start, (const uint8_t *) end, (const uint8_t *) job->regions[r].end);
+				break;
+			}
+			chunk -= n;
+		}
+	}
+	return NULL;
+}
+
+static int compareAddr(const void *a, const void *b)
+{
+	uintptr_t x = *(const uintptr_t *) a;
+	uintptr_t y = *(const uintptr_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+int scanPattern(const char *pattern, const char *so_name, uintptr_t *results, int max)
+{
+	struct pattern pat;
+	struct scanJob *job;
+	pthread_t tids[MAX_THREADS];
+	uintptr_t total;
+	long ncpu;
+	int nthread;
+	int i;
+	int count;
+
+	if (pattern == NULL || (results == NULL && max > 0) || parsePattern(pattern, &pat) == -1) {
+		LOGD("illegal pattern");
+		return -1;
+	}
+
+	job = (struct scanJob *) calloc(1, sizeof(struct scanJob));
+	if (job == NULL) {
+		return -1;
+	}
+	job->pat = &pat;
+	job->results = results;
+	job->max = max;
+	pthread_mutex_init(&job->lock, NULL);
+
+	job->nregion = readRegions(so_name, job->regions, MAX_REGIONS);
+	if (job->nregion <= 0) {
+		LOGD("no executable mapping for %s", so_name ? so_name : "(all)");
+		count = job->nregion == 0 ? 0 : -1;
+		pthread_mutex_destroy(&job->lock);
+		free(job);
+		return count;
+	}
+
+	total = 0;
+	for (i = 0; i < job->nregion; ++i) {
+		total += job->regions[i].end - job->regions[i].start;
+	}
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nthread = ncpu < 1 ? 1 : (ncpu > MAX_THREADS ? MAX_THREADS : ncpu);
+	if (total < PARALLEL_SIZE) {
+		nthread = 1;
+	}
+
+	// a few chunks per thread keep the threads busy when regions differ in size
+	job->chunk_size = total / (nthread * 4);
+	if (job->chunk_size < CHUNK_SIZE) {
+		job->chunk_size = CHUNK_SIZE;
+	}
+	for (i = 0; i < job->nregion; ++i) {
+		job->nchunk += (job->regions[i].end - job->regions[i].start + job->chunk_size - 1) / job->chunk_size;
+	}
+
+	for (i = 1; i < nthread; ++i) {
+		if (pthread_create(&tids[i], NULL, scanThread, job) != 0) {
+			break;
+		}
+	}
+	nthread = i;
+	scanThread(job);
+	for (i = 1; i < nthread; ++i) {
+		pthread_join(tids[i], NULL);
+	}
+
+	count = job->count;
+	qsort(results, count < max ? count : max, sizeof(uintptr_t), compareAddr);
+	LOGD("pattern scan of %lu bytes with %d threads: %d matches", (unsigned long) total, nthread, count);
+
+	pthread_mutex_destroy(&job->lock);
+	free(job);
+	return count;
+}
@@ -0,0 +1,15 @@
+#ifndef _SCANNER_H
+#define _SCANNER_H
+
+#include <stdint.h>
+
+/*
+ * pattern is a list of hex bytes separated by spaces, "??" (or "?") matches
+ * any byte, e.g. "2D E9 F0 4F ?? ?? 4F F0". so_name restricts the scan to the
+ * executable mappings whose path contains it, NULL scans every executable
+ * mapping. The lowest max match addresses are stored in ascending order,
+ * the return value is the total number of matches or -1 on error.
+ */
+int scanPattern(const char *pattern, const char *so_name, uintptr_t *results, int max);
+
+#endif
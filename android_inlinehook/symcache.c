@@ -0,0 +1,492 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "list.h"
+#include "symcache.h"
+
+#define ENABLE_DEBUG
+#include "log.h"
+
+/*
+ * On-disk symbol index, one file per library and NT_GNU_BUILD_ID, named
+ * <soname>.<build-id in hex>.symidx.
+ *
+ *   struct symbolCacheHeader
+ *   uint32_t displace[nbucket]
+ *   uint32_t slots[nslot]		// .dynsym index, 0 for an empty slot
+ *
+ * A name hashes to a bucket, the bucket's displacement picks the slot
+ * (hash and displace perfect hashing), so a lookup is one probe followed by
+ * one strcmp against the library's own .dynstr. The file is rebuilt when the
+ * build-id of the loaded library no longer matches the header.
+ *
+ * A file with nbucket == 0 records that no index could be built for this
+ * build-id, lookups then go straight to findSymbolAddr().
+ */
+
+#define SYMCACHE_MAGIC		0x58444953	// "SIDX"
+#define SYMCACHE_VERSION	1
+#define MAX_BUILD_ID		32
+#define MAX_DISPLACE		0x100000
+
+#ifndef NT_GNU_BUILD_ID
+#define NT_GNU_BUILD_ID		3
+#endif
+
+struct symbolCacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t build_id_size;
+	uint8_t build_id[MAX_BUILD_ID];
+	uint32_t nbucket;
+	uint32_t nslot;
+};
+
+struct symbolCache {
+	struct list_head list;
+	struct soinfo *si;
+	void *map;
+	size_t map_size;
+	uint32_t *displace;
+	uint32_t *slots;
+	uint32_t nbucket;
+	uint32_t nslot;
+};
+
+static struct list_head caches = {&caches, &caches};
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static char cache_dir[256];
+
+int setSymbolCacheDir(const char *dir)
+{
+	if (dir == NULL || strlen(dir) >= sizeof(cache_dir)) {
+		LOGD("illegal parameter");
+		return -1;
+	}
+
+	pthread_mutex_lock(&caches_lock);
+	strcpy(cache_dir, dir);
+	pthread_mutex_unlock(&caches_lock);
+	return 0;
+}
+
+static uint32_t fmix32(uint32_t h)
+{
+	h ^= h >> 16;
+	h *= 0x85EBCA6B;
+	h ^= h >> 13;
+	h *= 0xC2B2AE35;
+	h ^= h >> 16;
+	return h;
+}
+
+static uint32_t fnv1a(const char *name)
+{
+	const unsigned char *p = (const unsigned char *) name;
+	uint32_t h = 2166136261U;
+
+	while (*p) {
+		h ^= *p++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static uint32_t slotOf(uint32_t hash, uint32_t d, uint32_t nslot)
+{
+	uint32_t h1;
+	uint32_t h2;
+
+	h1 = fmix32(hash ^ 0x9E3779B9);
+	h2 = fmix32(h1) % (nslot - 1) + 1;
+	return (uint32_t) (((uint64_t) h1 + (uint64_t) d * h2) % nslot);
+}
+
+static int isPrime(uint32_t n)
+{
+	uint32_t i;
+
+	if (n < 2) {
+		return 0;
+	}
+	for (i = 2; i * i <= n; ++i) {
+		if (n % i == 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int getBuildId(struct soinfo *si, uint8_t *build_id)
+{
+	size_t i;
+
+	for (i = 0; i < si->phnum; ++i) {
+		const char *note;
+		const char *end;
+
+		if (si->phdr[i].p_type != PT_NOTE) {
+			continue;
+		}
+
+		note = (const char *) (si->base + si->phdr[i].p_vaddr);
+		end = note + si->phdr[i].p_memsz;
+		while (note + sizeof(Elf32_Nhdr) <= end) {
+			const Elf32_Nhdr *nhdr = (const Elf32_Nhdr *) note;
+			const char *name = note + sizeof(Elf32_Nhdr);
+			const char *desc = name + ((nhdr->n_namesz + 3) & ~3);
+
+			if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 && memcmp(name, "GNU", 4) == 0 && nhdr->n_descsz <= MAX_BUILD_ID) {
+				memcpy(build_id, desc, nhdr->n_descsz);
+				return nhdr->n_descsz;
+			}
+			note = desc + ((nhdr->n_descsz + 3) & ~3);
+		}
+	}
+	return 0;
+}
+
+static int isCachedSymbol(struct soinfo *si, size_t i)
+{
+	Elf32_Sym *s = si->symtab + i;
+
+	return s->st_shndx != SHN_UNDEF && ELF32_ST_TYPE(s->st_info) == STT_FUNC && si->strtab[s->st_name] != '\0';
+}
+
+static int buildCache(struct soinfo *si, const char *path, const uint8_t *build_id, int build_id_size)
+{
+	struct symbolCacheHeader header;
+	uint32_t *hashes;
+	uint32_t *keys;
+	uint32_t *bucket_start;
+	uint32_t *bucket_order;
+	uint32_t *displace;
+	uint32_t *slots;
+	uint32_t nkey;
+	uint32_t nbucket;
+	uint32_t nslot;
+	uint32_t b;
+	size_t i;
+	size_t size;
+	char tmp_path[PATH_MAX];
+	int fd;
+	int ret;
+
+	ret = -1;
+	hashes = NULL;
+	keys = NULL;
+	bucket_start = NULL;
+	bucket_order = NULL;
+	displace = NULL;
+	slots = NULL;
+
+	nkey = 0;
+	for (i = 1; i < si->nchain; ++i) {
+		if (isCachedSymbol(si, i)) {
+			++nkey;
+		}
+	}
+	if (nkey == 0) {
+		nbucket = 0;
+		nslot = 0;
+		goto _write;
+	}
+
+	nbucket = (nkey + 3) / 4;
+	for (nslot = nkey + nkey / 8 + 2; !isPrime(nslot); ++nslot);
+
+	hashes = (uint32_t *) malloc(sizeof(uint32_t) * nkey);
+	keys = (uint32_t *) malloc(sizeof(uint32_t) * nkey);
+	bucket_start = (uint32_t *) calloc(nbucket + 1, sizeof(uint32_t));
+	bucket_order = (uint32_t *) malloc(sizeof(uint32_t) * nbucket);
+	displace = (uint32_t *) calloc(nbucket, sizeof(uint32_t));
+	slots = (uint32_t *) calloc(nslot, sizeof(uint32_t));
+	if (hashes == NULL || keys == NULL || bucket_start == NULL || bucket_order == NULL || displace == NULL || slots == NULL) {
+		goto _out;
+	}
+
+	// counting sort of the symbols by bucket
+	for (i = 1; i < si->nchain; ++i) {
+		if (isCachedSymbol(si, i)) {
+			++bucket_start[fnv1a(si->strtab + si->symtab[i].st_name) % nbucket + 1];
+		}
+	}
+	for (b = 0; b < nbucket; ++b) {
+		bucket_start[b + 1] += bucket_start[b];
+		bucket_order[b] = b;
+	}
+	for (i = 1; i < si->nchain; ++i) {
+		if (isCachedSymbol(si, i)) {
+			uint32_t h = fnv1a(si->strtab + si->symtab[i].st_name);
+			uint32_t pos = bucket_start[h % nbucket] + displace[h % nbucket]++;
+
+			hashes[pos] = h;
+			keys[pos] = i;
+		}
+	}
+	memset(displace, 0, sizeof(uint32_t) * nbucket);
+
+	/*
+	 * Keys with the same hash (a name versioned twice in .dynsym, or a real
+	 * collision) land in the same bucket and no displacement separates them.
+	 * Keep the first one, lookups of the others fail the strcmp and fall back
+	 * to findSymbolAddr().
+	 */
+	for (b = 0; b < nbucket; ++b) {
+		uint32_t k;
+		uint32_t m;
+
+		for (k = bucket_start[b] + 1; k < bucket_start[b + 1]; ++k) {
+			for (m = bucket_start[b]; m < k; ++m) {
+				if (keys[m] != 0 && hashes[m] == hashes[k]) {
+					keys[k] = 0;
+					break;
+				}
+			}
+		}
+	}
+
+	// place the largest buckets first, insertion sort is fine for these sizes
+	for (b = 1; b < nbucket; ++b) {
+		uint32_t cur = bucket_order[b];
+		uint32_t size = bucket_start[cur + 1] - bucket_start[cur];
+		uint32_t j = b;
+
+		while (j > 0 && bucket_start[bucket_order[j - 1] + 1] - bucket_start[bucket_order[j - 1]] < size) {
+			bucket_order[j] = bucket_order[j - 1];
+			--j;
+		}
+		bucket_order[j] = cur;
+	}
+
+	for (b = 0; b < nbucket; ++b) {
+		uint32_t cur = bucket_order[b];
+		uint32_t first = bucket_start[cur];
+		uint32_t last = bucket_start[cur + 1];
+		uint32_t d;
+
+		if (first == last) {
+			break;
+		}
+
+		for (d = 0; d < MAX_DISPLACE; ++d) {
+			uint32_t k;
+
+			for (k = first; k < last; ++k) {
+				uint32_t slot;
+				uint32_t m;
+
+				if (keys[k] == 0) {
+					continue;
+				}
+				slot = slotOf(hashes[k], d, nslot);
+				if (slots[slot] != 0) {
+					break;
+				}
+				for (m = first; m < k; ++m) {
+					if (keys[m] != 0 && slotOf(hashes[m], d, nslot) == slot) {
+						break;
+					}
+				}
+				if (m != k) {
+					break;
+				}
+			}
+			if (k == last) {
+				break;
+			}
+		}
+		if (d == MAX_DISPLACE) {
+			LOGD("can not build perfect hash for %s", si->name);
+			nbucket = 0;
+			nslot = 0;
+			goto _write;
+		}
+
+		displace[cur] = d;
+		for (i = first; i < last; ++i) {
+			if (keys[i] != 0) {
+				slots[slotOf(hashes[i], d, nslot)] = keys[i];
+			}
+		}
+	}
+
+_write:
+	memset(&header, 0, sizeof(header));
+	header.magic = SYMCACHE_MAGIC;
+	header.version = SYMCACHE_VERSION;
+	header.build_id_size = build_id_size;
+	memcpy(header.build_id, build_id, build_id_size);
+	header.nbucket = nbucket;
+	header.nslot = nslot;
+
+	// write to a temporary file and rename, readers never see a partial index
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, getpid());
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		LOGD("open %s failed", tmp_path);
+		goto _out;
+	}
+	size = sizeof(uint32_t) * nbucket;
+	if (write(fd, &header, sizeof(header)) != sizeof(header)
+		|| (size != 0 && write(fd, displace, size) != (ssize_t) size)
+		|| (nslot != 0 && write(fd, slots, sizeof(uint32_t) * nslot) != (ssize_t) (sizeof(uint32_t) * nslot))) {
+		LOGD("write %s failed", tmp_path);
+		close(fd);
+		unlink(tmp_path);
+		goto _out;
+	}
+	close(fd);
+
+	if (rename(tmp_path, path) != 0) {
+		unlink(tmp_path);
+		goto _out;
+	}
+
+	LOGD("built symbol cache %s, %u symbols, %u slots", path, nkey, nslot);
+	ret = 0;
+
+_out:
+	free(hashes);
+	free(keys);
+	free(bucket_start);
+	free(bucket_order);
+	free(displace);
+	free(slots);
+	return ret;
+}
+
+static struct symbolCache *mapCache(struct soinfo *si, const char *path, const uint8_t *build_id, int build_id_size)
+{
+	struct symbolCache *cache;
+	struct symbolCacheHeader *header;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(struct symbolCacheHeader)) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	header = (struct symbolCacheHeader *) map;
+	if (header->magic != SYMCACHE_MAGIC || header->version != SYMCACHE_VERSION
+		|| header->build_id_size != (uint32_t) build_id_size || memcmp(header->build_id, build_id, build_id_size) != 0
+		|| (header->nbucket != 0 && header->nslot < 2) || (header->nbucket == 0 && header->nslot != 0)
+		|| st.st_size != (off_t) (sizeof(struct symbolCacheHeader) + sizeof(uint32_t) * ((uint64_t) header->nbucket + header->nslot))) {
+		LOGD("symbol cache %s is stale", path);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	cache = (struct symbolCache *) calloc(1, sizeof(struct symbolCache));
+	if (cache == NULL) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	cache->si = si;
+	cache->map = map;
+	cache->map_size = st.st_size;
+	cache->nbucket = header->nbucket;
+	cache->nslot = header->nslot;
+	cache->displace = (uint32_t *) (header + 1);		// unused when nbucket is 0
+	cache->slots = cache->displace + cache->nbucket;
+	return cache;
+}
+
+static struct symbolCache *getCache(struct soinfo *si)
+{
+	struct list_head *pos;
+	struct symbolCache *cache;
+	uint8_t build_id[MAX_BUILD_ID];
+	int build_id_size;
+	const char *name;
+	char hex[MAX_BUILD_ID * 2 + 1];
+	char path[PATH_MAX];
+	int i;
+
+	list_for_each(pos, &caches) {
+		cache = list_entry(pos, struct symbolCache, list);
+		if (cache->si == si) {
+			return cache;
+		}
+	}
+
+	if (cache_dir[0] == '\0' || si->symtab == NULL || si->strtab == NULL || si->nchain == 0) {
+		return NULL;
+	}
+
+	build_id_size = getBuildId(si, build_id);
+	if (build_id_size == 0) {
+		return NULL;
+	}
+
+	// libraries with the same name in different directories (or versions) get their own file
+	for (i = 0; i < build_id_size; ++i) {
+		sprintf(hex + i * 2, "%02x", build_id[i]);
+	}
+	hex[i * 2] = '\0';
+	name = strrchr(si->name, '/');
+	name = name == NULL ? si->name : name + 1;
+	snprintf(path, sizeof(path), "%s/%s.%s.symidx", cache_dir, name, hex);
+
+	cache = mapCache(si, path, build_id, build_id_size);
+	if (cache == NULL) {
+		if (buildCache(si, path, build_id, build_id_size) == 0) {
+			cache = mapCache(si, path, build_id, build_id_size);
+		}
+	}
+	if (cache == NULL) {
+		// remember the failure too, the next hook in this library does not try again
+		cache = (struct symbolCache *) calloc(1, sizeof(struct symbolCache));
+		if (cache == NULL) {
+			return NULL;
+		}
+		cache->si = si;
+	}
+
+	list_add(&cache->list, &caches);
+	return cache;
+}
+
+uint32_t findSymbolAddrInCache(struct soinfo *si, const char *symbol_name)
+{
+	struct symbolCache *cache;
+	uint32_t hash;
+	uint32_t idx;
+	uint32_t addr;
+	Elf32_Sym *s;
+
+	addr = 0;
+	pthread_mutex_lock(&caches_lock);
+	cache = getCache(si);
+	if (cache != NULL && cache->nbucket != 0) {
+		hash = fnv1a(symbol_name);
+		idx = cache->slots[slotOf(hash, cache->displace[hash % cache->nbucket], cache->nslot)];
+		if (idx != 0 && idx < si->nchain) {
+			s = si->symtab + idx;
+			if (strcmp(si->strtab + s->st_name, symbol_name) == 0 && ELF32_ST_TYPE(s->st_info) == STT_FUNC) {
+				addr = s->st_value + si->base;
+			}
+		}
+	}
+	pthread_mutex_unlock(&caches_lock);
+
+	return addr;
+}
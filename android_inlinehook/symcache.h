@@ -0,0 +1,8 @@
+#ifndef _SYMCACHE_H
+#define _SYMCACHE_H
+
+#include "inlineHook.h"
+
+uint32_t findSymbolAddrInCache(struct soinfo *si, const char *symbol_name);
+
+#endif
@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <linux/audit.h>
+
+#include "syscallhook.h"
+
+#define ENABLE_DEBUG
+#include "log.h"
+
+#define MAX_SYSCALL_HOOKS	64
+
+#if defined(__arm__)
+#define SYSCALL_HOOK_ARCH	AUDIT_ARCH_ARM
+#elif defined(__aarch64__)
+#define SYSCALL_HOOK_ARCH	AUDIT_ARCH_AARCH64
+#elif defined(__i386__)
+#define SYSCALL_HOOK_ARCH	AUDIT_ARCH_I386
+#elif defined(__x86_64__)
+#define SYSCALL_HOOK_ARCH	AUDIT_ARCH_X86_64
+#endif
+
+#ifndef SECCOMP_SET_MODE_FILTER
+#define SECCOMP_SET_MODE_FILTER		1
+#endif
+#ifndef SECCOMP_GET_NOTIF_SIZES
+#define SECCOMP_GET_NOTIF_SIZES		3
+#endif
+#ifndef SECCOMP_RET_USER_NOTIF
+// older uapi headers, linux 5.0
+#define SECCOMP_RET_USER_NOTIF		0x7fc00000U
+#define SECCOMP_FILTER_FLAG_NEW_LISTENER	(1UL << 3)
+
+struct seccomp_notif_sizes {
+	uint16_t seccomp_notif;
+	uint16_t seccomp_notif_resp;
+	uint16_t seccomp_data;
+};
+
+struct seccomp_notif {
+	uint64_t id;
+	uint32_t pid;
+	uint32_t flags;
+	struct seccomp_data data;
+};
+
+struct seccomp_notif_resp {
+	uint64_t id;
+	int64_t val;
+	int32_t error;
+	uint32_t flags;
+};
+
+#define SECCOMP_IOCTL_NOTIF_RECV	_IOWR('!', 0, struct seccomp_notif)
+#define SECCOMP_IOCTL_NOTIF_SEND	_IOWR('!', 1, struct seccomp_notif_resp)
+#endif
+#ifndef SECCOMP_USER_NOTIF_FLAG_CONTINUE
+#define SECCOMP_USER_NOTIF_FLAG_CONTINUE	(1UL << 0)	// linux 5.5
+#endif
+
+struct syscallHook {
+	int nr;
+	syscallHandler handler;
+	void *arg;
+};
+
+static struct syscallHook hooks[MAX_SYSCALL_HOOKS];
+static int nhook;
+static volatile int listener = -1;
+static int started;
+
+int registerSyscallHook(int nr, syscallHandler handler, void *arg)
+{
+	if (nr < 0 || handler == NULL || started || nhook == MAX_SYSCALL_HOOKS) {
+		LOGD("illegal parameter in registerSyscallHook()");
+		return -1;
+	}
+
+	hooks[nhook].nr = nr;
+	hooks[nhook].handler = handler;
+	hooks[nhook].arg = arg;
+	++nhook;
+	return 0;
+}
+
+static struct syscallHook *findHook(int nr)
+{
+	int i;
+
+	for (i = 0; i < nhook; ++i) {
+		if (hooks[i].nr == nr) {
+			return &hooks[i];
+		}
+	}
+	return NULL;
+}
+
+static void *supervisorThread(void *arg)
+{
+	struct seccomp_notif_sizes *sizes = (struct seccomp_notif_sizes *) arg;
+	struct seccomp_notif *req;
+	struct seccomp_notif_resp *resp;
+	struct syscallHook *hook;
+	struct syscallEvent event;
+	int fd;
+	int i;
+
+	req = (struct seccomp_notif *) malloc(sizes->seccomp_notif);
+	resp = (struct seccomp_notif_resp *) malloc(sizes->seccomp_notif_resp);
+
+	// the installing thread can not make any syscall to hand the fd over
+	while ((fd = listener) == -1) {
+		usleep(100);
+	}
+
+	while (fd >= 0) {
+		memset(req, 0, sizes->seccomp_notif);
+		if (ioctl(fd, SECCOMP_IOCTL_NOTIF_RECV, req) == -1) {
+			if (errno == EINTR || errno == ENOENT) {
+				continue;
+			}
+			LOGD("SECCOMP_IOCTL_NOTIF_RECV failed: %s", strerror(errno));
+			break;
+		}
+
+		memset(&event, 0, sizeof(event));
+		event.tid = req->pid;
+		event.nr = req->data.nr;
+		for (i = 0; i < 6; ++i) {
+			event.args[i] = req->data.args[i];
+		}
+		event.instruction_pointer = req->data.instruction_pointer;
+
+		memset(resp, 0, sizes->seccomp_notif_resp);
+		resp->id = req->id;
+		hook = findHook(req->data.nr);
+		if (hook == NULL || hook->handler(&event, hook->arg) == SYSCALL_HOOK_CONTINUE) {
+			resp->flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE;
+		}
+		else if (event.error) {
+			resp->error = -event.error;
+		}
+		else {
+			resp->val = event.ret;
+		}
+
+		// ENOENT: the caller was interrupted by a signal in the meantime
+		if (ioctl(fd, SECCOMP_IOCTL_NOTIF_SEND, resp) == -1 && errno != ENOENT) {
+			LOGD("SECCOMP_IOCTL_NOTIF_SEND failed: %s", strerror(errno));
+		}
+	}
+
+	free(req);
+	free(resp);
+	return NULL;
+}
+
+/*
+ * Checks the architecture first, a syscall number only means something for
+ * one of them. Everything not hooked is allowed without leaving the kernel.
+ */
+static int buildFilter(struct sock_filter *filter)
+{
+	int n = 0;
+	int i;
+
+	filter[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch));
+	filter[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYSCALL_HOOK_ARCH, 1, 0);
+	filter[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+	filter[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr));
+	for (i = 0; i < nhook; ++i) {
+		filter[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, hooks[i].nr, nhook - i, 0);
+	}
+	filter[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+	filter[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_USER_NOTIF);
+	return n;
+}
+
+/*
+ * Unhooked and passed on syscalls are answered with FLAG_CONTINUE, which
+ * needs linux 5.5 while user notification itself is 5.0. Without it they
+ * would wait forever, so it is tried in a child: an older kernel rejects
+ * any flag with EINVAL, a newer one looks for the (unknown) id and fails
+ * with ENOENT.
+ */
+static int probeContinue()
+{
+	struct sock_filter filter[1] = {BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW)};
+	struct sock_fprog prog = {1, filter};
+	struct seccomp_notif_resp resp;
+	pid_t pid;
+	int status;
+	int fd;
+
+	pid = fork();
+	if (pid == -1) {
+		return -1;
+	}
+	if (pid == 0) {
+		if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == -1) {
+			_exit(1);
+		}
+		fd = syscall(__NR_seccomp, SECCOMP_SET_MODE_FILTER, SECCOMP_FILTER_FLAG_NEW_LISTENER, &prog);
+		if (fd == -1) {
+			_exit(1);
+		}
+		memset(&resp, 0, sizeof(resp));
+		resp.flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE;
+		_exit(ioctl(fd, SECCOMP_IOCTL_NOTIF_SEND, &resp) == -1 && errno == ENOENT ? 0 : 1);
+	}
+
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+int syscallHookStart()
+{
+	static struct seccomp_notif_sizes sizes;
+	struct sock_filter filter[MAX_SYSCALL_HOOKS + 6];
+	struct sock_fprog prog;
+	pthread_t tid;
+	int fd;
+
+	if (started || nhook == 0) {
+		LOGD("no syscall hooks registered or already started");
+		return -1;
+	}
+
+	if (syscall(__NR_seccomp, SECCOMP_GET_NOTIF_SIZES, 0, &sizes) == -1) {
+		LOGD("seccomp user notification is not supported: %s", strerror(errno));
+		return -1;
+	}
+	if (probeContinue() == -1) {
+		LOGD("SECCOMP_USER_NOTIF_FLAG_CONTINUE is not supported");
+		return -1;
+	}
+	if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == -1) {
+		return -1;
+	}
+
+	prog.len = buildFilter(filter);
+	prog.filter = filter;
+
+	listener = -1;		// a failed start before left -2
+	if (pthread_create(&tid, NULL, supervisorThread, &sizes) != 0) {
+		return -1;
+	}
+	pthread_detach(tid);
+
+	fd = syscall(__NR_seccomp, SECCOMP_SET_MODE_FILTER, SECCOMP_FILTER_FLAG_NEW_LISTENER, &prog);
+	if (fd == -1) {
+		LOGD("seccomp filter failed: %s", strerror(errno));
+		listener = -2;	// lets the supervisor exit
+		return -1;
+	}
+
+	// from here on every hooked syscall of this thread waits for the supervisor
+	started = 1;
+	listener = fd;
+	return 0;
+}
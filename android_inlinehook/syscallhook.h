@@ -0,0 +1,46 @@
+#ifndef _SYSCALLHOOK_H
+#define _SYSCALLHOOK_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Syscall hooks catch every way into the kernel, including inline svc #0
+ * sites an inline hook can not reach. A seccomp filter lets all other
+ * syscalls through in the kernel and turns the hooked ones into user
+ * notifications that a supervisor thread passes to the handlers, so only
+ * hooked syscalls pay for the round trip.
+ *
+ * The filter covers the thread calling syscallHookStart() and every thread
+ * it creates afterwards, call it early from the main thread. The supervisor
+ * thread is started before the filter, so handlers may use any syscall.
+ * Pointer arguments point into the memory of this process, but the calling
+ * thread can change the data while the handler runs.
+ */
+
+#define SYSCALL_HOOK_CONTINUE	0	// let the kernel run the syscall as usual
+#define SYSCALL_HOOK_RETURN		1	// skip it and return ret, or -1 with errno = error
+
+struct syscallEvent {
+	pid_t tid;
+	int nr;
+	uint64_t args[6];
+	uint64_t instruction_pointer;
+	int64_t ret;
+	int error;
+};
+
+typedef int (*syscallHandler)(struct syscallEvent *event, void *arg);
+
+int registerSyscallHook(int nr, syscallHandler handler, void *arg);
+int syscallHookStart();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
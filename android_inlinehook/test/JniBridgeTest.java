@@ -0,0 +1,22 @@
+// the Java side of jnibridge_test.c
+import java.nio.ByteBuffer;
+
+public class JniBridgeTest {
+	static int nestedResult = 1;
+
+	static native int nested();
+
+	// r0 += r1 + id, d0 = 7; id 2 also runs a handler from inside this one
+	static void onHook(int id, ByteBuffer regs) {
+		regs.putInt(0, regs.getInt(0) + regs.getInt(4) + id);
+		regs.putLong(64, 7);
+		if (id == 2) {
+			nestedResult = nested();
+		}
+	}
+
+	static void onThrow(int id, ByteBuffer regs) {
+		regs.putInt(0, 0);
+		throw new IllegalStateException("thrown on purpose");
+	}
+}
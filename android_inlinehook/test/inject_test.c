@@ -0,0 +1,188 @@
+// gcc -Wall -pthread inject_test.c ../inject.c ../utils.c -o inject_test && ./inject_test
+// Patches data of forked children, which share our addresses, so this runs on any host that allows tracing children.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+
+#include "../inject.h"
+
+#define NCHILD		4
+#define NTHREAD		3		// besides the main thread
+
+static int failed = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		failed++; \
+	} \
+} while (0)
+
+static volatile int flag = 0;
+static const char text[16] = "original";	// read-only, written through /proc/<pid>/mem
+
+static void *idleThread(void *arg)
+{
+	while (1) {
+		usleep(1000);
+	}
+	return NULL;
+}
+
+// exits with 0 once both patches are seen
+static void child(int ready)
+{
+	const char *volatile p = text;
+	pthread_t tid;
+	int i;
+
+	for (i = 0; i < NTHREAD; ++i) {
+		pthread_create(&tid, NULL, idleThread, NULL);
+	}
+	write(ready, "", 1);
+
+	while (flag == 0) {
+		usleep(1000);
+	}
+	_exit(strcmp(p, "patched") == 0 ? 0 : 1);
+}
+
+static pid_t spawn()
+{
+	int fds[2];
+	char c;
+	pid_t pid;
+
+	if (pipe(fds) == -1) {
+		return -1;
+	}
+	pid = fork();
+	if (pid == 0) {
+		close(fds[0]);
+		child(fds[1]);
+	}
+	close(fds[1]);
+	if (pid > 0 && read(fds[0], &c, 1) != 1) {
+		pid = -1;
+	}
+	close(fds[0]);
+	return pid;
+}
+
+static int exitCode(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+		return -1;
+	}
+	return WEXITSTATUS(status);
+}
+
+static void testPatches()
+{
+	static const int one = 1;
+	static const char patched[] = "patched";
+	struct injectPatch patches[2] = {
+		{(uintptr_t) &flag, &one, sizeof(one)},
+		{(uintptr_t) text, patched, sizeof(patched)},
+	};
+	struct injectResult results[NCHILD];
+	pid_t pids[NCHILD];
+	int i;
+
+	for (i = 0; i < NCHILD; ++i) {
+		pids[i] = spawn();
+		CHECK(pids[i] > 0);
+	}
+
+	// the text patch goes first, the child may exit as soon as it sees the flag
+	CHECK(injectPatches(pids, NCHILD, patches + 1, 1, 2, results) == NCHILD);
+	CHECK(injectPatches(pids, NCHILD, patches, 1, 2, results) == NCHILD);
+	for (i = 0; i < NCHILD; ++i) {
+		CHECK(results[i].pid == pids[i]);
+		CHECK(results[i].error == 0);
+		CHECK(exitCode(pids[i]) == 0);
+	}
+	CHECK(text[0] == 'o');		// ours is untouched
+}
+
+static void testThreads()
+{
+	static const int one = 1;
+	struct injectPatch patch = {(uintptr_t) &flag, &one, sizeof(one)};
+	struct injectResult result;
+	pid_t pid;
+
+	pid = spawn();
+	CHECK(pid > 0);
+	CHECK(injectPatches(&pid, 1, &patch, 1, 1, &result) == 1);
+	CHECK(result.nthread == NTHREAD + 1);
+	kill(pid, SIGKILL);
+	exitCode(pid);
+}
+
+static void testGone()
+{
+	static const int one = 1;
+	struct injectPatch patch = {(uintptr_t) &flag, &one, sizeof(one)};
+	struct injectResult result;
+	pid_t pid;
+
+	pid = spawn();
+	CHECK(pid > 0);
+	kill(pid, SIGKILL);
+	exitCode(pid);
+
+	CHECK(injectPatches(&pid, 1, &patch, 1, 1, &result) == 0);
+	CHECK(result.error != 0);
+	CHECK(injectPatches(&pid, 0, &patch, 1, 1, &result) == -1);
+}
+
+// the second patch goes to a read-only shared mapping, which even /proc/<pid>/mem can't write, the first one has to be undone
+static void testRollback()
+{
+	static const int one = 1;
+	static const char patched[] = "patched";
+	struct injectPatch patches[2] = {
+		{(uintptr_t) text, patched, sizeof(patched)},
+		{0, patched, sizeof(patched)},
+	};
+	struct injectPatch flag_patch = {(uintptr_t) &flag, &one, sizeof(one)};
+	struct injectResult result;
+	void *shared;
+	pid_t pid;
+	int fd;
+
+	fd = open("/proc/self/exe", O_RDONLY);
+	CHECK(fd != -1);
+	shared = mmap(NULL, 4096, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	CHECK(shared != MAP_FAILED);
+	patches[1].addr = (uintptr_t) shared;
+
+	pid = spawn();
+	CHECK(pid > 0);
+	CHECK(injectPatches(&pid, 1, patches, 2, 1, &result) == 0);
+	CHECK(result.error != 0);
+	CHECK(injectPatches(&pid, 1, &flag_patch, 1, 1, &result) == 1);
+	CHECK(exitCode(pid) == 1);
+	munmap(shared, 4096);
+}
+
+int main()
+{
+	testPatches();
+	testThreads();
+	testGone();
+	testRollback();
+	printf("%s\n", failed ? "FAILED" : "OK");
+	return failed ? 1 : 0;
+}
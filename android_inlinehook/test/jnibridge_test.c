@@ -0,0 +1,117 @@
+// javac JniBridgeTest.java && gcc -Wall -I$JAVA_HOME/include -I$JAVA_HOME/include/linux jnibridge_test.c ../jnibridge.c -L$JAVA_HOME/lib/server -ljvm -pthread -o jnibridge_test && LD_LIBRARY_PATH=$JAVA_HOME/lib/server ./jnibridge_test
+// Runs the upcalls on a desktop JVM with callInlineHookJava(), installing the hooks is ARM only.
+#include <stdio.h>
+#include <string.h>
+
+#include "../jnibridge.h"
+
+static int failed = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		failed++; \
+	} \
+} while (0)
+
+static jclass test_class;
+
+// JniBridgeTest.nested(), called by onHook() while its own upcall runs
+static jint nested(JNIEnv *env, jclass clazz)
+{
+	struct inlineHookRegs regs;
+
+	memset(&regs, 0, sizeof(regs));
+	return callInlineHookJava(env, &regs, test_class, "onHook", 1, 0);
+}
+
+static JNINativeMethod natives[] = {
+	{"nested", "()I", (void *) nested},
+};
+
+static void testInit(JavaVM *vm)
+{
+	CHECK(jniBridgeInit(NULL) == -1);
+	CHECK(jniBridgeInit(vm) == 0);
+	CHECK(jniBridgeInit(vm) == 0);	// once is enough, again is fine
+}
+
+static void testUpcall(JNIEnv *env)
+{
+	struct inlineHookRegs regs;
+
+	memset(&regs, 0, sizeof(regs));
+	regs.r[0] = 40;
+	regs.r[1] = 1;
+	CHECK(callInlineHookJava(env, &regs, test_class, "onHook", 1, 0) == 0);
+	CHECK(regs.r[0] == 42);
+	CHECK(regs.r[1] == 1);
+	CHECK(regs.d[0] == 0);		// not saved without INLINE_HOOK_REGS_VFP, not written back
+
+	CHECK(callInlineHookJava(env, &regs, test_class, "onHook", 0, INLINE_HOOK_REGS_VFP) == 0);
+	CHECK(regs.r[0] == 43);
+	CHECK(regs.d[0] == 7);
+}
+
+static void testNested(JNIEnv *env)
+{
+	struct inlineHookRegs regs;
+	jfieldID field;
+
+	memset(&regs, 0, sizeof(regs));
+	CHECK(callInlineHookJava(env, &regs, test_class, "onHook", 2, 0) == 0);
+	CHECK(regs.r[0] == 2);
+
+	// the handler inside the handler was skipped
+	field = (*env)->GetStaticFieldID(env, test_class, "nestedResult", "I");
+	CHECK(field != NULL && (*env)->GetStaticIntField(env, test_class, field) == -1);
+}
+
+static void testErrors(JNIEnv *env)
+{
+	struct inlineHookRegs regs;
+
+	memset(&regs, 0, sizeof(regs));
+	regs.r[0] = 5;
+	CHECK(callInlineHookJava(env, &regs, test_class, "onThrow", 1, 0) == -1);
+	CHECK(regs.r[0] == 5);		// a handler that threw changes nothing
+	CHECK((*env)->ExceptionCheck(env) == JNI_FALSE);
+
+	CHECK(callInlineHookJava(env, &regs, test_class, "missing", 1, 0) == -1);
+	CHECK((*env)->ExceptionCheck(env) == JNI_FALSE);
+	CHECK(callInlineHookJava(env, NULL, test_class, "onHook", 1, 0) == -1);
+	CHECK(callInlineHookJava(env, &regs, NULL, "onHook", 1, 0) == -1);
+
+	CHECK(registerInlineHookJavaByAddr(env, 0x1000, test_class, "onHook", 1, 0) == -1);	// not on this host
+}
+
+int main()
+{
+	JavaVMInitArgs args;
+	JavaVMOption options[1];
+	JavaVM *vm;
+	JNIEnv *env;
+
+	options[0].optionString = "-Djava.class.path=.";
+	args.version = JNI_VERSION_1_6;
+	args.nOptions = 1;
+	args.options = options;
+	args.ignoreUnrecognized = JNI_FALSE;
+	if (JNI_CreateJavaVM(&vm, (void **) &env, &args) != JNI_OK) {
+		printf("can not create the VM\n");
+		return 1;
+	}
+
+	test_class = (*env)->FindClass(env, "JniBridgeTest");
+	if (test_class == NULL || (*env)->RegisterNatives(env, test_class, natives, 1) != 0) {
+		printf("can not load JniBridgeTest.class, run javac first\n");
+		return 1;
+	}
+
+	testInit(vm);
+	testUpcall(env);
+	testNested(env);
+	testErrors(env);
+	printf("%s\n", failed ? "FAILED" : "OK");
+	return failed ? 1 : 0;
+}
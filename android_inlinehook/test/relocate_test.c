@@ -0,0 +1,120 @@
+// gcc -Wall relocate_test.c ../relocate.c -o relocate_test && ./relocate_test
+// The relocators only produce instruction words, so this runs on any host.
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../relocate.h"
+
+#define TARGET		0x10000
+#define NEAR_BUFFER	0x10800		// the literal is within LDR's 4 KB reach
+#define FAR_BUFFER	0x200000
+
+static int failed = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		failed++; \
+	} \
+} while (0)
+
+// LDR PC, [PC, #-4] followed by its literal, the entry patch of the absolute mode
+static void testArmLdrPc()
+{
+	uint32_t orig[1] = {0xE51FF004};
+	uint32_t out[64];
+	struct relocateContext ctx;
+	int length;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.buffer = out;
+	ctx.buffer_addr = FAR_BUFFER;
+	length = relocateInstructionInArm(&ctx, TARGET, orig, 4, out);
+	CHECK(length == 9 * 4);
+	CHECK(ctx.error == 0);
+	CHECK(out[0] == 0xE24DD004);	// SUB SP, SP, #4
+	CHECK(out[1] == 0xE52D0004);	// PUSH {R0}
+	CHECK(out[2] == 0xE59F000C);	// LDR R0, [PC, #12]
+	CHECK(out[3] == 0xE08F0000);	// ADD R0, PC, R0
+	CHECK(out[4] == 0xE5900000);	// LDR R0, [R0]
+	CHECK(out[5] == 0xE58D0004);	// STR R0, [SP, #4]
+	CHECK(out[6] == 0xE8BD8001);	// POP {R0, PC}
+	CHECK(out[7] + FAR_BUFFER + 20 == TARGET + 4);	// ADD reads PC as its address + 8
+	CHECK((out[8] & 0xFF000000) == 0xEA000000);	// B back to the target
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.buffer = out;
+	ctx.buffer_addr = NEAR_BUFFER;
+	length = relocateInstructionInArm(&ctx, TARGET, orig, 4, out);
+	CHECK(length == 2 * 4);
+	CHECK(ctx.error == 0);
+	CHECK(out[0] == (0xE51FF000 | (NEAR_BUFFER + 8 - (TARGET + 4))));	// LDR PC, [PC, #-n]
+}
+
+// LDR.W PC, [PC] followed by its literal, the entry patch of the thumb absolute mode
+static void testThumbLdrPc()
+{
+	uint16_t orig[2] = {0xF8DF, 0xF000};
+	uint16_t out[64];
+	struct relocateContext ctx;
+	uint32_t literal;
+	int length;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.buffer = out;
+	ctx.buffer_addr = FAR_BUFFER;
+	length = relocateInstructionInThumb(&ctx, TARGET, orig, 4, out);
+	CHECK(length == 12 * 2);
+	CHECK(ctx.error == 0);
+	CHECK(out[0] == 0xB081);	// SUB SP, #4
+	CHECK(out[1] == 0xB401);	// PUSH {R0}
+	CHECK(out[2] == 0xF8DF && out[3] == 0x0008);	// LDR.W R0, [PC, #8]
+	CHECK(out[4] == 0x4478);	// ADD R0, PC
+	CHECK(out[5] == 0x6800);	// LDR R0, [R0]
+	CHECK(out[6] == 0x9001);	// STR R0, [SP, #4]
+	CHECK(out[7] == 0xBD01);	// POP {R0, PC}
+	literal = out[8] | (out[9] << 16);
+	CHECK(literal + FAR_BUFFER + 12 == TARGET + 4);	// ADD reads PC as its address + 4
+	CHECK((out[10] & 0xF800) == 0xF000 && (out[11] & 0xD000) == 0x9000);	// B.W back to the target
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.buffer = out;
+	ctx.buffer_addr = NEAR_BUFFER;
+	length = relocateInstructionInThumb(&ctx, TARGET, orig, 4, out);
+	CHECK(length == 4 * 2);
+	CHECK(ctx.error == 0);
+	CHECK(out[0] == 0xF85F && out[1] == (0xF000 | (NEAR_BUFFER + 4 - (TARGET + 4))));	// LDR.W PC, [PC, #-n]
+}
+
+// MOV PC, PC is a jump, with a position independent buffer it becomes a branch
+static void testMovPc()
+{
+	uint32_t arm[1] = {0xE1A0F00F};
+	uint16_t thumb[2] = {0x46FF, 0xBF00};
+	uint32_t out[64];
+	struct relocateContext ctx;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.buffer = out;
+	ctx.buffer_addr = FAR_BUFFER;
+	CHECK(relocateInstructionInArm(&ctx, TARGET, arm, 4, out) == 2 * 4);
+	CHECK(ctx.error == 0);
+	CHECK((out[0] & 0xFF000000) == 0xEA000000);	// B
+	CHECK(FAR_BUFFER + 8 + ((int32_t) (out[0] << 8) >> 6) == TARGET + 8);
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.buffer = out;
+	ctx.buffer_addr = FAR_BUFFER;
+	CHECK(relocateInstructionInThumb(&ctx, TARGET, thumb, 4, (uint16_t *) out) == 5 * 2);	// B.W, NOP, B.W back
+	CHECK(ctx.error == 0);
+}
+
+int main()
+{
+	testArmLdrPc();
+	testThumbLdrPc();
+	testMovPc();
+	printf("%s\n", failed ? "FAILED" : "OK");
+	return failed ? 1 : 0;
+}
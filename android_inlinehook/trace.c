@@ -0,0 +1,419 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "inlineHook.h"
+#include "trace.h"
+
+#define ENABLE_DEBUG
+#include "log.h"
+
+#define TRACE_RING_SIZE		16384	// records per CPU, power of two
+#define TRACE_MAX_CPUS		32
+#define TRACE_CHUNK			(4 * 1024 * 1024)	// the file grows by this much
+#define TRACE_CPU_REFRESH	256		// records between two getcpu calls
+
+typedef uint64_t (*traceFunction)(uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3);
+
+struct traceProbe {
+	uint32_t *trampoline;
+	uint16_t id;
+};
+
+/*
+ * Multi-producer ring: a probe claims a slot by moving head with a CAS and
+ * publishes it through seq, the flusher is the only consumer. A full ring
+ * drops the record instead of waiting. inflight counts the probes between
+ * their tracing check and the publish, stopping waits for it to drop to 0.
+ */
+struct traceRing {
+	volatile uint32_t head;
+	uint32_t dropped;
+	volatile uint32_t inflight;
+	uint8_t pad1[52];
+	volatile uint32_t tail;
+	uint8_t pad2[60];
+	volatile uint32_t seq[TRACE_RING_SIZE];
+	struct traceRecord records[TRACE_RING_SIZE];
+} __attribute__((aligned(64)));
+
+struct traceThread {
+	uint32_t tid;
+	uint32_t cpu;
+	uint32_t countdown;
+	int busy;			// recording, probes hit meanwhile (memcpy, clock_gettime) are not traced
+};
+
+static __thread struct traceThread trace_thread;
+
+static struct traceRing *rings;
+static int ncpu;
+static volatile int tracing;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t fork_once = PTHREAD_ONCE_INIT;
+static pthread_t flusher;
+static volatile int flusher_running;
+static int trace_fd = -1;
+static uint8_t *map;		// TRACE_CHUNK bytes of the file from map_offset
+static uint64_t map_offset;
+static uint64_t used;		// bytes of the file written so far
+static uint64_t written;	// records
+
+static uint64_t nowNs()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct traceProbe *traceProbeCreate(uint16_t id)
+{
+	struct traceProbe *probe;
+
+	probe = (struct traceProbe *) calloc(1, sizeof(struct traceProbe));
+	if (probe != NULL) {
+		probe->id = id;
+	}
+	return probe;
+}
+
+void traceProbeDestroy(struct traceProbe *probe)
+{
+	free(probe);
+}
+
+uint32_t **traceTrampoline(struct traceProbe *probe)
+{
+	return &probe->trampoline;
+}
+
+static void traceWrite(struct traceProbe *probe, int type, const uint32_t *v)
+{
+	struct traceThread *self = &trace_thread;
+	struct traceRing *ring;
+	struct traceRecord *record;
+	uint32_t head;
+	unsigned cpu;
+
+	// a stale cpu only costs some sharing, the CAS keeps the ring consistent
+	if (self->countdown-- == 0) {
+		if (self->tid == 0) {
+			self->tid = syscall(__NR_gettid);
+		}
+		if (syscall(__NR_getcpu, &cpu, NULL, NULL) == 0) {
+			self->cpu = cpu;
+		}
+		self->countdown = TRACE_CPU_REFRESH;
+	}
+	ring = &rings[self->cpu % ncpu];
+
+	// the barrier of the add orders it before the check, stopInlineHookTrace() does the reverse
+	__sync_fetch_and_add(&ring->inflight, 1);
+	if (!tracing) {
+		__sync_fetch_and_sub(&ring->inflight, 1);
+		return;
+	}
+
+	do {
+		head = ring->head;
+		if (head - ring->tail >= TRACE_RING_SIZE) {
+			__sync_fetch_and_add(&ring->dropped, 1);
+			__sync_fetch_and_sub(&ring->inflight, 1);
+			return;
+		}
+	} while (!__sync_bool_compare_and_swap(&ring->head, head, head + 1));
+
+	record = &ring->records[head & (TRACE_RING_SIZE - 1)];
+	record->time_ns = nowNs();
+	record->tid = self->tid;
+	record->id = probe->id;
+	record->type = type;
+	record->cpu = self->cpu;
+	memcpy(record->v, v, sizeof(record->v));
+
+	__sync_synchronize();
+	ring->seq[head & (TRACE_RING_SIZE - 1)] = head + 1;
+	__sync_fetch_and_sub(&ring->inflight, 1);
+}
+
+uint64_t traceCall(uint32_t *args, struct traceProbe *probe)
+{
+	struct traceThread *self = &trace_thread;
+	uint64_t value;
+	uint32_t v[4];
+
+	if (!tracing || self->busy) {
+		return ((traceFunction) probe->trampoline)(args[0], args[1], args[2], args[3]);
+	}
+
+	self->busy = 1;
+	traceWrite(probe, TRACE_ENTRY, args);
+	self->busy = 0;
+
+	// calls of other traced functions from this one are recorded as usual
+	value = ((traceFunction) probe->trampoline)(args[0], args[1], args[2], args[3]);
+
+	v[0] = (uint32_t) value;
+	v[1] = (uint32_t) (value >> 32);
+	v[2] = 0;
+	v[3] = 0;
+	self->busy = 1;
+	traceWrite(probe, TRACE_RETURN, v);
+	self->busy = 0;
+
+	return value;
+}
+
+static int mapChunk()
+{
+	if (map != NULL) {
+		munmap(map, TRACE_CHUNK);
+		map = NULL;
+	}
+
+	map_offset = used;	// always a multiple of TRACE_CHUNK
+	if (ftruncate(trace_fd, map_offset + TRACE_CHUNK) == -1) {
+		LOGD("ftruncate trace file failed: %s", strerror(errno));
+		return -1;
+	}
+	map = (uint8_t *) mmap(NULL, TRACE_CHUNK, PROT_READ | PROT_WRITE, MAP_SHARED, trace_fd, map_offset);
+	if (map == MAP_FAILED) {
+		LOGD("mmap trace file failed: %s", strerror(errno));
+		map = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static int append(const void *data, uint32_t size)
+{
+	uint32_t n;
+
+	while (size > 0) {
+		if (map == NULL || used == map_offset + TRACE_CHUNK) {
+			if (mapChunk() == -1) {
+				return -1;
+			}
+		}
+		n = map_offset + TRACE_CHUNK - used;
+		if (n > size) {
+			n = size;
+		}
+		memcpy(map + (used - map_offset), data, n);
+		data = (const uint8_t *) data + n;
+		used += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/*
+ * Copies every published run of a ring with one append, up to the end of
+ * the ring or the first slot a probe is still filling in.
+ */
+static int drainRings()
+{
+	struct traceRing *ring;
+	uint32_t tail;
+	uint32_t idx;
+	uint32_t n;
+	int total;
+	int i;
+
+	total = 0;
+	for (i = 0; i < ncpu; ++i) {
+		ring = &rings[i];
+		tail = ring->tail;
+		for (;;) {
+			idx = tail & (TRACE_RING_SIZE - 1);
+			for (n = 0; idx + n < TRACE_RING_SIZE && ring->seq[idx + n] == tail + n + 1; ++n);
+			if (n == 0) {
+				break;
+			}
+			__sync_synchronize();
+			if (append(&ring->records[idx], n * sizeof(struct traceRecord)) == -1) {
+				break;
+			}
+			tail += n;
+			total += n;
+		}
+		__sync_synchronize();
+		ring->tail = tail;
+	}
+	written += total;
+	return total;
+}
+
+static void *flusherThread(void *arg)
+{
+	while (flusher_running) {
+		if (drainRings() == 0) {
+			usleep(200);
+		}
+	}
+	return NULL;
+}
+
+static void forkPrepare()
+{
+	pthread_mutex_lock(&trace_lock);
+}
+
+static void forkParent()
+{
+	pthread_mutex_unlock(&trace_lock);
+}
+
+/*
+ * The child has no flusher and must not append to the parent's file, it
+ * stops tracing and can start its own trace.
+ */
+static void forkChild()
+{
+	trace_thread.tid = 0;
+	trace_thread.countdown = 0;
+
+	if (trace_fd != -1) {
+		tracing = 0;
+		flusher_running = 0;
+		if (map != NULL) {
+			munmap(map, TRACE_CHUNK);
+			map = NULL;
+		}
+		close(trace_fd);
+		trace_fd = -1;
+		memset(rings, 0, ncpu * sizeof(struct traceRing));
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static void registerForkHandlers()
+{
+	pthread_atfork(forkPrepare, forkParent, forkChild);
+}
+
+int startInlineHookTrace(const char *path)
+{
+	struct traceFileHeader header;
+	struct timespec ts;
+
+	if (path == NULL) {
+		LOGD("illegal parameter in startInlineHookTrace()");
+		return -1;
+	}
+
+	pthread_once(&fork_once, registerForkHandlers);
+	pthread_mutex_lock(&trace_lock);
+	if (trace_fd != -1) {
+		pthread_mutex_unlock(&trace_lock);
+		LOGD("trace already started");
+		return -1;
+	}
+
+	if (rings == NULL) {
+		ncpu = sysconf(_SC_NPROCESSORS_CONF);
+		if (ncpu < 1 || ncpu > TRACE_MAX_CPUS) {
+			ncpu = ncpu < 1 ? 1 : TRACE_MAX_CPUS;
+		}
+		if (posix_memalign((void **) &rings, 64, ncpu * sizeof(struct traceRing)) != 0) {
+			rings = NULL;
+			pthread_mutex_unlock(&trace_lock);
+			return -1;
+		}
+		memset(rings, 0, ncpu * sizeof(struct traceRing));
+	}
+
+	trace_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (trace_fd == -1) {
+		LOGD("open %s failed: %s", path, strerror(errno));
+		pthread_mutex_unlock(&trace_lock);
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic = TRACE_MAGIC;
+	header.version = TRACE_VERSION;
+	header.record_size = sizeof(struct traceRecord);
+	header.ncpu = ncpu;
+	header.start_ns = nowNs();
+	clock_gettime(CLOCK_REALTIME, &ts);
+	header.start_realtime_ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+	used = 0;
+	written = 0;
+	if (append(&header, sizeof(header)) == -1) {
+		close(trace_fd);
+		trace_fd = -1;
+		pthread_mutex_unlock(&trace_lock);
+		return -1;
+	}
+
+	flusher_running = 1;
+	if (pthread_create(&flusher, NULL, flusherThread, NULL) != 0) {
+		munmap(map, TRACE_CHUNK);
+		map = NULL;
+		close(trace_fd);
+		trace_fd = -1;
+		pthread_mutex_unlock(&trace_lock);
+		return -1;
+	}
+
+	tracing = 1;
+	pthread_mutex_unlock(&trace_lock);
+	return 0;
+}
+
+int stopInlineHookTrace()
+{
+	int i;
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_fd == -1) {
+		pthread_mutex_unlock(&trace_lock);
+		return -1;
+	}
+
+	// probes already past the tracing check still finish their record
+	tracing = 0;
+	__sync_synchronize();
+	flusher_running = 0;
+	pthread_join(flusher, NULL);
+	for (i = 0; i < ncpu; ++i) {
+		while (rings[i].inflight != 0) {
+			sched_yield();
+		}
+	}
+	drainRings();
+
+	if (map != NULL) {
+		munmap(map, TRACE_CHUNK);
+		map = NULL;
+	}
+	ftruncate(trace_fd, used);
+	close(trace_fd);
+	trace_fd = -1;
+
+	pthread_mutex_unlock(&trace_lock);
+	return 0;
+}
+
+void getInlineHookTraceStats(struct inlineHookTraceStats *stats)
+{
+	int i;
+
+	memset(stats, 0, sizeof(struct inlineHookTraceStats));
+	stats->records = written;
+	stats->bytes = used;
+	for (i = 0; rings != NULL && i < ncpu; ++i) {
+		stats->dropped += rings[i].dropped;
+	}
+}
@@ -0,0 +1,54 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Trace file: a struct traceFileHeader followed by struct traceRecord, in
+ * the order the flusher drained them. Records of one CPU are in order, the
+ * decoder sorts by time_ns to merge CPUs. A trace that was not stopped
+ * cleanly ends with zeroed records, time_ns is never 0 for a real one.
+ */
+
+#define TRACE_MAGIC		0x43525449	// "ITRC"
+#define TRACE_VERSION	1
+
+#define TRACE_ENTRY		0	// v[] holds r0-r3
+#define TRACE_RETURN	1	// v[0]:v[1] holds r0:r1
+
+struct traceFileHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t ncpu;
+	uint64_t start_ns;		// CLOCK_MONOTONIC at start
+	uint64_t start_realtime_ns;	// CLOCK_REALTIME at the same moment
+};
+
+struct traceRecord {
+	uint64_t time_ns;		// CLOCK_MONOTONIC
+	uint32_t tid;
+	uint16_t id;
+	uint8_t type;
+	uint8_t cpu;
+	uint32_t v[4];
+};
+
+#ifndef TRACE_FORMAT_ONLY
+
+struct traceProbe;
+
+struct traceProbe *traceProbeCreate(uint16_t id);
+void traceProbeDestroy(struct traceProbe *probe);
+
+/*
+ * Entry point of the trace stub, like memoCall(): args points at the saved
+ * r0-r3, the original is called through probe->trampoline and its r0:r1
+ * is returned.
+ */
+uint64_t traceCall(uint32_t *args, struct traceProbe *probe);
+uint32_t **traceTrampoline(struct traceProbe *probe);
+
+#endif
+
+#endif
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TRACE_FORMAT_ONLY
+#include "../trace.h"
+
+/*
+ * Decoder for trace files written by startInlineHookTrace().
+ *
+ *   tracedump [-r] <trace file>
+ *
+ * Prints one line per record in time order, merging the per-CPU streams:
+ *
+ *   +<us since start> <tid> <cpu> <id> > r0 r1 r2 r3
+ *   +<us since start> <tid> <cpu> <id> < r0:r1 (<us in the call>)
+ *
+ * -r prints the records in file order instead, without the call durations.
+ */
+
+#define MAX_DEPTH	64
+
+struct threadStack {
+	uint32_t tid;
+	int depth;
+	uint64_t entered[MAX_DEPTH];
+};
+
+static int compareRecords(const void *a, const void *b)
+{
+	const struct traceRecord *x = *(const struct traceRecord **) a;
+	const struct traceRecord *y = *(const struct traceRecord **) b;
+
+	if (x->time_ns != y->time_ns) {
+		return x->time_ns < y->time_ns ? -1 : 1;
+	}
+	// entry before return when the clock did not advance
+	return (int) x->type - (int) y->type;
+}
+
+static struct threadStack *findStack(struct threadStack **stacks, int *nstack, uint32_t tid)
+{
+	struct threadStack *stack;
+	int i;
+
+	for (i = 0; i < *nstack; ++i) {
+		if ((*stacks)[i].tid == tid) {
+			return &(*stacks)[i];
+		}
+	}
+
+	*stacks = (struct threadStack *) realloc(*stacks, (*nstack + 1) * sizeof(struct threadStack));
+	stack = &(*stacks)[(*nstack)++];
+	memset(stack, 0, sizeof(struct threadStack));
+	stack->tid = tid;
+	return stack;
+}
+
+int main(int argc, char *argv[])
+{
+	struct traceFileHeader *header;
+	struct traceRecord *records;
+	struct traceRecord **order;
+	struct traceRecord *record;
+	struct threadStack *stacks;
+	struct threadStack *stack;
+	struct stat st;
+	uint8_t *data;
+	size_t count;
+	size_t i;
+	int nstack;
+	int raw;
+	int fd;
+
+	raw = argc == 3 && strcmp(argv[1], "-r") == 0;
+	if (argc != 2 + raw) {
+		fprintf(stderr, "usage: %s [-r] <trace file>\n", argv[0]);
+		return 1;
+	}
+
+	fd = open(argv[1 + raw], O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(struct traceFileHeader)) {
+		fprintf(stderr, "can not read %s\n", argv[1 + raw]);
+		return 1;
+	}
+	data = (uint8_t *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	header = (struct traceFileHeader *) data;
+	if (header->magic != TRACE_MAGIC || header->version != TRACE_VERSION || header->record_size != sizeof(struct traceRecord)) {
+		fprintf(stderr, "%s is not a version %d trace file\n", argv[1 + raw], TRACE_VERSION);
+		return 1;
+	}
+
+	// a trace that was not stopped ends with zeroed records
+	records = (struct traceRecord *) (data + sizeof(struct traceFileHeader));
+	count = (st.st_size - sizeof(struct traceFileHeader)) / sizeof(struct traceRecord);
+	for (i = 0; i < count && records[i].time_ns != 0; ++i);
+	count = i;
+
+	order = (struct traceRecord **) malloc((count + 1) * sizeof(struct traceRecord *));
+	for (i = 0; i < count; ++i) {
+		order[i] = &records[i];
+	}
+	if (!raw) {
+		qsort(order, count, sizeof(struct traceRecord *), compareRecords);
+	}
+
+	printf("# %zu records on %u cpus, started at %" PRIu64 ".%09" PRIu64 " (realtime)\n", count, header->ncpu,
+		header->start_realtime_ns / 1000000000, header->start_realtime_ns % 1000000000);
+
+	stacks = NULL;
+	nstack = 0;
+	for (i = 0; i < count; ++i) {
+		record = order[i];
+		printf("+%" PRIu64 ".%03" PRIu64 " %u %u %u ", (record->time_ns - header->start_ns) / 1000,
+			(record->time_ns - header->start_ns) % 1000, record->tid, record->cpu, record->id);
+
+		if (record->type == TRACE_ENTRY) {
+			printf("> 0x%x 0x%x 0x%x 0x%x\n", record->v[0], record->v[1], record->v[2], record->v[3]);
+			if (!raw) {
+				stack = findStack(&stacks, &nstack, record->tid);
+				if (stack->depth < MAX_DEPTH) {
+					stack->entered[stack->depth] = record->time_ns;
+				}
+				++stack->depth;
+			}
+			continue;
+		}
+
+		printf("< 0x%x:0x%x", record->v[1], record->v[0]);
+		if (!raw) {
+			stack = findStack(&stacks, &nstack, record->tid);
+			// the entry may have been dropped, or recorded before the trace started
+			if (stack->depth > 0 && --stack->depth < MAX_DEPTH) {
+				printf(" (%.3f us)", (record->time_ns - stack->entered[stack->depth]) / 1000.0);
+			}
+		}
+		printf("\n");
+	}
+
+	free(stacks);
+	free(order);
+	munmap(data, st.st_size);
+	close(fd);
+	return 0;
+}
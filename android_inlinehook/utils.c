@@ -1,8 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <dirent.h>
 #include <string.h>
 #include <errno.h>
-#include <asm/signal.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 
 #include "utils.h"
 
@@ -16,7 +19,7 @@ void contAllThreads(pid_t pid, pid_t *tids)
 
 	i = 0;
 	for (tid = tids[i]; tid != 0; tid = tids[++i]) {
-		tkill(pid, tid, SIGCONT);
+		syscall(__NR_tgkill, pid, tid, SIGCONT);
 	}	
 }
 
@@ -27,7 +30,7 @@ void stopAllThreads(pid_t pid, pid_t *tids)
 
 	i = 0;
 	for (tid = tids[i]; tid != 0; tid = tids[++i]) {
-		tkill(pid, tid, SIGSTOP);
+		syscall(__NR_tgkill, pid, tid, SIGSTOP);
 	}
 }
 
@@ -1,6 +1,8 @@
 #ifndef _UTILS_H
 #define _UTILS_H
 
+#include <sys/types.h>
+
 void contAllThreads(pid_t pid, pid_t *tids);
 void stopAllThreads(pid_t pid, pid_t *tids);
 int getAllTids(pid_t pid, pid_t *tids);
@@ -0,0 +1,579 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/ucontext.h>
+
+#include "list.h"
+#include "watch.h"
+
+#define ENABLE_DEBUG
+#include "log.h"
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 4096
+#endif
+
+#define PAGE_START(addr) (~(PAGE_SIZE - 1) & (addr))
+#define PAGE_END(addr)	(PAGE_START((addr) + PAGE_SIZE - 1))
+
+// the undefined instructions the kernel turns into SIGTRAP, as used by gdb
+#define THUMB_BREAKPOINT	0xDE01
+#define ARM_BREAKPOINT		0xE7F001F0
+
+#define MAX_WATCH_RANGES	256
+#define MAX_WATCH_PAGES		256
+#define MAX_STEP_PAGES		4		// a store multiple can span pages
+#define MAX_STEP_HITS		8
+#define WATCH_ALIGN			16
+
+extern int asm_cacheflush(long start, long end, long flags);
+
+struct watchRange {
+	uint32_t addr;
+	uint32_t size;
+	watchCallback callback;
+	void *arg;
+	int used;
+};
+
+struct watchPage {
+	uint32_t addr;
+	int refs;
+};
+
+// pages handed out by watchAlloc(), only watched objects live there
+struct watchArena {
+	struct list_head list;
+	uint32_t base;
+	uint32_t size;
+	uint32_t top;
+	uint32_t live;
+};
+
+// the store one thread is stepping over, guarded by step_lock
+struct watchStep {
+	pid_t owner;
+	uint32_t pc;
+	uint32_t addr;
+	uint32_t size;
+	uint32_t trap;
+	uint32_t orig;
+	int thumb;
+	uint32_t pages[MAX_STEP_PAGES];
+	int npage;
+};
+
+static struct watchRange ranges[MAX_WATCH_RANGES];
+static struct watchPage pages[MAX_WATCH_PAGES];
+static int npage;
+static struct watchStep step;
+static volatile int step_lock;
+
+static uint64_t faults;
+static uint64_t hits;
+static uint64_t false_positives;
+static uint64_t start_ms;
+
+static struct sigaction old_segv_action;
+static struct sigaction old_trap_action;
+static pthread_once_t handler_once = PTHREAD_ONCE_INIT;
+
+static struct list_head arenas = {&arenas, &arenas};
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pid_t gettid_()
+{
+	return syscall(__NR_gettid);
+}
+
+static uint64_t nowMs()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// spins with sched_yield(), the lock is also taken in signal handlers
+static void lockStep()
+{
+	while (!__sync_bool_compare_and_swap(&step_lock, 0, 1)) {
+		sched_yield();
+	}
+}
+
+static void unlockStep()
+{
+	__sync_lock_release(&step_lock);
+}
+
+/*
+ * The lock outside of the handlers: a signal handler storing to a watched
+ * page on this thread would fault into lockStep() and spin forever, so
+ * every signal, SIGSEGV and SIGTRAP included, waits until it is released.
+ */
+static void lockStepBlocked(sigset_t *old)
+{
+	sigset_t set;
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, old);
+	lockStep();
+}
+
+static void unlockStepBlocked(const sigset_t *old)
+{
+	unlockStep();
+	pthread_sigmask(SIG_SETMASK, old, NULL);
+}
+
+void *watchAlloc(size_t size)
+{
+	struct list_head *pos;
+	struct watchArena *arena;
+	void *addr;
+
+	if (size == 0) {
+		return NULL;
+	}
+	size = (size + WATCH_ALIGN - 1) & ~(WATCH_ALIGN - 1);
+
+	pthread_mutex_lock(&arena_lock);
+	list_for_each(pos, &arenas) {
+		arena = list_entry(pos, struct watchArena, list);
+		if (arena->top + size <= arena->size) {
+			addr = (void *) (arena->base + arena->top);
+			arena->top += size;
+			arena->live++;
+			pthread_mutex_unlock(&arena_lock);
+			return addr;
+		}
+	}
+
+	arena = (struct watchArena *) calloc(1, sizeof(struct watchArena));
+	if (arena == NULL) {
+		pthread_mutex_unlock(&arena_lock);
+		return NULL;
+	}
+	arena->size = PAGE_END(size);
+	addr = mmap(NULL, arena->size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (addr == MAP_FAILED) {
+		free(arena);
+		pthread_mutex_unlock(&arena_lock);
+		return NULL;
+	}
+	arena->base = (uint32_t) addr;
+	arena->top = size;
+	arena->live = 1;
+	list_add(&arena->list, &arenas);
+	pthread_mutex_unlock(&arena_lock);
+
+	return addr;
+}
+
+// arenas are not reused piecemeal, a page goes away with its last object
+void watchFree(void *ptr)
+{
+	struct list_head *pos;
+	struct watchArena *arena;
+
+	pthread_mutex_lock(&arena_lock);
+	list_for_each(pos, &arenas) {
+		arena = list_entry(pos, struct watchArena, list);
+		if ((uint32_t) ptr >= arena->base && (uint32_t) ptr < arena->base + arena->size) {
+			if (--arena->live == 0) {
+				munmap((void *) arena->base, arena->size);
+				list_del(&arena->list);
+				free(arena);
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&arena_lock);
+}
+
+static struct watchPage *findPage(uint32_t addr)
+{
+	int i;
+
+	for (i = 0; i < npage; ++i) {
+		if (pages[i].addr == PAGE_START(addr)) {
+			return &pages[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Bytes written by the store at pc, the common encodings are decoded and
+ * anything else is assumed to be a word. The fault address is the first
+ * byte that faulted, so stores starting below a watched page are cut.
+ */
+static uint32_t storeSize(uint32_t pc, int thumb)
+{
+	uint32_t instruction;
+	uint16_t hw1, hw2;
+
+	if (thumb) {
+		hw1 = *(uint16_t *) pc;
+		if ((hw1 & 0xE000) == 0xE000 && (hw1 & 0x1800) != 0) {
+			hw2 = *(uint16_t *) (pc + 2);
+			if ((hw1 & 0xFE50) == 0xE800 && (hw1 & 0x0180) != 0) {
+				return 4 * __builtin_popcount(hw2);		// STM.W / PUSH.W
+			}
+			if ((hw1 & 0xFFF0) == 0xE840) {
+				return 4;		// STREX
+			}
+			if ((hw1 & 0xFE50) == 0xE840) {
+				return 8;		// STRD
+			}
+			if ((hw1 & 0xFF10) == 0xF800) {
+				return 1 << ((hw1 >> 5) & 3);	// STR.W / STRH.W / STRB.W
+			}
+			if ((hw1 & 0xFF30) == 0xED00 && (hw2 & 0x0E00) == 0x0A00) {
+				return (hw2 & 0x100) ? 8 : 4;	// VSTR
+			}
+			if ((hw1 & 0xFE10) == 0xEC00 && (hw2 & 0x0E00) == 0x0A00) {
+				return (hw2 & 0xFF) * 4;		// VSTM / VPUSH
+			}
+			if ((hw1 & 0xFF10) == 0xF900) {
+				return 32;		// VST1-4, at most four D registers
+			}
+			return 4;
+		}
+		if ((hw1 & 0xF800) == 0x6000 || (hw1 & 0xF800) == 0x9000 || (hw1 & 0xFE00) == 0x5000) {
+			return 4;		// STR
+		}
+		if ((hw1 & 0xF800) == 0x8000 || (hw1 & 0xFE00) == 0x5200) {
+			return 2;		// STRH
+		}
+		if ((hw1 & 0xF800) == 0x7000 || (hw1 & 0xFE00) == 0x5400) {
+			return 1;		// STRB
+		}
+		if ((hw1 & 0xFE00) == 0xB400) {
+			return 4 * __builtin_popcount(hw1 & 0x1FF);	// PUSH
+		}
+		if ((hw1 & 0xF800) == 0xC000) {
+			return 4 * __builtin_popcount(hw1 & 0xFF);	// STMIA
+		}
+		return 4;
+	}
+
+	instruction = *(uint32_t *) pc;
+	if ((instruction & 0xFF100000) == 0xF4000000) {
+		return 32;		// VST1-4
+	}
+	if ((instruction & 0x0C100000) == 0x04000000) {
+		return (instruction & 0x400000) ? 1 : 4;	// STR / STRB
+	}
+	if ((instruction & 0x0FF00FF0) == 0x01800F90) {
+		return 4;		// STREX
+	}
+	if ((instruction & 0x0E1000F0) == 0x000000B0) {
+		return 2;		// STRH
+	}
+	if ((instruction & 0x0E1000F0) == 0x000000F0) {
+		return 8;		// STRD
+	}
+	if ((instruction & 0x0E100000) == 0x08000000) {
+		return 4 * __builtin_popcount(instruction & 0xFFFF);	// STM / PUSH
+	}
+	if ((instruction & 0x0F300E00) == 0x0D000A00) {
+		return (instruction & 0x100) ? 8 : 4;	// VSTR
+	}
+	if ((instruction & 0x0E100E00) == 0x0C000A00) {
+		return (instruction & 0xFF) * 4;		// VSTM / VPUSH
+	}
+	return 4;
+}
+
+static void chainHandler(struct sigaction *old, int sig, siginfo_t *info, void *ucontext)
+{
+	if (old->sa_flags & SA_SIGINFO) {
+		old->sa_sigaction(sig, info, ucontext);
+	}
+	else if (old->sa_handler == SIG_DFL || old->sa_handler == SIG_IGN) {
+		// not ours, fault again with the previous disposition
+		sigaction(sig, old, NULL);
+	}
+	else {
+		old->sa_handler(sig);
+	}
+}
+
+static void writeCode(uint32_t addr, uint32_t value, int thumb)
+{
+	mprotect((void *) PAGE_START(addr), PAGE_END(addr + 4) - PAGE_START(addr), PROT_READ | PROT_WRITE | PROT_EXEC);
+	if (thumb) {
+		*(uint16_t *) addr = value;
+	}
+	else {
+		*(uint32_t *) addr = value;
+	}
+	mprotect((void *) PAGE_START(addr), PAGE_END(addr + 4) - PAGE_START(addr), PROT_READ | PROT_EXEC);
+	asm_cacheflush(addr, addr + 4, 0);
+}
+
+static void faultHandler(int sig, siginfo_t *info, void *ucontext)
+{
+	ucontext_t *uc = (ucontext_t *) ucontext;
+	uint32_t addr = (uint32_t) info->si_addr;
+	uint32_t pc = uc->uc_mcontext.arm_pc;
+	int thumb = (uc->uc_mcontext.arm_cpsr & 0x20) != 0;
+	struct watchPage *page;
+	uint16_t hw;
+	pid_t tid;
+
+	tid = gettid_();
+	if (info->si_code != SEGV_ACCERR) {
+		chainHandler(&old_segv_action, sig, info, ucontext);
+		return;
+	}
+
+	// the store being stepped over reached into another watched page
+	if (step_lock && step.owner == tid) {
+		if (findPage(addr) != NULL && step.npage < MAX_STEP_PAGES) {
+			step.pages[step.npage++] = PAGE_START(addr);
+			mprotect((void *) PAGE_START(addr), PAGE_SIZE, PROT_READ | PROT_WRITE);
+			return;
+		}
+		chainHandler(&old_segv_action, sig, info, ucontext);
+		return;
+	}
+
+	lockStep();
+	page = findPage(addr);
+	if (page == NULL) {
+		unlockStep();
+		chainHandler(&old_segv_action, sig, info, ucontext);
+		return;
+	}
+	faults++;
+
+	step.owner = tid;
+	step.pc = pc;
+	step.addr = addr;
+	step.size = storeSize(pc, thumb);
+	step.thumb = thumb;
+	if (thumb) {
+		hw = *(uint16_t *) pc;
+		step.trap = pc + (((hw & 0xE000) == 0xE000 && (hw & 0x1800) != 0) ? 4 : 2);
+		step.orig = *(uint16_t *) step.trap;
+		writeCode(step.trap, THUMB_BREAKPOINT, 1);
+	}
+	else {
+		step.trap = pc + 4;
+		step.orig = *(uint32_t *) step.trap;
+		writeCode(step.trap, ARM_BREAKPOINT, 0);
+	}
+	step.pages[0] = page->addr;
+	step.npage = 1;
+	mprotect((void *) page->addr, PAGE_SIZE, PROT_READ | PROT_WRITE);
+
+	// step_lock stays held until the store is done and the page closed again
+}
+
+static void trapHandler(int sig, siginfo_t *info, void *ucontext)
+{
+	ucontext_t *uc = (ucontext_t *) ucontext;
+	uint32_t pc = uc->uc_mcontext.arm_pc;
+	int thumb = (uc->uc_mcontext.arm_cpsr & 0x20) != 0;
+	struct watchRange matched[MAX_STEP_HITS];
+	uint32_t addr;
+	uint32_t size;
+	uint32_t end;
+	int nmatch;
+	int i;
+
+	if (!step_lock || pc != step.trap) {
+		// a step that already finished, the instruction is back
+		if (thumb ? *(uint16_t *) pc != THUMB_BREAKPOINT : *(uint32_t *) pc != ARM_BREAKPOINT) {
+			return;
+		}
+		chainHandler(&old_trap_action, sig, info, ucontext);
+		return;
+	}
+	if (step.owner != gettid_()) {
+		// another thread ran the same code, it retries once the step is over
+		sched_yield();
+		return;
+	}
+
+	writeCode(step.trap, step.orig, step.thumb);
+	for (i = 0; i < step.npage; ++i) {
+		mprotect((void *) step.pages[i], PAGE_SIZE, PROT_READ);
+	}
+
+	nmatch = 0;
+	end = step.addr + step.size;
+	for (i = 0; i < MAX_WATCH_RANGES && nmatch < MAX_STEP_HITS; ++i) {
+		if (ranges[i].used && ranges[i].addr < end && step.addr < ranges[i].addr + ranges[i].size) {
+			matched[nmatch++] = ranges[i];
+		}
+	}
+	if (nmatch > 0) {
+		hits++;
+	}
+	else {
+		false_positives++;
+	}
+
+	// the next fault may fill in step as soon as the lock is released
+	step.owner = 0;
+	pc = step.pc;
+	addr = step.addr;
+	size = step.size;
+	unlockStep();
+
+	for (i = 0; i < nmatch; ++i) {
+		matched[i].callback(addr > matched[i].addr ? addr : matched[i].addr, size, pc, matched[i].arg);
+	}
+}
+
+static void installHandlers()
+{
+	struct sigaction action;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = faultHandler;
+	action.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGSEGV, &action, &old_segv_action);
+
+	action.sa_sigaction = trapHandler;
+	sigaction(SIGTRAP, &action, &old_trap_action);
+
+	start_ms = nowMs();
+}
+
+int watchAdd(void *addr, uint32_t size, watchCallback callback, void *arg)
+{
+	struct watchPage *page;
+	sigset_t old;
+	uint32_t p;
+	int id;
+
+	if (addr == NULL || size == 0 || callback == NULL) {
+		LOGD("illegal parameter in watchAdd()");
+		return -1;
+	}
+	pthread_once(&handler_once, installHandlers);
+
+	lockStepBlocked(&old);
+	for (id = 0; id < MAX_WATCH_RANGES && ranges[id].used; ++id);
+	if (id == MAX_WATCH_RANGES) {
+		unlockStepBlocked(&old);
+		LOGD("too many watched ranges");
+		return -1;
+	}
+
+	for (p = PAGE_START((uint32_t) addr); p < (uint32_t) addr + size; p += PAGE_SIZE) {
+		page = findPage(p);
+		if (page == NULL) {
+			if (npage == MAX_WATCH_PAGES || mprotect((void *) p, PAGE_SIZE, PROT_READ) != 0) {
+				break;
+			}
+			page = &pages[npage++];
+			page->addr = p;
+			page->refs = 0;
+		}
+		page->refs++;
+	}
+	if (p < (uint32_t) addr + size) {
+		// out of pages or not ours to protect, undo the ones taken so far
+		while (p > PAGE_START((uint32_t) addr)) {
+			p -= PAGE_SIZE;
+			page = findPage(p);
+			if (--page->refs == 0 && mprotect((void *) p, PAGE_SIZE, PROT_READ | PROT_WRITE) == 0) {
+				*page = pages[--npage];
+			}
+		}
+		unlockStepBlocked(&old);
+		LOGD("can not watch %p, too many pages or mprotect failed", addr);
+		return -1;
+	}
+
+	ranges[id].addr = (uint32_t) addr;
+	ranges[id].size = size;
+	ranges[id].callback = callback;
+	ranges[id].arg = arg;
+	ranges[id].used = 1;
+	unlockStepBlocked(&old);
+
+	return id;
+}
+
+int watchRemove(int id)
+{
+	struct watchPage *page;
+	sigset_t old;
+	uint32_t p;
+	int ret;
+
+	if (id < 0 || id >= MAX_WATCH_RANGES) {
+		LOGD("illegal parameter in watchRemove()");
+		return -1;
+	}
+
+	lockStepBlocked(&old);
+	if (!ranges[id].used) {
+		unlockStepBlocked(&old);
+		return -1;
+	}
+	ret = 0;
+	for (p = PAGE_START(ranges[id].addr); p < ranges[id].addr + ranges[id].size; p += PAGE_SIZE) {
+		page = findPage(p);
+		if (page == NULL || --page->refs != 0) {
+			continue;
+		}
+		// a page that stays read-only is kept, its stores are stepped over as false positives
+		if (mprotect((void *) p, PAGE_SIZE, PROT_READ | PROT_WRITE) != 0) {
+			ret = -1;
+			continue;
+		}
+		*page = pages[--npage];
+	}
+	ranges[id].used = 0;
+	unlockStepBlocked(&old);
+
+	return ret;
+}
+
+void getWatchStats(struct watchStats *stats)
+{
+	sigset_t old;
+	int i;
+
+	memset(stats, 0, sizeof(struct watchStats));
+	lockStepBlocked(&old);
+	stats->faults = faults;
+	stats->hits = hits;
+	stats->false_positives = false_positives;
+	for (i = 0; i < MAX_WATCH_RANGES; ++i) {
+		stats->ranges += ranges[i].used;
+	}
+	stats->pages = npage;
+	unlockStepBlocked(&old);
+	stats->elapsed_ms = start_ms ? nowMs() - start_ms : 0;
+}
+
+void dumpWatchStats()
+{
+	struct watchStats stats;
+	uint32_t seconds;
+
+	getWatchStats(&stats);
+	seconds = stats.elapsed_ms / 1000 ? stats.elapsed_ms / 1000 : 1;
+	LOGD("watch: %u ranges on %u pages, %llu faults (%llu/s), %llu hits, %llu false positives (%u%%)",
+		stats.ranges, stats.pages,
+		(unsigned long long) stats.faults, (unsigned long long) (stats.faults / seconds),
+		(unsigned long long) stats.hits, (unsigned long long) stats.false_positives,
+		stats.faults ? (unsigned) (stats.false_positives * 100 / stats.faults) : 0);
+}
@@ -0,0 +1,51 @@
+#ifndef _WATCH_H
+#define _WATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Data watchpoints without debug registers. The pages holding watched ranges
+ * are made read-only; a store into them faults, the page is opened for that
+ * one instruction, a breakpoint behind it closes the page again, and the
+ * callback runs if the store overlapped a watched range. Stores elsewhere
+ * on the page are false positives and only cost the round trip.
+ *
+ * Objects from watchAlloc() share pages with other watched objects only,
+ * watching memory from malloc() also traps on its neighbours.
+ *
+ * Callbacks run inside the SIGTRAP handler of the storing thread after the
+ * store completed, only async-signal-safe functions may be used there. While
+ * one thread steps over its store, stores of other threads to the open page
+ * are not seen. Stores by the kernel (e.g. read() into a watched buffer) fail
+ * with EFAULT instead of being reported.
+ */
+
+typedef void (*watchCallback)(uint32_t addr, uint32_t size, uint32_t pc, void *arg);
+
+struct watchStats {
+	uint64_t faults;			// stores into watched pages
+	uint64_t hits;				// ... that overlapped a watched range
+	uint64_t false_positives;	// ... that did not
+	uint32_t ranges;
+	uint32_t pages;
+	uint32_t elapsed_ms;		// since the first watchpoint, for rates
+};
+
+void *watchAlloc(size_t size);
+void watchFree(void *ptr);
+
+int watchAdd(void *addr, uint32_t size, watchCallback callback, void *arg);	// returns an id
+int watchRemove(int id);	// -1 also when a page could not be made writable again, the range is gone either way
+void getWatchStats(struct watchStats *stats);
+void dumpWatchStats();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif